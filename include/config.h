@@ -0,0 +1,385 @@
+#ifndef _FCSH_CONFIG_H
+#define _FCSH_CONFIG_H
+
+// Storage settings: the RocksDB tuning read from --config and the flags of the same name, and the
+// specs namespaces are created with
+
+#include <algorithm>
+#include <cerrno>
+#include <cstring>
+#include <exception>
+#include <fstream>
+#include <iostream>
+#include <memory>
+#include <optional>
+#include <string>
+#include <utility>
+#include <vector>
+
+#include <rocksdb/cache.h>
+#include <rocksdb/filter_policy.h>
+#include <rocksdb/options.h>
+#include <rocksdb/slice_transform.h>
+#include <rocksdb/status.h>
+#include <rocksdb/table.h>
+#include <rocksdb/version.h>
+
+#include <expiry.h>
+#include <merge.h>
+
+// Parse a --prefix-extractor spec. Null if it doesn't make sense.
+inline std::shared_ptr<const rocksdb::SliceTransform> makePrefixExtractor(const std::string& spec)
+{
+  size_t colon = spec.find(':');
+  if (colon == std::string::npos)
+    return nullptr;
+
+  std::string kind = spec.substr(0, colon);
+  size_t length = 0;
+  try
+  {
+    length = std::stoul(spec.substr(colon + 1));
+  }
+  catch (const std::exception&)
+  {
+    return nullptr;
+  }
+
+  if (length == 0)
+    return nullptr;
+
+  if (kind == "fixed")
+    return std::shared_ptr<const rocksdb::SliceTransform>(rocksdb::NewFixedPrefixTransform(length));
+  if (kind == "capped")
+    return std::shared_ptr<const rocksdb::SliceTransform>(rocksdb::NewCappedPrefixTransform(length));
+
+  return nullptr;
+}
+
+// Whether every key starting with prefix lands in the prefix's own extractor bucket, so a scan of
+// them can run in prefix mode. A capped extractor takes keys up to its cap, so for a prefix shorter
+// than that the keys under it fall into buckets of their own; a byte appended to the prefix tells.
+inline bool coversPrefix(const rocksdb::SliceTransform& extractor, const std::string& prefix)
+{
+  std::string longer = prefix + '\0';
+  return extractor.InDomain(prefix) && extractor.InDomain(longer) &&
+    extractor.Transform(longer) == extractor.Transform(prefix);
+}
+
+inline bool parseCompression(const std::string& name, rocksdb::CompressionType& out)
+{
+  static const std::pair<const char*, rocksdb::CompressionType> types[] = {
+    { "none", rocksdb::kNoCompression },
+    { "snappy", rocksdb::kSnappyCompression },
+    { "zlib", rocksdb::kZlibCompression },
+    { "bzip2", rocksdb::kBZip2Compression },
+    { "lz4", rocksdb::kLZ4Compression },
+    { "lz4hc", rocksdb::kLZ4HCCompression },
+    { "xpress", rocksdb::kXpressCompression },
+    { "zstd", rocksdb::kZSTD },
+  };
+
+  for (const auto& [type_name, type] : types)
+  {
+    if (name == type_name)
+    {
+      out = type;
+      return true;
+    }
+  }
+
+  return false;
+}
+
+// RocksDB tuning, read from --config and then from the flags of the same name
+struct StorageConfig
+{
+  size_t write_buffer = 4ull << 30;  // Default: 4GB
+  int max_files = 500;               // Default: 500
+  size_t block_cache_bytes = 0;      // 0: RocksDB's default cache
+  bool hyper_clock_cache = false;
+  double filter_bits_per_key = 0;    // 0: no filter, unless prefix scans want one
+  bool ribbon_filter = false;
+  size_t block_size = 0;             // 0: RocksDB's default
+  bool partition_index_filters = false;
+  bool pin_l0_filter_index = false;
+  std::vector<rocksdb::CompressionType> compression_per_level;
+  std::optional<rocksdb::CompressionType> bottommost_compression;
+
+  // Table options as apply() set them up, for namespaces to start from
+  rocksdb::BlockBasedTableOptions table_options;
+
+  // False for an unknown name or a value that doesn't parse
+  bool set(const std::string& name, const std::string& value)
+  {
+    try
+    {
+      if (name == "write-buffer")
+        write_buffer = std::stoull(value);
+      else if (name == "max-files")
+        max_files = std::stoi(value);
+      else if (name == "block-cache-bytes")
+        block_cache_bytes = std::stoull(value);
+      else if (name == "block-cache-type")
+      {
+        if (value != "lru" && value != "hyperclock")
+          return false;
+        hyper_clock_cache = value == "hyperclock";
+      }
+      else if (name == "filter-bits-per-key")
+        filter_bits_per_key = std::stod(value);
+      else if (name == "filter-type")
+      {
+        if (value != "bloom" && value != "ribbon")
+          return false;
+        ribbon_filter = value == "ribbon";
+      }
+      else if (name == "block-size")
+        block_size = std::stoull(value);
+      else if (name == "partition-index-filters")
+        return parseSwitch(value, partition_index_filters);
+      else if (name == "pin-l0-filter-index")
+        return parseSwitch(value, pin_l0_filter_index);
+      else if (name == "compression-per-level")
+      {
+        compression_per_level.clear();
+        size_t start = 0;
+        while (start <= value.size())
+        {
+          size_t comma = std::min(value.find(',', start), value.size());
+          rocksdb::CompressionType type;
+          if (!parseCompression(value.substr(start, comma - start), type))
+            return false;
+          compression_per_level.push_back(type);
+          start = comma + 1;
+        }
+      }
+      else if (name == "bottommost-compression")
+      {
+        rocksdb::CompressionType type;
+        if (!parseCompression(value, type))
+          return false;
+        bottommost_compression = type;
+      }
+      else
+        return false;
+    }
+    catch (const std::exception&)
+    {
+      return false;
+    }
+
+    return true;
+  }
+
+  static bool parseSwitch(const std::string& value, bool& out)
+  {
+    if (value == "true" || value == "1")
+      out = true;
+    else if (value == "false" || value == "0")
+      out = false;
+    else
+      return false;
+
+    return true;
+  }
+
+  // Lines of `name = value`; a bare name turns a switch on, and # starts a comment
+  bool load(const std::string& path)
+  {
+    std::ifstream in(path);
+    if (!in)
+    {
+      std::cerr << "Error reading config file " << path << ": " << strerror(errno) << std::endl;
+      return false;
+    }
+
+    auto trim = [](const std::string& text) {
+      size_t begin = text.find_first_not_of(" \t\r");
+      size_t end = text.find_last_not_of(" \t\r");
+      return begin == std::string::npos ? std::string() : text.substr(begin, end - begin + 1);
+    };
+
+    std::string line;
+    for (int number = 1; std::getline(in, line); number++)
+    {
+      line = trim(line.substr(0, line.find('#')));
+      if (line.empty())
+        continue;
+
+      size_t equals = line.find('=');
+      std::string name = trim(line.substr(0, equals));
+      std::string value = equals == std::string::npos ? "true" : trim(line.substr(equals + 1));
+      if (!set(name, value))
+      {
+        std::cerr << path << ":" << number << ": bad setting: " << line << std::endl;
+        return false;
+      }
+    }
+
+    return true;
+  }
+
+  // prefix_scans: a prefix extractor is set, so the SST filters should hold prefix blooms
+  bool apply(rocksdb::Options& options, bool prefix_scans)
+  {
+    options.db_write_buffer_size = write_buffer;
+    options.max_open_files = max_files;
+    if (!compression_per_level.empty())
+      options.compression_per_level = compression_per_level;
+    if (bottommost_compression)
+      options.bottommost_compression = *bottommost_compression;
+
+    if (block_size > 0)
+      table_options.block_size = block_size;
+
+    if (block_cache_bytes > 0)
+    {
+      if (hyper_clock_cache)
+      {
+#if ROCKSDB_MAJOR >= 8
+        // The clock cache sizes its table from the typical entry, which is about a data block
+        table_options.block_cache = rocksdb::HyperClockCacheOptions(block_cache_bytes, table_options.block_size).MakeSharedCache();
+#else
+        std::cerr << "Error: --block-cache-type hyperclock needs RocksDB 8 or later.\n";
+        return false;
+#endif
+      }
+      else
+        table_options.block_cache = rocksdb::NewLRUCache(block_cache_bytes);
+    }
+
+    // Prefix scans want prefix blooms in the SST filters even if nobody asked for filters
+    double bits = filter_bits_per_key;
+    if (bits == 0 && prefix_scans)
+      bits = 10;
+
+    if (bits > 0)
+    {
+      if (ribbon_filter)
+        table_options.filter_policy.reset(rocksdb::NewRibbonFilterPolicy(bits));
+      else
+        table_options.filter_policy.reset(rocksdb::NewBloomFilterPolicy(bits));
+    }
+
+    // Index and filter blocks live in the block cache rather than on the heap, partitioned so only
+    // the parts in use are loaded; the small top level stays pinned
+    if (partition_index_filters)
+    {
+      table_options.index_type = rocksdb::BlockBasedTableOptions::kTwoLevelIndexSearch;
+      table_options.partition_filters = bits > 0;
+      table_options.cache_index_and_filter_blocks = true;
+      table_options.pin_top_level_index_and_filter = true;
+    }
+
+    if (pin_l0_filter_index)
+    {
+      table_options.cache_index_and_filter_blocks = true;
+      table_options.pin_l0_filter_and_index_blocks_in_cache = true;
+    }
+
+    options.table_factory.reset(rocksdb::NewBlockBasedTableFactory(table_options));
+    return true;
+  }
+};
+
+// A namespace's tuning: the spec given to CREATE_NAMESPACE, `name=value` settings separated by
+// semicolons. Anything not set is as for the default namespace, except merge and key-ttl, which
+// are off unless the spec turns them on.
+//   compaction         level, universal or fifo
+//   compression        as for --compression-per-level, for every level
+//   ttl                seconds; SSTs older than this are compacted again (fifo drops them)
+//   prefix             prefix extractor, as for --prefix-extractor, with prefix blooms
+//   block-cache-bytes  a block cache of its own instead of a share of the default one
+//   merge              MERGE operator, as for --merge-operator, or none
+//   key-ttl            on or off: per-key TTLs, as for --key-ttl (not together with merge)
+inline rocksdb::Status configureNamespace(const std::string& spec, const StorageConfig& storage, rocksdb::ColumnFamilyOptions& options)
+{
+  rocksdb::BlockBasedTableOptions table_options = storage.table_options;
+  bool own_table = false;
+
+  size_t start = 0;
+  while (start < spec.size())
+  {
+    size_t end = std::min(spec.find(';', start), spec.size());
+    std::string setting = spec.substr(start, end - start);
+    start = end + 1;
+    if (setting.empty())
+      continue;
+
+    size_t equals = setting.find('=');
+    std::string name = setting.substr(0, equals);
+    std::string value = equals == std::string::npos ? std::string() : setting.substr(equals + 1);
+    bool ok = true;
+    try
+    {
+      if (name == "compaction")
+      {
+        if (value == "level")
+          options.compaction_style = rocksdb::kCompactionStyleLevel;
+        else if (value == "universal")
+          options.compaction_style = rocksdb::kCompactionStyleUniversal;
+        else if (value == "fifo")
+          options.compaction_style = rocksdb::kCompactionStyleFIFO;
+        else
+          ok = false;
+      }
+      else if (name == "compression")
+      {
+        ok = parseCompression(value, options.compression);
+        options.compression_per_level.clear();
+      }
+      else if (name == "ttl")
+        options.ttl = std::stoull(value);
+      else if (name == "prefix")
+      {
+        options.prefix_extractor = makePrefixExtractor(value);
+        options.memtable_prefix_bloom_size_ratio = 0.1;
+        ok = options.prefix_extractor != nullptr;
+
+        if (!table_options.filter_policy)
+        {
+          table_options.filter_policy.reset(storage.ribbon_filter ? rocksdb::NewRibbonFilterPolicy(10) : rocksdb::NewBloomFilterPolicy(10));
+          own_table = true;
+        }
+      }
+      else if (name == "merge")
+      {
+        options.merge_operator = value == "none" ? nullptr : makeMergeOperator(value);
+        ok = options.merge_operator != nullptr || value == "none";
+      }
+      else if (name == "key-ttl")
+      {
+        options.compaction_filter = value == "on" ? ExpiryCompactionFilter::instance() : nullptr;
+        ok = value == "on" || value == "off";
+      }
+      else if (name == "block-cache-bytes")
+      {
+        size_t bytes = std::stoull(value);
+        table_options.block_cache = rocksdb::NewLRUCache(bytes);
+        own_table = true;
+        ok = bytes > 0;
+      }
+      else
+        ok = false;
+    }
+    catch (const std::exception&)
+    {
+      ok = false;
+    }
+
+    if (!ok)
+      return rocksdb::Status::InvalidArgument("Bad namespace setting", setting);
+  }
+
+  if (own_table)
+    options.table_factory.reset(rocksdb::NewBlockBasedTableFactory(table_options));
+
+  // Merged values would lose their expiry
+  if (options.merge_operator && options.compaction_filter != nullptr)
+    return rocksdb::Status::InvalidArgument("A namespace can't have both merge and key-ttl");
+
+  return rocksdb::Status::OK();
+}
+
+#endif
@@ -0,0 +1,104 @@
+#ifndef _FCSH_EXPIRY_H
+#define _FCSH_EXPIRY_H
+
+#include <algorithm>
+#include <chrono>
+#include <cstdint>
+#include <string>
+
+#include <rocksdb/compaction_filter.h>
+#include <rocksdb/slice.h>
+
+// Per-key expiry (--key-ttl, and the key-ttl namespace setting). Every value stored in a namespace
+// with it on ends in a trailer: EXPIRY_NEVER, or the BE32 Unix time (in seconds) the key expires
+// at followed by EXPIRY_AT. Being at the end, the trailer leaves the value a prefix of what's
+// stored, so reads still hand out the stored bytes in place; it costs a byte per value, and five
+// for one that expires.
+//
+// An expired key reads as absent until compaction gets to it, and then ExpiryCompactionFilter
+// drops it, so expiring costs no delete, tombstone or sweep.
+//
+// Nothing in a value says whether it has a trailer, so a namespace keeps the format it started
+// with: key-ttl is only set when a namespace is created, and RocksDbEngine::open won't switch
+// --key-ttl on or off for a default namespace that already holds values.
+
+constexpr uint8_t EXPIRY_NEVER = 0x00;
+constexpr uint8_t EXPIRY_AT = 0x01;
+constexpr size_t EXPIRY_TRAILER_MAX = 5;
+
+inline uint32_t expiryNow()
+{
+  auto now = std::chrono::system_clock::now().time_since_epoch();
+  return static_cast<uint32_t>(std::chrono::duration_cast<std::chrono::seconds>(now).count());
+}
+
+// Writes the trailer for a value that expires ttl seconds from now (0: never) into out, and
+// returns its length
+inline size_t expiryTrailer(uint32_t ttl, char* out)
+{
+  if (ttl == 0)
+  {
+    out[0] = static_cast<char>(EXPIRY_NEVER);
+    return 1;
+  }
+
+  uint64_t at = std::min<uint64_t>(uint64_t(expiryNow()) + ttl, UINT32_MAX);
+  out[0] = static_cast<char>(at >> 24);
+  out[1] = static_cast<char>(at >> 16);
+  out[2] = static_cast<char>(at >> 8);
+  out[3] = static_cast<char>(at);
+  out[4] = static_cast<char>(EXPIRY_AT);
+  return EXPIRY_TRAILER_MAX;
+}
+
+// Cuts the trailer off a stored value (a Slice or PinnableSlice). False if the key has expired
+// by now. The trailer doesn't identify itself, so this is only for namespaces whose every value
+// was written with one: a value without one loses its last byte if that is EXPIRY_NEVER, or is
+// read as expiring (and dropped by the filter) if it ends in EXPIRY_AT. Only a value too short for
+// the trailer it ends in is left as it is.
+template <typename StoredSlice>
+bool stripExpiry(StoredSlice& value, uint32_t now)
+{
+  if (value.empty())
+    return true;
+
+  uint8_t kind = static_cast<uint8_t>(value[value.size() - 1]);
+  if (kind == EXPIRY_NEVER)
+  {
+    value.remove_suffix(1);
+    return true;
+  }
+
+  if (kind != EXPIRY_AT || value.size() < EXPIRY_TRAILER_MAX)
+    return true;
+
+  auto at = reinterpret_cast<const uint8_t*>(value.data() + value.size() - EXPIRY_TRAILER_MAX);
+  uint32_t expires = (uint32_t(at[0]) << 24) | (uint32_t(at[1]) << 16) | (uint32_t(at[2]) << 8) | at[3];
+  value.remove_suffix(EXPIRY_TRAILER_MAX);
+  return now < expires;
+}
+
+// Drops expired keys as compaction rewrites them. Stateless, so one instance serves every
+// namespace and compaction thread.
+class ExpiryCompactionFilter : public rocksdb::CompactionFilter
+{
+public:
+  static const ExpiryCompactionFilter* instance()
+  {
+    static const ExpiryCompactionFilter filter;
+    return &filter;
+  }
+
+  const char* Name() const override
+  {
+    return "scramjet.expiry";
+  }
+
+  bool Filter(int, const rocksdb::Slice&, const rocksdb::Slice& existing_value, std::string*, bool*) const override
+  {
+    rocksdb::Slice value = existing_value;
+    return !stripExpiry(value, expiryNow());
+  }
+};
+
+#endif
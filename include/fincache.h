@@ -1,12 +1,285 @@
-#include <rocksdb/db.h>
+#ifndef _FCSH_FINCACHE_H
+#define _FCSH_FINCACHE_H
 
+#include <coroutine>
+#include <cstdint>
+#include <exception>
+#include <functional>
+#include <future>
 #include <memory>
+#include <optional>
+#include <stdexcept>
+#include <string>
+#include <string_view>
+#include <utility>
+#include <vector>
 
-class FinCacheDB
+// Server error, or the connection to the server failing
+class FinCacheError : public std::runtime_error
 {
+public:
+  using std::runtime_error::runtime_error;
+};
+
+namespace fincache_detail
+{
+  // What an async call hands its result to: the value (if any) and, on failure, the error
+  template <typename T>
+  struct Completion
+  {
+    using type = std::function<void(T&&, std::exception_ptr)>;
+  };
+
+  template <>
+  struct Completion<void>
+  {
+    using type = std::function<void(std::exception_ptr)>;
+  };
+
+  template <typename T>
+  using CompletionOf = typename Completion<T>::type;
+
+  template <typename T>
+  CompletionOf<T> fulfil(std::shared_ptr<std::promise<T>> promise)
+  {
+    if constexpr (std::is_void_v<T>)
+    {
+      return [promise](std::exception_ptr error) {
+        if (error)
+          promise->set_exception(error);
+        else
+          promise->set_value();
+      };
+    }
+    else
+    {
+      return [promise](T&& value, std::exception_ptr error) {
+        if (error)
+          promise->set_exception(error);
+        else
+          promise->set_value(std::move(value));
+      };
+    }
+  }
+}
+
+// Client for the scramjet wire protocol over its UNIX socket.
+//
+// Requests are spread over a pool of connections and pipelined on each: every request is tagged,
+// so any number can be in flight and replies are matched up as they come back. One I/O thread per
+// client reads the replies and runs completions; a request goes out straight from the calling
+// thread when its connection's send queue is empty, so a lone request costs one send().
+//
+// Every call comes in four flavours:
+//   get(key)                    blocks for the result (not allowed on the client's I/O thread)
+//   get_async(key)              returns a std::future
+//   get_async(key, completion)  calls completion on the I/O thread
+//   co_await co_get(key)        resumes the coroutine on the I/O thread
+// Failures throw FinCacheError, or hand it to the completion. Completions and scan callbacks run
+// on the I/O thread, so they should be quick and must not throw. Keys and values are only read
+// during the call, except for co_ calls, which send when first awaited.
+class FinCacheClient
+{
+public:
+  using Value = std::optional<std::string>;
+
+  // Scan rows point straight into the receive buffer and are only valid during the call. Return
+  // false to skip the rest of the scan.
+  using ScanCallback = std::function<bool(std::string_view key, std::string_view value)>;
+
+  template <typename T>
+  using Completion = fincache_detail::CompletionOf<T>;
+
+  // Result of a co_ call; resumes the awaiting coroutine on the client's I/O thread
+  template <typename T>
+  class Awaitable
+  {
+  private:
+    std::function<void(Completion<T>)> m_start;
+    std::conditional_t<std::is_void_v<T>, bool, std::optional<T>> m_value {};
+    std::exception_ptr m_error;
+
+  public:
+    explicit Awaitable(std::function<void(Completion<T>)> start) :
+      m_start(std::move(start))
+    { }
+
+    bool await_ready() const noexcept { return false; }
+
+    // The reply may resume the coroutine (and destroy this) before m_start returns, so it is
+    // called from a local
+    void await_suspend(std::coroutine_handle<> handle)
+    {
+      auto start = std::move(m_start);
+      if constexpr (std::is_void_v<T>)
+      {
+        start([this, handle](std::exception_ptr error) {
+          m_error = error;
+          handle.resume();
+        });
+      }
+      else
+      {
+        start([this, handle](T&& value, std::exception_ptr error) {
+          m_error = error;
+          if (!error)
+            m_value.emplace(std::move(value));
+          handle.resume();
+        });
+      }
+    }
+
+    T await_resume()
+    {
+      if (m_error)
+        std::rethrow_exception(m_error);
+      if constexpr (!std::is_void_v<T>)
+        return std::move(*m_value);
+    }
+  };
+
+  FinCacheClient(const FinCacheClient&) = delete;
+  FinCacheClient& operator=(const FinCacheClient&) = delete;
+
+  // Connects the whole pool up front; throws FinCacheError if the server isn't there
+  explicit FinCacheClient(const std::string& socket_path, size_t pool_size = 4);
+
+  // Fails whatever is still in flight
+  ~FinCacheClient();
+
+  // GET_ONE: the value, or nothing if the key isn't there
+  void get_async(std::string_view key, Completion<Value> done);
+
+  // MULTI_GET: one result per key, in the order asked
+  void multi_get_async(const std::vector<std::string_view>& keys, Completion<std::vector<Value>> done);
+
+  // PUT_ONE
+  void put_async(std::string_view key, std::string_view value, Completion<void> done);
+
+  // PUT_MULTI: all pairs in one stream; fails if any of the server's batches did
+  void put_batch_async(const std::vector<std::pair<std::string_view, std::string_view>>& pairs, Completion<void> done);
+
+  // GET_BETWEEN: rows with low <= key <= high, in order. Completes with the number of rows seen.
+  void scan_async(std::string_view low, std::string_view high, ScanCallback row, Completion<size_t> done);
+
+  // GET_N: up to `limit` rows from the first key >= start
+  void scan_async(std::string_view start, uint32_t limit, ScanCallback row, Completion<size_t> done);
+
+  std::future<Value> get_async(std::string_view key)
+  {
+    return future<Value>([&](Completion<Value> done) { get_async(key, std::move(done)); });
+  }
+
+  std::future<std::vector<Value>> multi_get_async(const std::vector<std::string_view>& keys)
+  {
+    return future<std::vector<Value>>([&](Completion<std::vector<Value>> done) { multi_get_async(keys, std::move(done)); });
+  }
+
+  std::future<void> put_async(std::string_view key, std::string_view value)
+  {
+    return future<void>([&](Completion<void> done) { put_async(key, value, std::move(done)); });
+  }
+
+  std::future<void> put_batch_async(const std::vector<std::pair<std::string_view, std::string_view>>& pairs)
+  {
+    return future<void>([&](Completion<void> done) { put_batch_async(pairs, std::move(done)); });
+  }
+
+  std::future<size_t> scan_async(std::string_view low, std::string_view high, ScanCallback row)
+  {
+    return future<size_t>([&](Completion<size_t> done) { scan_async(low, high, std::move(row), std::move(done)); });
+  }
+
+  std::future<size_t> scan_async(std::string_view start, uint32_t limit, ScanCallback row)
+  {
+    return future<size_t>([&](Completion<size_t> done) { scan_async(start, limit, std::move(row), std::move(done)); });
+  }
+
+  Value get(std::string_view key)
+  {
+    checkNotIoThread();
+    return get_async(key).get();
+  }
+
+  std::vector<Value> multi_get(const std::vector<std::string_view>& keys)
+  {
+    checkNotIoThread();
+    return multi_get_async(keys).get();
+  }
+
+  void put(std::string_view key, std::string_view value)
+  {
+    checkNotIoThread();
+    put_async(key, value).get();
+  }
+
+  void put_batch(const std::vector<std::pair<std::string_view, std::string_view>>& pairs)
+  {
+    checkNotIoThread();
+    put_batch_async(pairs).get();
+  }
+
+  size_t scan(std::string_view low, std::string_view high, ScanCallback row)
+  {
+    checkNotIoThread();
+    return scan_async(low, high, std::move(row)).get();
+  }
+
+  size_t scan(std::string_view start, uint32_t limit, ScanCallback row)
+  {
+    checkNotIoThread();
+    return scan_async(start, limit, std::move(row)).get();
+  }
+
+  Awaitable<Value> co_get(std::string_view key)
+  {
+    return Awaitable<Value>([this, key](Completion<Value> done) { get_async(key, std::move(done)); });
+  }
+
+  Awaitable<std::vector<Value>> co_multi_get(const std::vector<std::string_view>& keys)
+  {
+    return Awaitable<std::vector<Value>>([this, &keys](Completion<std::vector<Value>> done) { multi_get_async(keys, std::move(done)); });
+  }
+
+  Awaitable<void> co_put(std::string_view key, std::string_view value)
+  {
+    return Awaitable<void>([this, key, value](Completion<void> done) { put_async(key, value, std::move(done)); });
+  }
+
+  Awaitable<void> co_put_batch(const std::vector<std::pair<std::string_view, std::string_view>>& pairs)
+  {
+    return Awaitable<void>([this, &pairs](Completion<void> done) { put_batch_async(pairs, std::move(done)); });
+  }
+
+  Awaitable<size_t> co_scan(std::string_view low, std::string_view high, ScanCallback row)
+  {
+    return Awaitable<size_t>([this, low, high, row = std::move(row)](Completion<size_t> done) mutable {
+      scan_async(low, high, std::move(row), std::move(done));
+    });
+  }
+
+  Awaitable<size_t> co_scan(std::string_view start, uint32_t limit, ScanCallback row)
+  {
+    return Awaitable<size_t>([this, start, limit, row = std::move(row)](Completion<size_t> done) mutable {
+      scan_async(start, limit, std::move(row), std::move(done));
+    });
+  }
+
 private:
-  std::unique_ptr<rocksdb::DB> m_db;
+  class Impl;
+  std::unique_ptr<Impl> m_impl;
 
-  int insert_one(const rocksdb::Slice& key_slice, const rocksdb::Slice& value_slice);
-  int read_one(const rocksdb::Slice& key);
+  template <typename T>
+  static std::future<T> future(const std::function<void(Completion<T>)>& start)
+  {
+    auto promise = std::make_shared<std::promise<T>>();
+    std::future<T> result = promise->get_future();
+    start(fincache_detail::fulfil<T>(promise));
+    return result;
+  }
+
+  // Blocking on the I/O thread would wait for a reply only that thread can read
+  void checkNotIoThread() const;
 };
+
+#endif
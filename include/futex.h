@@ -0,0 +1,61 @@
+#ifndef _FCSH_FUTEX_H
+#define _FCSH_FUTEX_H
+
+#include <atomic>
+#include <cstdint>
+#include <ctime>
+#include <linux/futex.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+// Sleep/wake for one consumer thread waiting on work published by others. The consumer takes a
+// ticket with prepare() *before* it looks for work, and only sleeps in wait() if nobody has
+// notify()'d since; a notify landing between the check and the sleep makes the futex call return
+// straight away instead of being lost. notify() only makes the syscall when someone is asleep.
+class FutexSignal
+{
+private:
+  alignas(64) std::atomic<uint32_t> m_seq;
+  std::atomic<bool> m_waiting;
+
+public:
+  FutexSignal(const FutexSignal&) = delete;
+  FutexSignal& operator=(const FutexSignal&) = delete;
+
+  FutexSignal() :
+    m_seq(0),
+    m_waiting(false)
+  {
+  }
+
+  uint32_t prepare() const
+  {
+    return m_seq.load(std::memory_order_acquire);
+  }
+
+  // Returns once notified after the ticket was taken, on timeout, or spuriously
+  void wait(uint32_t ticket, int timeout_ms)
+  {
+    m_waiting.store(true, std::memory_order_seq_cst);
+    if (m_seq.load(std::memory_order_seq_cst) == ticket)
+    {
+      struct timespec timeout = { timeout_ms / 1000, (timeout_ms % 1000) * 1000000L };
+      syscall(SYS_futex, reinterpret_cast<uint32_t*>(&m_seq), FUTEX_WAIT_PRIVATE, ticket,
+        timeout_ms < 0 ? nullptr : &timeout, nullptr, 0);
+    }
+
+    m_waiting.store(false, std::memory_order_relaxed);
+  }
+
+  void notify()
+  {
+    m_seq.fetch_add(1, std::memory_order_seq_cst);
+    if (m_waiting.load(std::memory_order_seq_cst))
+    {
+      syscall(SYS_futex, reinterpret_cast<uint32_t*>(&m_seq), FUTEX_WAKE_PRIVATE, 1, nullptr,
+        nullptr, 0);
+    }
+  }
+};
+
+#endif
@@ -0,0 +1,283 @@
+#ifndef _FCSH_HOTCACHE_H
+#define _FCSH_HOTCACHE_H
+
+#include <algorithm>
+#include <cstdint>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <string_view>
+#include <unordered_map>
+#include <vector>
+
+// Byte-bounded cache of values for the hottest keys, so a skewed read load can be answered
+// without a memtable and block lookup per GET. Keys are spread over lock-striped shards by hash.
+//
+// Each shard evicts with CLOCK (a hit only sets a reference bit, so hits never reorder anything)
+// and admits with TinyLFU: every lookup bumps the key in a small count-min sketch, and once the
+// shard is full a new value only gets in if its key has been asked for more often than the one
+// it would push out. One-off reads of cold keys therefore can't flush the hot set.
+//
+// Values are filled in after a miss and dropped by writers once their write has landed. To stop
+// a slow reader putting back a value that a write has since replaced, lookup() hands out the
+// shard's generation on a miss and insert() is refused if the shard was invalidated since.
+class HotCache
+{
+public:
+  struct Stats
+  {
+    uint64_t hits = 0;
+    uint64_t misses = 0;
+    uint64_t entries = 0;
+    uint64_t bytes = 0;
+  };
+
+private:
+  static constexpr size_t SHARD_BITS = 6;
+  static constexpr size_t SHARDS = size_t(1) << SHARD_BITS;
+  static constexpr size_t ENTRY_OVERHEAD = 64; // rough per-entry bookkeeping, charged on top
+
+  struct KeyHash
+  {
+    using is_transparent = void;
+    size_t operator()(std::string_view key) const { return std::hash<std::string_view>()(key); }
+  };
+
+  struct Entry;
+  using Map = std::unordered_map<std::string, Entry, KeyHash, std::equal_to<>>;
+
+  struct Entry
+  {
+    std::string value;
+    uint32_t slot = 0; // position on the clock
+    bool referenced = false;
+  };
+
+  // Count-min sketch of 4-bit counters (4 rows), halved every sample_size increments so old
+  // popularity fades
+  class Sketch
+  {
+  private:
+    std::vector<uint64_t> m_table; // 16 counters per word
+    size_t m_mask = 0;
+    size_t m_additions = 0;
+    size_t m_sample_size = 0;
+
+    size_t index(uint64_t hash, int row) const
+    {
+      uint64_t h = (hash + row * 0x9E3779B97F4A7C15ULL) * 0xBF58476D1CE4E5B9ULL;
+      return static_cast<size_t>(h >> 32) & m_mask;
+    }
+
+    static unsigned counter(uint64_t hash, int row) { return ((hash >> (row * 4)) & 15); }
+
+  public:
+    void resize(size_t counters)
+    {
+      size_t words = 1;
+      while (words * 16 < counters)
+        words <<= 1;
+
+      m_table.assign(words, 0);
+      m_mask = words - 1;
+      m_additions = 0;
+      m_sample_size = words * 16 * 10;
+    }
+
+    unsigned frequency(uint64_t hash) const
+    {
+      unsigned freq = 15;
+      for (int row = 0; row < 4; row++)
+      {
+        unsigned shift = counter(hash, row) * 4;
+        freq = std::min<unsigned>(freq, (m_table[index(hash, row)] >> shift) & 15);
+      }
+      return freq;
+    }
+
+    void increment(uint64_t hash)
+    {
+      bool added = false;
+      for (int row = 0; row < 4; row++)
+      {
+        uint64_t& word = m_table[index(hash, row)];
+        unsigned shift = counter(hash, row) * 4;
+        if (((word >> shift) & 15) != 15)
+        {
+          word += uint64_t(1) << shift;
+          added = true;
+        }
+      }
+
+      if (added && ++m_additions >= m_sample_size)
+      {
+        for (uint64_t& word : m_table)
+          word = (word >> 1) & 0x7777777777777777ULL;
+        m_additions /= 2;
+      }
+    }
+  };
+
+  struct alignas(64) Shard
+  {
+    std::mutex lock;
+    Map map;
+    std::vector<Map::value_type*> clock;
+    size_t hand = 0;
+    size_t bytes = 0;
+    Sketch sketch;
+    uint64_t generation = 0; // bumped by every invalidation
+    uint64_t hits = 0;
+    uint64_t misses = 0;
+  };
+
+  std::unique_ptr<Shard[]> m_shards;
+  size_t m_shard_bytes;
+  size_t m_max_charge; // anything bigger would churn a whole shard; it isn't cached
+
+  static uint64_t hashOf(std::string_view key) { return KeyHash()(key); }
+  Shard& shardOf(uint64_t hash) { return m_shards[hash >> (64 - SHARD_BITS)]; }
+
+  static size_t charge(size_t key_size, size_t value_size) { return key_size + value_size + ENTRY_OVERHEAD; }
+
+  void erase(Shard& shard, Map::iterator it)
+  {
+    uint32_t slot = it->second.slot;
+    Map::value_type* last = shard.clock.back();
+    shard.clock[slot] = last;
+    last->second.slot = slot;
+    shard.clock.pop_back();
+
+    shard.bytes -= charge(it->first.size(), it->second.value.size());
+    shard.map.erase(it);
+  }
+
+  // Sweep the hand to the first entry not referenced since the last pass
+  Map::value_type* victim(Shard& shard)
+  {
+    while (true)
+    {
+      if (shard.hand >= shard.clock.size())
+        shard.hand = 0;
+
+      Map::value_type* entry = shard.clock[shard.hand];
+      if (!entry->second.referenced)
+        return entry;
+
+      entry->second.referenced = false;
+      shard.hand++;
+    }
+  }
+
+public:
+  HotCache(const HotCache&) = delete;
+  HotCache& operator=(const HotCache&) = delete;
+
+  explicit HotCache(size_t capacity_bytes) :
+    m_shards(new Shard[SHARDS]),
+    m_shard_bytes(capacity_bytes / SHARDS),
+    m_max_charge(m_shard_bytes / 8)
+  {
+    // Room for a few times as many keys as fit, assuming smallish values
+    for (size_t i = 0; i < SHARDS; i++)
+      m_shards[i].sketch.resize(std::max<size_t>(m_shard_bytes / 64, 1024));
+  }
+
+  // Copies the value out on a hit. On a miss, `ticket` is what insert() wants back.
+  bool lookup(std::string_view key, std::string& value, uint64_t& ticket)
+  {
+    uint64_t hash = hashOf(key);
+    Shard& shard = shardOf(hash);
+    std::lock_guard<std::mutex> guard(shard.lock);
+    shard.sketch.increment(hash);
+
+    auto it = shard.map.find(key);
+    if (it == shard.map.end())
+    {
+      shard.misses++;
+      ticket = shard.generation;
+      return false;
+    }
+
+    shard.hits++;
+    it->second.referenced = true;
+    value.assign(it->second.value);
+    return true;
+  }
+
+  // Offer a value read after a miss. Dropped if the shard was invalidated in between, or if the
+  // key is no more popular than what it would evict.
+  void insert(std::string_view key, std::string_view value, uint64_t ticket)
+  {
+    size_t cost = charge(key.size(), value.size());
+    if (cost > m_max_charge)
+      return;
+
+    uint64_t hash = hashOf(key);
+    Shard& shard = shardOf(hash);
+    std::lock_guard<std::mutex> guard(shard.lock);
+    if (shard.generation != ticket || shard.map.find(key) != shard.map.end())
+      return;
+
+    if (shard.bytes + cost > m_shard_bytes)
+    {
+      Map::value_type* first = victim(shard);
+      if (shard.sketch.frequency(hash) <= shard.sketch.frequency(hashOf(first->first)))
+        return;
+
+      while (shard.bytes + cost > m_shard_bytes)
+        erase(shard, shard.map.find(victim(shard)->first));
+    }
+
+    auto it = shard.map.try_emplace(std::string(key)).first;
+    it->second.value.assign(value);
+    it->second.slot = static_cast<uint32_t>(shard.clock.size());
+    shard.clock.push_back(&*it);
+    shard.bytes += cost;
+  }
+
+  // Writers call this once their write is visible to readers
+  void invalidate(std::string_view key)
+  {
+    uint64_t hash = hashOf(key);
+    Shard& shard = shardOf(hash);
+    std::lock_guard<std::mutex> guard(shard.lock);
+    shard.generation++;
+
+    auto it = shard.map.find(key);
+    if (it != shard.map.end())
+      erase(shard, it);
+  }
+
+  void clear()
+  {
+    for (size_t i = 0; i < SHARDS; i++)
+    {
+      Shard& shard = m_shards[i];
+      std::lock_guard<std::mutex> guard(shard.lock);
+      shard.generation++;
+      shard.map.clear();
+      shard.clock.clear();
+      shard.hand = 0;
+      shard.bytes = 0;
+    }
+  }
+
+  Stats stats()
+  {
+    Stats total;
+    for (size_t i = 0; i < SHARDS; i++)
+    {
+      Shard& shard = m_shards[i];
+      std::lock_guard<std::mutex> guard(shard.lock);
+      total.hits += shard.hits;
+      total.misses += shard.misses;
+      total.entries += shard.map.size();
+      total.bytes += shard.bytes;
+    }
+    return total;
+  }
+};
+
+#endif
@@ -0,0 +1,266 @@
+#ifndef _FCSH_MERGE_H
+#define _FCSH_MERGE_H
+
+#include <algorithm>
+#include <cstdint>
+#include <memory>
+#include <stdexcept>
+#include <string>
+
+#include <rocksdb/merge_operator.h>
+#include <rocksdb/slice.h>
+
+// Built-in merge operators behind MERGE. A read-modify-write becomes one blind write of an
+// operand, which RocksDB folds into the value when it is read or compacted, so counters and
+// appends need neither a GET first nor a lock around the pair.
+//
+//   add      8-byte big-endian signed integers, summed (wrapping on overflow)
+//   max      8-byte big-endian signed integers, the largest kept
+//   min      8-byte big-endian signed integers, the smallest kept
+//   append   bytes, concatenated
+//   list:N   items appended to a list that keeps the newest N, stored as (BE32 length, item)...
+//
+// All of them are associative, so RocksDB can also fold operands into each other before it has
+// found the value underneath. A stored value the operator can't read (put there by PUT_ONE, say)
+// counts as no value at all rather than failing the read.
+class ValueMergeOperator : public rocksdb::AssociativeMergeOperator
+{
+public:
+  // Turns the operand a client sent into the stored form. False if the operator can't take it;
+  // nothing malformed must reach Merge, where a failure turns every read of the key into an error.
+  virtual bool encodeOperand(const rocksdb::Slice& operand, std::string& out) const
+  {
+    out.assign(operand.data(), operand.size());
+    return true;
+  }
+};
+
+class Int64MergeOperator : public ValueMergeOperator
+{
+public:
+  enum class Mode
+  {
+    Add,
+    Max,
+    Min
+  };
+
+private:
+  Mode m_mode;
+
+  static bool decode(const rocksdb::Slice& bytes, int64_t& out)
+  {
+    if (bytes.size() != 8)
+      return false;
+
+    uint64_t value = 0;
+    for (size_t i = 0; i < 8; i++)
+      value = (value << 8) | static_cast<uint8_t>(bytes[i]);
+
+    out = static_cast<int64_t>(value);
+    return true;
+  }
+
+  static void encode(int64_t value, std::string& out)
+  {
+    uint64_t bits = static_cast<uint64_t>(value);
+    out.resize(8);
+    for (size_t i = 8; i-- > 0; bits >>= 8)
+      out[i] = static_cast<char>(bits & 0xFF);
+  }
+
+public:
+  explicit Int64MergeOperator(Mode mode) :
+    m_mode(mode)
+  { }
+
+  const char* Name() const override
+  {
+    switch (m_mode)
+    {
+      case Mode::Add: return "scramjet.add";
+      case Mode::Max: return "scramjet.max";
+      default: return "scramjet.min";
+    }
+  }
+
+  bool encodeOperand(const rocksdb::Slice& operand, std::string& out) const override
+  {
+    if (operand.size() != 8)
+      return false;
+
+    out.assign(operand.data(), operand.size());
+    return true;
+  }
+
+  bool Merge(const rocksdb::Slice&, const rocksdb::Slice* existing_value, const rocksdb::Slice& value,
+    std::string* new_value, rocksdb::Logger*) const override
+  {
+    int64_t operand;
+    int64_t base;
+    if (!decode(value, operand))
+      return false;
+
+    if (existing_value == nullptr || !decode(*existing_value, base))
+    {
+      new_value->assign(value.data(), value.size());
+      return true;
+    }
+
+    int64_t result;
+    switch (m_mode)
+    {
+      case Mode::Add:
+        result = static_cast<int64_t>(static_cast<uint64_t>(base) + static_cast<uint64_t>(operand));
+        break;
+      case Mode::Max:
+        result = std::max(base, operand);
+        break;
+      default:
+        result = std::min(base, operand);
+        break;
+    }
+
+    encode(result, *new_value);
+    return true;
+  }
+};
+
+class AppendMergeOperator : public ValueMergeOperator
+{
+public:
+  const char* Name() const override
+  {
+    return "scramjet.append";
+  }
+
+  bool Merge(const rocksdb::Slice&, const rocksdb::Slice* existing_value, const rocksdb::Slice& value,
+    std::string* new_value, rocksdb::Logger*) const override
+  {
+    new_value->clear();
+    if (existing_value != nullptr)
+    {
+      new_value->reserve(existing_value->size() + value.size());
+      new_value->assign(existing_value->data(), existing_value->size());
+    }
+
+    new_value->append(value.data(), value.size());
+    return true;
+  }
+};
+
+// Trimming a concatenation to its newest N items doesn't care how the pieces were grouped, so
+// this stays associative
+class BoundedListMergeOperator : public ValueMergeOperator
+{
+private:
+  size_t m_max_items;
+
+  static uint32_t readLength(const char* at)
+  {
+    auto bytes = reinterpret_cast<const uint8_t*>(at);
+    return (uint32_t(bytes[0]) << 24) | (uint32_t(bytes[1]) << 16) | (uint32_t(bytes[2]) << 8) | bytes[3];
+  }
+
+  // Walks the items of a list, stopping after `stop` of them; false if it isn't a list
+  static bool walk(const rocksdb::Slice& list, size_t stop, size_t& items, size_t& offset)
+  {
+    items = 0;
+    offset = 0;
+    while (offset < list.size() && items < stop)
+    {
+      if (list.size() - offset < 4)
+        return false;
+
+      uint32_t length = readLength(list.data() + offset);
+      if (list.size() - offset - 4 < length)
+        return false;
+
+      offset += 4 + length;
+      items++;
+    }
+
+    return true;
+  }
+
+public:
+  explicit BoundedListMergeOperator(size_t max_items) :
+    m_max_items(max_items)
+  { }
+
+  const char* Name() const override
+  {
+    return "scramjet.list";
+  }
+
+  bool encodeOperand(const rocksdb::Slice& operand, std::string& out) const override
+  {
+    if (operand.size() > UINT32_MAX)
+      return false;
+
+    uint32_t length = static_cast<uint32_t>(operand.size());
+    char header[4] = {
+      static_cast<char>(length >> 24), static_cast<char>(length >> 16),
+      static_cast<char>(length >> 8), static_cast<char>(length)
+    };
+
+    out.assign(header, sizeof(header));
+    out.append(operand.data(), operand.size());
+    return true;
+  }
+
+  bool Merge(const rocksdb::Slice&, const rocksdb::Slice* existing_value, const rocksdb::Slice& value,
+    std::string* new_value, rocksdb::Logger*) const override
+  {
+    size_t items;
+    size_t offset;
+    new_value->clear();
+    if (existing_value != nullptr && walk(*existing_value, SIZE_MAX, items, offset))
+      new_value->assign(existing_value->data(), existing_value->size());
+
+    new_value->append(value.data(), value.size());
+    if (!walk(*new_value, SIZE_MAX, items, offset))
+      return false;
+
+    if (items > m_max_items)
+    {
+      walk(*new_value, items - m_max_items, items, offset);
+      new_value->erase(0, offset);
+    }
+
+    return true;
+  }
+};
+
+// Parse a merge operator spec (add, max, min, append or list:N). Null if it doesn't make sense.
+inline std::shared_ptr<ValueMergeOperator> makeMergeOperator(const std::string& spec)
+{
+  if (spec == "add")
+    return std::make_shared<Int64MergeOperator>(Int64MergeOperator::Mode::Add);
+  if (spec == "max")
+    return std::make_shared<Int64MergeOperator>(Int64MergeOperator::Mode::Max);
+  if (spec == "min")
+    return std::make_shared<Int64MergeOperator>(Int64MergeOperator::Mode::Min);
+  if (spec == "append")
+    return std::make_shared<AppendMergeOperator>();
+
+  if (spec.rfind("list:", 0) == 0)
+  {
+    size_t max_items = 0;
+    try
+    {
+      max_items = std::stoul(spec.substr(5));
+    }
+    catch (const std::exception&)
+    {
+      return nullptr;
+    }
+
+    if (max_items > 0)
+      return std::make_shared<BoundedListMergeOperator>(max_items);
+  }
+
+  return nullptr;
+}
+
+#endif
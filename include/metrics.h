@@ -0,0 +1,212 @@
+#ifndef _FCSH_METRICS_H
+#define _FCSH_METRICS_H
+
+#include <array>
+#include <atomic>
+#include <cstdint>
+#include <cstdio>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <string_view>
+#include <vector>
+
+// Counter written by a single thread and read by any. Updates are a plain load and store, so
+// counting costs no locked instruction.
+class LocalCounter
+{
+private:
+  std::atomic<uint64_t> m_value { 0 };
+
+public:
+  void add(uint64_t n)
+  {
+    m_value.store(m_value.load(std::memory_order_relaxed) + n, std::memory_order_relaxed);
+  }
+
+  uint64_t get() const
+  {
+    return m_value.load(std::memory_order_relaxed);
+  }
+};
+
+// Single-writer gauge. Threads may move the same quantity up and down in their own gauges (one
+// allocates, another frees); only the sum over all of them means anything then.
+class LocalGauge
+{
+private:
+  std::atomic<int64_t> m_value { 0 };
+
+public:
+  void add(int64_t n)
+  {
+    m_value.store(m_value.load(std::memory_order_relaxed) + n, std::memory_order_relaxed);
+  }
+
+  void set(int64_t n)
+  {
+    m_value.store(n, std::memory_order_relaxed);
+  }
+
+  int64_t get() const
+  {
+    return m_value.load(std::memory_order_relaxed);
+  }
+};
+
+// Single-writer latency histogram over fixed bounds, 1us to 10s in 1-2.5-5 steps (Prometheus wants
+// the same buckets from every scrape).
+class LatencyHistogram
+{
+public:
+  static constexpr size_t BOUNDS = 22;
+  static constexpr std::array<uint64_t, BOUNDS> BOUNDS_NS = {
+    1000, 2500, 5000, 10000, 25000, 50000, 100000, 250000, 500000,
+    1000000, 2500000, 5000000, 10000000, 25000000, 50000000, 100000000, 250000000, 500000000,
+    1000000000, 2500000000, 5000000000, 10000000000
+  };
+
+  // Sum over many histograms; the last bucket is everything above the top bound
+  struct Totals
+  {
+    std::array<uint64_t, BOUNDS + 1> buckets {};
+    uint64_t sum_ns = 0;
+  };
+
+private:
+  std::array<LocalCounter, BOUNDS + 1> m_buckets;
+  LocalCounter m_sum_ns;
+
+public:
+  // `n` observations that all took `ns`
+  void record(uint64_t ns, uint64_t n = 1)
+  {
+    size_t i = 0;
+    while (i < BOUNDS && ns > BOUNDS_NS[i])
+      i++;
+
+    m_buckets[i].add(n);
+    m_sum_ns.add(ns * n);
+  }
+
+  void addTo(Totals& totals) const
+  {
+    for (size_t i = 0; i <= BOUNDS; i++)
+      totals.buckets[i] += m_buckets[i].get();
+    totals.sum_ns += m_sum_ns.get();
+  }
+};
+
+// One Block per recording thread, so metrics are only ever written by their own thread and never
+// share a cache line. A thread's block is made on its first local() and outlives the thread, so
+// its counts stay in the totals. The thread's slot is a function static: keep one PerThread per
+// Block type.
+template <typename Block>
+class PerThread
+{
+private:
+  std::mutex m_lock;
+  std::vector<std::unique_ptr<Block>> m_blocks;
+
+public:
+  Block& local()
+  {
+    thread_local Block* t_block = nullptr;
+    if (t_block == nullptr)
+    {
+      std::lock_guard<std::mutex> guard(m_lock);
+      m_blocks.push_back(std::make_unique<Block>());
+      t_block = m_blocks.back().get();
+    }
+    return *t_block;
+  }
+
+  template <typename Fn>
+  void forEach(Fn fn)
+  {
+    std::lock_guard<std::mutex> guard(m_lock);
+    for (const auto& block : m_blocks)
+      fn(*block);
+  }
+};
+
+// Builds a page in the Prometheus text exposition format (version 0.0.4). Labels are passed
+// preformatted, e.g. op="get_one"; durations go out in seconds.
+class PrometheusText
+{
+private:
+  std::string m_out;
+
+  void name(std::string_view metric, std::string_view suffix, std::string_view labels, std::string_view extra)
+  {
+    m_out.append(metric).append(suffix);
+    if (!labels.empty() || !extra.empty())
+    {
+      m_out += '{';
+      m_out.append(labels);
+      if (!labels.empty() && !extra.empty())
+        m_out += ',';
+      m_out.append(extra);
+      m_out += '}';
+    }
+    m_out += ' ';
+  }
+
+  void number(double value)
+  {
+    char text[32];
+    snprintf(text, sizeof(text), "%.9g", value);
+    m_out.append(text);
+  }
+
+public:
+  // HELP and TYPE lines, once per metric ahead of its samples
+  void family(std::string_view metric, std::string_view type, std::string_view help)
+  {
+    m_out.append("# HELP ").append(metric).append(" ").append(help).append("\n");
+    m_out.append("# TYPE ").append(metric).append(" ").append(type).append("\n");
+  }
+
+  void sample(std::string_view metric, std::string_view labels, uint64_t value)
+  {
+    name(metric, "", labels, "");
+    m_out.append(std::to_string(value)).append("\n");
+  }
+
+  void sample(std::string_view metric, std::string_view labels, int64_t value)
+  {
+    name(metric, "", labels, "");
+    m_out.append(std::to_string(value)).append("\n");
+  }
+
+  void histogram(std::string_view metric, std::string_view labels, const LatencyHistogram::Totals& totals)
+  {
+    uint64_t cumulative = 0;
+    for (size_t i = 0; i < LatencyHistogram::BOUNDS; i++)
+    {
+      cumulative += totals.buckets[i];
+      char le[40];
+      snprintf(le, sizeof(le), "le=\"%.9g\"", LatencyHistogram::BOUNDS_NS[i] / 1e9);
+      name(metric, "_bucket", labels, le);
+      m_out.append(std::to_string(cumulative)).append("\n");
+    }
+
+    cumulative += totals.buckets[LatencyHistogram::BOUNDS];
+    name(metric, "_bucket", labels, "le=\"+Inf\"");
+    m_out.append(std::to_string(cumulative)).append("\n");
+
+    name(metric, "_sum", labels, "");
+    number(totals.sum_ns / 1e9);
+    m_out.append("\n");
+
+    name(metric, "_count", labels, "");
+    m_out.append(std::to_string(cumulative)).append("\n");
+  }
+
+  const std::string& str() const
+  {
+    return m_out;
+  }
+};
+
+#endif
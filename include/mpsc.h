@@ -0,0 +1,99 @@
+#ifndef _FCSH_MPSC_H
+#define _FCSH_MPSC_H
+
+#include <atomic>
+
+// Link for MpscQueue elements; derive from it
+struct MpscNode
+{
+  std::atomic<MpscNode*> next;
+};
+
+// Intrusive multi-producer single-consumer queue (Vyukov). push() is one atomic exchange and
+// never waits, from any number of threads; pop() may only be called from one thread at a time.
+// T must derive from MpscNode.
+//
+// pop() can come back empty while a producer is halfway through push(). The consumer just
+// tries again later; the element shows up once the producer's second store lands.
+template <typename T>
+class MpscQueue
+{
+private:
+  alignas(64) std::atomic<MpscNode*> m_head; // producers swap themselves in here
+  alignas(64) MpscNode* m_tail;              // consumer side
+  MpscNode m_stub;
+
+public:
+  MpscQueue(const MpscQueue&) = delete;
+  MpscQueue& operator=(const MpscQueue&) = delete;
+
+  MpscQueue() :
+    m_head(&m_stub),
+    m_tail(&m_stub)
+  {
+    m_stub.next.store(nullptr, std::memory_order_relaxed);
+  }
+
+  void push(T* node)
+  {
+    link(node);
+  }
+
+  T* pop()
+  {
+    return static_cast<T*>(unlink());
+  }
+
+private:
+  void link(MpscNode* node)
+  {
+    node->next.store(nullptr, std::memory_order_relaxed);
+    MpscNode* prev = m_head.exchange(node, std::memory_order_acq_rel);
+    prev->next.store(node, std::memory_order_release);
+  }
+
+  MpscNode* unlink()
+  {
+    MpscNode* tail = m_tail;
+    MpscNode* next = tail->next.load(std::memory_order_acquire);
+
+    // Step over the stub
+    if (tail == &m_stub)
+    {
+      if (next == nullptr)
+      {
+        return nullptr;
+      }
+
+      m_tail = next;
+      tail = next;
+      next = next->next.load(std::memory_order_acquire);
+    }
+
+    if (next != nullptr)
+    {
+      m_tail = next;
+      return tail;
+    }
+
+    // tail looks like the last element. If a producer has already swapped in after it, its
+    // link isn't visible yet; come back later.
+    if (tail != m_head.load(std::memory_order_acquire))
+    {
+      return nullptr;
+    }
+
+    // Really the last one: put the stub behind it so it can be handed out
+    link(&m_stub);
+    next = tail->next.load(std::memory_order_acquire);
+    if (next != nullptr)
+    {
+      m_tail = next;
+      return tail;
+    }
+
+    return nullptr;
+  }
+};
+
+#endif
@@ -1,6 +1,15 @@
 #include <memory>
 #include <tuple>
 #include <optional>
+#include <stdexcept>
+#include <cstring>
+#include <type_traits>
+
+#ifdef __linux__
+  #include <atomic>
+  #include <sys/mman.h>
+  #include <unistd.h>
+#endif
 
 template <typename T>
 T min(T a, T b)
@@ -8,6 +17,22 @@ T min(T a, T b)
   return (a < b) ? a : b;
 }
 
+// A range of the ring in (at most) two pieces: second is only non-empty when the range wraps
+// around the end of the allocation.
+template <typename T>
+struct RingSpan
+{
+  T* first;
+  size_t first_len;
+  T* second;
+  size_t second_len;
+
+  size_t size() const
+  {
+    return first_len + second_len;
+  }
+};
+
 template <typename T>
 class RingBuffer
 {
@@ -143,6 +168,90 @@ public:
     return count;
   }
 
+  // Copy count elements starting at offset without consuming them
+  size_t peek_n(size_t offset, size_t count, T* out) const
+  {
+    if (offset >= m_size)
+    {
+      return 0;
+    }
+
+    if (count > m_size - offset)
+    {
+      count = m_size - offset;
+    }
+
+    for (size_t i = 0; i < count; ++i)
+    {
+      out[i] = m_buffer[(m_start + offset + i) % m_alloc];
+    }
+
+    return count;
+  }
+
+  // Borrow count elements starting at offset without copying them (clamped to what is there).
+  // The span stays valid until those elements are consumed or the buffer is resized.
+  RingSpan<const T> peek_span(size_t offset, size_t count) const
+  {
+    if (offset >= m_size)
+    {
+      return { nullptr, 0, nullptr, 0 };
+    }
+
+    if (count > m_size - offset)
+    {
+      count = m_size - offset;
+    }
+
+    size_t first = (m_start + offset) % m_alloc;
+    size_t firstLen = min(count, m_alloc - first);
+    return { &m_buffer[first], firstLen, &m_buffer[0], count - firstLen };
+  }
+
+  // The unused part of the ring, for writing into in place. Follow up with produce().
+  RingSpan<T> free_span()
+  {
+    size_t free = m_alloc - m_size;
+    if (free == 0)
+    {
+      return { nullptr, 0, nullptr, 0 };
+    }
+
+    size_t end = (m_start + m_size) % m_alloc;
+    size_t firstLen = min(free, m_alloc - end);
+    return { &m_buffer[end], firstLen, &m_buffer[0], free - firstLen };
+  }
+
+  // Count elements were written into the front of free_span()
+  void produce(size_t count)
+  {
+    if (count > m_alloc - m_size)
+    {
+      throw std::out_of_range("Produced more than the free space");
+    }
+
+    m_size += count;
+  }
+
+  // Drop count elements from the front
+  size_t discard(size_t count)
+  {
+    if (count > m_size)
+    {
+      count = m_size;
+    }
+
+    if (count == 0)
+    {
+      return 0;
+    }
+
+    m_start = (m_start + count) % m_alloc;
+    m_size -= count;
+
+    return count;
+  }
+
   bool empty() const
   {
     return m_size == 0;
@@ -179,3 +288,283 @@ public:
     resize(m_size);
   }
 };
+
+#ifdef __linux__
+
+// Read/write index of a MirroredRingBuffer: a plain counter, or in SPSC mode an atomic on its own
+// cache line so the producer's and consumer's indices don't bounce the same line between cores
+template <bool Concurrent>
+struct RingIndex
+{
+  size_t value = 0;
+
+  size_t load(std::memory_order) const
+  {
+    return value;
+  }
+
+  void store(size_t v, std::memory_order)
+  {
+    value = v;
+  }
+};
+
+template <>
+struct alignas(64) RingIndex<true>
+{
+  std::atomic<size_t> value { 0 };
+
+  size_t load(std::memory_order order) const
+  {
+    return value.load(order);
+  }
+
+  void store(size_t v, std::memory_order order)
+  {
+    value.store(v, order);
+  }
+};
+
+// RingBuffer variant for trivially copyable T, backed by a power-of-two region that is mapped
+// twice, back to back, in virtual memory (a memfd behind two MAP_FIXED mappings). Any window of up
+// to capacity() elements is contiguous wherever it starts, so spans never come in two pieces,
+// indices wrap with a mask, and bulk copies are one memcpy.
+//
+// With Spsc set the ring is wait-free for one producer thread (free_span/produce/push_n) and one
+// consumer thread (peek_n/peek_span/discard/pop_n): each side only writes its own index, publishing
+// with a release store and reading the other side's with acquire. Telling the consumer there is
+// something to read is up to the owner, which usually has other work to wake it for too.
+// resize() and clear() still need the other side to be idle, and push_n() may resize, so size the
+// ring up front when sharing it.
+//
+// Capacity is rounded up to a power of two of at least one page. Each ring costs two mappings, so
+// keep an eye on vm.max_map_count with very many rings.
+template <typename T, bool Spsc = false>
+class MirroredRingBuffer
+{
+  static_assert(std::is_trivially_copyable_v<T>, "MirroredRingBuffer copies elements with memcpy");
+  static_assert((sizeof(T) & (sizeof(T) - 1)) == 0, "Element size must be a power of two");
+
+private:
+  T* m_buffer;
+  size_t m_alloc;
+  size_t m_mask;
+  RingIndex<Spsc> m_head; // elements consumed so far, written by the consumer
+  RingIndex<Spsc> m_tail; // elements produced so far, written by the producer
+
+  static size_t roundCapacity(size_t count)
+  {
+    size_t bytes = static_cast<size_t>(sysconf(_SC_PAGESIZE));
+    while (bytes < count * sizeof(T))
+    {
+      bytes *= 2;
+    }
+
+    return bytes / sizeof(T);
+  }
+
+  // Reserve twice the size, then map the same memfd pages over both halves
+  static T* map(size_t count)
+  {
+    size_t bytes = count * sizeof(T);
+    int fd = memfd_create("rbuf", MFD_CLOEXEC);
+    if (fd == -1)
+    {
+      throw std::runtime_error("Failed to create ring buffer memory");
+    }
+
+    if (ftruncate(fd, bytes) == -1)
+    {
+      close(fd);
+      throw std::runtime_error("Failed to size ring buffer memory");
+    }
+
+    void* base = mmap(nullptr, 2 * bytes, PROT_NONE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (base == MAP_FAILED)
+    {
+      close(fd);
+      throw std::runtime_error("Failed to reserve ring buffer address space");
+    }
+
+    uint8_t* lower = static_cast<uint8_t*>(base);
+    void* first = mmap(lower, bytes, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_FIXED, fd, 0);
+    void* second = mmap(lower + bytes, bytes, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_FIXED, fd, 0);
+    close(fd); // the mappings keep the pages alive
+
+    if (first == MAP_FAILED || second == MAP_FAILED)
+    {
+      munmap(base, 2 * bytes);
+      throw std::runtime_error("Failed to map ring buffer memory");
+    }
+
+    return reinterpret_cast<T*>(base);
+  }
+
+  static void unmap(T* buffer, size_t count)
+  {
+    if (buffer != nullptr)
+    {
+      munmap(buffer, 2 * count * sizeof(T));
+    }
+  }
+
+  // Producer side: how much is queued, seen from the writer
+  size_t producerSize() const
+  {
+    return m_tail.load(std::memory_order_relaxed) - m_head.load(std::memory_order_acquire);
+  }
+
+  // Consumer side: how much can be read, seen from the reader
+  size_t consumerSize() const
+  {
+    return m_tail.load(std::memory_order_acquire) - m_head.load(std::memory_order_relaxed);
+  }
+
+public:
+  MirroredRingBuffer(const MirroredRingBuffer&) = delete;
+  MirroredRingBuffer& operator=(const MirroredRingBuffer&) = delete;
+  MirroredRingBuffer(MirroredRingBuffer&&) = delete;
+  MirroredRingBuffer& operator=(MirroredRingBuffer&&) = delete;
+
+  MirroredRingBuffer(size_t bsize) :
+    m_buffer(nullptr),
+    m_alloc(roundCapacity(bsize)),
+    m_mask(m_alloc - 1)
+  {
+    m_buffer = map(m_alloc);
+  }
+
+  ~MirroredRingBuffer()
+  {
+    unmap(m_buffer, m_alloc);
+  }
+
+  void resize(size_t bsize)
+  {
+    bsize = roundCapacity(bsize);
+    if (bsize == m_alloc)
+      return;
+
+    size_t head = m_head.load(std::memory_order_acquire);
+    size_t used = m_tail.load(std::memory_order_acquire) - head;
+
+    // if the new size is smaller than needed, throw an exception
+    if (bsize < used)
+      throw std::runtime_error("Buffer size too small");
+
+    T* newBuffer = map(bsize);
+    memcpy(newBuffer, m_buffer + (head & m_mask), used * sizeof(T));
+
+    unmap(m_buffer, m_alloc);
+    m_buffer = newBuffer;
+    m_alloc = bsize;
+    m_mask = bsize - 1;
+    m_head.store(0, std::memory_order_release);
+    m_tail.store(used, std::memory_order_release);
+  }
+
+  void push_n(const T* values, size_t count)
+  {
+    size_t used = producerSize();
+    if (count > m_alloc - used)
+    {
+      size_t newAlloc = m_alloc;
+      while (newAlloc - used < count)
+      {
+        newAlloc *= 2;
+      }
+
+      resize(newAlloc);
+    }
+
+    memcpy(m_buffer + (m_tail.load(std::memory_order_relaxed) & m_mask), values, count * sizeof(T));
+    produce(count);
+  }
+
+  size_t pop_n(size_t count, T* out)
+  {
+    count = peek_n(0, count, out);
+    return discard(count);
+  }
+
+  // Copy count elements starting at offset without consuming them
+  size_t peek_n(size_t offset, size_t count, T* out) const
+  {
+    RingSpan<const T> span = peek_span(offset, count);
+    memcpy(out, span.first, span.first_len * sizeof(T));
+    return span.first_len;
+  }
+
+  // Borrow count elements starting at offset; always one piece
+  RingSpan<const T> peek_span(size_t offset, size_t count) const
+  {
+    size_t used = consumerSize();
+    if (offset >= used)
+      return { nullptr, 0, nullptr, 0 };
+
+    if (count > used - offset)
+      count = used - offset;
+
+    return { m_buffer + ((m_head.load(std::memory_order_relaxed) + offset) & m_mask), count, nullptr, 0 };
+  }
+
+  // The unused part of the ring, for writing into in place; always one piece
+  RingSpan<T> free_span()
+  {
+    return { m_buffer + (m_tail.load(std::memory_order_relaxed) & m_mask), m_alloc - producerSize(),
+      nullptr, 0 };
+  }
+
+  // Publish count elements written into free_span()
+  void produce(size_t count)
+  {
+    if (count > m_alloc - producerSize())
+      throw std::out_of_range("Produced more than the free space");
+
+    m_tail.store(m_tail.load(std::memory_order_relaxed) + count, std::memory_order_release);
+  }
+
+  // Drop count elements from the front
+  size_t discard(size_t count)
+  {
+    size_t used = consumerSize();
+    if (count > used)
+      count = used;
+
+    m_head.store(m_head.load(std::memory_order_relaxed) + count, std::memory_order_release);
+    return count;
+  }
+
+  bool empty() const
+  {
+    return size() == 0;
+  }
+
+  bool full() const
+  {
+    return size() == m_alloc;
+  }
+
+  // Exact from either side while the other is idle; a snapshot otherwise
+  size_t size() const
+  {
+    return m_tail.load(std::memory_order_acquire) - m_head.load(std::memory_order_acquire);
+  }
+
+  size_t capacity() const
+  {
+    return m_alloc;
+  }
+
+  size_t available_without_alloc() const
+  {
+    return m_alloc - size();
+  }
+
+  void clear()
+  {
+    m_head.store(m_tail.load(std::memory_order_relaxed), std::memory_order_release);
+  }
+};
+
+#endif
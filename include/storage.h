@@ -0,0 +1,1288 @@
+#ifndef _FCSH_STORAGE_H
+#define _FCSH_STORAGE_H
+
+// The store under the server, picked at startup (--storage-engine): RocksDB's LSM tree for
+// write-heavy data, or, in builds with HAVE_LMDB, LMDB's memory-mapped B-tree for read-mostly data
+// that fits in RAM, where a read is a page walk and values come straight out of the map.
+//
+// Engines speak RocksDB's types (Slice, Status, ReadOptions, WriteBatch, Iterator), so handlers
+// and error texts don't change with the engine. Read options an engine has no use for (fill_cache,
+// readahead and so on) are ignored.
+//
+// RocksDB can also hold namespaces: column families, each with its own memtable, compaction,
+// compression and prefix extractor, so differently shaped data doesn't have to share one tuning.
+
+#include <chrono>
+#include <cstdint>
+#include <filesystem>
+#include <fstream>
+#include <functional>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <shared_mutex>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+#include <rocksdb/db.h>
+#include <rocksdb/sst_file_writer.h>
+#include <rocksdb/utilities/optimistic_transaction_db.h>
+#include <rocksdb/utilities/transaction.h>
+#include <rocksdb/write_batch.h>
+
+#include <expiry.h>
+
+#ifdef HAVE_LMDB
+  #include <lmdb.h>
+  #include <metrics.h>
+#endif
+
+// BULK_PUT rolls over to a new SST file once the current one reaches this size
+#ifndef BULK_SST_FILE_BYTES
+  #define BULK_SST_FILE_BYTES (256 << 20) // 256MB
+#endif
+
+// A conditional write that lost a race for one of its keys reads its conditions again and retries
+// this many times before giving up with Busy
+#ifndef CONDITIONAL_WRITE_RETRIES
+  #define CONDITIONAL_WRITE_RETRIES 8
+#endif
+
+class StorageEngine
+{
+public:
+  // A fixed view of the store, for reads that must not see later writes
+  class Snapshot
+  {
+  public:
+    virtual ~Snapshot() = default;
+  };
+
+  // A BULK_PUT in progress. Keys must arrive in strictly ascending order; nothing is visible
+  // until finish() has succeeded, and dropping an unfinished load throws it away.
+  class BulkLoad
+  {
+  public:
+    virtual ~BulkLoad() = default;
+
+    // Does nothing once the load has failed, so the rest of the stream can be drained cheaply
+    virtual void add(const rocksdb::Slice& key, const rocksdb::Slice& value) = 0;
+    virtual rocksdb::Status finish() = 0;
+  };
+
+  // A namespace other than the default one, which is id 0 and never has one of these. Ids are
+  // never reused. A dropped namespace stays readable by whoever still holds it, and its handle
+  // goes when the last of them lets go (which has to be before the engine goes).
+  struct Namespace
+  {
+    uint32_t id;
+    std::string name;
+    rocksdb::ColumnFamilyHandle* handle;
+    std::shared_ptr<const rocksdb::SliceTransform> prefix_extractor;
+    std::shared_ptr<rocksdb::MergeOperator> merge_operator;
+    const rocksdb::CompactionFilter* compaction_filter;
+  };
+
+  // What a key has to hold for a conditional write to go ahead
+  struct Condition
+  {
+    const Namespace* ns;
+    std::string key;
+    bool exists;       // false: the key must be absent
+    std::string value; // when it exists
+    bool expiring;     // stored values carry an expiry trailer (expiry.h), and expired ones count as absent
+  };
+
+  virtual ~StorageEngine() = default;
+
+  // Column family to put a namespace's writes in; null is the default one
+  static rocksdb::ColumnFamilyHandle* columnFamily(const Namespace* ns)
+  {
+    return ns != nullptr ? ns->handle : nullptr;
+  }
+
+  virtual const char* name() const = 0;
+
+  // Reads below take the namespace to read from, null for the default one
+
+  // The value may point into the store; it stays valid until it is Reset
+  virtual rocksdb::Status get(const rocksdb::ReadOptions& options, const Namespace* ns, const rocksdb::Slice& key,
+    rocksdb::PinnableSlice* value) = 0;
+
+  // Point lookups for keys[0..count), which are sorted
+  virtual void multiGet(const rocksdb::ReadOptions& options, const Namespace* ns, size_t count,
+    const rocksdb::Slice* keys, rocksdb::PinnableSlice* values, rocksdb::Status* statuses) = 0;
+
+  // Honours iterate_lower_bound and iterate_upper_bound. Reads the latest data unless given a
+  // snapshot, which must outlive the iterator.
+  virtual rocksdb::Iterator* newIterator(const rocksdb::ReadOptions& options, const Namespace* ns,
+    const Snapshot* snapshot = nullptr) = 0;
+
+  // Null if the engine can't take one right now
+  virtual const Snapshot* getSnapshot() = 0;
+  virtual void releaseSnapshot(const Snapshot* snapshot) = 0;
+
+  // Applies the whole batch atomically
+  virtual rocksdb::Status write(const rocksdb::WriteOptions& options, rocksdb::WriteBatch* batch) = 0;
+
+  // Applies the whole batch atomically if every condition holds, with no write to those keys in
+  // between as far as anyone can tell. Aborted if one doesn't, with failed set to its index.
+  virtual rocksdb::Status writeIf(const rocksdb::WriteOptions& options, const std::vector<Condition>& conditions,
+    rocksdb::WriteBatch* batch, size_t& failed) = 0;
+
+  virtual std::unique_ptr<BulkLoad> newBulkLoad(std::shared_ptr<const Namespace> ns, uint64_t connection_id) = 0;
+
+  // RocksDB's integer properties (rocksdb.estimate-num-keys and the like); false if the engine
+  // has no such thing
+  virtual bool getIntProperty(const std::string& property, uint64_t* value) = 0;
+
+  // Creates the namespace, tuned by spec (see the engine), or finds it if it already exists, in
+  // which case the spec is ignored
+  virtual rocksdb::Status createNamespace(const std::string& name, const std::string& spec,
+    std::shared_ptr<const Namespace>& ns) = 0;
+
+  // NotFound if there is no such namespace (or it's the default one, which can't be dropped)
+  virtual rocksdb::Status dropNamespace(uint32_t id) = 0;
+
+  // Null if there is no such namespace
+  virtual std::shared_ptr<const Namespace> findNamespace(uint32_t id) = 0;
+};
+
+class RocksDbEngine : public StorageEngine
+{
+public:
+  // Turns a namespace's spec into its column family options, which start out as the DB's own
+  // without its merge operator or compaction filter (see namespaceBase)
+  using ConfigureNamespace = std::function<rocksdb::Status(const std::string& spec, rocksdb::ColumnFamilyOptions& options)>;
+
+private:
+  struct RocksDbSnapshot : Snapshot
+  {
+    const rocksdb::Snapshot* snapshot;
+
+    explicit RocksDbSnapshot(const rocksdb::Snapshot* snapshot) :
+      snapshot(snapshot)
+    { }
+  };
+
+  // Sorted pairs are streamed into SST files under the ingest directory, rolling to a new file
+  // every BULK_SST_FILE_BYTES, and the whole set is ingested straight into the bottom of the LSM
+  // in one go, bypassing the memtable and WAL. Files that never made it into the DB are removed
+  // when the load is dropped.
+  class SstBulkLoad : public BulkLoad
+  {
+  private:
+    rocksdb::DB* m_db;
+    std::shared_ptr<const Namespace> m_ns; // keeps the column family's handle alive
+    rocksdb::ColumnFamilyHandle* m_handle;
+    rocksdb::Options m_options;
+    std::string m_dir;
+    std::string m_prefix;
+    std::unique_ptr<rocksdb::SstFileWriter> m_writer;
+    std::vector<std::string> m_files;
+    std::string m_last_key;
+    rocksdb::Status m_status;
+
+    rocksdb::Status openFile()
+    {
+      std::filesystem::path dir = m_dir.empty() ? std::filesystem::temp_directory_path() : std::filesystem::path(m_dir);
+      std::string filename = (dir / (m_prefix + std::to_string(m_files.size()) + ".sst")).string();
+
+      m_writer = std::make_unique<rocksdb::SstFileWriter>(rocksdb::EnvOptions(), m_options, m_handle);
+      m_files.push_back(filename);
+      return m_writer->Open(filename);
+    }
+
+    rocksdb::Status finishFile()
+    {
+      rocksdb::ExternalSstFileInfo info;
+      auto status = m_writer->Finish(&info);
+      m_writer.reset();
+      m_last_key = info.largest_key;
+      return status;
+    }
+
+  public:
+    SstBulkLoad(rocksdb::DB* db, std::shared_ptr<const Namespace> ns, const std::string& dir, uint64_t connection_id) :
+      m_db(db),
+      m_ns(std::move(ns)),
+      m_handle(m_ns ? m_ns->handle : db->DefaultColumnFamily()),
+      m_options(db->GetOptions(m_handle)),
+      m_dir(dir),
+      m_prefix("bulk_" + std::to_string(connection_id) + "_" + std::to_string(
+        std::chrono::system_clock::now().time_since_epoch().count()
+      ) + "_")
+    { }
+
+    ~SstBulkLoad()
+    {
+      m_writer.reset();
+      for (const std::string& file : m_files)
+      {
+        std::error_code ec;
+        std::filesystem::remove(file, ec);
+      }
+    }
+
+    void add(const rocksdb::Slice& key, const rocksdb::Slice& value) override
+    {
+      if (!m_status.ok())
+        return;
+
+      if (!m_writer)
+      {
+        // The SST writer checks ordering within a file; across files it's up to us
+        if (!m_files.empty() && m_options.comparator->Compare(key, m_last_key) <= 0)
+        {
+          m_status = rocksdb::Status::InvalidArgument("Keys must be added in strict ascending order.");
+          return;
+        }
+
+        m_status = openFile();
+        if (!m_status.ok())
+          return;
+      }
+
+      m_status = m_writer->Put(key, value);
+      if (m_status.ok() && m_writer->FileSize() >= BULK_SST_FILE_BYTES)
+        m_status = finishFile();
+    }
+
+    rocksdb::Status finish() override
+    {
+      if (m_status.ok() && m_writer)
+        m_status = finishFile();
+
+      if (!m_status.ok() || m_files.empty())
+        return m_status;
+
+      rocksdb::IngestExternalFileOptions options;
+      options.move_files = true;
+      m_status = m_db->IngestExternalFile(m_handle, m_files, options);
+      if (m_status.ok())
+        m_files.clear(); // owned by the DB now
+
+      return m_status;
+    }
+  };
+
+  rocksdb::OptimisticTransactionDB* m_txn_db;
+  rocksdb::DB* m_db; // the DB under m_txn_db, for everything but conditional writes
+  rocksdb::ColumnFamilyHandle* m_default = nullptr; // the handle Open gave out for the default column family
+  std::string m_path;
+  std::string m_ingest_dir;
+  rocksdb::ColumnFamilyOptions m_base;
+  ConfigureNamespace m_configure;
+
+  // Namespaces by id, and the spec each was created with by name (as saved in the specs file)
+  std::shared_mutex m_namespaces_mutex;
+  std::unordered_map<uint32_t, std::shared_ptr<const Namespace>> m_namespaces;
+  std::map<std::string, std::string> m_specs;
+
+  RocksDbEngine(rocksdb::OptimisticTransactionDB* txn_db, const std::string& path, const std::string& ingest_dir,
+    const rocksdb::ColumnFamilyOptions& base, ConfigureNamespace configure) :
+    m_txn_db(txn_db),
+    m_db(txn_db->GetBaseDB()),
+    m_path(path),
+    m_ingest_dir(ingest_dir),
+    m_base(namespaceBase(base)),
+    m_configure(std::move(configure))
+  { }
+
+  // What a namespace's options start from. The merge operator and compaction filter (the expiry
+  // filter, whose namespaces store trailers) decide how values are stored, and only the saved spec
+  // survives a restart, so a namespace only gets them from its spec and never from the flags of
+  // the run that created or reopened it.
+  static rocksdb::ColumnFamilyOptions namespaceBase(const rocksdb::ColumnFamilyOptions& options)
+  {
+    rocksdb::ColumnFamilyOptions base = options;
+    base.merge_operator = nullptr;
+    base.compaction_filter = nullptr;
+    base.compaction_filter_factory = nullptr;
+    return base;
+  }
+
+  rocksdb::ColumnFamilyHandle* handle(const Namespace* ns) const
+  {
+    return ns != nullptr ? ns->handle : m_db->DefaultColumnFamily();
+  }
+
+  std::shared_ptr<const Namespace> makeNamespace(rocksdb::ColumnFamilyHandle* handle, const rocksdb::ColumnFamilyOptions& options)
+  {
+    rocksdb::DB* db = m_db;
+    auto ns = new Namespace { handle->GetID(), handle->GetName(), handle, options.prefix_extractor, options.merge_operator,
+      options.compaction_filter };
+    return std::shared_ptr<const Namespace>(ns, [db](const Namespace* ns) {
+      db->DestroyColumnFamilyHandle(ns->handle);
+      delete ns;
+    });
+  }
+
+  // RocksDB keeps the column families but not how we tuned them, so the specs are kept next to
+  // the DB: a line of name, tab, spec per namespace, and one for the default namespace saying
+  // whether its values carry expiry trailers (see valueFormat)
+  static std::string specsPath(const std::string& path)
+  {
+    return (std::filesystem::path(path) / "NAMESPACES").string();
+  }
+
+  // Expiry trailers (--key-ttl) don't identify themselves, so values written without them would be
+  // misread with them and the other way round: the default namespace has to keep the format it
+  // started with
+  static std::string valueFormat(const rocksdb::ColumnFamilyOptions& options)
+  {
+    return options.compaction_filter == ExpiryCompactionFilter::instance() ? "key-ttl=on" : "key-ttl=off";
+  }
+
+  bool defaultEmpty() const
+  {
+    std::unique_ptr<rocksdb::Iterator> it(m_db->NewIterator(rocksdb::ReadOptions(), m_default));
+    it->SeekToFirst();
+    return !it->Valid() && it->status().ok();
+  }
+
+  static std::map<std::string, std::string> loadSpecs(const std::string& path)
+  {
+    std::map<std::string, std::string> specs;
+    std::ifstream in(specsPath(path));
+    std::string line;
+    while (std::getline(in, line))
+    {
+      size_t tab = line.find('\t');
+      if (tab != std::string::npos)
+        specs[line.substr(0, tab)] = line.substr(tab + 1);
+    }
+
+    return specs;
+  }
+
+  // Written aside and renamed over the old file, so a crash leaves one or the other
+  rocksdb::Status saveSpecs()
+  {
+    std::string path = specsPath(m_path);
+    std::string temp = path + ".tmp";
+    {
+      std::ofstream out(temp, std::ios::trunc);
+      for (const auto& [name, spec] : m_specs)
+        out << name << '\t' << spec << '\n';
+
+      out.flush();
+      if (!out)
+        return rocksdb::Status::IOError("Can't write " + temp);
+    }
+
+    std::error_code ec;
+    std::filesystem::rename(temp, path, ec);
+    if (ec)
+      return rocksdb::Status::IOError("Can't replace " + path + ": " + ec.message());
+
+    return rocksdb::Status::OK();
+  }
+
+public:
+  RocksDbEngine(const RocksDbEngine&) = delete;
+  RocksDbEngine& operator=(const RocksDbEngine&) = delete;
+
+  // BULK_PUT stages its SST files in ingest_dir (empty: the temp directory). Ingestion hard links
+  // them into the DB, so it should be on the same filesystem as the DB to avoid a copy.
+  // Namespaces created earlier are opened again with their saved specs. Opening the default
+  // namespace with or without key TTLs when it was written the other way is refused, as is turning
+  // them on for one that already holds values from before the format was recorded.
+  //
+  // The DB is opened for optimistic transactions, which only cost anything when there is a
+  // conditional write: plain writes go straight to the DB underneath, and a conditional write
+  // checks at commit that nothing has written its keys since it read them. Checks for different
+  // keys don't wait on each other (kValidateParallel locks a hash bucket per key).
+  static rocksdb::Status open(const rocksdb::Options& options, const std::string& path, const std::string& ingest_dir,
+    ConfigureNamespace configure, std::unique_ptr<StorageEngine>& engine)
+  {
+    // A new DB has nothing to list yet
+    std::vector<std::string> names;
+    if (!rocksdb::DB::ListColumnFamilies(options, path, &names).ok())
+      names = { rocksdb::kDefaultColumnFamilyName };
+
+    std::map<std::string, std::string> specs = loadSpecs(path);
+    std::vector<rocksdb::ColumnFamilyDescriptor> descriptors;
+    for (const std::string& name : names)
+    {
+      rocksdb::ColumnFamilyOptions cf_options = options;
+      if (name != rocksdb::kDefaultColumnFamilyName)
+      {
+        cf_options = namespaceBase(options);
+        auto status = configure(specs[name], cf_options);
+        if (!status.ok())
+          return rocksdb::Status::InvalidArgument("Namespace " + name, status.ToString());
+      }
+
+      descriptors.emplace_back(name, cf_options);
+    }
+
+    rocksdb::OptimisticTransactionDBOptions txn_options;
+    txn_options.validate_policy = rocksdb::OccValidationPolicy::kValidateParallel;
+
+    rocksdb::OptimisticTransactionDB* db = nullptr;
+    std::vector<rocksdb::ColumnFamilyHandle*> handles;
+    auto status = rocksdb::OptimisticTransactionDB::Open(options, txn_options, path, descriptors, &handles, &db);
+    if (!status.ok())
+      return status;
+
+    std::unique_ptr<RocksDbEngine> rocks(new RocksDbEngine(db, path, ingest_dir, options, std::move(configure)));
+    for (size_t i = 0; i < handles.size(); i++)
+    {
+      const std::string& name = descriptors[i].name;
+      if (name == rocksdb::kDefaultColumnFamilyName)
+      {
+        rocks->m_default = handles[i];
+        continue;
+      }
+
+      rocks->m_namespaces[handles[i]->GetID()] = rocks->makeNamespace(handles[i], descriptors[i].options);
+      rocks->m_specs[name] = specs[name];
+    }
+
+    std::string format = valueFormat(options);
+    auto saved = specs.find(rocksdb::kDefaultColumnFamilyName);
+    if (saved != specs.end() && saved->second != format)
+      return rocksdb::Status::InvalidArgument("The default namespace was written with " + saved->second, "it can't be opened with " + format);
+    if (saved == specs.end() && format == "key-ttl=on" && !rocks->defaultEmpty())
+      return rocksdb::Status::InvalidArgument("The default namespace already holds values without expiry trailers", "key-ttl=on needs it empty");
+
+    rocks->m_specs[rocksdb::kDefaultColumnFamilyName] = format;
+    if (saved == specs.end())
+    {
+      status = rocks->saveSpecs();
+      if (!status.ok())
+        return status;
+    }
+
+    engine = std::move(rocks);
+    return rocksdb::Status::OK();
+  }
+
+  ~RocksDbEngine()
+  {
+    m_namespaces.clear();
+    if (m_default != nullptr)
+      m_db->DestroyColumnFamilyHandle(m_default);
+
+    m_db->Close();
+    delete m_txn_db; // and the DB under it
+  }
+
+  const char* name() const override
+  {
+    return "rocksdb";
+  }
+
+  rocksdb::Status get(const rocksdb::ReadOptions& options, const Namespace* ns, const rocksdb::Slice& key,
+    rocksdb::PinnableSlice* value) override
+  {
+    return m_db->Get(options, handle(ns), key, value);
+  }
+
+  void multiGet(const rocksdb::ReadOptions& options, const Namespace* ns, size_t count, const rocksdb::Slice* keys,
+    rocksdb::PinnableSlice* values, rocksdb::Status* statuses) override
+  {
+    m_db->MultiGet(options, handle(ns), count, keys, values, statuses, true);
+  }
+
+  rocksdb::Iterator* newIterator(const rocksdb::ReadOptions& options, const Namespace* ns, const Snapshot* snapshot) override
+  {
+    if (snapshot == nullptr)
+      return m_db->NewIterator(options, handle(ns));
+
+    rocksdb::ReadOptions at_snapshot = options;
+    at_snapshot.snapshot = static_cast<const RocksDbSnapshot*>(snapshot)->snapshot;
+    return m_db->NewIterator(at_snapshot, handle(ns));
+  }
+
+  const Snapshot* getSnapshot() override
+  {
+    return new RocksDbSnapshot(m_db->GetSnapshot());
+  }
+
+  void releaseSnapshot(const Snapshot* snapshot) override
+  {
+    auto held = static_cast<const RocksDbSnapshot*>(snapshot);
+    m_db->ReleaseSnapshot(held->snapshot);
+    delete held;
+  }
+
+  rocksdb::Status write(const rocksdb::WriteOptions& options, rocksdb::WriteBatch* batch) override
+  {
+    return m_db->Write(options, batch);
+  }
+
+  // An optimistic transaction: the conditions are read with GetForUpdate, and the commit fails
+  // with Busy if any of their keys was written after that. Then they are read and checked again.
+  rocksdb::Status writeIf(const rocksdb::WriteOptions& options, const std::vector<Condition>& conditions,
+    rocksdb::WriteBatch* batch, size_t& failed) override
+  {
+    rocksdb::ReadOptions read_options;
+    std::unique_ptr<rocksdb::Transaction> txn;
+    std::string value;
+    uint32_t now = expiryNow();
+    for (int attempt = 0; ; attempt++)
+    {
+      txn.reset(m_txn_db->BeginTransaction(options, rocksdb::OptimisticTransactionOptions(), txn.release()));
+      for (size_t i = 0; i < conditions.size(); i++)
+      {
+        const Condition& condition = conditions[i];
+        auto status = txn->GetForUpdate(read_options, handle(condition.ns), condition.key, &value);
+        if (!status.ok() && !status.IsNotFound())
+          return status;
+
+        rocksdb::Slice stored(value);
+        bool exists = status.ok() && (!condition.expiring || stripExpiry(stored, now));
+        if (exists != condition.exists || (exists && stored != rocksdb::Slice(condition.value)))
+        {
+          failed = i;
+          return rocksdb::Status::Aborted("Condition failed");
+        }
+      }
+
+      auto status = txn->RebuildFromWriteBatch(batch);
+      if (status.ok())
+        status = txn->Commit();
+
+      // TryAgain: the memtables no longer go back far enough to tell, which a fresh read fixes
+      if (!(status.IsBusy() || status.IsTryAgain()) || attempt == CONDITIONAL_WRITE_RETRIES)
+        return status;
+    }
+  }
+
+  std::unique_ptr<BulkLoad> newBulkLoad(std::shared_ptr<const Namespace> ns, uint64_t connection_id) override
+  {
+    return std::make_unique<SstBulkLoad>(m_db, std::move(ns), m_ingest_dir, connection_id);
+  }
+
+  bool getIntProperty(const std::string& property, uint64_t* value) override
+  {
+    return m_db->GetIntProperty(property, value);
+  }
+
+  // If the spec can't be saved the namespace is still created, but comes back untuned after a
+  // restart
+  rocksdb::Status createNamespace(const std::string& name, const std::string& spec,
+    std::shared_ptr<const Namespace>& ns) override
+  {
+    if (name.empty() || name == rocksdb::kDefaultColumnFamilyName || name.find_first_of("\t\n") != std::string::npos)
+      return rocksdb::Status::InvalidArgument("Bad namespace name");
+
+    std::unique_lock<std::shared_mutex> lock(m_namespaces_mutex);
+    for (const auto& [id, existing] : m_namespaces)
+    {
+      if (existing->name == name)
+      {
+        ns = existing;
+        return rocksdb::Status::OK();
+      }
+    }
+
+    rocksdb::ColumnFamilyOptions cf_options = m_base;
+    auto status = m_configure(spec, cf_options);
+    if (!status.ok())
+      return status;
+
+    rocksdb::ColumnFamilyHandle* handle = nullptr;
+    status = m_db->CreateColumnFamily(cf_options, name, &handle);
+    if (!status.ok())
+      return status;
+
+    ns = makeNamespace(handle, cf_options);
+    m_namespaces[ns->id] = ns;
+    m_specs[name] = spec;
+    return saveSpecs();
+  }
+
+  rocksdb::Status dropNamespace(uint32_t id) override
+  {
+    std::unique_lock<std::shared_mutex> lock(m_namespaces_mutex);
+    auto it = m_namespaces.find(id);
+    if (it == m_namespaces.end())
+      return rocksdb::Status::NotFound();
+
+    auto status = m_db->DropColumnFamily(it->second->handle);
+    if (!status.ok())
+      return status;
+
+    m_specs.erase(it->second->name);
+    m_namespaces.erase(it);
+    return saveSpecs();
+  }
+
+  std::shared_ptr<const Namespace> findNamespace(uint32_t id) override
+  {
+    std::shared_lock<std::shared_mutex> lock(m_namespaces_mutex);
+    auto it = m_namespaces.find(id);
+    return it != m_namespaces.end() ? it->second : nullptr;
+  }
+};
+
+#ifdef HAVE_LMDB
+
+// Read transactions open at once: live iterators, snapshots, values still pinned by a get, and
+// each thread's few idle ones
+#ifndef LMDB_MAX_READERS
+  #define LMDB_MAX_READERS 4096
+#endif
+
+// Idle read transactions each thread keeps around for the next get or iterator
+#ifndef LMDB_IDLE_READERS_PER_THREAD
+  #define LMDB_IDLE_READERS_PER_THREAD 8
+#endif
+
+// LMDB's single B-tree in a memory map. Readers never block: a read transaction is a fixed view
+// of the tree, and gets hand out values by pointing straight into the map for as long as they are
+// pinned. Writers take LMDB's one writer lock, so each write() commits alone; the map doesn't grow
+// by itself, so writes fail once it is full (--lmdb-map-size).
+//
+// Like RocksDB without sync, commits reach the OS right away but are only flushed to disk when a
+// write asks for sync. Any read transaction held open (a snapshot, a long scan) stops the pages
+// it can see from being reused, so the file grows under writes while it lives.
+class LmdbEngine : public StorageEngine
+{
+private:
+  // A reset-and-renewed read transaction, shared by whatever still points into its view. Only
+  // ever touched by one thread at a time.
+  struct ReadTxn
+  {
+    MDB_txn* txn = nullptr;
+    uint32_t pins = 0;
+  };
+
+  // Idle read transactions, so a get costs a renew instead of a begin
+  struct IdleReaders
+  {
+    std::vector<ReadTxn*> txns;
+  };
+
+  struct LmdbSnapshot : Snapshot
+  {
+    MDB_txn* txn;
+
+    explicit LmdbSnapshot(MDB_txn* txn) :
+      txn(txn)
+    { }
+  };
+
+  class LmdbIterator;
+  class LmdbBulkLoad;
+  struct Replay;
+
+  MDB_env* m_env;
+  MDB_dbi m_dbi;
+  PerThread<IdleReaders> m_idle; // one engine per process: PerThread keys its slot by type
+
+  LmdbEngine(MDB_env* env, MDB_dbi dbi) :
+    m_env(env),
+    m_dbi(dbi)
+  { }
+
+  static rocksdb::Status error(int rc)
+  {
+    if (rc == MDB_MAP_FULL)
+      return rocksdb::Status::IOError("LMDB map is full (raise --lmdb-map-size)");
+    return rocksdb::Status::IOError(mdb_strerror(rc));
+  }
+
+  static MDB_val toVal(const rocksdb::Slice& slice)
+  {
+    return MDB_val { slice.size(), const_cast<char*>(slice.data()) };
+  }
+
+  static rocksdb::Slice toSlice(const MDB_val& val)
+  {
+    return rocksdb::Slice(static_cast<const char*>(val.mv_data), val.mv_size);
+  }
+
+  ReadTxn* acquire(rocksdb::Status& status)
+  {
+    std::vector<ReadTxn*>& idle = m_idle.local().txns;
+    if (!idle.empty())
+    {
+      ReadTxn* read = idle.back();
+      idle.pop_back();
+      int rc = mdb_txn_renew(read->txn);
+      if (rc == 0)
+        return read;
+
+      mdb_txn_abort(read->txn);
+      delete read;
+      status = error(rc);
+      return nullptr;
+    }
+
+    auto read = new ReadTxn();
+    int rc = mdb_txn_begin(m_env, nullptr, MDB_RDONLY, &read->txn);
+    if (rc == 0)
+      return read;
+
+    delete read;
+    status = error(rc);
+    return nullptr;
+  }
+
+  // Drops a pin; the last one lets go of the view and parks the transaction on this thread
+  void release(ReadTxn* read)
+  {
+    if (read->pins > 0 && --read->pins > 0)
+      return;
+
+    std::vector<ReadTxn*>& idle = m_idle.local().txns;
+    if (idle.size() < LMDB_IDLE_READERS_PER_THREAD)
+    {
+      mdb_txn_reset(read->txn);
+      idle.push_back(read);
+      return;
+    }
+
+    mdb_txn_abort(read->txn);
+    delete read;
+  }
+
+  static void unpin(void* engine, void* read)
+  {
+    static_cast<LmdbEngine*>(engine)->release(static_cast<ReadTxn*>(read));
+  }
+
+  void pin(rocksdb::PinnableSlice* value, const MDB_val& val, ReadTxn* read)
+  {
+    read->pins++;
+    value->PinSlice(toSlice(val), &LmdbEngine::unpin, this, read);
+  }
+
+  rocksdb::Status apply(rocksdb::WriteBatch* batch, unsigned int put_flags, bool sync,
+    const std::vector<Condition>* conditions = nullptr, size_t* failed = nullptr);
+
+public:
+  LmdbEngine(const LmdbEngine&) = delete;
+  LmdbEngine& operator=(const LmdbEngine&) = delete;
+
+  // Opens (or creates) the environment in the directory at path, mapping up to map_size bytes
+  static rocksdb::Status open(const std::string& path, size_t map_size, std::unique_ptr<StorageEngine>& engine)
+  {
+    std::error_code ec;
+    std::filesystem::create_directories(path, ec);
+
+    // MDB_NOTLS: read transactions aren't tied to a thread, so a thread can hold many and the
+    // idle ones can be reused. MDB_NORDAHEAD: point reads of a working set that fits in RAM only
+    // lose from readahead.
+    MDB_env* env = nullptr;
+    int rc = mdb_env_create(&env);
+    if (rc == 0)
+      rc = mdb_env_set_mapsize(env, map_size);
+    if (rc == 0)
+      rc = mdb_env_set_maxreaders(env, LMDB_MAX_READERS);
+    if (rc == 0)
+      rc = mdb_env_open(env, path.c_str(), MDB_NOTLS | MDB_NOSYNC | MDB_NORDAHEAD, 0644);
+
+    MDB_txn* txn = nullptr;
+    MDB_dbi dbi = 0;
+    if (rc == 0)
+      rc = mdb_txn_begin(env, nullptr, 0, &txn);
+    if (rc == 0)
+      rc = mdb_dbi_open(txn, nullptr, 0, &dbi);
+    if (rc == 0)
+      rc = mdb_txn_commit(txn);
+    else if (txn != nullptr)
+      mdb_txn_abort(txn);
+
+    if (rc != 0)
+    {
+      if (env != nullptr)
+        mdb_env_close(env);
+      return error(rc);
+    }
+
+    engine.reset(new LmdbEngine(env, dbi));
+    return rocksdb::Status::OK();
+  }
+
+  // Everything reading from the engine has to be gone by now
+  ~LmdbEngine()
+  {
+    m_idle.forEach([](IdleReaders& idle) {
+      for (ReadTxn* read : idle.txns)
+      {
+        mdb_txn_abort(read->txn);
+        delete read;
+      }
+      idle.txns.clear();
+    });
+
+    mdb_env_sync(m_env, 1);
+    mdb_env_close(m_env);
+  }
+
+  const char* name() const override
+  {
+    return "lmdb";
+  }
+
+  rocksdb::Status get(const rocksdb::ReadOptions&, const Namespace*, const rocksdb::Slice& key, rocksdb::PinnableSlice* value) override
+  {
+    rocksdb::Status status;
+    ReadTxn* read = acquire(status);
+    if (read == nullptr)
+      return status;
+
+    MDB_val k = toVal(key);
+    MDB_val v;
+    int rc = mdb_get(read->txn, m_dbi, &k, &v);
+    if (rc != 0)
+    {
+      release(read);
+      return rc == MDB_NOTFOUND ? rocksdb::Status::NotFound() : error(rc);
+    }
+
+    pin(value, v, read);
+    return rocksdb::Status::OK();
+  }
+
+  // All from one view, which stays open until the last value is Reset
+  void multiGet(const rocksdb::ReadOptions&, const Namespace*, size_t count, const rocksdb::Slice* keys,
+    rocksdb::PinnableSlice* values, rocksdb::Status* statuses) override
+  {
+    rocksdb::Status status;
+    ReadTxn* read = acquire(status);
+    if (read == nullptr)
+    {
+      for (size_t i = 0; i < count; i++)
+        statuses[i] = status;
+      return;
+    }
+
+    read->pins++; // held across the loop
+    for (size_t i = 0; i < count; i++)
+    {
+      MDB_val k = toVal(keys[i]);
+      MDB_val v;
+      int rc = mdb_get(read->txn, m_dbi, &k, &v);
+      if (rc == 0)
+      {
+        pin(&values[i], v, read);
+        statuses[i] = rocksdb::Status::OK();
+      }
+      else
+        statuses[i] = rc == MDB_NOTFOUND ? rocksdb::Status::NotFound() : error(rc);
+    }
+    release(read);
+  }
+
+  rocksdb::Iterator* newIterator(const rocksdb::ReadOptions& options, const Namespace* ns, const Snapshot* snapshot) override;
+
+  const Snapshot* getSnapshot() override
+  {
+    MDB_txn* txn = nullptr;
+    if (mdb_txn_begin(m_env, nullptr, MDB_RDONLY, &txn) != 0)
+      return nullptr;
+    return new LmdbSnapshot(txn);
+  }
+
+  void releaseSnapshot(const Snapshot* snapshot) override
+  {
+    auto held = static_cast<const LmdbSnapshot*>(snapshot);
+    mdb_txn_abort(held->txn);
+    delete held;
+  }
+
+  rocksdb::Status write(const rocksdb::WriteOptions& options, rocksdb::WriteBatch* batch) override
+  {
+    return apply(batch, 0, options.sync);
+  }
+
+  // LMDB's writer lock already keeps everyone else out between the check and the write
+  rocksdb::Status writeIf(const rocksdb::WriteOptions& options, const std::vector<Condition>& conditions,
+    rocksdb::WriteBatch* batch, size_t& failed) override
+  {
+    return apply(batch, 0, options.sync, &conditions, &failed);
+  }
+
+  std::unique_ptr<BulkLoad> newBulkLoad(std::shared_ptr<const Namespace> ns, uint64_t connection_id) override;
+
+  bool getIntProperty(const std::string&, uint64_t*) override
+  {
+    return false;
+  }
+
+  rocksdb::Status createNamespace(const std::string&, const std::string&, std::shared_ptr<const Namespace>&) override
+  {
+    return rocksdb::Status::NotSupported("LMDB has no namespaces");
+  }
+
+  rocksdb::Status dropNamespace(uint32_t) override
+  {
+    return rocksdb::Status::NotFound();
+  }
+
+  std::shared_ptr<const Namespace> findNamespace(uint32_t) override
+  {
+    return nullptr;
+  }
+};
+
+// Walks the tree with a cursor inside a read transaction: its own (renewed on Refresh) or a
+// snapshot's. Keys and values point into the map and stay valid until the iterator goes or is
+// refreshed, as with pin_data. LMDB orders keys bytewise, like RocksDB's default comparator.
+class LmdbEngine::LmdbIterator : public rocksdb::Iterator
+{
+private:
+  LmdbEngine& m_engine;
+  ReadTxn* m_read; // null when reading a snapshot
+  MDB_cursor* m_cursor = nullptr;
+  std::string m_lower;
+  std::string m_upper;
+  bool m_has_lower;
+  bool m_has_upper;
+  MDB_val m_key {};
+  MDB_val m_value {};
+  bool m_valid = false;
+  rocksdb::Status m_status;
+
+  // Lands on the result of a cursor op, then checks the bounds
+  void position(int rc)
+  {
+    m_valid = rc == 0;
+    if (rc != 0 && rc != MDB_NOTFOUND)
+      m_status = error(rc);
+    if (!m_valid)
+      return;
+
+    rocksdb::Slice key = toSlice(m_key);
+    if ((m_has_upper && key.compare(m_upper) >= 0) || (m_has_lower && key.compare(m_lower) < 0))
+      m_valid = false;
+  }
+
+  // First key at or after target. LMDB has no empty keys and won't seek to one.
+  int seekAtOrAfter(const rocksdb::Slice& target)
+  {
+    if (target.empty())
+      return mdb_cursor_get(m_cursor, &m_key, &m_value, MDB_FIRST);
+
+    m_key = toVal(target);
+    return mdb_cursor_get(m_cursor, &m_key, &m_value, MDB_SET_RANGE);
+  }
+
+  // Last key before the upper bound, or the last key there is
+  void seekBelowUpper()
+  {
+    int rc = m_has_upper ? seekAtOrAfter(m_upper) : MDB_NOTFOUND;
+    if (rc == 0)
+      rc = mdb_cursor_get(m_cursor, &m_key, &m_value, MDB_PREV);
+    else if (rc == MDB_NOTFOUND)
+      rc = mdb_cursor_get(m_cursor, &m_key, &m_value, MDB_LAST);
+    position(rc);
+  }
+
+public:
+  LmdbIterator(LmdbEngine& engine, ReadTxn* read, MDB_txn* txn, const rocksdb::ReadOptions& options) :
+    m_engine(engine),
+    m_read(read),
+    m_has_lower(options.iterate_lower_bound != nullptr),
+    m_has_upper(options.iterate_upper_bound != nullptr)
+  {
+    if (m_has_lower)
+      m_lower = options.iterate_lower_bound->ToString();
+    if (m_has_upper)
+      m_upper = options.iterate_upper_bound->ToString();
+
+    int rc = mdb_cursor_open(txn, m_engine.m_dbi, &m_cursor);
+    if (rc != 0)
+      m_status = error(rc);
+  }
+
+  ~LmdbIterator()
+  {
+    if (m_cursor != nullptr)
+      mdb_cursor_close(m_cursor);
+    if (m_read != nullptr)
+      m_engine.release(m_read);
+  }
+
+  bool Valid() const override
+  {
+    return m_valid;
+  }
+
+  void SeekToFirst() override
+  {
+    if (m_cursor == nullptr)
+      return;
+
+    if (m_has_lower)
+      position(seekAtOrAfter(m_lower));
+    else
+      position(mdb_cursor_get(m_cursor, &m_key, &m_value, MDB_FIRST));
+  }
+
+  void SeekToLast() override
+  {
+    if (m_cursor != nullptr)
+      seekBelowUpper();
+  }
+
+  void Seek(const rocksdb::Slice& target) override
+  {
+    if (m_cursor == nullptr)
+      return;
+
+    if (m_has_lower && target.compare(m_lower) < 0)
+      position(seekAtOrAfter(m_lower));
+    else
+      position(seekAtOrAfter(target));
+  }
+
+  // Last key at or before target
+  void SeekForPrev(const rocksdb::Slice& target) override
+  {
+    if (m_cursor == nullptr)
+      return;
+
+    if (m_has_upper && target.compare(m_upper) >= 0)
+    {
+      seekBelowUpper();
+      return;
+    }
+
+    int rc = seekAtOrAfter(target);
+    if (rc == MDB_NOTFOUND)
+      rc = mdb_cursor_get(m_cursor, &m_key, &m_value, MDB_LAST);
+    else if (rc == 0 && toSlice(m_key) != target)
+      rc = mdb_cursor_get(m_cursor, &m_key, &m_value, MDB_PREV);
+    position(rc);
+  }
+
+  void Next() override
+  {
+    position(mdb_cursor_get(m_cursor, &m_key, &m_value, MDB_NEXT));
+  }
+
+  void Prev() override
+  {
+    position(mdb_cursor_get(m_cursor, &m_key, &m_value, MDB_PREV));
+  }
+
+  rocksdb::Slice key() const override
+  {
+    return toSlice(m_key);
+  }
+
+  rocksdb::Slice value() const override
+  {
+    return toSlice(m_value);
+  }
+
+  rocksdb::Status status() const override
+  {
+    return m_status;
+  }
+
+  // Moves the view up to the latest commit; the iterator has to be positioned again
+  rocksdb::Status Refresh() override
+  {
+    if (m_read == nullptr)
+      return rocksdb::Status::NotSupported("Snapshot iterators can't be refreshed");
+
+    m_valid = false;
+    mdb_txn_reset(m_read->txn);
+    int rc = mdb_txn_renew(m_read->txn);
+    if (rc == 0)
+      rc = mdb_cursor_renew(m_read->txn, m_cursor);
+    return rc == 0 ? rocksdb::Status::OK() : error(rc);
+  }
+};
+
+inline rocksdb::Iterator* LmdbEngine::newIterator(const rocksdb::ReadOptions& options, const Namespace*, const Snapshot* snapshot)
+{
+  if (snapshot != nullptr)
+    return new LmdbIterator(*this, nullptr, static_cast<const LmdbSnapshot*>(snapshot)->txn, options);
+
+  rocksdb::Status status;
+  ReadTxn* read = acquire(status);
+  if (read == nullptr)
+    return rocksdb::NewErrorIterator(status);
+
+  read->pins++;
+  return new LmdbIterator(*this, read, read->txn, options);
+}
+
+// Plays a WriteBatch into a write transaction. LMDB has no merge operators or column families.
+struct LmdbEngine::Replay : rocksdb::WriteBatch::Handler
+{
+  MDB_txn* txn;
+  MDB_dbi dbi;
+  unsigned int put_flags;
+  int rc = 0;
+
+  Replay(MDB_txn* txn, MDB_dbi dbi, unsigned int put_flags) :
+    txn(txn),
+    dbi(dbi),
+    put_flags(put_flags)
+  { }
+
+  rocksdb::Status result(int code)
+  {
+    rc = code;
+    return code == 0 ? rocksdb::Status::OK() : error(code);
+  }
+
+  rocksdb::Status PutCF(uint32_t column_family, const rocksdb::Slice& key, const rocksdb::Slice& value) override
+  {
+    if (column_family != 0)
+      return rocksdb::Status::InvalidArgument("LMDB has only the default column family");
+
+    MDB_val k = toVal(key);
+    MDB_val v = toVal(value);
+    return result(mdb_put(txn, dbi, &k, &v, put_flags));
+  }
+
+  rocksdb::Status DeleteCF(uint32_t column_family, const rocksdb::Slice& key) override
+  {
+    if (column_family != 0)
+      return rocksdb::Status::InvalidArgument("LMDB has only the default column family");
+
+    MDB_val k = toVal(key);
+    int code = mdb_del(txn, dbi, &k, nullptr);
+    return result(code == MDB_NOTFOUND ? 0 : code);
+  }
+
+  rocksdb::Status SingleDeleteCF(uint32_t column_family, const rocksdb::Slice& key) override
+  {
+    return DeleteCF(column_family, key);
+  }
+
+  // [begin, end)
+  rocksdb::Status DeleteRangeCF(uint32_t column_family, const rocksdb::Slice& begin, const rocksdb::Slice& end) override
+  {
+    if (column_family != 0)
+      return rocksdb::Status::InvalidArgument("LMDB has only the default column family");
+
+    MDB_cursor* cursor;
+    int code = mdb_cursor_open(txn, dbi, &cursor);
+    if (code != 0)
+      return result(code);
+
+    // Seeks from begin again after every delete rather than trusting the cursor's position
+    MDB_val k;
+    MDB_val v;
+    do
+    {
+      k = toVal(begin);
+      code = mdb_cursor_get(cursor, &k, &v, MDB_SET_RANGE);
+      if (code == 0 && toSlice(k).compare(end) >= 0)
+        break;
+      if (code == 0)
+        code = mdb_cursor_del(cursor, 0);
+    } while (code == 0);
+    mdb_cursor_close(cursor);
+    return result(code == MDB_NOTFOUND ? 0 : code);
+  }
+
+  rocksdb::Status MergeCF(uint32_t, const rocksdb::Slice&, const rocksdb::Slice&) override
+  {
+    return rocksdb::Status::NotSupported("LMDB has no merge operators");
+  }
+};
+
+// Conditions are checked inside the write transaction, before the batch is played into it
+inline rocksdb::Status LmdbEngine::apply(rocksdb::WriteBatch* batch, unsigned int put_flags, bool sync,
+  const std::vector<Condition>* conditions, size_t* failed)
+{
+  MDB_txn* txn;
+  int rc = mdb_txn_begin(m_env, nullptr, 0, &txn);
+  if (rc != 0)
+    return error(rc);
+
+  uint32_t now = expiryNow();
+  for (size_t i = 0; conditions != nullptr && i < conditions->size(); i++)
+  {
+    const Condition& condition = (*conditions)[i];
+    MDB_val k = toVal(condition.key);
+    MDB_val v;
+    rc = mdb_get(txn, m_dbi, &k, &v);
+    if (rc != 0 && rc != MDB_NOTFOUND)
+    {
+      mdb_txn_abort(txn);
+      return error(rc);
+    }
+
+    rocksdb::Slice stored = rc == 0 ? toSlice(v) : rocksdb::Slice();
+    bool exists = rc == 0 && (!condition.expiring || stripExpiry(stored, now));
+    if (exists != condition.exists || (exists && stored != rocksdb::Slice(condition.value)))
+    {
+      mdb_txn_abort(txn);
+      *failed = i;
+      return rocksdb::Status::Aborted("Condition failed");
+    }
+  }
+
+  Replay replay(txn, m_dbi, put_flags);
+  auto status = batch->Iterate(&replay);
+  if (!status.ok())
+  {
+    mdb_txn_abort(txn);
+    return replay.rc == MDB_KEYEXIST ? rocksdb::Status::Busy() : status;
+  }
+
+  rc = mdb_txn_commit(txn);
+  if (rc == 0 && sync)
+    rc = mdb_env_sync(m_env, 1);
+  return rc == 0 ? rocksdb::Status::OK() : error(rc);
+}
+
+// There is no file to ingest, so the stream is held in memory and committed in one write
+// transaction at the end. Sorted keys past the end of the tree are appended, which fills pages
+// in order instead of splitting them.
+class LmdbEngine::LmdbBulkLoad : public BulkLoad
+{
+private:
+  LmdbEngine& m_engine;
+  rocksdb::WriteBatch m_batch;
+  std::string m_last_key;
+  rocksdb::Status m_status;
+
+public:
+  explicit LmdbBulkLoad(LmdbEngine& engine) :
+    m_engine(engine)
+  { }
+
+  void add(const rocksdb::Slice& key, const rocksdb::Slice& value) override
+  {
+    if (!m_status.ok())
+      return;
+
+    if (m_batch.Count() > 0 && key.compare(m_last_key) <= 0)
+    {
+      m_status = rocksdb::Status::InvalidArgument("Keys must be added in strict ascending order.");
+      return;
+    }
+
+    m_last_key.assign(key.data(), key.size());
+    m_status = m_batch.Put(key, value);
+  }
+
+  rocksdb::Status finish() override
+  {
+    if (!m_status.ok() || m_batch.Count() == 0)
+      return m_status;
+
+    // MDB_APPEND refuses a key that isn't past the end of the tree; then it's an ordinary load
+    m_status = m_engine.apply(&m_batch, MDB_APPEND, true);
+    if (m_status.IsBusy())
+      m_status = m_engine.apply(&m_batch, 0, true);
+
+    m_batch.Clear();
+    return m_status;
+  }
+};
+
+inline std::unique_ptr<StorageEngine::BulkLoad> LmdbEngine::newBulkLoad(std::shared_ptr<const Namespace>, uint64_t)
+{
+  return std::make_unique<LmdbBulkLoad>(*this);
+}
+
+#endif
+
+#endif
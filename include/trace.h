@@ -0,0 +1,293 @@
+#ifndef _FCSH_TRACE_H
+#define _FCSH_TRACE_H
+
+// Sampled request tracing. Compiled in with ENABLE_TRACING (cmake -DSCRAMJET_WITH_TRACING=ON) and
+// switched on at run time with a sample rate; without ENABLE_TRACING the TRACE_ macros compile
+// to nothing and Tracer is an empty stand-in.
+//
+// A sampled request marks its thread active while it runs, and every TRACE_SPAN on that thread
+// then records a begin/end pair into the thread's own ring of events. Unsampled requests pay for
+// a thread-local flag test per span. dump() drains every ring into Chrome trace JSON, which
+// chrome://tracing and Perfetto open as is.
+
+#include <cstdint>
+#include <string>
+
+#ifdef ENABLE_TRACING
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cmath>
+#include <cstdint>
+#include <cstdio>
+#include <mutex>
+#include <string>
+#include <thread>
+
+#include <metrics.h>
+
+#if defined(__x86_64__) || defined(__i386__)
+  #include <x86intrin.h>
+  #define TRACE_USE_TSC
+#endif
+
+// Events each thread keeps until the next dump; older ones are overwritten (power of two)
+#ifndef TRACE_RING_EVENTS
+  #define TRACE_RING_EVENTS 16384
+#endif
+
+class Tracer
+{
+private:
+  static constexpr uint64_t RING_MASK = TRACE_RING_EVENTS - 1;
+  static_assert((TRACE_RING_EVENTS & RING_MASK) == 0, "TRACE_RING_EVENTS must be a power of two");
+
+  // One event. seq is the event's index + 1 once it is fully written and 0 while it is being
+  // rewritten, so a dump racing the writer can tell a torn copy from a good one.
+  struct alignas(64) Slot
+  {
+    std::atomic<uint64_t> seq { 0 };
+    std::atomic<uint64_t> start { 0 };
+    std::atomic<uint64_t> end { 0 };
+    std::atomic<const char*> name { nullptr };
+    std::atomic<const char*> category { nullptr };
+    std::atomic<const char*> arg_name { nullptr };
+    std::atomic<uint64_t> arg { 0 };
+  };
+
+  // Single-writer ring of one thread's events
+  struct Ring
+  {
+    static inline std::atomic<uint32_t> s_next_tid { 1 };
+
+    uint32_t tid = s_next_tid.fetch_add(1, std::memory_order_relaxed);
+    std::atomic<uint64_t> head { 0 }; // events written so far
+    uint64_t read = 0; // events already dumped, under s_dump_lock
+    Slot slots[TRACE_RING_EVENTS];
+
+    void push(const char* name, const char* category, uint64_t start, uint64_t end, const char* arg_name, uint64_t arg)
+    {
+      uint64_t index = head.load(std::memory_order_relaxed);
+      Slot& slot = slots[index & RING_MASK];
+      slot.seq.store(0, std::memory_order_relaxed);
+      std::atomic_thread_fence(std::memory_order_release);
+
+      slot.start.store(start, std::memory_order_relaxed);
+      slot.end.store(end, std::memory_order_relaxed);
+      slot.name.store(name, std::memory_order_relaxed);
+      slot.category.store(category, std::memory_order_relaxed);
+      slot.arg_name.store(arg_name, std::memory_order_relaxed);
+      slot.arg.store(arg, std::memory_order_relaxed);
+
+      slot.seq.store(index + 1, std::memory_order_release);
+      head.store(index + 1, std::memory_order_release);
+    }
+  };
+
+  static inline PerThread<Ring> s_rings;
+  static inline std::mutex s_dump_lock;
+  static inline uint64_t s_period = 0; // sample one call to sample() in this many, on average
+  static inline uint64_t s_base = 0; // timestamps are dumped relative to this
+  static inline double s_ticks_per_us = 1000;
+
+  static inline thread_local bool t_active = false;
+  static inline thread_local uint64_t t_countdown = 0;
+  static inline thread_local uint64_t t_rng = 0;
+
+  // Gap to the next sample: uniform over 1 .. 2 * period - 1, so samples can't lock step with a
+  // periodic request pattern
+  static uint64_t nextGap()
+  {
+    if (t_rng == 0)
+      t_rng = now() | 1;
+
+    t_rng ^= t_rng << 13;
+    t_rng ^= t_rng >> 7;
+    t_rng ^= t_rng << 17;
+    return 1 + t_rng % (2 * s_period - 1);
+  }
+
+  static void appendNumber(std::string& out, double value)
+  {
+    char text[32];
+    snprintf(text, sizeof(text), "%.3f", value);
+    out.append(text);
+  }
+
+public:
+  static constexpr bool COMPILED_IN = true;
+
+  // TSC ticks on x86 (any recent x86 has an invariant TSC), steady_clock nanoseconds elsewhere
+  static uint64_t now()
+  {
+#ifdef TRACE_USE_TSC
+    return __rdtsc();
+#else
+    return std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now().time_since_epoch()).count();
+#endif
+  }
+
+  // Sample this fraction of requests (0 turns tracing off). Call once at startup, before any
+  // thread traces; it takes a few milliseconds to calibrate the clock.
+  static void configure(double rate)
+  {
+    s_period = rate <= 0 ? 0 : std::max<uint64_t>(1, std::llround(1 / std::min(rate, 1.0)));
+
+    auto wall = std::chrono::steady_clock::now();
+    uint64_t ticks = now();
+    std::this_thread::sleep_for(std::chrono::milliseconds(20));
+    double us = std::chrono::duration<double, std::micro>(std::chrono::steady_clock::now() - wall).count();
+    s_ticks_per_us = (now() - ticks) / us;
+    s_base = ticks;
+  }
+
+  static bool enabled()
+  {
+    return s_period != 0;
+  }
+
+  // Whether to trace the next request (or I/O call) on this thread
+  static bool sample()
+  {
+    if (s_period == 0)
+      return false;
+
+    if (t_countdown > 1)
+    {
+      t_countdown--;
+      return false;
+    }
+
+    t_countdown = nextGap();
+    return true;
+  }
+
+  // Whether spans on this thread belong to a sampled request
+  static bool active()
+  {
+    return t_active;
+  }
+
+  static void setActive(bool active)
+  {
+    t_active = active;
+  }
+
+  static void record(const char* name, const char* category, uint64_t start, uint64_t end,
+    const char* arg_name = nullptr, uint64_t arg = 0)
+  {
+    s_rings.local().push(name, category, start, end, arg_name, arg);
+  }
+
+  // Everything recorded since the last dump, as Chrome trace JSON (complete events, times in
+  // microseconds). Events overwritten before they could be dumped are counted in otherData.
+  static std::string dump()
+  {
+    std::lock_guard<std::mutex> guard(s_dump_lock);
+    std::string out = "{\"displayTimeUnit\":\"ns\",\"traceEvents\":[";
+    uint64_t dropped = 0;
+    bool first = true;
+
+    s_rings.forEach([&](Ring& ring) {
+      uint64_t head = ring.head.load(std::memory_order_acquire);
+      uint64_t from = std::max(ring.read, head > TRACE_RING_EVENTS ? head - TRACE_RING_EVENTS : 0);
+      dropped += from - ring.read;
+      ring.read = head;
+
+      out.append(first ? "" : ",");
+      first = false;
+      out.append("{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":1,\"tid\":").append(std::to_string(ring.tid));
+      out.append(",\"args\":{\"name\":\"thread ").append(std::to_string(ring.tid)).append("\"}}");
+
+      for (uint64_t i = from; i < head; i++)
+      {
+        const Slot& slot = ring.slots[i & RING_MASK];
+        uint64_t seq = slot.seq.load(std::memory_order_acquire);
+        uint64_t start = slot.start.load(std::memory_order_relaxed);
+        uint64_t end = slot.end.load(std::memory_order_relaxed);
+        const char* name = slot.name.load(std::memory_order_relaxed);
+        const char* category = slot.category.load(std::memory_order_relaxed);
+        const char* arg_name = slot.arg_name.load(std::memory_order_relaxed);
+        uint64_t arg = slot.arg.load(std::memory_order_relaxed);
+        std::atomic_thread_fence(std::memory_order_acquire);
+        if (seq != i + 1 || slot.seq.load(std::memory_order_relaxed) != seq)
+        {
+          dropped++; // overwritten while we looked
+          continue;
+        }
+
+        out.append(",{\"name\":\"").append(name).append("\",\"cat\":\"").append(category);
+        out.append("\",\"ph\":\"X\",\"pid\":1,\"tid\":").append(std::to_string(ring.tid));
+        out.append(",\"ts\":");
+        appendNumber(out, (start - s_base) / s_ticks_per_us);
+        out.append(",\"dur\":");
+        appendNumber(out, end > start ? (end - start) / s_ticks_per_us : 0);
+        if (arg_name != nullptr)
+          out.append(",\"args\":{\"").append(arg_name).append("\":").append(std::to_string(arg)).append("}");
+        out.append("}");
+      }
+    });
+
+    out.append("],\"otherData\":{\"dropped\":").append(std::to_string(dropped)).append("}}");
+    return out;
+  }
+};
+
+// Records its scope as an event while the thread is tracing a request (or when told to)
+class TraceSpan
+{
+private:
+  const char* m_name;
+  const char* m_category;
+  uint64_t m_start;
+
+public:
+  TraceSpan(const TraceSpan&) = delete;
+  TraceSpan& operator=(const TraceSpan&) = delete;
+
+  TraceSpan(const char* name, const char* category, bool on = Tracer::active()) :
+    m_name(name),
+    m_category(category),
+    m_start(on ? Tracer::now() : 0)
+  { }
+
+  ~TraceSpan()
+  {
+    if (m_start != 0)
+      Tracer::record(m_name, m_category, m_start, Tracer::now());
+  }
+};
+
+#define TRACE_CONCAT_(a, b) a##b
+#define TRACE_CONCAT(a, b) TRACE_CONCAT_(a, b)
+
+// Span over the rest of the enclosing scope, part of the sampled request running on this thread
+#define TRACE_SPAN(name, category) TraceSpan TRACE_CONCAT(trace_span_, __LINE__)(name, category)
+
+// Span sampled on its own, for work done outside any request
+#define TRACE_SAMPLED_SPAN(name, category) TraceSpan TRACE_CONCAT(trace_span_, __LINE__)(name, category, Tracer::sample())
+
+#else
+
+class Tracer
+{
+public:
+  static constexpr bool COMPILED_IN = false;
+
+  static uint64_t now() { return 0; }
+  static void configure(double) { }
+  static constexpr bool enabled() { return false; }
+  static constexpr bool sample() { return false; }
+  static constexpr bool active() { return false; }
+  static void setActive(bool) { }
+  static void record(const char*, const char*, uint64_t, uint64_t, const char* = nullptr, uint64_t = 0) { }
+  static std::string dump() { return std::string(); }
+};
+
+#define TRACE_SPAN(name, category) do { } while (false)
+#define TRACE_SAMPLED_SPAN(name, category) do { } while (false)
+
+#endif
+
+#endif
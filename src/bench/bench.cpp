@@ -0,0 +1,1095 @@
+#include <vector>
+#include <algorithm>
+#include <string_view>
+#include <iostream>
+#include <iomanip>
+#include <unordered_map>
+#include <deque>
+#include <memory>
+#include <thread>
+#include <atomic>
+#include <random>
+#include <chrono>
+#include <cmath>
+#include <cstring>
+#include <stdint.h>
+#include <getopt.h>
+
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <poll.h>
+#include <fcntl.h>
+#include <unistd.h>
+
+using std::string_view;
+using std::string;
+using std::vector;
+using std::cout;
+using std::cerr;
+using std::endl;
+using Clock = std::chrono::steady_clock;
+
+// Wire protocol, as spoken by the server (see src/main/fincache.cpp). Lengths and request ids in
+// requests are in host order, since the server only listens on a UNIX socket; everything in
+// replies is big-endian.
+constexpr char OP_GET_ONE = 0x01;
+constexpr char OP_GET_N = 0x02;
+constexpr char OP_GET_BETWEEN = 0x03;
+constexpr char OP_PUT_ONE = 0x04;
+constexpr char OP_PUT_MULTI = 0x05;
+constexpr char OP_BULK_PUT = 0x06;
+constexpr char OP_FLAG_TAGGED = static_cast<char>(0x80);
+
+constexpr uint8_t STAT_OK = 0x00;
+constexpr uint8_t STAT_NOT_FOUND = 0x01;
+constexpr uint8_t STAT_ERR = 0x02;
+
+// What the bench can ask for, named as on the command line (--mix)
+enum OpKind
+{
+  KIND_GET,
+  KIND_GET_N,
+  KIND_GET_BETWEEN,
+  KIND_PUT,
+  KIND_PUT_MULTI,
+  KIND_BULK_PUT,
+  KIND_COUNT
+};
+
+static const char* const KIND_NAMES[KIND_COUNT] = { "get", "getn", "between", "put", "putmulti", "bulkput" };
+
+inline uint32_t getBE32(const uint8_t* in)
+{
+  return (uint32_t(in[0]) << 24) | (uint32_t(in[1]) << 16) | (uint32_t(in[2]) << 8) | uint32_t(in[3]);
+}
+
+inline uint16_t getBE16(const uint8_t* in)
+{
+  return static_cast<uint16_t>((in[0] << 8) | in[1]);
+}
+
+inline void appendU32(string& out, uint32_t value)
+{
+  out.append(reinterpret_cast<const char*>(&value), sizeof(value));
+}
+
+inline uint64_t splitmix64(uint64_t x)
+{
+  x += 0x9E3779B97F4A7C15ULL;
+  x = (x ^ (x >> 30)) * 0xBF58476D1CE4E5B9ULL;
+  x = (x ^ (x >> 27)) * 0x94D049BB133111EBULL;
+  return x ^ (x >> 31);
+}
+
+// Latency histogram in the HdrHistogram layout: every power of two is split into 64 linear
+// sub-buckets, so any recorded value is reported within 1.6% of itself, from nanoseconds up to
+// hours, in a few KB of counters. Values are nanoseconds.
+class Histogram
+{
+private:
+  static constexpr int SUB_BITS = 7;
+  static constexpr size_t BUCKETS = size_t(64 - SUB_BITS + 2) << (SUB_BITS - 1);
+
+  vector<uint64_t> m_counts;
+  uint64_t m_total = 0;
+  uint64_t m_max = 0;
+  long double m_sum = 0;
+
+  static size_t indexOf(uint64_t value)
+  {
+    if (value < (uint64_t(1) << SUB_BITS))
+      return static_cast<size_t>(value);
+
+    int shift = (63 - __builtin_clzll(value)) - (SUB_BITS - 1);
+    return (size_t(shift) << (SUB_BITS - 1)) + static_cast<size_t>(value >> shift);
+  }
+
+  // Largest value that lands in the bucket
+  static uint64_t highestOf(size_t index)
+  {
+    if (index < (size_t(1) << SUB_BITS))
+      return index;
+
+    int shift = static_cast<int>(index >> (SUB_BITS - 1)) - 1;
+    uint64_t sub = index - (size_t(shift) << (SUB_BITS - 1));
+    return ((sub + 1) << shift) - 1;
+  }
+
+public:
+  Histogram() :
+    m_counts(BUCKETS, 0)
+  { }
+
+  void record(uint64_t value)
+  {
+    m_counts[indexOf(value)]++;
+    m_total++;
+    m_sum += value;
+    m_max = std::max(m_max, value);
+  }
+
+  void merge(const Histogram& other)
+  {
+    for (size_t i = 0; i < BUCKETS; i++)
+      m_counts[i] += other.m_counts[i];
+    m_total += other.m_total;
+    m_sum += other.m_sum;
+    m_max = std::max(m_max, other.m_max);
+  }
+
+  uint64_t count() const { return m_total; }
+  uint64_t max() const { return m_max; }
+  double mean() const { return m_total == 0 ? 0 : static_cast<double>(m_sum / m_total); }
+
+  uint64_t percentile(double p) const
+  {
+    if (m_total == 0)
+      return 0;
+
+    uint64_t rank = static_cast<uint64_t>(std::ceil(p / 100.0 * m_total));
+    rank = std::clamp<uint64_t>(rank, 1, m_total);
+    uint64_t seen = 0;
+    for (size_t i = 0; i < BUCKETS; i++)
+    {
+      seen += m_counts[i];
+      if (seen >= rank)
+        return std::min(highestOf(i), m_max);
+    }
+    return m_max;
+  }
+};
+
+// Key or value size: fixed:N, uniform:MIN:MAX or normal:MEAN:STDDEV (a bare N is fixed)
+class SizeDistribution
+{
+private:
+  enum Kind { FIXED, UNIFORM, NORMAL } m_kind = FIXED;
+  double m_a = 0;
+  double m_b = 0;
+
+public:
+  bool parse(const string& spec)
+  {
+    try
+    {
+      size_t colon = spec.find(':');
+      string kind = colon == string::npos ? "fixed" : spec.substr(0, colon);
+      string rest = colon == string::npos ? spec : spec.substr(colon + 1);
+      size_t second = rest.find(':');
+
+      if (kind == "fixed")
+      {
+        m_kind = FIXED;
+        m_a = std::stod(rest);
+        return m_a >= 0;
+      }
+
+      if (second == string::npos)
+        return false;
+
+      m_a = std::stod(rest.substr(0, second));
+      m_b = std::stod(rest.substr(second + 1));
+      if (kind == "uniform")
+      {
+        m_kind = UNIFORM;
+        return m_a >= 0 && m_b >= m_a;
+      }
+      if (kind == "normal")
+      {
+        m_kind = NORMAL;
+        return m_a >= 0 && m_b >= 0;
+      }
+    }
+    catch (const std::exception&)
+    {
+    }
+
+    return false;
+  }
+
+  template <typename Rng>
+  size_t sample(Rng& rng) const
+  {
+    switch (m_kind)
+    {
+      case UNIFORM:
+        return std::uniform_int_distribution<size_t>(size_t(m_a), size_t(m_b))(rng);
+      case NORMAL:
+        return static_cast<size_t>(std::max(0.0, std::round(std::normal_distribution<double>(m_a, m_b)(rng))));
+      default:
+        return static_cast<size_t>(m_a);
+    }
+  }
+};
+
+// Key index in [0, n): uniform, or Zipfian with exponent theta (Gray et al., as in YCSB). Zipfian
+// ranks are scrambled so the hot keys are spread over the key space rather than bunched at the
+// start of it. Shared by every connection; next() only reads.
+class KeyChooser
+{
+private:
+  uint64_t m_n;
+  double m_theta;
+  double m_zetan = 0;
+  double m_alpha = 0;
+  double m_eta = 0;
+
+  static double zeta(uint64_t n, double theta)
+  {
+    double sum = 0;
+    for (uint64_t i = 1; i <= n; i++)
+      sum += 1.0 / std::pow(static_cast<double>(i), theta);
+    return sum;
+  }
+
+public:
+  KeyChooser(uint64_t n, double theta) :
+    m_n(n),
+    m_theta(theta)
+  {
+    if (m_theta > 0)
+    {
+      m_zetan = zeta(n, theta);
+      m_alpha = 1.0 / (1.0 - theta);
+      m_eta = (1.0 - std::pow(2.0 / n, 1.0 - theta)) / (1.0 - zeta(2, theta) / m_zetan);
+    }
+  }
+
+  template <typename Rng>
+  uint64_t next(Rng& rng) const
+  {
+    if (m_theta <= 0)
+      return std::uniform_int_distribution<uint64_t>(0, m_n - 1)(rng);
+
+    double u = std::uniform_real_distribution<double>(0, 1)(rng);
+    double uz = u * m_zetan;
+    uint64_t rank;
+    if (uz < 1.0)
+      rank = 0;
+    else if (uz < 1.0 + std::pow(0.5, m_theta))
+      rank = 1;
+    else
+      rank = static_cast<uint64_t>(m_n * std::pow(m_eta * u - m_eta + 1.0, m_alpha));
+
+    return splitmix64(std::min(rank, m_n - 1)) % m_n;
+  }
+};
+
+struct BenchConfig
+{
+  string socket_path;
+  unsigned connections = 4;
+  unsigned depth = 1;
+  double rate = 0; // total ops/s over all connections; 0 for closed loop
+  double duration = 10;
+  double warmup = 0;
+  uint64_t keys = 1000000;
+  double zipf = 0;
+  SizeDistribution key_size;
+  SizeDistribution value_size;
+  uint32_t scan_rows = 100;
+  uint32_t batch = 100; // pairs per PUT_MULTI / BULK_PUT
+  bool preload = false;
+  uint64_t seed = 1;
+  double weights[KIND_COUNT] = { 1, 0, 0, 0, 0, 0 };
+};
+
+struct Stats
+{
+  Histogram latency[KIND_COUNT];
+  uint64_t errors[KIND_COUNT] = {};
+  uint64_t misses[KIND_COUNT] = {};
+  uint64_t rows[KIND_COUNT] = {};
+
+  void merge(const Stats& other)
+  {
+    for (int k = 0; k < KIND_COUNT; k++)
+    {
+      latency[k].merge(other.latency[k]);
+      errors[k] += other.errors[k];
+      misses[k] += other.misses[k];
+      rows[k] += other.rows[k];
+    }
+  }
+};
+
+// Keys are "k", the index zero-padded to a fixed width so keys sort like their indices, then
+// filler up to a size picked from --key-size. The size is seeded by the index, so a key is
+// always spelled the same way.
+class KeySpace
+{
+private:
+  const BenchConfig& m_config;
+  int m_width;
+
+public:
+  explicit KeySpace(const BenchConfig& config) :
+    m_config(config),
+    m_width(static_cast<int>(std::to_string(config.keys > 0 ? config.keys - 1 : 0).size()))
+  { }
+
+  void key(uint64_t index, string& out) const
+  {
+    char digits[32];
+    int len = snprintf(digits, sizeof(digits), "k%0*llu", m_width, static_cast<unsigned long long>(index));
+    out.assign(digits, len);
+
+    std::mt19937_64 rng(splitmix64(index ^ m_config.seed));
+    size_t size = m_config.key_size.sample(rng);
+    if (size > out.size())
+      out.append(size - out.size(), '.');
+  }
+};
+
+// One connection driving requests and reading replies, on its own thread. Up to --depth requests
+// are in flight, tagged with an id once there is more than one. With --rate, requests are due on a
+// fixed schedule and latency counts from when each was due, not when it went out, so a stalled
+// server shows up in the percentiles instead of just slowing the bench down (no coordinated
+// omission).
+class Connection
+{
+private:
+  struct Pending
+  {
+    OpKind kind;
+    Clock::time_point due;
+  };
+
+  const BenchConfig& m_config;
+  const KeyChooser& m_chooser;
+  const KeySpace& m_keys;
+  Stats& m_stats;
+  std::mt19937_64 m_rng;
+  int m_fd = -1;
+
+  string m_out;
+  size_t m_out_pos = 0;
+  vector<uint8_t> m_in;
+  size_t m_in_pos = 0;
+
+  uint32_t m_next_id = 1;
+  std::unordered_map<uint32_t, Pending> m_tagged;
+  std::deque<Pending> m_untagged;
+
+  // Reply being read: which request it answers, and how far into a scan we have parsed
+  bool m_reading = false;
+  Pending m_current = {};
+  size_t m_progress = 0;
+  uint64_t m_scan_rows = 0;
+
+  Clock::time_point m_record_from;
+  string m_key;
+  string m_key2;
+  string m_value;
+  vector<uint64_t> m_batch;
+
+  bool tagged() const { return m_config.depth > 1; }
+  size_t inflight() const { return m_tagged.size() + m_untagged.size(); }
+
+  void fillValue(size_t size)
+  {
+    m_value.resize(size);
+    for (size_t i = 0; i < size; i++)
+      m_value[i] = static_cast<char>('a' + (i % 26));
+  }
+
+  void appendPair(const string& key, size_t value_size)
+  {
+    fillValue(value_size);
+    appendU32(m_out, static_cast<uint32_t>(key.size()));
+    m_out.append(key);
+    appendU32(m_out, static_cast<uint32_t>(m_value.size()));
+    m_out.append(m_value);
+  }
+
+  OpKind pickKind()
+  {
+    double total = 0;
+    for (double weight : m_config.weights)
+      total += weight;
+
+    double pick = std::uniform_real_distribution<double>(0, total)(m_rng);
+    for (int k = 0; k < KIND_COUNT; k++)
+    {
+      if (pick < m_config.weights[k])
+        return static_cast<OpKind>(k);
+      pick -= m_config.weights[k];
+    }
+    return KIND_GET;
+  }
+
+  // Opcode (and tag, when pipelining) of a request, queued up to be matched with its reply
+  void startRequest(OpKind kind, Clock::time_point due)
+  {
+    static const char opcodes[KIND_COUNT] = { OP_GET_ONE, OP_GET_N, OP_GET_BETWEEN, OP_PUT_ONE, OP_PUT_MULTI, OP_BULK_PUT };
+
+    char opcode = opcodes[kind];
+    if (tagged())
+    {
+      m_out.push_back(opcode | OP_FLAG_TAGGED);
+      appendU32(m_out, m_next_id);
+      m_tagged[m_next_id++] = { kind, due };
+    }
+    else
+    {
+      m_out.push_back(opcode);
+      m_untagged.push_back({ kind, due });
+    }
+  }
+
+  void send(OpKind kind, Clock::time_point due)
+  {
+    startRequest(kind, due);
+
+    uint64_t index = m_chooser.next(m_rng);
+    m_keys.key(index, m_key);
+    switch (kind)
+    {
+      case KIND_GET:
+        appendU32(m_out, static_cast<uint32_t>(m_key.size()));
+        m_out.append(m_key);
+        break;
+      case KIND_GET_N:
+        appendU32(m_out, static_cast<uint32_t>(m_key.size()));
+        m_out.append(m_key);
+        appendU32(m_out, m_config.scan_rows);
+        break;
+      case KIND_GET_BETWEEN:
+        m_keys.key(std::min(index + m_config.scan_rows - 1, m_config.keys - 1), m_key2);
+        appendU32(m_out, static_cast<uint32_t>(m_key.size()));
+        m_out.append(m_key);
+        appendU32(m_out, static_cast<uint32_t>(m_key2.size()));
+        m_out.append(m_key2);
+        break;
+      case KIND_PUT:
+        appendPair(m_key, m_config.value_size.sample(m_rng));
+        break;
+      case KIND_PUT_MULTI:
+      case KIND_BULK_PUT:
+        // BULK_PUT wants its keys sorted and distinct
+        m_batch.clear();
+        m_batch.push_back(index);
+        while (m_batch.size() < m_config.batch)
+          m_batch.push_back(m_chooser.next(m_rng));
+        if (kind == KIND_BULK_PUT)
+        {
+          std::sort(m_batch.begin(), m_batch.end());
+          m_batch.erase(std::unique(m_batch.begin(), m_batch.end()), m_batch.end());
+        }
+
+        for (uint64_t i : m_batch)
+        {
+          m_keys.key(i, m_key);
+          appendPair(m_key, m_config.value_size.sample(m_rng));
+        }
+        appendU32(m_out, 0);
+        break;
+      default:
+        break;
+    }
+  }
+
+  // Push out what the socket takes. False if the connection is gone.
+  bool flush()
+  {
+    while (m_out_pos < m_out.size())
+    {
+      ssize_t sent = ::send(m_fd, m_out.data() + m_out_pos, m_out.size() - m_out_pos, MSG_NOSIGNAL);
+      if (sent < 0)
+      {
+        if (errno == EINTR)
+          continue;
+        return errno == EAGAIN || errno == EWOULDBLOCK;
+      }
+      m_out_pos += static_cast<size_t>(sent);
+    }
+
+    m_out.clear();
+    m_out_pos = 0;
+    return true;
+  }
+
+  // Read what has arrived. False if the connection is gone.
+  bool receive()
+  {
+    while (true)
+    {
+      size_t at = m_in.size();
+      m_in.resize(at + 65536);
+      ssize_t got = ::recv(m_fd, m_in.data() + at, 65536, 0);
+      if (got <= 0)
+      {
+        m_in.resize(at);
+        if (got < 0 && errno == EINTR)
+          continue;
+        return got < 0 && (errno == EAGAIN || errno == EWOULDBLOCK);
+      }
+      m_in.resize(at + static_cast<size_t>(got));
+    }
+  }
+
+  // Size of a complete error frame (status, BE16 length, text) at p, or 0 if it isn't all here
+  static size_t errorFrame(const uint8_t* p, size_t avail)
+  {
+    if (avail < 3)
+      return 0;
+    size_t size = 3 + getBE16(p + 1);
+    return avail >= size ? size : 0;
+  }
+
+  // Parse one reply body for `kind`. Returns its size once it has fully arrived, else 0; scans
+  // remember how far they got in m_progress so rows aren't parsed twice.
+  size_t parse(OpKind kind, const uint8_t* p, size_t avail, uint8_t& status)
+  {
+    switch (kind)
+    {
+      case KIND_GET:
+        if (avail < 1)
+          return 0;
+        status = p[0];
+        if (status == STAT_NOT_FOUND)
+          return 1;
+        if (status == STAT_ERR)
+          return errorFrame(p, avail);
+        if (avail < 5 || avail < 5 + size_t(getBE32(p + 1)))
+          return 0;
+        return 5 + getBE32(p + 1);
+
+      case KIND_PUT:
+        if (avail < 2)
+          return 0;
+        status = p[0];
+        return 2;
+
+      case KIND_BULK_PUT:
+        if (avail < 1)
+          return 0;
+        status = p[0];
+        return status == STAT_ERR ? errorFrame(p, avail) : 1;
+
+      case KIND_PUT_MULTI:
+      {
+        if (avail < 4)
+          return 0;
+        uint32_t records = getBE32(p);
+        size_t at = 4;
+        status = STAT_OK;
+        for (uint32_t i = 0; i < records; i++)
+        {
+          if (avail < at + 5)
+            return 0;
+          if (p[at] == STAT_ERR)
+          {
+            status = STAT_ERR;
+            if (avail < at + 7 || avail < at + 7 + getBE16(p + at + 5))
+              return 0;
+            at += 7 + getBE16(p + at + 5);
+          }
+          else
+            at += 5;
+        }
+        return at;
+      }
+
+      default: // scans: rows until the all-zero end marker
+        while (true)
+        {
+          const uint8_t* row = p + m_progress;
+          size_t left = avail - m_progress;
+          if (left < 1)
+            return 0;
+          if (row[0] == STAT_ERR)
+          {
+            size_t size = errorFrame(row, left);
+            if (size == 0)
+              return 0;
+            status = STAT_ERR;
+            return m_progress + size;
+          }
+          if (left < 5 || left < 9 + size_t(getBE32(row + 1)))
+            return 0;
+
+          uint32_t klen = getBE32(row + 1);
+          uint32_t vlen = getBE32(row + 5 + klen);
+          if (left < 9 + size_t(klen) + vlen)
+            return 0;
+
+          m_progress += 9 + size_t(klen) + vlen;
+          if (klen == 0 && vlen == 0)
+          {
+            status = STAT_OK;
+            return m_progress;
+          }
+          m_scan_rows++;
+        }
+    }
+  }
+
+  // Match up every complete reply in the input with its request. False on a reply we can't
+  // place, which means we've lost track of the stream.
+  bool consumeReplies(Clock::time_point now)
+  {
+    while (true)
+    {
+      const uint8_t* p = m_in.data() + m_in_pos;
+      size_t avail = m_in.size() - m_in_pos;
+
+      if (!m_reading)
+      {
+        if (tagged())
+        {
+          if (avail < 4)
+            break;
+          auto it = m_tagged.find(getBE32(p));
+          if (it == m_tagged.end())
+            return false;
+
+          m_current = it->second;
+          m_tagged.erase(it);
+          m_in_pos += 4;
+          p += 4;
+          avail -= 4;
+        }
+        else
+        {
+          if (m_untagged.empty())
+            return avail == 0;
+          m_current = m_untagged.front();
+          m_untagged.pop_front();
+        }
+
+        m_reading = true;
+        m_progress = 0;
+        m_scan_rows = 0;
+      }
+
+      uint8_t status = STAT_OK;
+      size_t size = parse(m_current.kind, p, avail, status);
+      if (size == 0)
+        break;
+
+      m_in_pos += size;
+      m_reading = false;
+      if (m_current.due >= m_record_from)
+      {
+        OpKind kind = m_current.kind;
+        m_stats.latency[kind].record(std::chrono::duration_cast<std::chrono::nanoseconds>(now - m_current.due).count());
+        m_stats.rows[kind] += m_scan_rows;
+        if (status == STAT_ERR)
+          m_stats.errors[kind]++;
+        else if (status == STAT_NOT_FOUND)
+          m_stats.misses[kind]++;
+      }
+    }
+
+    // Keep the unparsed tail at the front
+    if (m_in_pos > 0 && (m_in_pos == m_in.size() || m_in_pos >= 1 << 20))
+    {
+      m_in.erase(m_in.begin(), m_in.begin() + m_in_pos);
+      m_in_pos = 0;
+    }
+    return true;
+  }
+
+public:
+  Connection(const Connection&) = delete;
+  Connection& operator=(const Connection&) = delete;
+
+  Connection(const BenchConfig& config, const KeyChooser& chooser, const KeySpace& keys, Stats& stats, uint64_t seed) :
+    m_config(config),
+    m_chooser(chooser),
+    m_keys(keys),
+    m_stats(stats),
+    m_rng(seed)
+  { }
+
+  ~Connection()
+  {
+    if (m_fd != -1)
+      close(m_fd);
+  }
+
+  bool open()
+  {
+    m_fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (m_fd == -1)
+      return false;
+
+    struct sockaddr_un addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    strncpy(addr.sun_path, m_config.socket_path.c_str(), sizeof(addr.sun_path) - 1);
+    if (connect(m_fd, reinterpret_cast<sockaddr*>(&addr), sizeof(addr)) == -1)
+      return false;
+
+    return fcntl(m_fd, F_SETFL, fcntl(m_fd, F_GETFL) | O_NONBLOCK) != -1;
+  }
+
+  // Write keys [first, last) with PUT_MULTI, batch by batch, nothing recorded
+  bool preload(uint64_t first, uint64_t last)
+  {
+    m_record_from = Clock::time_point::max();
+    for (uint64_t at = first; at < last; )
+    {
+      // Tagged like the rest when pipelining, which is how the replies get read
+      startRequest(KIND_PUT_MULTI, Clock::now());
+      for (uint32_t n = 0; n < m_config.batch && at < last; n++, at++)
+      {
+        m_keys.key(at, m_key);
+        appendPair(m_key, m_config.value_size.sample(m_rng));
+      }
+      appendU32(m_out, 0);
+
+      while (inflight() > 0)
+      {
+        if (!flush() || !receive() || !consumeReplies(Clock::now()))
+          return false;
+
+        struct pollfd pfd = { m_fd, short(POLLIN | (m_out.empty() ? 0 : POLLOUT)), 0 };
+        if (inflight() > 0)
+          poll(&pfd, 1, 100);
+      }
+    }
+    return true;
+  }
+
+  // Drive the mix until `end`, then wait for what's still in flight. False if the server went away.
+  bool run(Clock::time_point start, Clock::time_point end)
+  {
+    m_record_from = start + std::chrono::duration_cast<Clock::duration>(std::chrono::duration<double>(m_config.warmup));
+    bool paced = m_config.rate > 0;
+    auto interval = paced
+      ? std::chrono::duration_cast<Clock::duration>(std::chrono::duration<double>(m_config.connections / m_config.rate))
+      : Clock::duration::zero();
+    Clock::time_point next_due = start;
+    Clock::time_point give_up = end + std::chrono::seconds(10);
+
+    while (true)
+    {
+      Clock::time_point now = Clock::now();
+      bool sending = now < end;
+      if (!sending && inflight() == 0)
+        return true;
+      if (now >= give_up)
+      {
+        cerr << "Gave up waiting for " << inflight() << " replies" << endl;
+        return false;
+      }
+
+      while (sending && inflight() < m_config.depth && (!paced || next_due <= now))
+      {
+        send(pickKind(), paced ? next_due : now);
+        next_due += interval;
+      }
+
+      if (!flush())
+        return false;
+
+      // Sleep until a reply, room to write, or the next request is due
+      struct timespec timeout = { 0, 100 * 1000 * 1000 };
+      if (paced && sending && inflight() < m_config.depth)
+      {
+        auto wait = std::max(next_due - Clock::now(), Clock::duration::zero());
+        auto ns = std::chrono::duration_cast<std::chrono::nanoseconds>(wait).count();
+        timeout = { static_cast<time_t>(ns / 1000000000), static_cast<long>(ns % 1000000000) };
+      }
+
+      struct pollfd pfd = { m_fd, short(POLLIN | (m_out.empty() ? 0 : POLLOUT)), 0 };
+      ppoll(&pfd, 1, &timeout, nullptr);
+
+      if (!receive() || !consumeReplies(Clock::now()))
+        return false;
+    }
+  }
+};
+
+bool parseMix(const string& spec, double (&weights)[KIND_COUNT])
+{
+  std::fill(std::begin(weights), std::end(weights), 0);
+  double total = 0;
+  size_t start = 0;
+  while (start <= spec.size())
+  {
+    size_t comma = std::min(spec.find(',', start), spec.size());
+    string item = spec.substr(start, comma - start);
+    size_t colon = item.find(':');
+    string name = item.substr(0, colon);
+    double weight = 1;
+    try
+    {
+      if (colon != string::npos)
+        weight = std::stod(item.substr(colon + 1));
+    }
+    catch (const std::exception&)
+    {
+      return false;
+    }
+
+    auto found = std::find_if(std::begin(KIND_NAMES), std::end(KIND_NAMES), [&name](const char* kind) { return name == kind; });
+    if (found == std::end(KIND_NAMES) || weight < 0)
+      return false;
+
+    weights[found - std::begin(KIND_NAMES)] = weight;
+    total += weight;
+    start = comma + 1;
+  }
+
+  return total > 0;
+}
+
+void report(const Stats& stats, double seconds)
+{
+  auto us = [](uint64_t ns) { return ns / 1000.0; };
+
+  cout << std::fixed << std::setprecision(1);
+  cout << endl << std::left << std::setw(10) << "op" << std::right
+       << std::setw(11) << "count" << std::setw(11) << "ops/s"
+       << std::setw(10) << "mean" << std::setw(10) << "p50" << std::setw(10) << "p90"
+       << std::setw(10) << "p99" << std::setw(10) << "p99.9" << std::setw(10) << "p99.99"
+       << std::setw(10) << "max" << "   (latency in us)" << endl;
+
+  Histogram all;
+  for (int k = 0; k < KIND_COUNT; k++)
+  {
+    const Histogram& h = stats.latency[k];
+    all.merge(h);
+    if (h.count() == 0)
+      continue;
+
+    cout << std::left << std::setw(10) << KIND_NAMES[k] << std::right
+         << std::setw(11) << h.count() << std::setw(11) << h.count() / seconds
+         << std::setw(10) << us(h.mean()) << std::setw(10) << us(h.percentile(50))
+         << std::setw(10) << us(h.percentile(90)) << std::setw(10) << us(h.percentile(99))
+         << std::setw(10) << us(h.percentile(99.9)) << std::setw(10) << us(h.percentile(99.99))
+         << std::setw(10) << us(h.max()) << endl;
+  }
+
+  cout << std::left << std::setw(10) << "total" << std::right
+       << std::setw(11) << all.count() << std::setw(11) << all.count() / seconds
+       << std::setw(10) << us(all.mean()) << std::setw(10) << us(all.percentile(50))
+       << std::setw(10) << us(all.percentile(90)) << std::setw(10) << us(all.percentile(99))
+       << std::setw(10) << us(all.percentile(99.9)) << std::setw(10) << us(all.percentile(99.99))
+       << std::setw(10) << us(all.max()) << endl << endl;
+
+  for (int k = 0; k < KIND_COUNT; k++)
+  {
+    if (stats.errors[k] > 0 || stats.misses[k] > 0)
+      cout << KIND_NAMES[k] << ": " << stats.errors[k] << " errors, " << stats.misses[k] << " not found" << endl;
+    if (stats.rows[k] > 0)
+      cout << KIND_NAMES[k] << ": " << stats.rows[k] << " rows, " << static_cast<double>(stats.rows[k]) / stats.latency[k].count() << " per scan" << endl;
+  }
+}
+
+void print_usage(const char* program_name)
+{
+  string usage = R"(
+Usage: )" + string(program_name) + R"( [options]
+Load generator speaking the scramjet wire protocol over its UNIX socket.
+Options:
+  --socket-path <path>   Server socket (required)
+  --mix <ops>            Weighted op mix, e.g. get:90,put:10 (default: get). Ops: get, getn,
+                         between, put, putmulti, bulkput
+  --connections <n>      Connections, one thread each (default: 4)
+  --depth <n>            Requests in flight per connection, tagged when above 1 (default: 1)
+  --rate <ops/s>         Open loop at this total rate; latency counts from when a request was
+                         due, not when it went out (default: 0, closed loop)
+  --duration <s>         How long to run (default: 10)
+  --warmup <s>           Leave the first seconds out of the numbers (default: 0)
+  --keys <n>             Key space size (default: 1000000)
+  --zipf <theta>         Zipfian key skew, 0 < theta < 1, e.g. 0.99 (default: 0, uniform)
+  --key-size <dist>      Key size: N, fixed:N, uniform:MIN:MAX or normal:MEAN:STDDEV (default: 16)
+  --value-size <dist>    Value size, same forms (default: 100)
+  --scan-rows <n>        Rows per getn, and keys spanned by between (default: 100)
+  --batch <n>            Pairs per putmulti and bulkput, and per preload batch (default: 100)
+  --preload              Write the whole key space before the run
+  --seed <n>             Random seed (default: 1)
+  --help                 Show this help message
+)";
+  cout << usage;
+}
+
+int main(int argc, char** argv)
+{
+  BenchConfig config;
+  config.key_size.parse("16");
+  config.value_size.parse("100");
+
+  static struct option long_options[] = {
+    {"socket-path", required_argument, nullptr, 's'},
+    {"mix", required_argument, nullptr, 'm'},
+    {"connections", required_argument, nullptr, 'c'},
+    {"depth", required_argument, nullptr, 'q'},
+    {"rate", required_argument, nullptr, 'r'},
+    {"duration", required_argument, nullptr, 'd'},
+    {"warmup", required_argument, nullptr, 'w'},
+    {"keys", required_argument, nullptr, 'k'},
+    {"zipf", required_argument, nullptr, 'z'},
+    {"key-size", required_argument, nullptr, 'K'},
+    {"value-size", required_argument, nullptr, 'V'},
+    {"scan-rows", required_argument, nullptr, 'n'},
+    {"batch", required_argument, nullptr, 'b'},
+    {"preload", no_argument, nullptr, 'P'},
+    {"seed", required_argument, nullptr, 'S'},
+    {"help", no_argument, nullptr, 'h'},
+    {nullptr, 0, nullptr, 0}};
+
+  try
+  {
+    int opt;
+    while ((opt = getopt_long(argc, argv, "s:m:c:q:r:d:w:k:z:K:V:n:b:PS:h", long_options, nullptr)) != -1)
+    {
+      switch (opt)
+      {
+      case 's':
+        config.socket_path = optarg;
+        break;
+      case 'm':
+        if (!parseMix(optarg, config.weights))
+        {
+          cerr << "Bad --mix: " << optarg << endl;
+          return 1;
+        }
+        break;
+      case 'c':
+        config.connections = std::stoul(optarg);
+        break;
+      case 'q':
+        config.depth = std::stoul(optarg);
+        break;
+      case 'r':
+        config.rate = std::stod(optarg);
+        break;
+      case 'd':
+        config.duration = std::stod(optarg);
+        break;
+      case 'w':
+        config.warmup = std::stod(optarg);
+        break;
+      case 'k':
+        config.keys = std::stoull(optarg);
+        break;
+      case 'z':
+        config.zipf = std::stod(optarg);
+        break;
+      case 'K':
+      case 'V':
+        if (!(opt == 'K' ? config.key_size : config.value_size).parse(optarg))
+        {
+          cerr << "Bad size distribution: " << optarg << endl;
+          return 1;
+        }
+        break;
+      case 'n':
+        config.scan_rows = std::stoul(optarg);
+        break;
+      case 'b':
+        config.batch = std::stoul(optarg);
+        break;
+      case 'P':
+        config.preload = true;
+        break;
+      case 'S':
+        config.seed = std::stoull(optarg);
+        break;
+      case 'h':
+        print_usage(argv[0]);
+        return 0;
+      default:
+        cerr << "Unknown option. Use --help for usage information.\n";
+        return 1;
+      }
+    }
+  }
+  catch (const std::exception&)
+  {
+    cerr << "Bad number: " << optarg << endl;
+    return 1;
+  }
+
+  if (config.socket_path.empty())
+  {
+    cerr << "Error: --socket-path is required.\n";
+    print_usage(argv[0]);
+    return 1;
+  }
+
+  if (config.connections == 0 || config.depth == 0 || config.keys == 0 || config.batch == 0 || config.scan_rows == 0)
+  {
+    cerr << "Error: --connections, --depth, --keys, --batch and --scan-rows must be positive.\n";
+    return 1;
+  }
+
+  if (config.zipf < 0 || config.zipf >= 1)
+  {
+    cerr << "Error: --zipf must be in [0, 1).\n";
+    return 1;
+  }
+
+  KeyChooser chooser(config.keys, config.zipf);
+  KeySpace keys(config);
+  vector<Stats> stats(config.connections);
+  vector<std::unique_ptr<Connection>> connections;
+  for (unsigned i = 0; i < config.connections; i++)
+  {
+    connections.push_back(std::make_unique<Connection>(config, chooser, keys, stats[i], splitmix64(config.seed + i)));
+    if (!connections.back()->open())
+    {
+      cerr << "Error connecting to " << config.socket_path << ": " << strerror(errno) << endl;
+      return 1;
+    }
+  }
+
+  std::atomic<bool> failed(false);
+  vector<std::thread> threads;
+  if (config.preload)
+  {
+    cout << "Preloading " << config.keys << " keys..." << endl;
+    for (unsigned i = 0; i < config.connections; i++)
+    {
+      uint64_t first = config.keys * i / config.connections;
+      uint64_t last = config.keys * (i + 1) / config.connections;
+      threads.emplace_back([&, i, first, last] {
+        if (!connections[i]->preload(first, last))
+          failed = true;
+      });
+    }
+    for (auto& thread : threads)
+      thread.join();
+    threads.clear();
+
+    if (failed)
+    {
+      cerr << "Preload failed" << endl;
+      return 1;
+    }
+  }
+
+  cout << "Running for " << config.duration << "s on " << config.connections << " connections, depth " << config.depth
+       << (config.rate > 0 ? ", open loop at " + std::to_string(static_cast<uint64_t>(config.rate)) + " ops/s" : ", closed loop")
+       << endl;
+
+  Clock::time_point start = Clock::now();
+  Clock::time_point end = start + std::chrono::duration_cast<Clock::duration>(std::chrono::duration<double>(config.duration));
+  for (unsigned i = 0; i < config.connections; i++)
+  {
+    threads.emplace_back([&, i] {
+      if (!connections[i]->run(start, end))
+        failed = true;
+    });
+  }
+  for (auto& thread : threads)
+    thread.join();
+
+  Stats total;
+  for (const Stats& s : stats)
+    total.merge(s);
+
+  report(total, std::max(config.duration - config.warmup, 1e-3));
+  if (failed)
+  {
+    cerr << "A connection failed; the numbers above only cover what completed." << endl;
+    return 1;
+  }
+
+  return 0;
+}
@@ -0,0 +1,759 @@
+#include <fincache.h>
+
+#include <atomic>
+#include <mutex>
+#include <thread>
+#include <unordered_map>
+#include <cstring>
+#include <cerrno>
+#include <stdint.h>
+
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <fcntl.h>
+#include <unistd.h>
+
+using std::string_view;
+using std::string;
+using std::vector;
+using Value = FinCacheClient::Value;
+
+// Wire protocol, as spoken by the server (see src/main/fincache.cpp). Lengths and request ids in
+// requests are in host order, since the server only listens on a UNIX socket; everything in
+// replies is big-endian.
+constexpr char OP_GET_ONE = 0x01;
+constexpr char OP_GET_N = 0x02;
+constexpr char OP_GET_BETWEEN = 0x03;
+constexpr char OP_PUT_ONE = 0x04;
+constexpr char OP_PUT_MULTI = 0x05;
+constexpr char OP_MULTI_GET = 0x07;
+constexpr char OP_FLAG_TAGGED = static_cast<char>(0x80);
+
+constexpr uint8_t STAT_OK = 0x00;
+constexpr uint8_t STAT_NOT_FOUND = 0x01;
+constexpr uint8_t STAT_ERR = 0x02;
+
+// The server's MULTI_GET_MAX_KEYS
+constexpr size_t MULTI_GET_MAX_KEYS = 1 << 16;
+
+namespace
+{
+  inline uint32_t getBE32(const uint8_t* in)
+  {
+    return (uint32_t(in[0]) << 24) | (uint32_t(in[1]) << 16) | (uint32_t(in[2]) << 8) | uint32_t(in[3]);
+  }
+
+  inline uint16_t getBE16(const uint8_t* in)
+  {
+    return static_cast<uint16_t>((in[0] << 8) | in[1]);
+  }
+
+  inline void appendU32(string& out, size_t value)
+  {
+    uint32_t u32 = static_cast<uint32_t>(value);
+    out.append(reinterpret_cast<const char*>(&u32), sizeof(u32));
+  }
+
+  inline void appendBytes(string& out, string_view bytes)
+  {
+    appendU32(out, bytes.size());
+    out.append(bytes);
+  }
+
+  std::exception_ptr failure(const string& message)
+  {
+    return std::make_exception_ptr(FinCacheError(message));
+  }
+
+  // Size of the error frame (status, BE16 length, text) at p, or 0 if it hasn't all arrived
+  size_t errorFrame(const uint8_t* p, size_t size)
+  {
+    if (size < 3 || size < 3 + size_t(getBE16(p + 1)))
+      return 0;
+    return 3 + getBE16(p + 1);
+  }
+
+  std::exception_ptr serverError(const uint8_t* p)
+  {
+    string text(reinterpret_cast<const char*>(p + 3), getBE16(p + 1));
+    return failure(text.empty() ? "Server error" : text);
+  }
+
+  // A request waiting for its reply. parse() is handed what has arrived of the reply so far
+  // (after the request id); it takes what it can use, sets `used`, and returns true once the
+  // reply is complete and the completion has run. Streaming replies are consumed as they arrive.
+  class Request
+  {
+  public:
+    virtual ~Request() = default;
+    virtual bool parse(const uint8_t* data, size_t size, size_t& used) = 0;
+    virtual void fail(std::exception_ptr error) = 0;
+  };
+
+  class GetRequest : public Request
+  {
+  private:
+    FinCacheClient::Completion<Value> m_done;
+
+  public:
+    explicit GetRequest(FinCacheClient::Completion<Value> done) :
+      m_done(std::move(done))
+    { }
+
+    bool parse(const uint8_t* data, size_t size, size_t& used) override
+    {
+      used = 0;
+      if (size < 1)
+        return false;
+
+      if (data[0] == STAT_NOT_FOUND)
+      {
+        used = 1;
+        m_done(Value(), nullptr);
+        return true;
+      }
+
+      if (data[0] == STAT_ERR)
+      {
+        if ((used = errorFrame(data, size)) == 0)
+          return false;
+        m_done(Value(), serverError(data));
+        return true;
+      }
+
+      if (size < 5 || size < 5 + size_t(getBE32(data + 1)))
+        return false;
+
+      used = 5 + getBE32(data + 1);
+      m_done(Value(string(reinterpret_cast<const char*>(data + 5), used - 5)), nullptr);
+      return true;
+    }
+
+    void fail(std::exception_ptr error) override
+    {
+      m_done(Value(), error);
+    }
+  };
+
+  // MULTI_GET: GET_ONE style results back to back, taken one at a time as they arrive
+  class MultiGetRequest : public Request
+  {
+  private:
+    FinCacheClient::Completion<vector<Value>> m_done;
+    vector<Value> m_values;
+    size_t m_count;
+    std::exception_ptr m_error;
+
+  public:
+    MultiGetRequest(size_t count, FinCacheClient::Completion<vector<Value>> done) :
+      m_done(std::move(done)),
+      m_count(count)
+    {
+      m_values.reserve(count);
+    }
+
+    bool parse(const uint8_t* data, size_t size, size_t& used) override
+    {
+      used = 0;
+      while (m_values.size() < m_count)
+      {
+        const uint8_t* p = data + used;
+        size_t left = size - used;
+        if (left < 1)
+          return false;
+
+        if (p[0] == STAT_NOT_FOUND)
+        {
+          m_values.emplace_back();
+          used += 1;
+        }
+        else if (p[0] == STAT_ERR)
+        {
+          size_t frame = errorFrame(p, left);
+          if (frame == 0)
+            return false;
+          if (!m_error)
+            m_error = serverError(p);
+          m_values.emplace_back();
+          used += frame;
+        }
+        else
+        {
+          if (left < 5 || left < 5 + size_t(getBE32(p + 1)))
+            return false;
+          size_t len = getBE32(p + 1);
+          m_values.emplace_back(string(reinterpret_cast<const char*>(p + 5), len));
+          used += 5 + len;
+        }
+      }
+
+      m_done(std::move(m_values), m_error);
+      return true;
+    }
+
+    void fail(std::exception_ptr error) override
+    {
+      m_done(vector<Value>(), error);
+    }
+  };
+
+  class PutRequest : public Request
+  {
+  private:
+    FinCacheClient::Completion<void> m_done;
+
+  public:
+    explicit PutRequest(FinCacheClient::Completion<void> done) :
+      m_done(std::move(done))
+    { }
+
+    bool parse(const uint8_t* data, size_t size, size_t& used) override
+    {
+      used = 0;
+      if (size < 2)
+        return false;
+
+      used = 2;
+      m_done(data[0] == STAT_OK ? nullptr : failure("PUT failed"));
+      return true;
+    }
+
+    void fail(std::exception_ptr error) override
+    {
+      m_done(error);
+    }
+  };
+
+  // PUT_MULTI: a record count, then status and pair count per batch the server committed (plus
+  // the error text for a failed one)
+  class PutBatchRequest : public Request
+  {
+  private:
+    FinCacheClient::Completion<void> m_done;
+
+  public:
+    explicit PutBatchRequest(FinCacheClient::Completion<void> done) :
+      m_done(std::move(done))
+    { }
+
+    bool parse(const uint8_t* data, size_t size, size_t& used) override
+    {
+      used = 0;
+      if (size < 4)
+        return false;
+
+      uint32_t records = getBE32(data);
+      size_t at = 4;
+      std::exception_ptr error;
+      for (uint32_t i = 0; i < records; i++)
+      {
+        if (size < at + 5)
+          return false;
+
+        if (data[at] == STAT_ERR)
+        {
+          size_t frame = errorFrame(data + at + 4, size - at - 4); // status, pairs, then length
+          if (frame == 0)
+            return false;
+          if (!error)
+          {
+            string text(reinterpret_cast<const char*>(data + at + 7), getBE16(data + at + 5));
+            error = failure(text);
+          }
+          at += 4 + frame;
+        }
+        else
+          at += 5;
+      }
+
+      used = at;
+      m_done(error);
+      return true;
+    }
+
+    void fail(std::exception_ptr error) override
+    {
+      m_done(error);
+    }
+  };
+
+  // GET_N / GET_BETWEEN: rows until the all-zero end marker. Each row is handed to the callback
+  // in place and dropped from the buffer, so a scan of any size needs no more than a row's room.
+  class ScanRequest : public Request
+  {
+  private:
+    FinCacheClient::ScanCallback m_row;
+    FinCacheClient::Completion<size_t> m_done;
+    size_t m_rows = 0;
+    bool m_skipping = false;
+    std::exception_ptr m_error;
+
+  public:
+    ScanRequest(FinCacheClient::ScanCallback row, FinCacheClient::Completion<size_t> done) :
+      m_row(std::move(row)),
+      m_done(std::move(done))
+    { }
+
+    bool parse(const uint8_t* data, size_t size, size_t& used) override
+    {
+      used = 0;
+      while (true)
+      {
+        const uint8_t* p = data + used;
+        size_t left = size - used;
+        if (left < 1)
+          return false;
+
+        if (p[0] == STAT_ERR)
+        {
+          size_t frame = errorFrame(p, left);
+          if (frame == 0)
+            return false;
+          used += frame;
+          m_done(size_t(m_rows), serverError(p));
+          return true;
+        }
+
+        if (left < 9 || left < 9 + size_t(getBE32(p + 1)))
+          return false;
+
+        size_t klen = getBE32(p + 1);
+        size_t vlen = getBE32(p + 5 + klen);
+        if (left < 9 + klen + vlen)
+          return false;
+        used += 9 + klen + vlen;
+
+        if (klen == 0 && vlen == 0)
+        {
+          m_done(size_t(m_rows), m_error);
+          return true;
+        }
+
+        if (m_skipping)
+          continue;
+
+        m_rows++;
+        try
+        {
+          string_view key(reinterpret_cast<const char*>(p + 5), klen);
+          string_view value(reinterpret_cast<const char*>(p + 9 + klen), vlen);
+          m_skipping = !m_row(key, value);
+        }
+        catch (...)
+        {
+          m_error = std::current_exception();
+          m_skipping = true;
+        }
+      }
+    }
+
+    void fail(std::exception_ptr error) override
+    {
+      m_done(size_t(m_rows), error);
+    }
+  };
+}
+
+// One pooled connection. Callers append requests to `out` under the lock and send straight away
+// if nothing is queued ahead of them; the I/O thread sends the rest once the socket drains, and
+// owns the receive side.
+struct Connection
+{
+  int fd = -1;
+
+  std::mutex lock;
+  string out;
+  size_t out_pos = 0;
+  bool broken = false;
+  uint32_t next_id = 1;
+  std::unordered_map<uint32_t, std::unique_ptr<Request>> pending;
+
+  // I/O thread only
+  vector<uint8_t> in;
+  size_t in_pos = 0;
+  std::unique_ptr<Request> current;
+
+  ~Connection()
+  {
+    if (fd != -1)
+      close(fd);
+  }
+
+  // Send what the socket takes; the rest waits for EPOLLOUT. False if the connection is gone.
+  bool flushLocked()
+  {
+    while (out_pos < out.size())
+    {
+      ssize_t sent = ::send(fd, out.data() + out_pos, out.size() - out_pos, MSG_NOSIGNAL);
+      if (sent < 0)
+      {
+        if (errno == EINTR)
+          continue;
+        return errno == EAGAIN || errno == EWOULDBLOCK;
+      }
+      out_pos += static_cast<size_t>(sent);
+    }
+
+    out.clear();
+    out_pos = 0;
+    return true;
+  }
+};
+
+class FinCacheClient::Impl
+{
+public:
+  vector<std::unique_ptr<Connection>> m_connections;
+  std::atomic<size_t> m_next_connection;
+  int m_epoll_fd = -1;
+  int m_wake_fd = -1;
+  std::atomic<bool> m_stop;
+  std::thread m_thread;
+
+  Impl(const string& socket_path, size_t pool_size) :
+    m_next_connection(0),
+    m_stop(false)
+  {
+    try
+    {
+      open(socket_path, pool_size);
+    }
+    catch (...)
+    {
+      closeFds();
+      throw;
+    }
+
+    m_thread = std::thread(&Impl::run, this);
+  }
+
+  void open(const string& socket_path, size_t pool_size)
+  {
+    m_epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+    m_wake_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    if (m_epoll_fd == -1 || m_wake_fd == -1)
+      throw FinCacheError(string("Error setting up the client: ") + strerror(errno));
+
+    struct epoll_event event = {};
+    event.events = EPOLLIN;
+    event.data.u64 = UINT64_MAX;
+    epoll_ctl(m_epoll_fd, EPOLL_CTL_ADD, m_wake_fd, &event);
+
+    for (size_t i = 0; i < std::max<size_t>(pool_size, 1); i++)
+    {
+      auto connection = std::make_unique<Connection>();
+      connection->fd = connect(socket_path);
+
+      // Edge-triggered both ways: reads drain the socket, and EPOLLOUT only matters once a send
+      // came up short
+      event.events = EPOLLIN | EPOLLOUT | EPOLLRDHUP | EPOLLET;
+      event.data.u64 = i;
+      if (epoll_ctl(m_epoll_fd, EPOLL_CTL_ADD, connection->fd, &event) == -1)
+        throw FinCacheError(string("Error watching connection: ") + strerror(errno));
+
+      m_connections.push_back(std::move(connection));
+    }
+  }
+
+  void closeFds()
+  {
+    if (m_epoll_fd != -1)
+      close(m_epoll_fd);
+    if (m_wake_fd != -1)
+      close(m_wake_fd);
+  }
+
+  ~Impl()
+  {
+    if (m_thread.joinable())
+    {
+      m_stop.store(true, std::memory_order_release);
+      uint64_t one = 1;
+      ssize_t written = write(m_wake_fd, &one, sizeof(one));
+      (void)written;
+      m_thread.join();
+    }
+
+    for (auto& connection : m_connections)
+      breakConnection(*connection, "Client shut down");
+
+    closeFds();
+  }
+
+  static int connect(const string& socket_path)
+  {
+    int fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (fd == -1)
+      throw FinCacheError(string("Error creating socket: ") + strerror(errno));
+
+    struct sockaddr_un addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    if (socket_path.size() >= sizeof(addr.sun_path))
+    {
+      close(fd);
+      throw FinCacheError("Socket path too long: " + socket_path);
+    }
+    memcpy(addr.sun_path, socket_path.c_str(), socket_path.size() + 1);
+
+    if (::connect(fd, reinterpret_cast<sockaddr*>(&addr), sizeof(addr)) == -1 ||
+        fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) | O_NONBLOCK) == -1)
+    {
+      string error = strerror(errno);
+      close(fd);
+      throw FinCacheError("Error connecting to " + socket_path + ": " + error);
+    }
+
+    return fd;
+  }
+
+  // Queue a tagged request on the next healthy connection and send it if nothing is ahead of it.
+  // `encode` appends the frame after the opcode and id.
+  template <typename Encode>
+  void submit(char opcode, std::unique_ptr<Request> request, Encode&& encode)
+  {
+    size_t count = m_connections.size();
+    size_t first = m_next_connection.fetch_add(1, std::memory_order_relaxed);
+    for (size_t i = 0; i < count; i++)
+    {
+      Connection& connection = *m_connections[(first + i) % count];
+      std::unique_lock<std::mutex> guard(connection.lock);
+      if (connection.broken)
+        continue;
+
+      bool idle = connection.out.empty();
+      uint32_t id = connection.next_id++;
+      connection.out.push_back(opcode | OP_FLAG_TAGGED);
+      connection.out.append(reinterpret_cast<const char*>(&id), sizeof(id));
+      encode(connection.out);
+      connection.pending.emplace(id, std::move(request));
+
+      // The reply can come back (and complete the request) as soon as the lock is dropped. A
+      // failed send leaves the reply being read, if any, to the I/O thread.
+      if (idle && !connection.flushLocked())
+      {
+        guard.unlock();
+        failPending(connection, "Connection to server lost");
+      }
+      return;
+    }
+
+    request->fail(failure("No connection to server"));
+  }
+
+  // Fail every request still waiting for its reply; the connection takes no more
+  void failPending(Connection& connection, const string& reason)
+  {
+    std::unordered_map<uint32_t, std::unique_ptr<Request>> pending;
+    {
+      std::lock_guard<std::mutex> guard(connection.lock);
+      connection.broken = true;
+      pending.swap(connection.pending);
+      connection.out.clear();
+      connection.out_pos = 0;
+    }
+
+    for (auto& [id, request] : pending)
+      request->fail(failure(reason));
+  }
+
+  // Same, plus the reply being read. I/O thread only (or once it has stopped).
+  void breakConnection(Connection& connection, const string& reason)
+  {
+    if (connection.current)
+    {
+      connection.current->fail(failure(reason));
+      connection.current.reset();
+    }
+
+    failPending(connection, reason);
+  }
+
+  // Read what has arrived and hand it to the requests it answers. False if the connection broke;
+  // the replies that made it are still delivered.
+  bool receive(Connection& connection)
+  {
+    vector<uint8_t>& in = connection.in;
+    bool open = true;
+    while (true)
+    {
+      size_t at = in.size();
+      in.resize(at + 65536);
+      ssize_t got = ::recv(connection.fd, in.data() + at, 65536, 0);
+      if (got <= 0)
+      {
+        in.resize(at);
+        if (got < 0 && errno == EINTR)
+          continue;
+        open = got < 0 && (errno == EAGAIN || errno == EWOULDBLOCK);
+        break;
+      }
+      in.resize(at + static_cast<size_t>(got));
+    }
+
+    while (true)
+    {
+      const uint8_t* data = in.data() + connection.in_pos;
+      size_t size = in.size() - connection.in_pos;
+
+      if (!connection.current)
+      {
+        if (size < 4)
+          break;
+
+        uint32_t id = getBE32(data);
+        {
+          std::lock_guard<std::mutex> guard(connection.lock);
+          auto it = connection.pending.find(id);
+          if (it == connection.pending.end())
+            return false; // a reply to nothing we asked; the stream can't be trusted
+          connection.current = std::move(it->second);
+          connection.pending.erase(it);
+        }
+        connection.in_pos += 4;
+        continue;
+      }
+
+      size_t used = 0;
+      bool done = connection.current->parse(data, size, used);
+      connection.in_pos += used;
+      if (!done)
+        break;
+      connection.current.reset();
+    }
+
+    // Keep the unparsed tail at the front
+    if (connection.in_pos == in.size())
+    {
+      in.clear();
+      connection.in_pos = 0;
+    }
+    else if (connection.in_pos >= in.size() / 2)
+    {
+      in.erase(in.begin(), in.begin() + connection.in_pos);
+      connection.in_pos = 0;
+    }
+    return open;
+  }
+
+  void run()
+  {
+    struct epoll_event events[64];
+    while (!m_stop.load(std::memory_order_acquire))
+    {
+      int ready = epoll_wait(m_epoll_fd, events, 64, -1);
+      for (int i = 0; i < ready; i++)
+      {
+        uint64_t index = events[i].data.u64;
+        if (index == UINT64_MAX)
+          continue; // woken to stop
+
+        Connection& connection = *m_connections[index];
+        bool healthy = true;
+        if (events[i].events & EPOLLOUT)
+        {
+          std::lock_guard<std::mutex> guard(connection.lock);
+          healthy = connection.broken || connection.flushLocked();
+        }
+
+        if (events[i].events & (EPOLLIN | EPOLLRDHUP | EPOLLHUP | EPOLLERR))
+          healthy = healthy && receive(connection);
+
+        if (!healthy)
+        {
+          epoll_ctl(m_epoll_fd, EPOLL_CTL_DEL, connection.fd, nullptr);
+          breakConnection(connection, "Connection to server lost");
+        }
+      }
+    }
+  }
+};
+
+FinCacheClient::FinCacheClient(const string& socket_path, size_t pool_size) :
+  m_impl(std::make_unique<Impl>(socket_path, pool_size))
+{
+}
+
+FinCacheClient::~FinCacheClient() = default;
+
+void FinCacheClient::checkNotIoThread() const
+{
+  if (std::this_thread::get_id() == m_impl->m_thread.get_id())
+    throw std::logic_error("Blocking FinCacheClient call on its own I/O thread");
+}
+
+void FinCacheClient::get_async(string_view key, Completion<Value> done)
+{
+  m_impl->submit(OP_GET_ONE, std::make_unique<GetRequest>(std::move(done)), [key](string& out) {
+    appendBytes(out, key);
+  });
+}
+
+void FinCacheClient::multi_get_async(const vector<string_view>& keys, Completion<vector<Value>> done)
+{
+  if (keys.size() > MULTI_GET_MAX_KEYS)
+  {
+    done(vector<Value>(), failure("Too many keys for one multi_get"));
+    return;
+  }
+
+  if (keys.empty())
+  {
+    done(vector<Value>(), nullptr);
+    return;
+  }
+
+  m_impl->submit(OP_MULTI_GET, std::make_unique<MultiGetRequest>(keys.size(), std::move(done)), [&keys](string& out) {
+    appendU32(out, keys.size());
+    for (string_view key : keys)
+      appendBytes(out, key);
+  });
+}
+
+void FinCacheClient::put_async(string_view key, string_view value, Completion<void> done)
+{
+  m_impl->submit(OP_PUT_ONE, std::make_unique<PutRequest>(std::move(done)), [key, value](string& out) {
+    appendBytes(out, key);
+    appendBytes(out, value);
+  });
+}
+
+void FinCacheClient::put_batch_async(const vector<std::pair<string_view, string_view>>& pairs, Completion<void> done)
+{
+  // A zero key length ends the stream
+  for (const auto& [key, value] : pairs)
+  {
+    if (key.empty())
+    {
+      done(failure("put_batch can't write an empty key"));
+      return;
+    }
+  }
+
+  m_impl->submit(OP_PUT_MULTI, std::make_unique<PutBatchRequest>(std::move(done)), [&pairs](string& out) {
+    for (const auto& [key, value] : pairs)
+    {
+      appendBytes(out, key);
+      appendBytes(out, value);
+    }
+    appendU32(out, 0);
+  });
+}
+
+void FinCacheClient::scan_async(string_view low, string_view high, ScanCallback row, Completion<size_t> done)
+{
+  m_impl->submit(OP_GET_BETWEEN, std::make_unique<ScanRequest>(std::move(row), std::move(done)), [low, high](string& out) {
+    appendBytes(out, low);
+    appendBytes(out, high);
+  });
+}
+
+void FinCacheClient::scan_async(string_view start, uint32_t limit, ScanCallback row, Completion<size_t> done)
+{
+  m_impl->submit(OP_GET_N, std::make_unique<ScanRequest>(std::move(row), std::move(done)), [start, limit](string& out) {
+    appendBytes(out, start);
+    appendU32(out, limit);
+  });
+}
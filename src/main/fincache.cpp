@@ -1,4 +1,5 @@
 #include <vector>
+#include <algorithm>
 #include <string_view>
 #include <iostream>
 #include <unordered_map>
@@ -7,13 +8,33 @@
 #include <thread>
 #include <mutex>
 #include <array>
+#include <deque>
+#include <atomic>
 #include <optional>
+#include <cstring>
+#include <climits>
 #include <stdint.h>
 #include <getopt.h>
 #include <chrono>
+#include <fstream>
 
 #include <rocksdb/db.h>
+#include <rocksdb/write_batch.h>
+#include <rocksdb/version.h>
+#include <rocksdb/slice_transform.h>
+#include <rocksdb/table.h>
+#include <rocksdb/filter_policy.h>
+#include <rocksdb/cache.h>
+#include <rocksdb/statistics.h>
 #include <rbuf.h>
+#include <mpsc.h>
+#include <hotcache.h>
+#include <metrics.h>
+#include <trace.h>
+#include <storage.h>
+#include <merge.h>
+#include <expiry.h>
+#include <config.h>
 
 // #define ENABLE_NETWORK_BYTESWAP true
 // #define DISABLE_WAL true
@@ -30,13 +51,22 @@
   #include <sys/socket.h>
   #include <sys/un.h>
   #include <sys/uio.h>
+  #include <sys/epoll.h>
+  #include <sys/eventfd.h>
+  #include <poll.h>
+  #include <signal.h>
   #include <unistd.h>
   #include <netinet/in.h>
   #include <arpa/inet.h>
+  #include <futex.h>
 
   typedef int UnixSocket;
 #endif
 
+#ifdef HAVE_LIBURING
+  #include <liburing.h>
+#endif
+
 using std::string_view;
 using std::string;
 using std::vector;
@@ -54,12 +84,234 @@ constexpr char OP_GET_BETWEEN = 0x03;
 constexpr char OP_PUT_ONE = 0x04;
 constexpr char OP_PUT_MULTI = 0x05;
 constexpr char OP_BULK_PUT = 0x06;
+constexpr char OP_MULTI_GET = 0x07;
+
+// Scan control, honoured even while a GET_N/GET_BETWEEN is still streaming (as long as nothing
+// else was pipelined in front of them). Neither is tagged or gets a reply of its own.
+// SCAN_CREDIT (u32 bytes) switches the connection to credit-based flow control: from then on scans
+// only send rows while the client has credit left, and each SCAN_CREDIT grants that many more
+// bytes. SCAN_CANCEL ends the running scan early with the usual end marker; with no scan running
+// it does nothing.
+constexpr char OP_SCAN_CREDIT = 0x08;
+constexpr char OP_SCAN_CANCEL = 0x09;
+
+// Prefix scan: u32 prefix length, prefix, u32 max rows. Replies like GET_N.
+constexpr char OP_GET_PREFIX = 0x0A;
+
+// Reverse scans: same frames as GET_N, GET_BETWEEN and GET_PREFIX, rows come back in descending
+// key order. GET_N_REV starts at the last key <= the given one; GET_BETWEEN_REV takes the same
+// (low, high) pair as GET_BETWEEN and walks it from the top.
+constexpr char OP_GET_N_REV = 0x0B;
+constexpr char OP_GET_BETWEEN_REV = 0x0C;
+constexpr char OP_GET_PREFIX_REV = 0x0D;
+
+// Scan control: u32 row count the next scan on this connection is expected to return. Big scans
+// read ahead (see SCAN_READAHEAD_ROWS); GET_N needs no hint since it carries its count.
+constexpr char OP_SCAN_HINT = 0x0E;
+
+// Cursors, for paging through a range without seeking again for every page.
+// CURSOR_OPEN: u32 key length, start key, u8 flags (CURSOR_SNAPSHOT, CURSOR_REVERSE). Replies OK
+// and the BE32 handle. An empty start key means the first (last, in reverse) key.
+// CURSOR_NEXT: u32 handle, u32 max rows. Replies like GET_N, continuing where the last page
+// stopped; a page short of max rows is the last one. NOT_FOUND for an unknown handle.
+// CURSOR_CLOSE: u32 handle. Replies OK, or NOT_FOUND.
+// Handles are per connection, and cursors left idle for --cursor-idle-timeout are closed.
+constexpr char OP_CURSOR_OPEN = 0x0F;
+constexpr char OP_CURSOR_NEXT = 0x10;
+constexpr char OP_CURSOR_CLOSE = 0x11;
+
+// Hot-key cache counters: no payload. Replies OK, then BE64 hits, misses, entries and bytes
+// (all zero with the cache off).
+constexpr char OP_CACHE_STATS = 0x12;
+
+// Tracing: no payload. Replies OK, then a BE32 length and the requests sampled since the last
+// dump as Chrome trace JSON. Builds without tracing reply with an error.
+constexpr char OP_TRACE_DUMP = 0x13;
+
+// Namespaces: column families with their own memtable, compaction and tuning (see
+// configureNamespace). CREATE_NAMESPACE: u32 name length, name, u32 spec length, spec. Replies OK
+// and the BE32 id; creating a namespace that already exists just replies with its id.
+// DROP_NAMESPACE: u32 id. Replies OK, or NOT_FOUND.
+constexpr char OP_CREATE_NAMESPACE = 0x14;
+constexpr char OP_DROP_NAMESPACE = 0x15;
+
+// Read-modify-write: u32 key length, key, u32 operand length, operand, folded into the key's value
+// by its namespace's merge operator (see merge.h; --merge-operator for the default namespace, the
+// merge setting for the others). Replies like PUT_ONE, but an error comes with its message (as in
+// every other error reply), e.g. for a namespace without a merge operator or an operand it can't
+// take. Tagged MERGEs are batched like tagged PUT_ONEs.
+constexpr char OP_MERGE = 0x16;
+
+// Conditional writes, checked and applied as one step without a lock shared by unrelated keys
+// (see StorageEngine::writeIf). A condition is a u32 key length, key, u32 expected length and
+// expected value: the key must hold exactly that value, or with COND_ABSENT as the length (and no
+// value) must not exist.
+// CAS: a condition, then u32 value length and the value to put if it holds.
+// WRITE_IF: u32 condition count and the conditions, then u32 write count and the writes, each a
+// u8 kind (WRITE_PUT, WRITE_DELETE, WRITE_MERGE), u32 key length and key, then for puts and merges
+// u32 value length and value. The writes go in as one batch, only if every condition holds.
+// Both reply OK; STAT_CONFLICT and the BE32 index of the first condition that didn't hold; or an
+// error, when the keys kept changing under it or a merge operand was refused.
+constexpr char OP_CAS = 0x17;
+constexpr char OP_WRITE_IF = 0x18;
+
+// Writes with a per-key TTL, for namespaces that keep key TTLs (--key-ttl, the key-ttl setting).
+// PUT_ONE_TTL: u32 TTL in seconds, then a PUT_ONE frame. PUT_MULTI_TTL: u32 TTL in seconds, then
+// a PUT_MULTI stream, every pair of which gets it. A TTL of 0 never expires. PUT_ONE_TTL replies
+// like MERGE (errors come with their message) and PUT_MULTI_TTL like PUT_MULTI; a TTL for a
+// namespace without key TTLs is an error. An expired key reads as absent (GETs, scans, cursors and
+// conditions alike) and is dropped by compaction.
+constexpr char OP_PUT_ONE_TTL = 0x19;
+constexpr char OP_PUT_MULTI_TTL = 0x1A;
+
+constexpr uint32_t COND_ABSENT = 0xFFFFFFFF;
+constexpr uint8_t WRITE_PUT = 0x00;
+constexpr uint8_t WRITE_DELETE = 0x01;
+constexpr uint8_t WRITE_MERGE = 0x02;
+
+// A snapshot cursor pins one view for all its pages and keeps its iterator positioned, so a page
+// costs only its rows. Without it the cursor refreshes to the latest data and re-seeks on every
+// page, so it never holds on to old versions.
+constexpr uint8_t CURSOR_SNAPSHOT = 0x01;
+constexpr uint8_t CURSOR_REVERSE = 0x02;
+
+// Pipelining: an opcode with this bit set is followed by a 32-bit request id, then the usual
+// frame. The reply to it starts with the same id (big-endian) and may overtake replies to earlier
+// tagged requests, so clients can keep any number of requests in flight on one connection.
+constexpr char OP_FLAG_TAGGED = static_cast<char>(0x80);
+
+// An opcode with this bit set is followed by a 32-bit namespace id (after the request id, if
+// tagged), and the request reads or writes that namespace instead of the default one (id 0).
+// Cursors stay in the namespace they were opened in, requests that don't touch keys ignore it,
+// and scan control frames can't carry it. An id with no namespace behind it drops the connection.
+constexpr char OP_FLAG_NAMESPACE = 0x40;
 
 constexpr char STAT_OK = 0x00;
 constexpr char STAT_NOT_FOUND = 0x01;
 constexpr char STAT_ERR = 0x02;
+constexpr char STAT_CONFLICT = 0x03;
+
+static std::atomic<bool> g_stop(false); // lock-free, so safe to set from the signal handler
+
+// PUT_MULTI streams are committed in WriteBatches of roughly this many bytes (--put-batch-bytes)
+#ifndef PUT_MULTI_BATCH_BYTES
+  #define PUT_MULTI_BATCH_BYTES (4 << 20) // 4MB
+#endif
+
+static size_t g_put_batch_bytes = PUT_MULTI_BATCH_BYTES;
+
+// Write coalescing (--coalesce-writes): PUT_ONEs from every connection are committed together by
+// one thread, in synced batches. That makes coalesced writes durable once acked, where plain
+// PUT_ONEs are acked before the WAL is synced. A group closes once it holds this many bytes
+// (--coalesce-bytes) ...
+#ifndef COALESCE_MAX_BATCH_BYTES
+  #define COALESCE_MAX_BATCH_BYTES (1 << 20) // 1MB
+#endif
+
+// ... or after the committer has waited this long for it to fill up (--coalesce-delay). At 0 a
+// group is whatever queued up while the previous one was being written.
+#ifndef COALESCE_MAX_DELAY_US
+  #define COALESCE_MAX_DELAY_US 0
+#endif
+
+// Size of LMDB's memory map (--lmdb-map-size), which caps how much the store can hold. It only
+// reserves address space; the file grows as data is written.
+#ifndef LMDB_MAP_BYTES
+  #define LMDB_MAP_BYTES (64ULL << 30) // 64GB
+#endif
+
+// Prefix extractor the DB was opened with (--prefix-extractor), if any. Prefix scans whose prefix
+// it covers run in prefix mode, so the prefix bloom filters can skip SSTs without a match.
+static std::shared_ptr<const rocksdb::SliceTransform> g_prefix_extractor;
+
+// Merge operator of the default namespace (--merge-operator), if any
+static std::shared_ptr<ValueMergeOperator> g_merge_operator;
+
+// Per-key TTLs in the default namespace (--key-ttl): values carry an expiry trailer, and
+// ExpiryCompactionFilter drops expired keys in compaction (see expiry.h)
+static bool g_key_ttl = false;
+
+// Whether values in a namespace (null for the default one) carry expiry trailers
+bool expiring(const StorageEngine::Namespace* ns)
+{
+  // The expiry filter is the only compaction filter a namespace ever gets
+  return ns != nullptr ? ns->compaction_filter != nullptr : g_key_ttl;
+}
+
+// Cursors untouched for this long are closed (--cursor-idle-timeout)
+#ifndef CURSOR_IDLE_TIMEOUT_S
+  #define CURSOR_IDLE_TIMEOUT_S 60
+#endif
+
+static std::chrono::seconds g_cursor_idle_timeout(CURSOR_IDLE_TIMEOUT_S);
+
+// GET_ONE serves the hottest keys of the default namespace from a value cache of this many bytes
+// (--hot-cache-bytes, 0 for none). Every write path drops the keys it touched once the write has
+// landed.
+#ifndef HOT_CACHE_BYTES
+  #define HOT_CACHE_BYTES 0
+#endif
+
+static HotCache* g_hot_cache = nullptr;
 
-static volatile bool g_stop = false;
+// Point lookups only fill the block cache once one has been sized (--block-cache-bytes). Scans
+// never do, so a long scan can't push the hot blocks out.
+static bool g_fill_cache = false;
+
+// Metrics for the admin socket (--admin-socket); nothing is recorded without one. Each thread
+// counts into its own ThreadMetrics and a scrape adds them up. The per-opcode arrays are indexed
+// by opcode, so opcodes stay below the flag bits.
+constexpr size_t OP_SLOTS = 0x40;
+
+struct alignas(64) ThreadMetrics
+{
+  std::array<LocalCounter, OP_SLOTS> requests;
+  std::array<LocalCounter, OP_SLOTS> failures; // the handler threw and the connection was dropped
+  std::array<LatencyHistogram, OP_SLOTS> latency;
+  LocalCounter bytes_in;
+  LocalCounter bytes_out;
+  LocalCounter connections_opened;
+  LocalCounter connections_closed;
+  LocalGauge ring_bytes; // receive ring memory
+  LocalGauge ring_buffered; // bytes waiting in this loop's rings, as of its last sweep
+};
+
+static PerThread<ThreadMetrics>* g_metrics = nullptr;
+
+// Label of an opcode in metrics and traces; nullptr for the unused ones
+const char* opName(uint8_t op)
+{
+  switch (op)
+  {
+    case OP_GET_ONE: return "get_one";
+    case OP_GET_N: return "get_n";
+    case OP_GET_BETWEEN: return "get_between";
+    case OP_PUT_ONE: return "put_one";
+    case OP_PUT_MULTI: return "put_multi";
+    case OP_BULK_PUT: return "bulk_put";
+    case OP_MULTI_GET: return "multi_get";
+    case OP_SCAN_CREDIT: return "scan_credit";
+    case OP_SCAN_CANCEL: return "scan_cancel";
+    case OP_GET_PREFIX: return "get_prefix";
+    case OP_GET_N_REV: return "get_n_rev";
+    case OP_GET_BETWEEN_REV: return "get_between_rev";
+    case OP_GET_PREFIX_REV: return "get_prefix_rev";
+    case OP_SCAN_HINT: return "scan_hint";
+    case OP_CURSOR_OPEN: return "cursor_open";
+    case OP_CURSOR_NEXT: return "cursor_next";
+    case OP_CURSOR_CLOSE: return "cursor_close";
+    case OP_CACHE_STATS: return "cache_stats";
+    case OP_TRACE_DUMP: return "trace_dump";
+    case OP_CREATE_NAMESPACE: return "create_namespace";
+    case OP_DROP_NAMESPACE: return "drop_namespace";
+    case OP_MERGE: return "merge";
+    case OP_CAS: return "cas";
+    case OP_WRITE_IF: return "write_if";
+    case OP_PUT_ONE_TTL: return "put_one_ttl";
+    case OP_PUT_MULTI_TTL: return "put_multi_ttl";
+    default: return nullptr;
+  }
+}
 
 #if defined(_MSC_VER)
   #define NOINLINE __declspec(noinline)
@@ -69,10 +321,90 @@ static volatile bool g_stop = false;
   #define NOINLINE
 #endif
 
-// For smaller keys and values, allocate to the stack for performance
-// Bumping this up will require a larger stack per thread.
-#ifndef STACK_ALLOC_MAX_SIZE
-  #define STACK_ALLOC_MAX_SIZE 512 << 10 // 512KB
+// Each connection's receive ring starts this small and doubles on demand, so thousands of idle
+// connections don't pin gigabytes. Bursts are given back once the connection goes quiet.
+#ifndef CONN_BUFFER_INITIAL
+  #define CONN_BUFFER_INITIAL (16 << 10) // 16KB
+#endif
+
+// Most bytes pulled off the socket per recv(). They land straight in the receive ring, which
+// doubles whenever less than a quarter of it is free.
+#ifndef RECV_CHUNK_SIZE
+  #define RECV_CHUNK_SIZE (64 << 10) // 64KB
+#endif
+
+// Once this much reply data is queued behind a slow reader, streaming handlers (scans) pause
+// until EPOLLOUT says the peer caught up.
+#ifndef OUTPUT_HIGH_WATER
+  #define OUTPUT_HIGH_WATER (1 << 20) // 1MB
+#endif
+
+// How many read/execute rounds one connection gets before the loop moves on to its neighbours
+#ifndef SERVICE_BUDGET
+  #define SERVICE_BUDGET 64
+#endif
+
+// Provided receive buffers registered with each io_uring loop (count must be a power of two)
+#ifndef URING_BUFFER_COUNT
+  #define URING_BUFFER_COUNT 512
+#endif
+
+#ifndef URING_BUFFER_SIZE
+  #define URING_BUFFER_SIZE (16 << 10) // 16KB
+#endif
+
+// Scan rows are packed into a frame of about this size, which goes out in one write
+#ifndef SCAN_FRAME_BYTES
+  #define SCAN_FRAME_BYTES (256 << 10) // 256KB
+#endif
+
+// An idle connection gives its scan frame back after this many idle passes without a scan in
+// between. Giving it back on every one would make each small GET_N or GET_PREFIX allocate (and
+// fault in) a fresh SCAN_FRAME_BYTES.
+#ifndef SCAN_FRAME_IDLE_PASSES
+  #define SCAN_FRAME_IDLE_PASSES 64
+#endif
+
+// Values at least this big aren't copied into the scan frame; they go out by reference behind it
+#ifndef SCAN_GATHER_BYTES
+  #define SCAN_GATHER_BYTES (16 << 10) // 16KB
+#endif
+
+// Scans expected to return at least this many rows (GET_N's count, or a SCAN_HINT) read ahead
+// SCAN_READAHEAD_BYTES at a time, prefetching asynchronously where RocksDB supports it. Smaller
+// ones are left to RocksDB's own readahead, which only grows once it sees sequential reads.
+#ifndef SCAN_READAHEAD_ROWS
+  #define SCAN_READAHEAD_ROWS 1024
+#endif
+
+#ifndef SCAN_READAHEAD_BYTES
+  #define SCAN_READAHEAD_BYTES (2 << 20) // 2MB
+#endif
+
+// Open cursors allowed per connection
+#ifndef MAX_CURSORS_PER_CONNECTION
+  #define MAX_CURSORS_PER_CONNECTION 64
+#endif
+
+// Upper bound on the key count of one MULTI_GET frame
+#ifndef MULTI_GET_MAX_KEYS
+  #define MULTI_GET_MAX_KEYS (1 << 16)
+#endif
+
+// Most back-to-back tagged GETs (or PUTs) folded into one MultiGet (or WriteBatch)
+#ifndef PIPELINE_BATCH_MAX
+  #define PIPELINE_BATCH_MAX 1024
+#endif
+
+// Receive rings are mirrored in virtual memory, so every frame can be parsed in place, and run in
+// SPSC mode so a decoupled loop's I/O thread can fill them while its executor drains them. Build
+// with DISABLE_MIRRORED_RING to fall back to the plain (modulo indexed) ring, which rules out
+// --decouple-io.
+#if defined(__linux__) && !defined(DISABLE_MIRRORED_RING)
+  #define HAVE_SPSC_RING
+  using ReceiveRing = MirroredRingBuffer<uint8_t, true>;
+#else
+  using ReceiveRing = RingBuffer<uint8_t>;
 #endif
 
 #define MIN(a, b) ((a) < (b) ? (a) : (b))
@@ -143,998 +475,4258 @@ inline constexpr U truncate(T value)
 
 #endif
 
+// Lengths in response headers always go out most significant byte first
+inline void putBE16(uint8_t* out, uint16_t value)
+{
+  out[0] = static_cast<uint8_t>(value >> 8);
+  out[1] = static_cast<uint8_t>(value & 0xFF);
+}
+
+inline void putBE32(uint8_t* out, uint32_t value)
+{
+  out[0] = static_cast<uint8_t>(value >> 24);
+  out[1] = static_cast<uint8_t>((value >> 16) & 0xFF);
+  out[2] = static_cast<uint8_t>((value >> 8) & 0xFF);
+  out[3] = static_cast<uint8_t>(value & 0xFF);
+}
+
+inline void putBE64(uint8_t* out, uint64_t value)
+{
+  putBE32(out, static_cast<uint32_t>(value >> 32));
+  putBE32(out + 4, static_cast<uint32_t>(value & 0xFFFFFFFF));
+}
+
+// Non-blocking socket with a receive ring and an output queue. Nothing in here ever waits:
+// reads report when the kernel is drained, and writes park whatever the kernel didn't take
+// so the event loop can flush it on EPOLLOUT.
+//
+// Under the io_uring engine the socket is never touched directly: the loop feeds completed
+// receives in through receive(), and output only ever queues until the loop hands it to a
+// SEND through prepare_send()/complete_send().
 class BufferedSocket
 {
 private:
-  RingBuffer<uint8_t> m_buffer;
+  ReceiveRing m_buffer;
+  vector<uint8_t> m_outbuf;
+  size_t m_outpos;
+  vector<iovec> m_iov_scratch;
   UnixSocket m_socket;
-public:
-  BufferedSocket(size_t size, UnixSocket socket) :
-    m_buffer(size),
-    m_socket(socket)
-  { }
+  bool m_direct;
+  bool m_corked;
+
+  // io_uring engine: output owned by the in-flight SEND
+  vector<uint8_t> m_sending;
+  size_t m_sendpos;
 
-  // Read exactly n bytes into the provided buffer (gotta love the pointer arithmetic)
-  bool read_n(uint8_t* buffer, size_t n, struct timeval& timeout)
+  void resize_ring(size_t capacity)
   {
-    size_t bytesRead = m_buffer.pop_n(n, buffer);
-    if (bytesRead == n)
-      return true;
-    
-    while (bytesRead + m_buffer.size() < n)
+    size_t before = m_buffer.capacity();
+    m_buffer.resize(capacity);
+    if (g_metrics != nullptr)
+      g_metrics->local().ring_bytes.add(int64_t(m_buffer.capacity()) - int64_t(before));
+  }
+
+  static void count_out(size_t n)
+  {
+    if (g_metrics != nullptr)
+      g_metrics->local().bytes_out.add(n);
+  }
+
+  // sendmsg() until done or the kernel pushes back. Returns the number of bytes sent.
+  size_t send_iov(const iovec* iov, int iov_count)
+  {
+    m_iov_scratch.assign(iov, iov + iov_count);
+    iovec* cur = m_iov_scratch.data();
+    iovec* end = cur + iov_count;
+    size_t sent = 0;
+
+    while (cur != end)
     {
-      if (g_stop)
+      if (cur->iov_len == 0)
       {
-        throw std::runtime_error("Server is shutting down");
+        ++cur;
+        continue;
       }
 
-      // Wait until the socket has data to read
-      fd_set read_fds;
-      FD_ZERO(&read_fds);
-      FD_SET(m_socket, &read_fds);
+      struct msghdr msg;
+      memset(&msg, 0, sizeof(msg));
+      msg.msg_iov = cur;
+      msg.msg_iovlen = MIN(end - cur, IOV_MAX);
 
-      int select_result = select(m_socket + 1, &read_fds, nullptr, nullptr, &timeout);
-      if (select_result <= 0)
+      ssize_t status = sendmsg(m_socket, &msg, MSG_NOSIGNAL | MSG_DONTWAIT);
+      if (status < 0)
       {
         int err = errno;
-
-        if (g_stop)
-        {
-          throw std::runtime_error("Server is shutting down");
-        }
-
         switch (err)
         {
-          case EAGAIN: // Non-blocking socket would block
-            continue;
+          case EAGAIN:
+            return sent;
 #if EAGAIN != EWOULDBLOCK
           case EWOULDBLOCK:
-            continue;
+            return sent;
 #endif
-          case EINTR: // Interrupted by signal
-            continue;
-          case EBADF: // Invalid socket descriptor
-            throw std::runtime_error("Invalid socket descriptor");
-          case EINVAL:
-            throw std::runtime_error("Invalid argument");
-          case ENOMEM:
-            throw std::runtime_error("Out of memory");
-          default:
-            return false;
-        }
-      }
-
-      // Read chars from socket
-      char tmpBuf[m_buffer.available_without_alloc()];
-      ssize_t transferred = recv(m_socket, tmpBuf, m_buffer.available_without_alloc(), MSG_DONTWAIT); // nonblock read
-      
-      if (transferred <= 0)
-      {
-        int err = errno;
-        switch (err)
-        {
-          case EAGAIN: // Non-blocking socket would block
-            continue;
-#if EAGAIN != EWOULDBLOCK
-          case EWOULDBLOCK:
+          case EINTR:
             continue;
-#endif
+          case EPIPE:
+          case ECONNRESET:
+            throw std::runtime_error("Connection closed by peer");
           case EBADF:
             throw std::runtime_error("Invalid socket descriptor");
-          case EINTR:
-            continue;
           case EINVAL:
             throw std::runtime_error("Invalid argument");
-          case EFAULT:
-            // panic?
-            signal(SIGSEGV, 0);
-            throw std::runtime_error("Bad address");
-          case ENOTCONN:
-            // Socket is not connected
-            throw std::runtime_error("Socket is not connected");
-          case ENOTSOCK:
-            // Not a socket
-            throw std::runtime_error("Not a socket");
           default:
-            return false;
+            throw std::runtime_error("Error writing to socket");
         }
       }
 
-      m_buffer.push_n(tmpBuf, transferred);
-    }
-
-    m_buffer.pop_n(n - bytesRead, buffer + bytesRead);
-
-    return true;
-  }
+      sent += status;
+      count_out(status);
 
-  // Write exactly n bytes from the provided buffer
-  bool write_n(const char* buffer, size_t n, struct timeval& tv)
-  {
-    size_t bytesWritten = 0;
-    while (bytesWritten < n)
-    {
-      ssize_t result = send(m_socket, buffer + bytesWritten, n - bytesWritten, 0);
-      if (result == -1 && (errno == EAGAIN || errno == EWOULDBLOCK))
+      // Skip past the fully written iovecs, then trim the partially written one
+      size_t remaining = status;
+      while (cur != end && remaining >= cur->iov_len)
       {
-        // If the socket is non-blocking and would block, wait for it to become writable
-        fd_set write_fds;
-        FD_ZERO(&write_fds);
-        FD_SET(m_socket, &write_fds);
-
-        int select_result = select(m_socket + 1, nullptr, &write_fds, nullptr, &tv);
-        if (select_result <= 0) {
-          return false; // Timeout or error
-        }
-        continue; // Retry sending after the socket becomes writable
+        remaining -= cur->iov_len;
+        ++cur;
       }
-      if (result <= 0)
+
+      if (cur != end)
       {
-        return false; // Socket closed or error
+        cur->iov_base = static_cast<char*>(cur->iov_base) + remaining;
+        cur->iov_len -= remaining;
       }
-      bytesWritten += result;
     }
-    return true;
+
+    return sent;
   }
-};
 
-// WorkerContext holds the context for each worker thread
-// Note: absolutely NOT thread-safe. It's a per-thread context.
-// Don't be stooopid and use it across threads without some sort of locking and questioning life choices.
-class WorkerContext
-{
 public:
-  WorkerContext(UnixSocket socket, struct sockaddr_un client_addr, rocksdb::DB* db) :
-    m_socket(socket),
-    m_client_addr(client_addr),
-    m_db(db),
-    m_buffered_socket(4 << 20, socket)
-  { }
+  enum class FillResult
+  {
+    Data,       // new bytes landed in the ring
+    WouldBlock, // kernel buffer drained, wait for the next EPOLLIN
+    Full,       // no room left in the ring
+    Closed      // peer hung up
+  };
 
-  ~WorkerContext()
+  BufferedSocket(size_t size, UnixSocket socket, bool direct) :
+    m_buffer(size),
+    m_outpos(0),
+    m_socket(socket),
+    m_direct(direct),
+    m_corked(false),
+    m_sendpos(0)
   {
-    close(m_socket);
+    if (g_metrics != nullptr)
+      g_metrics->local().ring_bytes.add(m_buffer.capacity());
   }
 
-  UnixSocket m_socket;
-  struct sockaddr_un m_client_addr;
-  rocksdb::DB* m_db;
-  rocksdb::ReadOptions m_read_options;
-  rocksdb::WriteOptions m_write_options;
-  BufferedSocket m_buffered_socket;
-  rocksdb::PinnableSlice m_pinnable_slice;
-};
+  ~BufferedSocket()
+  {
+    if (g_metrics != nullptr)
+      g_metrics->local().ring_bytes.add(-int64_t(m_buffer.capacity()));
+  }
 
-size_t write_iov(UnixSocket socket, iovec* iov, int iov_count)
-{
-  assert(iov != nullptr);
+  // Double the receive ring when less than a quarter of it is free. Not while another thread is
+  // filling it.
+  void make_room()
+  {
+    if (m_buffer.available_without_alloc() < m_buffer.capacity() / 4)
+      resize_ring(m_buffer.capacity() * 2);
+  }
 
-  size_t total_writable = 0;
-  size_t written = 0;
-  size_t iov_written = 0;
+  // Pull one chunk from the socket straight into the ring's free space. Never grows the ring, so
+  // it is safe on the producer side of a shared one.
+  FillResult fill()
+  {
+    TRACE_SAMPLED_SPAN("recv", "socket");
+    RingSpan<uint8_t> space = m_buffer.free_span();
+    if (space.size() == 0)
+      return FillResult::Full;
 
-  int iov_start = 0;
+    size_t firstLen = MIN(space.first_len, size_t(RECV_CHUNK_SIZE));
+    size_t secondLen = MIN(space.second_len, size_t(RECV_CHUNK_SIZE) - firstLen);
 
-  for (size_t i = 0; i < iov_count; i++)
-    total_writable += iov[i].iov_len;
+    struct iovec iov[2];
+    iov[0].iov_base = space.first;
+    iov[0].iov_len = firstLen;
+    iov[1].iov_base = space.second;
+    iov[1].iov_len = secondLen;
 
-  while (true)
-  {
-    struct timeval timeout = { 5, 0 };
+    struct msghdr msg;
+    memset(&msg, 0, sizeof(msg));
+    msg.msg_iov = iov;
+    msg.msg_iovlen = secondLen > 0 ? 2 : 1;
 
-    // Wait until the socket is writable
-    struct fd_set write_fds;
-    FD_ZERO(&write_fds);
-    FD_SET(socket, &write_fds);
-    int select_status = select(socket + 1, nullptr, &write_fds, nullptr, &timeout);
-    if (select_status < 0)
+    while (true)
     {
-      int err = errno;
-      switch (err)
+      ssize_t transferred = recvmsg(m_socket, &msg, MSG_DONTWAIT); // nonblock read
+      if (transferred > 0)
       {
-        case EAGAIN:
-          continue;
-#if EAGAIN != EWOULDBLOCK
-        case EWOULDBLOCK:
-          continue;
-#endif
-        case EINTR:
-          continue;
-        case EBADF:
-          throw std::runtime_error("Invalid socket descriptor");
-        case EINVAL:
-          throw std::runtime_error("Invalid argument");
-        default:
-          // Handle other errors
-          throw std::runtime_error("Error writing to socket");
+        m_buffer.produce(transferred);
+        if (g_metrics != nullptr)
+          g_metrics->local().bytes_in.add(transferred);
+        return FillResult::Data;
       }
-    }
 
-    ssize_t status = writev(socket, iov + iov_start, iov_count - iov_start);
-    if (status < 0)
-    {
+      if (transferred == 0)
+        return FillResult::Closed;
+
       int err = errno;
       switch (err)
       {
-        case EAGAIN:
-          continue;
+        case EAGAIN: // Non-blocking socket would block
+          return FillResult::WouldBlock;
 #if EAGAIN != EWOULDBLOCK
         case EWOULDBLOCK:
-          continue;
+          return FillResult::WouldBlock;
 #endif
         case EINTR:
           continue;
+        case ECONNRESET:
+          return FillResult::Closed;
         case EBADF:
           throw std::runtime_error("Invalid socket descriptor");
         case EINVAL:
           throw std::runtime_error("Invalid argument");
+        case ENOTCONN:
+          throw std::runtime_error("Socket is not connected");
+        case ENOTSOCK:
+          throw std::runtime_error("Not a socket");
         default:
-          // Handle other errors
-          throw std::runtime_error("Error writing to socket");
+          throw std::runtime_error("Error reading from socket");
       }
     }
+  }
 
-    written += status;
-
-    size_t full_iovs_written = 0;
-    for (int iov_start = 0; iov_start < iov_count; iov_start++)
+  // Append bytes the io_uring engine received on our behalf
+  void receive(const uint8_t* data, size_t n)
+  {
+    size_t before = m_buffer.capacity();
+    m_buffer.push_n(data, n); // grows the ring if it has to
+    if (g_metrics != nullptr)
     {
-      iovec& cur = iov[iov_start];
-      if (full_iovs_written + cur.iov_len < written)
-        full_iovs_written += cur.iov_len;
-      else
-        break;
+      ThreadMetrics& metrics = g_metrics->local();
+      metrics.bytes_in.add(n);
+      metrics.ring_bytes.add(int64_t(m_buffer.capacity()) - int64_t(before));
     }
-
-    iov[iov_start].iov_base = static_cast<char*>(iov[iov_start].iov_base) + (written - full_iovs_written);
-    iov[iov_start].iov_len -= (written - full_iovs_written);
   }
 
-  return written;
-}
-
-void print_usage(const char* program_name)
-{
-  string usage = R"(
-Usage: [program_name] [options]
-Options:
-  --db-path <path>       Path to the RocksDB database (required)
-  --socket-path <path>   Path to the UNIX socket to listen on (required)
-  --write-buffer <size>  Write buffer size in bytes (default: 4GB)
-  --max-files <count>    Maximum number of open files (default: 500)
-  --help                 Show this help message
-)";
-  cout << usage;
-}
-
-UnixSocket bindAndListen(std::string& path)
-{
-  // Initialize the socket
-  UnixSocket server_socket = socket(AF_UNIX, SOCK_STREAM, 0);
-  if (server_socket == -1)
+  // Bytes received but not yet consumed
+  size_t buffered() const
   {
-    cerr << "Error creating socket: " << strerror(errno) << endl;
-    return -1;
+    return m_buffer.size();
   }
 
-  struct sockaddr_un server_addr;
-  memset(&server_addr, 0, sizeof(server_addr));
-  size_t pathLength = path.size() + 1;
-  if (pathLength > sizeof(server_addr.sun_path))
+  // Copy n bytes starting at offset without consuming them. False if they haven't all arrived.
+  bool peek(size_t offset, void* out, size_t n) const
   {
-    cerr << "Error: Socket path too long. Max length is " << sizeof(server_addr.sun_path) - 1 << " characters." << endl;
-    close(server_socket);
-    return -1;
-  }
-
-  // Set the socket address
-  server_addr.sun_family = AF_UNIX;
-  strcpy(server_addr.sun_path, path.c_str()); // Copy the socket path. strcpy since length is checked above
-  server_addr.sun_path[sizeof(server_addr.sun_path) - 1] = '\0';
-  server_addr.sun_len = sizeof(server_addr);
-
-  // Remove the socket file if it exists
-  unlink(path.c_str());
+    if (offset > m_buffer.size() || m_buffer.size() - offset < n)
+      return false;
 
-  if (bind(server_socket, (struct sockaddr*)&server_addr, sizeof(server_addr)) == -1)
-  {
-    cerr << "Error binding socket: " << strerror(errno) << endl;
-    close(server_socket);
-    return -1;
+    m_buffer.peek_n(offset, n, static_cast<uint8_t*>(out));
+    return true;
   }
 
-  if (listen(server_socket, 5) == -1)
+  // Borrow n buffered bytes at offset in place (one piece, or two if they wrap). Valid until
+  // they are consumed or the next fill(). False if they haven't all arrived.
+  bool borrow(size_t offset, size_t n, RingSpan<const uint8_t>& out) const
   {
-    cerr << "Error listening on socket: " << strerror(errno) << endl;
-    close(server_socket);
-    return -1;
-  }
-
-  cout << "Listening on socket: " << path << endl;
-  return server_socket;
-}
-
-// DO NOT INLINE. THIS FUNCTION USES UNSAFE CODE (alloca)
-NOINLINE void doGetOne(WorkerContext& context)
-{
-  uint32_t klen;
-  uint8_t* kbuf;
-  std::unique_ptr<uint8_t[]> kbuf_prot = nullptr;
-  
-  rocksdb::ReadOptions read_options;
-  struct timeval timeout;
-
-  read_options.fill_cache = false;
-  read_options.total_order_seek = false;
-  read_options.pin_data = true;
+    if (offset > m_buffer.size() || m_buffer.size() - offset < n)
+      return false;
 
-  // Don't worry about endianness. We only support UNIX sockets so assume data is local to system.
-  timeout = { 5, 0 };
-  if (!context.m_buffered_socket.read_n(reinterpret_cast<uint8_t*>(&klen), sizeof(klen), timeout));
-    throw std::runtime_error("Failed to read key length");
-  klen = fromNet32(klen);
+    out = n == 0 ? RingSpan<const uint8_t>{ nullptr, 0, nullptr, 0 } : m_buffer.peek_span(offset, n);
+    return true;
+  }
 
-  if (klen > STACK_ALLOC_MAX_SIZE)
+  void consume(size_t n)
   {
-    // Allocate on heap, use a unique_ptr to manage memory
-    kbuf_prot = std::make_unique<uint8_t[]>(klen);
-    kbuf = kbuf_prot.get();
+    m_buffer.discard(n);
   }
-  else
+
+  // Send a gathered reply. Goes straight to the kernel when nothing is queued ahead of it;
+  // whatever the kernel doesn't take is copied into the output queue.
+  void write_iov(const iovec* iov, int iov_count)
   {
-    kbuf = reinterpret_cast<uint8_t*>(alloca(klen)); // Allocate on stack
-  }
+    TRACE_SPAN("write_iov", "socket");
+    size_t written = 0;
+    if (m_direct && !m_corked && m_outpos == m_outbuf.size())
+      written = send_iov(iov, iov_count);
 
-  // Read the key
-  timeout = { 5, 0 };
-  if (!context.m_buffered_socket.read_n(kbuf, klen, timeout))
-    throw std::runtime_error("Failed to read key");
+    // Queue the unsent tail
+    for (int i = 0; i < iov_count; i++)
+    {
+      const uint8_t* base = static_cast<const uint8_t*>(iov[i].iov_base);
+      size_t len = iov[i].iov_len;
+      if (written >= len)
+      {
+        written -= len;
+        continue;
+      }
 
-  // Find and read the value from the DB
-  auto status = context.m_db->Get(
-    read_options,
-    nullptr,
-    rocksdb::Slice(reinterpret_cast<const char*>(kbuf), klen),
-    &context.m_pinnable_slice
-  );
+      m_outbuf.insert(m_outbuf.end(), base + written, base + len);
+      written = 0;
+    }
+  }
 
-  // Check if the key was found
-  if (status.IsNotFound())
+  void write_n(const void* buffer, size_t n)
   {
-    char response[] = { STAT_NOT_FOUND };
-    if (!context.m_buffered_socket.write_n(response, sizeof(response), timeout))
-      throw std::runtime_error("Failed to write error response");
-    
-    return;
+    iovec iov = { const_cast<void*>(buffer), n };
+    write_iov(&iov, 1);
   }
 
-  if (!status.ok())
+  // Pipelining clients get their replies batched: everything written while corked waits in the
+  // queue for the next flush(), so a burst of requests is answered with a single send.
+  void cork()
   {
-    string error = status.ToString();
-    uint16_t errorLength = static_cast<uint16_t>(toNet16(error.size()));
-    uint8_t errorHeader[] = {
-      STAT_ERR,
-      static_cast<uint8_t>(errorLength >> 8),
-      static_cast<uint8_t>(errorLength & 0xFF)
-    };
-
-    timeout = { 5, 0 };
-    if (!context.m_buffered_socket.write_n(reinterpret_cast<char*>(errorHeader), sizeof(error), timeout))
-      throw std::runtime_error("Failed to write error response");
-
-    timeout = { 5, 0 };
-    if (!context.m_buffered_socket.write_n(error.data(), errorLength, timeout))
-      throw std::runtime_error("Failed to write error response");
-    
-    return;
+    m_corked = true;
   }
 
-  // Write the value length and value. Use iovec to reduce syscalls
-  uint32_t vlen = static_cast<uint32_t>(toNet32(context.m_pinnable_slice.size()));
-  uint8_t response[] = {
-    STAT_OK,
-    static_cast<uint8_t>(vlen >> 24),
-    static_cast<uint8_t>((vlen >> 16) & 0xFF),
-    static_cast<uint8_t>((vlen >> 8) & 0xFF),
-    static_cast<uint8_t>(vlen & 0xFF)
-  };
-
-  struct iovec iov[2];
-
-  iov[0].iov_base = reinterpret_cast<void*>(&response);
-  iov[0].iov_len = sizeof(response);
+  // Push queued output to the kernel. True once the queue is empty.
+  bool flush()
+  {
+    while (m_outpos < m_outbuf.size())
+    {
+      ssize_t status = send(m_socket, m_outbuf.data() + m_outpos, m_outbuf.size() - m_outpos, MSG_NOSIGNAL | MSG_DONTWAIT);
+      if (status < 0)
+      {
+        int err = errno;
+        switch (err)
+        {
+          case EAGAIN:
+            break;
+#if EAGAIN != EWOULDBLOCK
+          case EWOULDBLOCK:
+            break;
+#endif
+          case EINTR:
+            continue;
+          case EPIPE:
+          case ECONNRESET:
+            throw std::runtime_error("Connection closed by peer");
+          default:
+            throw std::runtime_error("Error writing to socket");
+        }
+
+        // Kernel is full. Drop the sent prefix once it dominates the queue.
+        if (m_outpos > m_outbuf.size() / 2)
+        {
+          m_outbuf.erase(m_outbuf.begin(), m_outbuf.begin() + m_outpos);
+          m_outpos = 0;
+        }
+        return false;
+      }
 
-  iov[1].iov_base = const_cast<char*>(context.m_pinnable_slice.data());
-  iov[1].iov_len = vlen;
+      m_outpos += status;
+      count_out(status);
+    }
 
-  write_iov(context.m_socket, iov, 2);
-}
+    m_outbuf.clear();
+    m_outpos = 0;
+    return true;
+  }
 
-NOINLINE void doGetN(WorkerContext& context)
-{
-  uint32_t klen;
-  uint32_t n;
-  uint8_t* kbuf;
-  std::unique_ptr<uint8_t[]> kbuf_prot = nullptr;
+  // io_uring engine: move the queued output into the in-flight slot. The bytes stay put until
+  // complete_send() retires them, whatever the handlers queue in the meantime.
+  bool prepare_send(const uint8_t*& data, size_t& len)
+  {
+    if (m_sending.empty())
+    {
+      if (m_outbuf.empty())
+        return false;
 
-  rocksdb::ReadOptions read_options;
-  struct timeval timeout;
-  read_options.fill_cache = false;
-  read_options.pin_data = true;
-  read_options.total_order_seek = true;
+      m_sending.swap(m_outbuf);
+    }
 
-  // Read the start key length and value
-  timeout = { 5, 0 };
-  if (!context.m_buffered_socket.read_n(reinterpret_cast<uint8_t*>(&klen), sizeof(klen), timeout))
-    throw std::runtime_error("Failed to read key length");
+    data = m_sending.data() + m_sendpos;
+    len = m_sending.size() - m_sendpos;
+    return true;
+  }
 
-  klen = fromNet32(klen);
-  
-  if (klen > STACK_ALLOC_MAX_SIZE)
+  void complete_send(size_t n)
   {
-    // Allocate on heap, use a unique_ptr to manage memory
-    kbuf_prot = std::make_unique<uint8_t[]>(klen);
-    kbuf = kbuf_prot.get();
+    m_sendpos += n;
+    count_out(n);
+    if (m_sendpos == m_sending.size())
+    {
+      m_sending.clear();
+      m_sendpos = 0;
+    }
   }
-  else
+
+  size_t pending_output() const
   {
-    kbuf = reinterpret_cast<uint8_t*>(alloca(klen)); // Allocate on stack
+    return (m_outbuf.size() - m_outpos) + (m_sending.size() - m_sendpos);
   }
 
-  // Read the key
-  timeout = { 5, 0 };
-  if (!context.m_buffered_socket.read_n(kbuf, klen, timeout))
-    throw std::runtime_error("Failed to read key");
-
-  // Read the number of keys to get
-  timeout = { 5, 0 };
-  if (!context.m_buffered_socket.read_n(reinterpret_cast<uint8_t*>(&n), sizeof(n), timeout))
-    throw std::runtime_error("Failed to read number of keys");
-  
-  n = fromNet32(n);
-  
-  // Create an ierator and return the data
-  std::unique_ptr<rocksdb::Iterator> iter(context.m_db->NewIterator(read_options));
-  iter->Seek(rocksdb::Slice(reinterpret_cast<const char*>(kbuf), klen));
+  // The peer is not keeping up with our replies
+  bool congested() const
+  {
+    return pending_output() > OUTPUT_HIGH_WATER;
+  }
 
-  for (size_t i = 0; i < n; i++)
+  // Give back memory a burst left behind once the connection is idle. Leave the ring alone
+  // (with_ring false) while another thread may be filling it.
+  void trim(bool with_ring = true)
   {
-    if (!iter->Valid())
-    {
-      // Return a null KV pair and break
-      std::string error = iter->status().ToString();
-      uint16_t errorLength = static_cast<uint16_t>(toNet16(error.size()));
+    if (with_ring && m_buffer.empty() && m_buffer.capacity() > CONN_BUFFER_INITIAL)
+      resize_ring(CONN_BUFFER_INITIAL);
 
-      uint8_t errorHeader[] = {
-        STAT_ERR,
-        static_cast<uint8_t>(errorLength >> 8),
-        static_cast<uint8_t>(errorLength & 0xFF)
-      };
+    if (m_outbuf.empty() && m_outbuf.capacity() > OUTPUT_HIGH_WATER)
+      m_outbuf.shrink_to_fit();
 
-      iovec iov[2];
-      iov[0].iov_base = reinterpret_cast<void*>(&errorHeader);
-      iov[0].iov_len = sizeof(errorHeader);
-      iov[1].iov_base = const_cast<char*>(error.data());
-      iov[1].iov_len = iov[0].iov_len;
+    if (m_sending.empty() && m_sending.capacity() > OUTPUT_HIGH_WATER)
+      vector<uint8_t>().swap(m_sending);
+  }
+};
 
-      // Write the iovecs
-      write_iov(context.m_socket, iov, 2);
-      break;
-    }
+// Parses one request frame out of the receive buffer without consuming it. If the frame has
+// only partially arrived the handler bails out and re-parses from the top once the rest shows up;
+// lengths come first, so the (possibly large) key/value bytes are only copied once.
+class FrameReader
+{
+private:
+  BufferedSocket& m_socket;
+  size_t m_offset;
 
-    // Get the key and value
-    rocksdb::Slice kslice = iter->key();
-    rocksdb::Slice vslice = iter->value();
+public:
+  FrameReader(BufferedSocket& socket, size_t offset = 0) :
+    m_socket(socket),
+    m_offset(offset)
+  { }
 
-    uint32_t klen = toNet32(kslice.size());
-    uint32_t vlen = toNet32(vslice.size());
+  bool read_u32(uint32_t& out)
+  {
+    uint32_t raw = 0;
+    if (!m_socket.peek(m_offset, &raw, sizeof(raw)))
+      return false;
 
-    uint8_t firstHeader[] = {
-      STAT_OK,
-      static_cast<uint8_t>(klen >> 24),
-      static_cast<uint8_t>((klen >> 16) & 0xFF),
-      static_cast<uint8_t>((klen >> 8) & 0xFF),
-      static_cast<uint8_t>(klen & 0xFF)
-    };
+    out = fromNet32(raw);
+    m_offset += sizeof(raw);
+    return true;
+  }
 
-    struct iovec iov[2];
+  bool read_bytes(size_t n, string& out)
+  {
+    if (m_socket.buffered() - m_offset < n)
+      return false;
+
+    out.resize(n);
+    m_socket.peek(m_offset, out.data(), n);
+    m_offset += n;
+    return true;
+  }
 
-    iov[0].iov_base = reinterpret_cast<void*>(&klen);
-    iov[0].iov_len = sizeof(klen);
-    iov[1].iov_base = const_cast<char*>(kslice.data());
-    iov[1].iov_len = klen;
+  // Borrow the next n bytes in place, in one or two pieces. Valid until commit().
+  bool read_span(size_t n, RingSpan<const uint8_t>& out)
+  {
+    if (!m_socket.borrow(m_offset, n, out))
+      return false;
 
-    // Write the iovecs
-    write_iov(context.m_socket, iov, 2);
+    m_offset += n;
+    return true;
   }
-}
 
-NOINLINE void doGetBetween(WorkerContext& context)
-{
-  unsigned int k0len;
-  unsigned int k1len;
-  uint8_t* k0buf;
-  uint8_t* k1buf;
-  std::unique_ptr<uint8_t[]> k0buf_prot = nullptr;
-  std::unique_ptr<uint8_t[]> k1buf_prot = nullptr;
+  // Like read_span for callers that need the bytes in one piece: points straight into the
+  // receive buffer unless they wrap, in which case they're copied into scratch. Valid until commit().
+  bool read_view(size_t n, string& scratch, std::string_view& out)
+  {
+    RingSpan<const uint8_t> span;
+    if (!read_span(n, span))
+      return false;
 
-  rocksdb::ReadOptions read_options;
-  struct timeval timeout;
-  read_options.fill_cache = false;
-  read_options.pin_data = true;
-  read_options.total_order_seek = true;
+    if (span.second_len == 0)
+      out = std::string_view(reinterpret_cast<const char*>(span.first), span.first_len);
+    else
+    {
+      scratch.assign(reinterpret_cast<const char*>(span.first), span.first_len);
+      scratch.append(reinterpret_cast<const char*>(span.second), span.second_len);
+      out = scratch;
+    }
 
-  // Don't worry about endianness. We only support UNIX sockets so assume data is local to system.
-  // Read the keys lengths and values
-  timeout = { 5, 0 };
-  if (!context.m_buffered_socket.read_n(reinterpret_cast<uint8_t*>(&k0len), sizeof(k0len), timeout))
-    throw std::runtime_error("Failed to read key length");
+    return true;
+  }
 
-  // allocate then read the first key
-  k0len = fromNet32(k0len);
-  if (k0len > STACK_ALLOC_MAX_SIZE)
+  // The whole frame is here; drop it from the receive buffer
+  void commit()
   {
-    // Allocate on heap, use a unique_ptr to manage memory
-    k0buf_prot = std::make_unique<uint8_t[]>(k0len);
-    k0buf = k0buf_prot.get();
+    m_socket.consume(m_offset);
+    m_offset = 0;
   }
-  else
+};
+
+// A borrowed span of the receive buffer as the SliceParts RocksDB's write paths accept, so keys
+// and values go into a WriteBatch without being stitched together first
+class SpanSlices
+{
+private:
+  rocksdb::Slice m_parts[3];
+  int m_count;
+
+public:
+  // The trailer (a value's expiry, say) follows the span's bytes
+  SpanSlices(const RingSpan<const uint8_t>& span, const rocksdb::Slice& trailer = rocksdb::Slice()) :
+    m_parts{
+      rocksdb::Slice(reinterpret_cast<const char*>(span.first), span.first_len),
+      rocksdb::Slice(reinterpret_cast<const char*>(span.second), span.second_len)
+    },
+    m_count(m_parts[1].empty() ? 1 : 2)
+  {
+    if (!trailer.empty())
+      m_parts[m_count++] = trailer;
+  }
+
+  rocksdb::SliceParts parts() const
   {
-    k0buf = reinterpret_cast<uint8_t*>(alloca(k0len)); // Allocate on stack
+    return rocksdb::SliceParts(m_parts, m_count);
   }
-  if (!context.m_buffered_socket.read_n(k0buf, k0len, timeout))
-    throw std::runtime_error("Failed to read key");
+};
+
+class EventLoop;
+struct CoalescedWrite;
 
-  timeout = { 5, 0 };
-  if (!context.m_buffered_socket.read_n(reinterpret_cast<uint8_t*>(&k1len), sizeof(k1len), timeout))
-    throw std::runtime_error("Failed to read key length");
+// An open cursor. Between pages its iterator sits on the first row of the next one.
+struct Cursor
+{
+  std::shared_ptr<const StorageEngine::Namespace> ns;
+  std::unique_ptr<rocksdb::Iterator> iter;
+  const StorageEngine::Snapshot* snapshot = nullptr;
+  bool reverse = false;
+  string start; // live cursors: the start key, to seek back to until a row has been sent
+  string last_key; // live cursors: last row sent; the next page re-seeks past it
+  bool sent = false; // live cursors: last_key holds a row
+  bool fresh = true; // positioned by CURSOR_OPEN, nothing to refresh yet
+  std::chrono::steady_clock::time_point last_used;
+};
 
-  k1len = fromNet32(k1len);
-  if (k1len > STACK_ALLOC_MAX_SIZE)
+// WorkerContext holds the state of one client connection. It is owned by exactly one event loop
+// thread, and is absolutely NOT thread-safe.
+// Don't be stooopid and use it across threads without some sort of locking and questioning life choices.
+// (The one sanctioned exception is a DecoupledLoop, which splits it along the atomics below.)
+class WorkerContext : public MpscNode
+{
+public:
+  WorkerContext(uint64_t id, UnixSocket socket, struct sockaddr_un client_addr, StorageEngine* db, bool direct_io) :
+    m_id(id),
+    m_socket(socket),
+    m_client_addr(client_addr),
+    m_db(db),
+    m_buffered_socket(CONN_BUFFER_INITIAL, socket, direct_io),
+    m_pending_op(0),
+    m_tagged(false),
+    m_request_id(0),
+    m_frame_header(1),
+    m_timed_op(0),
+    m_trace_start(0),
+    m_trace_op(0),
+    m_trace_waiting(false),
+    m_scan_iter(nullptr),
+    m_scan_cursor(nullptr),
+    m_scan_reverse(false),
+    m_scan_expiring(false),
+    m_scan_remaining(0),
+    m_next_cursor(1),
+    m_scan_hint(0),
+    m_scan_frame_idle(0),
+    m_credit_mode(false),
+    m_scan_credit(0),
+    m_put_pairs(0),
+    m_put_records(0),
+    m_loop(nullptr),
+    m_awaiting_commit(false),
+    m_commit_batch(false),
+    m_scheduled(false),
+    m_uring_ops(0),
+    m_uring_sending(false),
+    m_closing(false),
+    m_exec_queued(false),
+    m_input_blocked(false),
+    m_input_closed(false),
+    m_forgotten(false),
+    m_commit_ack(nullptr),
+    m_retiring(false)
   {
-    // Allocate on heap, use a unique_ptr to manage memory
-    k1buf_prot = std::make_unique<uint8_t[]>(k1len);
-    k1buf = k1buf_prot.get();
+    if (g_metrics != nullptr)
+      g_metrics->local().connections_opened.add(1);
   }
-  else
+
+  ~WorkerContext()
   {
-    k1buf = reinterpret_cast<uint8_t*>(alloca(k1len)); // Allocate on stack
+    m_iter.reset();
+    while (!m_cursors.empty())
+      dropCursor(m_cursors.begin());
+
+    close(m_socket);
+
+    if (g_metrics != nullptr)
+      g_metrics->local().connections_closed.add(1);
   }
-  if (!context.m_buffered_socket.read_n(k1buf, k1len, timeout))
-    throw std::runtime_error("Failed to read key");
-  
-  // Create an iterator and return the data
-  std::unique_ptr<rocksdb::Iterator> iter(context.m_db->NewIterator(read_options));
-  iter->Seek(rocksdb::Slice(reinterpret_cast<const char*>(k0buf), k0len));
-  rocksdb::Slice k1slice(reinterpret_cast<const char*>(k1buf), k1len);
-  while (iter->Valid())
+
+  uint64_t m_id;
+  UnixSocket m_socket;
+  struct sockaddr_un m_client_addr;
+  StorageEngine* m_db;
+  rocksdb::ReadOptions m_read_options;
+  rocksdb::WriteOptions m_write_options;
+  BufferedSocket m_buffered_socket;
+  rocksdb::PinnableSlice m_pinnable_slice;
+
+  // Scratch space for keys/values parsed out of the current frame
+  string m_key;
+  string m_value;
+
+  // Opcode of a request that is still in progress (a streaming PUT, or a scan paused behind a
+  // slow reader). 0 when the connection is between requests.
+  char m_pending_op;
+
+  // Request id of the current request if it was tagged, and how many bytes of opcode (+ ids) sit
+  // in front of its frame body
+  bool m_tagged;
+  uint32_t m_request_id;
+  size_t m_frame_header;
+
+  // Namespace of the current request; null for the default one
+  std::shared_ptr<const StorageEngine::Namespace> m_ns;
+
+  // Metrics: opcode of the request being timed (0 if none) and when its first byte was looked at
+  uint8_t m_timed_op;
+  std::chrono::steady_clock::time_point m_timed_start;
+
+  // Tracing: when the sampled request in progress started (0 if it isn't sampled), its opcode,
+  // and whether it is still waiting for the rest of its frame
+  uint64_t m_trace_start;
+  uint8_t m_trace_op;
+  bool m_trace_waiting;
+
+  // Scratch space for pipelined batches
+  vector<uint32_t> m_batch_ids;
+  vector<string> m_batch_keys;
+  vector<uint8_t> m_batch_replies;
+
+  // The running scan: the iterator it reads (m_iter's, or a cursor's), which way it goes, and how
+  // many rows it may still send
+  std::unique_ptr<rocksdb::Iterator> m_iter;
+  rocksdb::Iterator* m_scan_iter;
+  Cursor* m_scan_cursor;
+  bool m_scan_reverse;
+  bool m_scan_expiring; // the rows carry expiry trailers, and expired ones are skipped
+  uint64_t m_scan_remaining;
+
+  unordered_map<uint32_t, Cursor> m_cursors;
+  uint32_t m_next_cursor;
+
+  // Range of the open scan, pushed down to the iterator (which only keeps the Slices, so the
+  // bytes live here), and the row count a SCAN_HINT expects from the next one
+  string m_scan_lower;
+  string m_scan_upper;
+  rocksdb::Slice m_lower_bound;
+  rocksdb::Slice m_upper_bound;
+  uint32_t m_scan_hint;
+
+  // Scan rows not sent yet (and idle passes since the last scan, see trim), and the flow control
+  // window (bytes the client will still take) once it has sent a SCAN_CREDIT
+  vector<uint8_t> m_scan_frame;
+  uint32_t m_scan_frame_idle;
+  bool m_credit_mode;
+  int64_t m_scan_credit;
+
+  // PUT_MULTI in progress: the batch being filled, how many pairs it holds, the per-batch
+  // records of the reply so far, the error that stopped the stream from being applied, and the
+  // expiry trailer every value gets
+  std::unique_ptr<rocksdb::WriteBatch> m_put_batch;
+  uint32_t m_put_pairs;
+  uint32_t m_put_records;
+  vector<uint8_t> m_put_results;
+  rocksdb::Status m_put_error;
+  string m_put_trailer;
+
+  // BULK_PUT in progress
+  std::unique_ptr<StorageEngine::BulkLoad> m_bulk;
+
+  // Loop that owns this connection, and whether it is parked until the write coalescer acks its
+  // last PUT (a single one, or the tagged batch in m_batch_ids)
+  EventLoop* m_loop;
+  bool m_awaiting_commit;
+  bool m_commit_batch;
+
+  // Already sitting in the event loop's ready queue
+  bool m_scheduled;
+
+  // io_uring engine bookkeeping: operations the kernel still holds, whether a SEND is one of
+  // them, and whether the connection is draining towards close
+  unsigned int m_uring_ops;
+  bool m_uring_sending;
+  bool m_closing;
+
+  // DecoupledLoop hand-off between the I/O thread (which only fills the receive ring) and the
+  // executor (which owns everything else). While m_input_blocked is set the ring was full and the
+  // I/O thread has stopped touching it until the executor clears the flag. Once m_forgotten is
+  // set the I/O thread has let go of the connection for good and the executor deletes it.
+  std::atomic<bool> m_exec_queued;
+  std::atomic<bool> m_input_blocked;
+  std::atomic<bool> m_input_closed;
+  std::atomic<bool> m_forgotten;
+  std::atomic<CoalescedWrite*> m_commit_ack;
+  bool m_retiring; // executor only
+
+  void dropCursor(unordered_map<uint32_t, Cursor>::iterator it)
   {
-    // Get the key and value
-    rocksdb::Slice kslice = iter->key();
-    rocksdb::Slice vslice = iter->value();
+    it->second.iter.reset(); // before the snapshot it reads
+    if (it->second.snapshot != nullptr)
+      m_db->releaseSnapshot(it->second.snapshot);
 
-    if (kslice.compare(k1slice) > 0)
-      break;
+    m_cursors.erase(it);
+  }
 
-    uint32_t klen = toNet32(kslice.size());
-    uint32_t vlen = toNet32(vslice.size());
-
-    uint8_t firstHeader[] = {
-      STAT_OK,
-      static_cast<uint8_t>(klen >> 24),
-      static_cast<uint8_t>((klen >> 16) & 0xFF),
-      static_cast<uint8_t>((klen >> 8) & 0xFF),
-      static_cast<uint8_t>(klen & 0xFF)
-    };
-
-    struct iovec iov[4];
-    iov[0].iov_base = reinterpret_cast<void*>(&firstHeader);
-    iov[0].iov_len = sizeof(firstHeader);
-    iov[1].iov_base = const_cast<char*>(kslice.data());
-    iov[1].iov_len = klen;
-    iov[2].iov_base = reinterpret_cast<void*>(&vlen);
-    iov[2].iov_len = sizeof(vlen);
-    iov[3].iov_base = const_cast<char*>(vslice.data());
-    iov[3].iov_len = vlen;
-
-    // Write the iovecs
-    write_iov(context.m_socket, iov, 2);
-  }
-
-  // Write a null KV pair to indicate end of stream
-  // status code, 4 byte key length, 4 byte value length
-  uint8_t endHeader[] = { STAT_OK, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00 };
-  if (!context.m_buffered_socket.write_n(reinterpret_cast<char*>(endHeader), sizeof(endHeader), timeout))
-    throw std::runtime_error("Failed to write null KV pair");
-}
+  void trim(bool with_ring = true)
+  {
+    m_buffered_socket.trim(with_ring);
+    if (m_value.capacity() > CONN_BUFFER_INITIAL)
+      string().swap(m_value);
 
-NOINLINE void doPutOne(WorkerContext& context)
-{
-  // Read the klen, key, vlen and value
-  unsigned int klen;
-  unsigned int vlen;
-  char* kbuf;
-  char* vbuf;
-  std::unique_ptr<char[]> kbuf_prot = nullptr;
-  std::unique_ptr<char[]> vbuf_prot = nullptr;
+    if (m_scan_frame.capacity() > 0 && ++m_scan_frame_idle >= SCAN_FRAME_IDLE_PASSES)
+      vector<uint8_t>().swap(m_scan_frame);
 
-  struct timeval timeout;
-  rocksdb::WriteOptions write_options;
-  write_options.sync = false;
-#ifdef DISABLE_WAL
-  write_options.disable_wal = true;
-#endif
+    // Keys a big MULTI_GET left behind (up to MULTI_GET_MAX_KEYS); a pipelined batch's are kept
+    if (m_batch_keys.size() > PIPELINE_BATCH_MAX)
+      vector<string>().swap(m_batch_keys);
+  }
+};
 
-  // Read KV pair
-  timeout = { 5, 0 };
-  if (!context.m_buffered_socket.read_n(reinterpret_cast<char*>(&klen), sizeof(klen), timeout))
-    throw std::runtime_error("Failed to read key length");
-  
-  if (klen > STACK_ALLOC_MAX_SIZE)
+// One connection's mutations on their way through the write coalescer and back to the loop that
+// owns the connection
+struct CoalescedWrite : MpscNode
+{
+  EventLoop* loop = nullptr;
+  uint64_t connection = 0;
+  std::shared_ptr<const StorageEngine::Namespace> ns;
+  bool merge = false; // the values are merge operands
+  char opcode = OP_PUT_ONE; // of the request, which decides how its reply looks
+  string ops; // (u32 klen, key, u32 vlen, value)...
+  rocksdb::Status status;
+
+  void append(const RingSpan<const uint8_t>& span)
   {
-    // Allocate on heap, use a unique_ptr to manage memory
-    kbuf_prot = std::make_unique<char[]>(klen);
-    kbuf = kbuf_prot.get();
+    uint32_t len = static_cast<uint32_t>(span.size());
+    ops.append(reinterpret_cast<const char*>(&len), sizeof(len));
+    ops.append(reinterpret_cast<const char*>(span.first), span.first_len);
+    ops.append(reinterpret_cast<const char*>(span.second), span.second_len);
   }
-  else
+
+  void append(const rocksdb::Slice& bytes)
   {
-    kbuf = reinterpret_cast<char*>(alloca(klen)); // Allocate on stack
+    uint32_t len = static_cast<uint32_t>(bytes.size());
+    ops.append(reinterpret_cast<const char*>(&len), sizeof(len));
+    ops.append(bytes.data(), bytes.size());
   }
 
-  timeout = { 5, 0 };
-  if (!context.m_buffered_socket.read_n(kbuf, klen, timeout))
-    throw std::runtime_error("Failed to read key");
-  
-  timeout = { 5, 0 };
-  if (!context.m_buffered_socket.read_n(reinterpret_cast<char*>(&vlen), sizeof(vlen), timeout))
-    throw std::runtime_error("Failed to read value length");
+  void put(const RingSpan<const uint8_t>& key, const RingSpan<const uint8_t>& value, const rocksdb::Slice& trailer)
+  {
+    append(key);
+    uint32_t len = static_cast<uint32_t>(value.size() + trailer.size());
+    ops.append(reinterpret_cast<const char*>(&len), sizeof(len));
+    ops.append(reinterpret_cast<const char*>(value.first), value.first_len);
+    ops.append(reinterpret_cast<const char*>(value.second), value.second_len);
+    ops.append(trailer.data(), trailer.size());
+  }
 
-  if (vlen > STACK_ALLOC_MAX_SIZE)
+  void put(const RingSpan<const uint8_t>& key, const rocksdb::Slice& value)
   {
-    // Allocate on heap, use a unique_ptr to manage memory
-    vbuf_prot = std::make_unique<char[]>(vlen);
-    vbuf = vbuf_prot.get();
+    append(key);
+    append(value);
   }
-  else
+
+  // Adds the ops to a batch; on failure some of them may be in it already
+  rocksdb::Status addTo(rocksdb::WriteBatch& batch) const
   {
-    vbuf = reinterpret_cast<char*>(alloca(vlen)); // Allocate on stack
+    rocksdb::ColumnFamilyHandle* column_family = StorageEngine::columnFamily(ns.get());
+    const char* pos = ops.data();
+    const char* end = pos + ops.size();
+    rocksdb::Status status;
+    while (status.ok() && pos != end)
+    {
+      uint32_t klen;
+      uint32_t vlen;
+      memcpy(&klen, pos, sizeof(klen));
+      rocksdb::Slice key(pos + sizeof(klen), klen);
+      pos += sizeof(klen) + klen;
+      memcpy(&vlen, pos, sizeof(vlen));
+      rocksdb::Slice value(pos + sizeof(vlen), vlen);
+      pos += sizeof(vlen) + vlen;
+      status = merge ? batch.Merge(column_family, key, value) : batch.Put(column_family, key, value);
+    }
+
+    return status;
   }
+};
+
+// Optional write-combining stage. Connections hand their PUTs over through a lock-free queue and
+// a dedicated committer thread folds everything queued into one synced WriteBatch, so a crowd of
+// small writers shares one WAL append and fsync instead of each paying for write-group leader
+// election. A connection is parked until its ack comes back, which keeps replies in order and
+// reads after writes consistent.
+class WriteCoalescer
+{
+private:
+  StorageEngine* m_db;
+  std::chrono::microseconds m_max_delay;
+  size_t m_max_bytes;
+  MpscQueue<CoalescedWrite> m_queue;
+  std::atomic<uint32_t> m_signal; // bumped on every submit; the committer sleeps on it
+  std::atomic<bool> m_stop;
+  std::thread m_thread;
 
-  timeout = { 5, 0 };
-  if (!context.m_buffered_socket.read_n(vbuf, vlen, timeout))
-    throw std::runtime_error("Failed to read value");
+  void run();
 
-  // Write the key and value to the DB
-  rocksdb::Slice kslice(kbuf, klen);
-  rocksdb::Slice vslice(vbuf, vlen);
+public:
+  WriteCoalescer(const WriteCoalescer&) = delete;
+  WriteCoalescer& operator=(const WriteCoalescer&) = delete;
 
-  auto status = context.m_db->Put(write_options, kslice, vslice);
-  if (!status.ok())
+  WriteCoalescer(StorageEngine* db, std::chrono::microseconds max_delay, size_t max_bytes) :
+    m_db(db),
+    m_max_delay(max_delay),
+    m_max_bytes(max_bytes),
+    m_signal(0),
+    m_stop(false),
+    m_thread(&WriteCoalescer::run, this)
+  { }
+
+  // Commits whatever is still queued before returning
+  ~WriteCoalescer()
   {
-    // return an error opcode
-    char error[] = { ERR_ERR, 0x00 }; // error of 0 length
-    if (!context.m_buffered_socket.write_n(error, sizeof(error), timeout))
-      throw std::runtime_error("Failed to write error response");
+    m_stop.store(true, std::memory_order_release);
+    m_signal.fetch_add(1, std::memory_order_release);
+    m_signal.notify_one();
+    m_thread.join();
   }
-  else
+
+  void submit(WorkerContext& context, CoalescedWrite* write)
   {
-    char status[] = { 0x00, 0x00 };
-    if (!context.m_buffered_socket.write_n(status, sizeof(status), timeout))
-      throw std::runtime_error("Failed to write success response");
+    write->loop = context.m_loop;
+    write->connection = context.m_id;
+    context.m_awaiting_commit = true;
+
+    m_queue.push(write);
+    m_signal.fetch_add(1, std::memory_order_release);
+    m_signal.notify_one();
   }
+};
+
+static WriteCoalescer* g_coalescer = nullptr;
+
+// Tagged requests get their id in front of the reply. Handlers call this once the frame is
+// committed, before writing anything else.
+void beginReply(WorkerContext& context)
+{
+  if (!context.m_tagged)
+    return;
+
+  uint8_t id[4];
+  putBE32(id, context.m_request_id);
+  context.m_buffered_socket.write_n(id, sizeof(id));
 }
 
-// NOINLINE boundary for alloca calls
-NOINLINE bool doPutN_one(
-  WorkerContext& context,
-  std::unique_ptr<char[]>& kbuf_cache,
-  std::unique_ptr<char[]>& vbuf_cache,
-  size_t& kbuf_cache_alloc,
-  size_t& vbuf_cache_alloc
-)
+void writeError(WorkerContext& context, const rocksdb::Status& status)
 {
-  unsigned int klen;
-  unsigned int vlen;
-  char* kbuf;
-  char* vbuf;
+  string error = status.ToString();
+  size_t errorLength = MIN(error.size(), size_t(0xFFFF));
 
-  struct timeval timeout;
+  uint8_t errorHeader[3] = { STAT_ERR };
+  putBE16(errorHeader + 1, static_cast<uint16_t>(errorLength));
 
-  rocksdb::WriteOptions write_options;
-  write_options.sync = false;
+  struct iovec iov[2];
+  iov[0].iov_base = errorHeader;
+  iov[0].iov_len = sizeof(errorHeader);
+  iov[1].iov_base = error.data();
+  iov[1].iov_len = errorLength;
 
-  // Read key
-  timeout = { 5, 0 };
-  if (!context.m_buffered_socket.read_n(reinterpret_cast<char*>(&klen), sizeof(klen), timeout))
-    throw std::runtime_error("Failed to read key length");
+  context.m_buffered_socket.write_iov(iov, 2);
+}
+
+// Send the scan rows packed so far
+void flushScanFrame(WorkerContext& context)
+{
+  vector<uint8_t>& frame = context.m_scan_frame;
+  if (!frame.empty())
+    context.m_buffered_socket.write_n(frame.data(), frame.size());
+
+  frame.clear();
+}
 
-  // Allocate space for the key
-  if (klen == 0)
+// One row of a scan: status, key length, key, value length, value. Rows collect in the scan frame
+// so a long scan costs one write per SCAN_FRAME_BYTES instead of one per row. Returns the row's
+// size on the wire.
+size_t writeRow(WorkerContext& context, const rocksdb::Slice& key, const rocksdb::Slice& value)
+{
+  vector<uint8_t>& frame = context.m_scan_frame;
+  if (frame.capacity() < SCAN_FRAME_BYTES)
+    frame.reserve(SCAN_FRAME_BYTES);
+
+  uint8_t header[4];
+  frame.push_back(STAT_OK);
+  putBE32(header, static_cast<uint32_t>(key.size()));
+  frame.insert(frame.end(), header, header + sizeof(header));
+  frame.insert(frame.end(), key.data(), key.data() + key.size());
+  putBE32(header, static_cast<uint32_t>(value.size()));
+  frame.insert(frame.end(), header, header + sizeof(header));
+
+  if (value.size() >= SCAN_GATHER_BYTES)
   {
-    // No more keys to read
-    return false;
+    // Send the frame with the value gathered on, rather than copying the value in
+    struct iovec iov[2];
+    iov[0].iov_base = frame.data();
+    iov[0].iov_len = frame.size();
+    iov[1].iov_base = const_cast<char*>(value.data());
+    iov[1].iov_len = value.size();
+
+    context.m_buffered_socket.write_iov(iov, 2);
+    frame.clear();
   }
-  else if (klen < STACK_ALLOC_MAX_SIZE)
+  else
   {
-    kbuf = reinterpret_cast<char*>(alloca(klen));
+    frame.insert(frame.end(), value.data(), value.data() + value.size());
+    if (frame.size() >= SCAN_FRAME_BYTES)
+      flushScanFrame(context);
   }
-  else if (kbuf_cache != nullptr && kbuf_cache_alloc >= klen)
+
+  return 9 + key.size() + value.size();
+}
+
+// A null KV pair marks the end of a scan: status code, 4 byte key length, 4 byte value length
+void writeEnd(WorkerContext& context)
+{
+  uint8_t endHeader[] = { STAT_OK, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00 };
+  context.m_scan_frame.insert(context.m_scan_frame.end(), endHeader, endHeader + sizeof(endHeader));
+  flushScanFrame(context);
+}
+
+// GET_ONE's reply for a found key: status, value length and value. Use iovec to reduce syscalls.
+void writeValue(WorkerContext& context, const rocksdb::Slice& value)
+{
+  uint8_t response[5] = { STAT_OK };
+  putBE32(response + 1, static_cast<uint32_t>(value.size()));
+
+  struct iovec iov[2];
+
+  iov[0].iov_base = reinterpret_cast<void*>(&response);
+  iov[0].iov_len = sizeof(response);
+
+  iov[1].iov_base = const_cast<char*>(value.data());
+  iov[1].iov_len = value.size();
+
+  context.m_buffered_socket.write_iov(iov, 2);
+}
+
+// Drop every key a written batch touched from the hot-key cache (which only holds the default
+// namespace). Called after the write, whether or not it went through, so a reader can't cache the
+// value it replaced.
+void invalidateHotKeys(const rocksdb::WriteBatch& batch)
+{
+  if (g_hot_cache == nullptr)
+    return;
+
+  struct Invalidator : rocksdb::WriteBatch::Handler
+  {
+    rocksdb::Status PutCF(uint32_t column_family, const rocksdb::Slice& key, const rocksdb::Slice&) override
+    {
+      if (column_family == 0)
+        g_hot_cache->invalidate(key.ToStringView());
+      return rocksdb::Status::OK();
+    }
+
+    rocksdb::Status MergeCF(uint32_t column_family, const rocksdb::Slice& key, const rocksdb::Slice&) override
+    {
+      if (column_family == 0)
+        g_hot_cache->invalidate(key.ToStringView());
+      return rocksdb::Status::OK();
+    }
+
+    rocksdb::Status DeleteCF(uint32_t column_family, const rocksdb::Slice& key) override
+    {
+      if (column_family == 0)
+        g_hot_cache->invalidate(key.ToStringView());
+      return rocksdb::Status::OK();
+    }
+
+    rocksdb::Status SingleDeleteCF(uint32_t column_family, const rocksdb::Slice& key) override
+    {
+      if (column_family == 0)
+        g_hot_cache->invalidate(key.ToStringView());
+      return rocksdb::Status::OK();
+    }
+
+    rocksdb::Status DeleteRangeCF(uint32_t column_family, const rocksdb::Slice&, const rocksdb::Slice&) override
+    {
+      if (column_family == 0)
+        g_hot_cache->clear();
+      return rocksdb::Status::OK();
+    }
+  } invalidator;
+
+  batch.Iterate(&invalidator);
+}
+
+void print_usage(const char* program_name)
+{
+  string usage = R"(
+Usage: [program_name] [options]
+Options:
+  --db-path <path>       Path to the database directory (required)
+  --socket-path <path>   Path to the UNIX socket to listen on (required)
+  --storage-engine <e>   rocksdb or lmdb (default: rocksdb). LMDB serves reads from a memory
+                         mapped B-tree, for read-mostly data that fits in RAM; it takes keys of
+                         up to 511 bytes and ignores the RocksDB settings below
+  --lmdb-map-size <n>    Most bytes the LMDB store may grow to (default: 64GB)
+  --config <path>        Read the storage settings below from a file of name = value lines;
+                         flags given on the command line win over the file
+  --write-buffer <size>  Write buffer size in bytes (default: 4GB)
+  --max-files <count>    Maximum number of open files (default: 500)
+  --block-cache-bytes <n>    Shared block cache size; point reads fill it (default: RocksDB's)
+  --block-cache-type <t>     lru or hyperclock (default: lru)
+  --filter-bits-per-key <n>  SST filter size (default: none, or 10 with a prefix extractor)
+  --filter-type <t>          bloom or ribbon (default: bloom)
+  --block-size <n>           SST data block size in bytes (default: RocksDB's)
+  --partition-index-filters  Two-level index and partitioned filters, for very large DBs
+  --pin-l0-filter-index      Keep L0 filter and index blocks pinned in the block cache
+  --compression-per-level <list>  Comma separated, e.g. none,none,lz4,lz4,zstd (default: RocksDB's)
+  --bottommost-compression <c>    Compression for the last level (default: RocksDB's)
+  --io-threads <count>   Number of event loop threads (default: number of cores)
+  --io-engine <name>     Socket I/O engine: epoll or io_uring (default: epoll)
+  --decouple-io          Give each epoll I/O thread its own executor thread for requests
+  --put-batch-bytes <n>  Commit PUT_MULTI streams in WriteBatches of this many bytes (default: 4MB)
+  --ingest-dir <path>    Staging directory for BULK_PUT SST files (default: temp directory)
+  --prefix-extractor <s> Key prefix for bloom filters, fixed:<len> or capped:<len> (default: none)
+  --merge-operator <op>  What MERGE does in the default namespace: add, max, min, append or
+                         list:<n> (default: none)
+  --key-ttl              Let writes to the default namespace carry a TTL (PUT_ONE_TTL,
+                         PUT_MULTI_TTL); compaction drops expired keys. Every value then carries
+                         an expiry, so the default namespace must not hold data written without
+                         it; a DB written with it must always be opened with it, and the other
+                         way round (both refused). Not with --merge-operator
+  --cursor-idle-timeout <s>  Close cursors idle for this many seconds (default: 60)
+  --hot-cache-bytes <n>  Serve GET_ONE for hot keys from a value cache this big (default: off)
+  --coalesce-writes      Commit PUT_ONEs from all connections in shared, synced WriteBatches.
+                         Unlike plain PUT_ONEs, an acked write then survives a machine crash
+  --coalesce-delay <us>  How long a coalesced group may wait to fill up (default: 0)
+  --coalesce-bytes <n>   Close a coalesced group at this many bytes (default: 1MB)
+  --admin-socket <path>  Serve Prometheus metrics on this UNIX socket (default: off)
+  --trace-sample <f>     Trace this fraction of requests, e.g. 0.01; TRACE_DUMP and the admin
+                         socket's /trace hand them out as Chrome trace JSON (default: off;
+                         needs a build with ENABLE_TRACING)
+  --help                 Show this help message
+)";
+  cout << usage;
+}
+
+UnixSocket bindAndListen(std::string& path)
+{
+  // Initialize the socket
+  UnixSocket server_socket = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+  if (server_socket == -1)
   {
-    kbuf = kbuf_cache.get();
+    cerr << "Error creating socket: " << strerror(errno) << endl;
+    return -1;
   }
-  else
+
+  struct sockaddr_un server_addr;
+  memset(&server_addr, 0, sizeof(server_addr));
+  size_t pathLength = path.size() + 1;
+  if (pathLength > sizeof(server_addr.sun_path))
   {
-    kbuf_cache = std::make_unique<char[]>(klen);
-    kbuf_cache_alloc = klen;
-    kbuf = kbuf_cache.get();
+    cerr << "Error: Socket path too long. Max length is " << sizeof(server_addr.sun_path) - 1 << " characters." << endl;
+    close(server_socket);
+    return -1;
   }
 
-  // Read the key
-  timeout = { 5, 0 };
-  if (!context.m_buffered_socket.read_n(kbuf, klen, timeout))
-    throw std::runtime_error("Failed to read key");
+  // Set the socket address
+  server_addr.sun_family = AF_UNIX;
+  strcpy(server_addr.sun_path, path.c_str()); // Copy the socket path. strcpy since length is checked above
+  server_addr.sun_path[sizeof(server_addr.sun_path) - 1] = '\0';
+
+  // Remove the socket file if it exists
+  unlink(path.c_str());
 
-  // Read the value length
-  timeout = { 5, 0 };
-  if (!context.m_buffered_socket.read_n(reinterpret_cast<char*>(&vlen), sizeof(vlen), timeout))
-    throw std::runtime_error("Failed to read value length");
-  
-  // Allocate space for the value
-  if (vlen < STACK_ALLOC_MAX_SIZE)
+  if (bind(server_socket, (struct sockaddr*)&server_addr, sizeof(server_addr)) == -1)
   {
-    vbuf = reinterpret_cast<char*>(alloca(vlen));
+    cerr << "Error binding socket: " << strerror(errno) << endl;
+    close(server_socket);
+    return -1;
   }
-  else if (vbuf_cache != nullptr && vbuf_cache_alloc >= vlen)
+
+  if (listen(server_socket, SOMAXCONN) == -1)
   {
-    vbuf = vbuf_cache.get();
+    cerr << "Error listening on socket: " << strerror(errno) << endl;
+    close(server_socket);
+    return -1;
   }
-  else
+
+  cout << "Listening on socket: " << path << endl;
+  return server_socket;
+}
+
+// Every handler below parses its frame straight out of the receive buffer and returns false if
+// it can't finish yet (frame not fully arrived, or the reply is backed up). The event loop calls
+// it again once there is more to read or room to write. The opcode byte (and request id, if the
+// frame is tagged) is left in the buffer for the handler to commit along with the rest of the frame.
+
+NOINLINE bool doGetOne(WorkerContext& context)
+{
+  uint32_t klen;
+  std::string_view key;
+  FrameReader frame(context.m_buffered_socket, context.m_frame_header);
+  if (!frame.read_u32(klen) || !frame.read_view(klen, context.m_key, key))
+    return false;
+
+  // The hot cache holds values as stored, expiry trailer and all
+  uint64_t ticket = 0;
+  bool cached = g_hot_cache != nullptr && !context.m_ns;
+  bool expires = expiring(context.m_ns.get());
+  if (cached && g_hot_cache->lookup(key, context.m_value, ticket))
+  {
+    rocksdb::Slice value(context.m_value);
+    bool live = !expires || stripExpiry(value, expiryNow());
+    frame.commit();
+    beginReply(context);
+    if (live)
+      writeValue(context, value);
+    else
+    {
+      char response[] = { STAT_NOT_FOUND };
+      context.m_buffered_socket.write_n(response, sizeof(response));
+    }
+    return true;
+  }
+
+  rocksdb::ReadOptions read_options;
+  read_options.fill_cache = g_fill_cache;
+  read_options.total_order_seek = false;
+  read_options.pin_data = true;
+
+  // Find and read the value from the DB. The key is looked up in place in the receive buffer.
+  context.m_pinnable_slice.Reset();
+  rocksdb::Status status;
+  {
+    TRACE_SPAN("get", "db");
+    status = context.m_db->get(read_options, context.m_ns.get(), rocksdb::Slice(key.data(), key.size()), &context.m_pinnable_slice);
+  }
+  if (cached && status.ok())
+    g_hot_cache->insert(key, context.m_pinnable_slice.ToStringView(), ticket);
+  if (expires && status.ok() && !stripExpiry(context.m_pinnable_slice, expiryNow()))
+  {
+    context.m_pinnable_slice.Reset();
+    status = rocksdb::Status::NotFound();
+  }
+  frame.commit();
+  beginReply(context);
+
+  // Check if the key was found
+  if (status.IsNotFound())
+  {
+    char response[] = { STAT_NOT_FOUND };
+    context.m_buffered_socket.write_n(response, sizeof(response));
+    return true;
+  }
+
+  if (!status.ok())
+  {
+    writeError(context, status);
+    return true;
+  }
+
+  writeValue(context, context.m_pinnable_slice);
+  context.m_pinnable_slice.Reset();
+  return true;
+}
+
+// Hot-key cache counters
+NOINLINE bool doCacheStats(WorkerContext& context)
+{
+  FrameReader frame(context.m_buffered_socket, context.m_frame_header);
+  frame.commit();
+  beginReply(context);
+
+  HotCache::Stats stats;
+  if (g_hot_cache != nullptr)
+    stats = g_hot_cache->stats();
+
+  uint8_t reply[1 + 4 * 8] = { STAT_OK };
+  putBE64(reply + 1, stats.hits);
+  putBE64(reply + 9, stats.misses);
+  putBE64(reply + 17, stats.entries);
+  putBE64(reply + 25, stats.bytes);
+  context.m_buffered_socket.write_n(reply, sizeof(reply));
+  return true;
+}
+
+// Sampled requests, drained from every thread's trace ring
+NOINLINE bool doTraceDump(WorkerContext& context)
+{
+  FrameReader frame(context.m_buffered_socket, context.m_frame_header);
+  frame.commit();
+  beginReply(context);
+
+  if (!Tracer::COMPILED_IN)
+  {
+    writeError(context, rocksdb::Status::NotSupported("Tracing is not built in (ENABLE_TRACING)"));
+    return true;
+  }
+
+  string trace = Tracer::dump();
+  uint8_t header[5] = { STAT_OK };
+  putBE32(header + 1, static_cast<uint32_t>(trace.size()));
+
+  struct iovec iov[2];
+  iov[0].iov_base = header;
+  iov[0].iov_len = sizeof(header);
+  iov[1].iov_base = trace.data();
+  iov[1].iov_len = trace.size();
+  context.m_buffered_socket.write_iov(iov, 2);
+  return true;
+}
+
+bool isScanOp(char opcode)
+{
+  switch (opcode)
+  {
+    case OP_GET_N:
+    case OP_GET_BETWEEN:
+    case OP_GET_PREFIX:
+    case OP_GET_N_REV:
+    case OP_GET_BETWEEN_REV:
+    case OP_GET_PREFIX_REV:
+    case OP_CURSOR_NEXT:
+      return true;
+    default:
+      return false;
+  }
+}
+
+// Stream rows from the connection's open iterator until the scan is done, the peer stops keeping
+// up, or its flow control credit runs out. Scans end when the iterator leaves its bounds or after
+// m_scan_remaining rows (which SCAN_CANCEL zeroes).
+bool continueScan(WorkerContext& context)
+{
+  TRACE_SPAN("iterate", "db");
+  rocksdb::Iterator* iter = context.m_scan_iter;
+  bool reverse = context.m_scan_reverse;
+  uint32_t now = context.m_scan_expiring ? expiryNow() : 0;
+
+  while (!context.m_buffered_socket.congested())
+  {
+    if (!iter->Valid() || context.m_scan_remaining == 0)
+    {
+      if (!iter->status().ok())
+      {
+        flushScanFrame(context);
+        writeError(context, iter->status());
+      }
+      else
+        writeEnd(context);
+
+      context.m_scan_frame_idle = 0;
+
+      // A cursor's iterator stays where the page stopped
+      context.m_iter.reset();
+      context.m_scan_iter = nullptr;
+      context.m_scan_cursor = nullptr;
+      context.m_pending_op = 0;
+      return true;
+    }
+
+    if (context.m_credit_mode && context.m_scan_credit <= 0)
+      break; // a SCAN_CREDIT picks us back up
+
+    // Expired rows compaction hasn't dropped yet are skipped, and don't count
+    rocksdb::Slice value = iter->value();
+    if (context.m_scan_expiring && !stripExpiry(value, now))
+    {
+      if (reverse)
+        iter->Prev();
+      else
+        iter->Next();
+      continue;
+    }
+
+    size_t sent = writeRow(context, iter->key(), value);
+    if (context.m_credit_mode)
+      context.m_scan_credit -= static_cast<int64_t>(sent);
+
+    Cursor* cursor = context.m_scan_cursor;
+    if (cursor != nullptr && cursor->snapshot == nullptr)
+    {
+      cursor->last_key.assign(iter->key().data(), iter->key().size());
+      cursor->sent = true;
+    }
+
+    --context.m_scan_remaining;
+    if (reverse)
+      iter->Prev();
+    else
+      iter->Next();
+  }
+
+  // Paused; the client shouldn't wait on rows we're sitting on
+  flushScanFrame(context);
+  return false;
+}
+
+// Apply a SCAN_CREDIT, SCAN_CANCEL or SCAN_HINT at the front of the buffer. False if there isn't
+// a complete one there.
+bool doScanControl(WorkerContext& context)
+{
+  BufferedSocket& socket = context.m_buffered_socket;
+  char opcode;
+  if (!socket.peek(0, &opcode, 1))
+    return false;
+
+  if (opcode == OP_SCAN_CANCEL)
+  {
+    socket.consume(1);
+    if (isScanOp(context.m_pending_op))
+      context.m_scan_remaining = 0;
+    return true;
+  }
+
+  if (opcode == OP_SCAN_CREDIT || opcode == OP_SCAN_HINT)
+  {
+    uint32_t value;
+    if (!socket.peek(1, &value, sizeof(value)))
+      return false;
+
+    socket.consume(1 + sizeof(value));
+    if (opcode == OP_SCAN_HINT)
+      context.m_scan_hint = value;
+    else
+    {
+      context.m_credit_mode = true;
+      context.m_scan_credit += value;
+    }
+    return true;
+  }
+
+  return false;
+}
+
+// Which of m_scan_lower (inclusive) and m_scan_upper (exclusive) bound a scan
+enum ScanBounds
+{
+  BOUND_NONE = 0,
+  BOUND_LOWER = 1,
+  BOUND_UPPER = 2,
+  BOUND_BOTH = BOUND_LOWER | BOUND_UPPER
+};
+
+// Open the scan's iterator: total order unless the prefix extractor can serve a prefix scan,
+// bounded to the range in the context, and reading ahead if it is expected to be big
+void openScan(WorkerContext& context, int bounds, bool prefix_mode, uint64_t expected_rows)
+{
+  rocksdb::ReadOptions read_options;
+  read_options.fill_cache = false;
+  read_options.pin_data = true;
+  read_options.total_order_seek = !prefix_mode;
+  read_options.prefix_same_as_start = prefix_mode;
+
+  // Lets RocksDB skip SSTs outside the range and stop reading blocks at its end
+  if (bounds & BOUND_LOWER)
+  {
+    context.m_lower_bound = context.m_scan_lower;
+    read_options.iterate_lower_bound = &context.m_lower_bound;
+  }
+  if (bounds & BOUND_UPPER)
+  {
+    context.m_upper_bound = context.m_scan_upper;
+    read_options.iterate_upper_bound = &context.m_upper_bound;
+  }
+
+  // A hint only counts for the scan right after it
+  expected_rows = std::max<uint64_t>(expected_rows, context.m_scan_hint);
+  context.m_scan_hint = 0;
+
+  if (expected_rows >= SCAN_READAHEAD_ROWS)
+  {
+    read_options.readahead_size = SCAN_READAHEAD_BYTES;
+#if ROCKSDB_MAJOR >= 7
+    read_options.async_io = true;
+    read_options.adaptive_readahead = true;
+#endif
+#if ROCKSDB_MAJOR > 8 || (ROCKSDB_MAJOR == 8 && ROCKSDB_MINOR >= 2)
+    read_options.auto_readahead_size = true; // trims readahead at the upper bound
+#endif
+  }
+
+  context.m_iter.reset(context.m_db->newIterator(read_options, context.m_ns.get()));
+}
+
+// Scan is positioned; take the frame off the buffer and stream the first rows
+bool startScan(WorkerContext& context, FrameReader& frame, char opcode, rocksdb::Iterator* iter,
+  bool reverse, uint64_t rows)
+{
+  frame.commit();
+  beginReply(context);
+  context.m_scan_iter = iter;
+  context.m_scan_reverse = reverse;
+  context.m_scan_expiring = expiring(context.m_scan_cursor != nullptr ? context.m_scan_cursor->ns.get() : context.m_ns.get());
+  context.m_scan_remaining = rows;
+  context.m_pending_op = opcode;
+
+  return continueScan(context);
+}
+
+NOINLINE bool doGetN(WorkerContext& context, char opcode)
+{
+  if (context.m_pending_op == opcode)
+    return continueScan(context);
+
+  uint32_t klen;
+  uint32_t n;
+  std::string_view start;
+  FrameReader frame(context.m_buffered_socket, context.m_frame_header);
+  if (!frame.read_u32(klen) || !frame.read_view(klen, context.m_key, start) || !frame.read_u32(n))
+    return false;
+
+  // Create an iterator and stream the data. Only the row count limits it.
+  rocksdb::Slice target(start.data(), start.size());
+  openScan(context, BOUND_NONE, false, n);
+  {
+    TRACE_SPAN("seek", "db");
+    if (opcode == OP_GET_N_REV)
+      context.m_iter->SeekForPrev(target);
+    else
+      context.m_iter->Seek(target);
+  }
+
+  return startScan(context, frame, opcode, context.m_iter.get(), opcode == OP_GET_N_REV, n);
+}
+
+NOINLINE bool doGetBetween(WorkerContext& context, char opcode)
+{
+  if (context.m_pending_op == opcode)
+    return continueScan(context);
+
+  // Don't worry about endianness. We only support UNIX sockets so assume data is local to system.
+  // Both keys become iterator bounds, so both are copied out of the frame.
+  uint32_t k0len;
+  uint32_t k1len;
+  FrameReader frame(context.m_buffered_socket, context.m_frame_header);
+  if (!frame.read_u32(k0len) || !frame.read_bytes(k0len, context.m_scan_lower) ||
+      !frame.read_u32(k1len) || !frame.read_bytes(k1len, context.m_scan_upper))
+    return false;
+
+  // k1 is inclusive; the smallest key after it is the exclusive upper bound
+  context.m_scan_upper.push_back('\0');
+  openScan(context, BOUND_BOTH, false, 0);
+  {
+    TRACE_SPAN("seek", "db");
+    if (opcode == OP_GET_BETWEEN_REV)
+      context.m_iter->SeekForPrev(rocksdb::Slice(context.m_scan_upper.data(), k1len));
+    else
+      context.m_iter->Seek(context.m_scan_lower);
+  }
+
+  return startScan(context, frame, opcode, context.m_iter.get(), opcode == OP_GET_BETWEEN_REV,
+    UINT64_MAX);
+}
+
+// Smallest key greater than every key starting with prefix; empty if there is none (the prefix is
+// empty or all 0xFF)
+string prefixSuccessor(const string& prefix)
+{
+  string successor = prefix;
+  while (!successor.empty() && static_cast<uint8_t>(successor.back()) == 0xFF)
+    successor.pop_back();
+
+  if (!successor.empty())
+    successor.back() = static_cast<char>(static_cast<uint8_t>(successor.back()) + 1);
+
+  return successor;
+}
+
+NOINLINE bool doGetPrefix(WorkerContext& context, char opcode)
+{
+  if (context.m_pending_op == opcode)
+    return continueScan(context);
+
+  uint32_t plen;
+  uint32_t n;
+  FrameReader frame(context.m_buffered_socket, context.m_frame_header);
+  if (!frame.read_u32(plen) || !frame.read_bytes(plen, context.m_scan_lower) || !frame.read_u32(n))
+    return false;
+
+  // The prefix's keys are exactly [prefix, successor). Without a successor every key from the
+  // prefix on starts with it.
+  const string& prefix = context.m_scan_lower;
+  context.m_scan_upper = prefixSuccessor(prefix);
+  bool bounded = !context.m_scan_upper.empty();
+  bool reverse = opcode == OP_GET_PREFIX_REV;
+
+  // Prefix mode needs every key under the prefix to land in one extractor bucket, or the scan
+  // stops at the first key in another and the filters skip SSTs it should read. Going in reverse
+  // we seek from the successor, which has to be in that bucket too.
+  rocksdb::SliceTransform const* extractor = context.m_ns ? context.m_ns->prefix_extractor.get() : g_prefix_extractor.get();
+  bool prefix_mode = extractor != nullptr && coversPrefix(*extractor, prefix);
+  if (prefix_mode && reverse)
+  {
+    const string& successor = context.m_scan_upper;
+    prefix_mode = bounded && extractor->InDomain(successor) &&
+      extractor->Transform(successor) == extractor->Transform(prefix);
+  }
+
+  openScan(context, bounded ? BOUND_BOTH : BOUND_LOWER, prefix_mode, n);
+  {
+    TRACE_SPAN("seek", "db");
+    if (!reverse)
+      context.m_iter->Seek(prefix);
+    else if (bounded)
+      context.m_iter->SeekForPrev(context.m_scan_upper); // lands below the (exclusive) bound
+    else
+      context.m_iter->SeekToLast();
+  }
+
+  return startScan(context, frame, opcode, context.m_iter.get(), reverse, n);
+}
+
+// Cursors read in total order, without bounds
+rocksdb::ReadOptions cursorReadOptions()
+{
+  rocksdb::ReadOptions read_options;
+  read_options.pin_data = true;
+  read_options.total_order_seek = true;
+  return read_options;
+}
+
+void seekCursor(Cursor& cursor, const rocksdb::Slice& target)
+{
+  TRACE_SPAN("seek", "db");
+  if (target.empty())
+  {
+    if (cursor.reverse)
+      cursor.iter->SeekToLast();
+    else
+      cursor.iter->SeekToFirst();
+  }
+  else if (cursor.reverse)
+    cursor.iter->SeekForPrev(target);
+  else
+    cursor.iter->Seek(target);
+}
+
+void writeStatus(WorkerContext& context, char status)
+{
+  context.m_buffered_socket.write_n(&status, 1);
+}
+
+NOINLINE bool doCursorOpen(WorkerContext& context)
+{
+  uint32_t klen;
+  std::string_view start;
+  FrameReader frame(context.m_buffered_socket, context.m_frame_header);
+  if (!frame.read_u32(klen) || !frame.read_view(klen, context.m_key, start) ||
+      !frame.read_bytes(1, context.m_value))
+    return false;
+
+  uint8_t flags = static_cast<uint8_t>(context.m_value[0]);
+  if (context.m_cursors.size() >= MAX_CURSORS_PER_CONNECTION)
+  {
+    frame.commit();
+    beginReply(context);
+    writeError(context, rocksdb::Status::Busy("Too many open cursors"));
+    return true;
+  }
+
+  const StorageEngine::Snapshot* snapshot = nullptr;
+  if (flags & CURSOR_SNAPSHOT)
+  {
+    snapshot = context.m_db->getSnapshot();
+    if (snapshot == nullptr)
+    {
+      frame.commit();
+      beginReply(context);
+      writeError(context, rocksdb::Status::Busy("Can't take a snapshot"));
+      return true;
+    }
+  }
+
+  uint32_t handle = context.m_next_cursor++;
+  Cursor& cursor = context.m_cursors[handle];
+  cursor.reverse = (flags & CURSOR_REVERSE) != 0;
+  cursor.snapshot = snapshot;
+  cursor.ns = context.m_ns;
+  if (snapshot == nullptr)
+    cursor.start.assign(start.data(), start.size());
+  cursor.iter.reset(context.m_db->newIterator(cursorReadOptions(), cursor.ns.get(), cursor.snapshot));
+  seekCursor(cursor, rocksdb::Slice(start.data(), start.size()));
+  cursor.last_used = std::chrono::steady_clock::now();
+  frame.commit();
+
+  uint8_t reply[5] = { STAT_OK };
+  putBE32(reply + 1, handle);
+  beginReply(context);
+  context.m_buffered_socket.write_n(reply, sizeof(reply));
+  return true;
+}
+
+NOINLINE bool doCursorNext(WorkerContext& context)
+{
+  if (context.m_pending_op == OP_CURSOR_NEXT)
+    return continueScan(context);
+
+  uint32_t handle;
+  uint32_t n;
+  FrameReader frame(context.m_buffered_socket, context.m_frame_header);
+  if (!frame.read_u32(handle) || !frame.read_u32(n))
+    return false;
+
+  auto it = context.m_cursors.find(handle);
+  if (it == context.m_cursors.end())
+  {
+    frame.commit();
+    beginReply(context);
+    writeStatus(context, STAT_NOT_FOUND);
+    return true;
+  }
+
+  // Live cursors catch up with the latest writes, then find their place again: just past the
+  // last row they sent (or at their start, if they haven't sent one), so keys written in between
+  // still show up. That goes for a cursor that ran off the end of its range too.
+  Cursor& cursor = it->second;
+  if (cursor.snapshot == nullptr && !cursor.fresh)
+  {
+    TRACE_SPAN("seek", "db");
+    if (!cursor.iter->Refresh().ok())
+      cursor.iter.reset(context.m_db->newIterator(cursorReadOptions(), cursor.ns.get()));
+
+    if (!cursor.sent)
+      seekCursor(cursor, cursor.start);
+    else if (cursor.reverse)
+    {
+      cursor.iter->SeekForPrev(cursor.last_key);
+      if (cursor.iter->Valid() && cursor.iter->key() == cursor.last_key)
+        cursor.iter->Prev();
+    }
+    else
+    {
+      cursor.iter->Seek(cursor.last_key);
+      if (cursor.iter->Valid() && cursor.iter->key() == cursor.last_key)
+        cursor.iter->Next();
+    }
+  }
+
+  cursor.fresh = false;
+  cursor.last_used = std::chrono::steady_clock::now();
+  context.m_scan_cursor = &cursor;
+  return startScan(context, frame, OP_CURSOR_NEXT, cursor.iter.get(), cursor.reverse, n);
+}
+
+NOINLINE bool doCursorClose(WorkerContext& context)
+{
+  uint32_t handle;
+  FrameReader frame(context.m_buffered_socket, context.m_frame_header);
+  if (!frame.read_u32(handle))
+    return false;
+
+  frame.commit();
+  beginReply(context);
+
+  auto it = context.m_cursors.find(handle);
+  if (it == context.m_cursors.end())
+  {
+    writeStatus(context, STAT_NOT_FOUND);
+    return true;
+  }
+
+  context.dropCursor(it);
+  writeStatus(context, STAT_OK);
+  return true;
+}
+
+// Close the connection's cursors that nobody has paged through for --cursor-idle-timeout. The one
+// a paused page is streaming from stays.
+void reapCursors(WorkerContext& context, std::chrono::steady_clock::time_point now)
+{
+  for (auto it = context.m_cursors.begin(); it != context.m_cursors.end(); )
+  {
+    auto next = std::next(it);
+    if (&it->second != context.m_scan_cursor && now - it->second.last_used > g_cursor_idle_timeout)
+      context.dropCursor(it);
+
+    it = next;
+  }
+}
+
+// Creating or dropping a column family writes to the DB's manifest, on the event loop thread
+NOINLINE bool doCreateNamespace(WorkerContext& context)
+{
+  uint32_t nlen;
+  uint32_t slen;
+  FrameReader frame(context.m_buffered_socket, context.m_frame_header);
+  if (!frame.read_u32(nlen) || !frame.read_bytes(nlen, context.m_key) ||
+      !frame.read_u32(slen) || !frame.read_bytes(slen, context.m_value))
+    return false;
+
+  frame.commit();
+  std::shared_ptr<const StorageEngine::Namespace> ns;
+  rocksdb::Status status;
+  {
+    TRACE_SPAN("create_namespace", "db");
+    status = context.m_db->createNamespace(context.m_key, context.m_value, ns);
+  }
+  beginReply(context);
+
+  if (!status.ok())
+  {
+    writeError(context, status);
+    return true;
+  }
+
+  uint8_t reply[5] = { STAT_OK };
+  putBE32(reply + 1, ns->id);
+  context.m_buffered_socket.write_n(reply, sizeof(reply));
+  return true;
+}
+
+// Requests already running against the namespace finish against it
+NOINLINE bool doDropNamespace(WorkerContext& context)
+{
+  uint32_t id;
+  FrameReader frame(context.m_buffered_socket, context.m_frame_header);
+  if (!frame.read_u32(id))
+    return false;
+
+  frame.commit();
+  rocksdb::Status status;
+  {
+    TRACE_SPAN("drop_namespace", "db");
+    status = context.m_db->dropNamespace(id);
+  }
+  beginReply(context);
+
+  if (status.IsNotFound())
+    writeStatus(context, STAT_NOT_FOUND);
+  else if (!status.ok())
+    writeError(context, status);
+  else
+    writeStatus(context, STAT_OK);
+
+  return true;
+}
+
+// PUT_ONE errors are a bare STAT_ERR; MERGE and PUT_ONE_TTL errors tell the client what went wrong
+void writePutReply(WorkerContext& context, const rocksdb::Status& status, char opcode = OP_PUT_ONE)
+{
+  if (!status.ok() && opcode != OP_PUT_ONE)
+    writeError(context, status);
+  else if (!status.ok())
+  {
+    // return an error opcode
+    char error[] = { STAT_ERR, 0x00 }; // error of 0 length
+    context.m_buffered_socket.write_n(error, sizeof(error));
+  }
+  else
+  {
+    char response[] = { 0x00, 0x00 };
+    context.m_buffered_socket.write_n(response, sizeof(response));
+  }
+}
+
+// PUT_ONE (or MERGE) replies for every request of a tagged batch (ids in m_batch_ids)
+void writePutBatchReplies(WorkerContext& context, const rocksdb::Status& status, char opcode = OP_PUT_ONE)
+{
+  if (!status.ok() && opcode != OP_PUT_ONE)
+  {
+    for (uint32_t id : context.m_batch_ids)
+    {
+      uint8_t header[4];
+      putBE32(header, id);
+      context.m_buffered_socket.write_n(header, sizeof(header));
+      writeError(context, status);
+    }
+    return;
+  }
+
+  // Id + status + zero length per reply
+  constexpr size_t REPLY = 6;
+  size_t count = context.m_batch_ids.size();
+  vector<uint8_t>& replies = context.m_batch_replies;
+  replies.assign(count * REPLY, 0);
+  for (size_t i = 0; i < count; i++)
+  {
+    uint8_t* reply = replies.data() + i * REPLY;
+    putBE32(reply, context.m_batch_ids[i]);
+    reply[4] = status.ok() ? 0x00 : STAT_ERR;
+  }
+
+  context.m_buffered_socket.write_n(replies.data(), replies.size());
+}
+
+// Metrics and tracing: the request is done. It took from the first look at it until its reply
+// was queued (for a coalesced PUT, until it was acked). Every request of a tagged batch is counted
+// at the batch's time.
+void recordRequest(WorkerContext& context)
+{
+  if (context.m_trace_start != 0)
+  {
+    const char* name = opName(context.m_trace_op);
+    Tracer::record(name != nullptr ? name : "unknown", "request", context.m_trace_start, Tracer::now(), "conn", context.m_id);
+    context.m_trace_start = 0;
+  }
+
+  if (g_metrics == nullptr || context.m_timed_op == 0)
+    return;
+
+  uint8_t op = context.m_timed_op;
+  context.m_timed_op = 0;
+
+  uint64_t count = 1;
+  if (context.m_tagged && (op == OP_GET_ONE || op == OP_PUT_ONE || op == OP_MERGE))
+    count = context.m_batch_ids.size();
+
+  auto elapsed = std::chrono::steady_clock::now() - context.m_timed_start;
+  ThreadMetrics& metrics = g_metrics->local();
+  metrics.requests[op].add(count);
+  metrics.latency[op].record(std::chrono::duration_cast<std::chrono::nanoseconds>(elapsed).count(), count);
+}
+
+// The write coalescer is done with this connection's write: reply and unpark it
+void finishCoalescedWrite(WorkerContext& context, const CoalescedWrite& write)
+{
+  context.m_awaiting_commit = false;
+  if (context.m_commit_batch)
+    writePutBatchReplies(context, write.status, write.opcode);
+  else
+  {
+    beginReply(context);
+    writePutReply(context, write.status, write.opcode);
+  }
+
+  recordRequest(context);
+}
+
+// Expiry trailer for a value put in the request's namespace, in out (EXPIRY_TRAILER_MAX bytes).
+// Empty in a namespace without key TTLs, where asking for a TTL is an error.
+rocksdb::Status valueTrailer(WorkerContext& context, uint32_t ttl, char* out, rocksdb::Slice& trailer)
+{
+  trailer = rocksdb::Slice();
+  if (!expiring(context.m_ns.get()))
+    return ttl == 0 ? rocksdb::Status::OK() : rocksdb::Status::NotSupported("No key TTLs in this namespace");
+
+  trailer = rocksdb::Slice(out, expiryTrailer(ttl, out));
+  return rocksdb::Status::OK();
+}
+
+NOINLINE bool doPutOne(WorkerContext& context, char opcode)
+{
+  // Read the TTL (PUT_ONE_TTL), klen, key, vlen and value
+  uint32_t ttl = 0;
+  uint32_t klen;
+  uint32_t vlen;
+  RingSpan<const uint8_t> key;
+  RingSpan<const uint8_t> value;
+  FrameReader frame(context.m_buffered_socket, context.m_frame_header);
+  if ((opcode == OP_PUT_ONE_TTL && !frame.read_u32(ttl)) ||
+      !frame.read_u32(klen) || !frame.read_span(klen, key) ||
+      !frame.read_u32(vlen) || !frame.read_span(vlen, value))
+    return false;
+
+  char trailer_bytes[EXPIRY_TRAILER_MAX];
+  rocksdb::Slice trailer;
+  auto status = valueTrailer(context, ttl, trailer_bytes, trailer);
+
+  // Coalesced writes are acked later, by finishCoalescedWrite()
+  if (status.ok() && g_coalescer != nullptr)
+  {
+    auto write = std::make_unique<CoalescedWrite>();
+    write->ns = context.m_ns;
+    write->opcode = opcode;
+    write->put(key, value, trailer);
+    frame.commit();
+    context.m_commit_batch = false;
+    g_coalescer->submit(context, write.release());
+    return true;
+  }
+
+  rocksdb::WriteOptions write_options;
+  write_options.sync = false;
+#ifdef DISABLE_WAL
+  write_options.disableWAL = true;
+#endif
+
+  // Write the key and value to the DB straight from the receive buffer (DB::Put only takes whole
+  // Slices; this is what it would do with them anyway)
+  rocksdb::WriteBatch batch;
+  if (status.ok())
+    status = batch.Put(StorageEngine::columnFamily(context.m_ns.get()), SpanSlices(key).parts(), SpanSlices(value, trailer).parts());
+  if (status.ok())
+  {
+    TRACE_SPAN("write", "db");
+    status = context.m_db->write(write_options, &batch);
+  }
+  invalidateHotKeys(batch);
+  frame.commit();
+  beginReply(context);
+  writePutReply(context, status, opcode);
+  return true;
+}
+
+// Merge operator of the request's namespace, null if it has none
+const ValueMergeOperator* mergeOperator(WorkerContext& context)
+{
+  if (!context.m_ns)
+    return g_merge_operator.get();
+
+  // Namespaces only ever get theirs from configureNamespace
+  return static_cast<const ValueMergeOperator*>(context.m_ns->merge_operator.get());
+}
+
+// Turn a MERGE operand into what gets written, or say why it can't be
+rocksdb::Status encodeOperand(WorkerContext& context, const rocksdb::Slice& operand, string& out)
+{
+  const ValueMergeOperator* merge = mergeOperator(context);
+  if (merge == nullptr)
+    return rocksdb::Status::NotSupported("No merge operator for this namespace");
+  if (!merge->encodeOperand(operand, out))
+    return rocksdb::Status::InvalidArgument("Bad operand for merge operator", merge->Name());
+
+  return rocksdb::Status::OK();
+}
+
+NOINLINE bool doMerge(WorkerContext& context)
+{
+  uint32_t klen;
+  uint32_t vlen;
+  RingSpan<const uint8_t> key;
+  std::string_view operand;
+  FrameReader frame(context.m_buffered_socket, context.m_frame_header);
+  if (!frame.read_u32(klen) || !frame.read_span(klen, key) ||
+      !frame.read_u32(vlen) || !frame.read_view(vlen, context.m_value, operand))
+    return false;
+
+  string encoded;
+  auto status = encodeOperand(context, rocksdb::Slice(operand.data(), operand.size()), encoded);
+  if (status.ok() && g_coalescer != nullptr)
+  {
+    auto write = std::make_unique<CoalescedWrite>();
+    write->ns = context.m_ns;
+    write->merge = true;
+    write->opcode = OP_MERGE;
+    write->put(key, encoded);
+    frame.commit();
+    context.m_commit_batch = false;
+    g_coalescer->submit(context, write.release());
+    return true;
+  }
+
+  rocksdb::WriteOptions write_options;
+  write_options.sync = false;
+#ifdef DISABLE_WAL
+  write_options.disableWAL = true;
+#endif
+
+  rocksdb::WriteBatch batch;
+  if (status.ok())
+  {
+    rocksdb::Slice value(encoded);
+    status = batch.Merge(StorageEngine::columnFamily(context.m_ns.get()), SpanSlices(key).parts(), rocksdb::SliceParts(&value, 1));
+  }
+  if (status.ok())
+  {
+    TRACE_SPAN("write", "db");
+    status = context.m_db->write(write_options, &batch);
+  }
+  invalidateHotKeys(batch);
+  frame.commit();
+  beginReply(context);
+  writePutReply(context, status, OP_MERGE);
+  return true;
+}
+
+// A key and the value it has to hold, as CAS and WRITE_IF carry them
+bool readCondition(FrameReader& frame, WorkerContext& context, StorageEngine::Condition& condition)
+{
+  uint32_t klen;
+  uint32_t vlen;
+  if (!frame.read_u32(klen) || !frame.read_bytes(klen, condition.key) || !frame.read_u32(vlen))
+    return false;
+
+  condition.ns = context.m_ns.get();
+  condition.expiring = expiring(condition.ns);
+  condition.exists = vlen != COND_ABSENT;
+  if (!condition.exists)
+  {
+    condition.value.clear();
+    return true;
+  }
+
+  return frame.read_bytes(vlen, condition.value);
+}
+
+// CAS and WRITE_IF. The writes go into the batch straight out of the receive buffer; a merge
+// operand its operator won't take fails the request without writing anything.
+NOINLINE bool doConditionalWrite(WorkerContext& context, char opcode)
+{
+  FrameReader frame(context.m_buffered_socket, context.m_frame_header);
+  rocksdb::ColumnFamilyHandle* cf = StorageEngine::columnFamily(context.m_ns.get());
+  vector<StorageEngine::Condition> conditions;
+  rocksdb::WriteBatch batch;
+  char trailer_bytes[EXPIRY_TRAILER_MAX];
+  rocksdb::Slice trailer;
+  auto status = valueTrailer(context, 0, trailer_bytes, trailer);
+
+  if (opcode == OP_CAS)
+  {
+    uint32_t vlen;
+    RingSpan<const uint8_t> value;
+    conditions.resize(1);
+    if (!readCondition(frame, context, conditions[0]) || !frame.read_u32(vlen) || !frame.read_span(vlen, value))
+      return false;
+
+    rocksdb::Slice key(conditions[0].key);
+    status = batch.Put(cf, rocksdb::SliceParts(&key, 1), SpanSlices(value, trailer).parts());
+  }
+  else
+  {
+    uint32_t count;
+    if (!frame.read_u32(count))
+      return false;
+
+    for (uint32_t i = 0; i < count; i++)
+    {
+      if (!readCondition(frame, context, conditions.emplace_back()))
+        return false;
+    }
+
+    if (!frame.read_u32(count))
+      return false;
+
+    string kind;
+    string encoded;
+    for (uint32_t i = 0; i < count; i++)
+    {
+      uint32_t klen;
+      uint32_t vlen = 0;
+      RingSpan<const uint8_t> key;
+      RingSpan<const uint8_t> value;
+      std::string_view operand;
+      if (!frame.read_bytes(1, kind) || !frame.read_u32(klen) || !frame.read_span(klen, key))
+        return false;
+
+      if (static_cast<uint8_t>(kind[0]) > WRITE_MERGE)
+        throw std::runtime_error("Unknown WRITE_IF write kind");
+      if (kind[0] != WRITE_DELETE && !frame.read_u32(vlen))
+        return false;
+
+      if (kind[0] == WRITE_PUT)
+      {
+        if (!frame.read_span(vlen, value))
+          return false;
+        if (status.ok())
+          status = batch.Put(cf, SpanSlices(key).parts(), SpanSlices(value, trailer).parts());
+      }
+      else if (kind[0] == WRITE_MERGE)
+      {
+        if (!frame.read_view(vlen, context.m_value, operand))
+          return false;
+        if (status.ok())
+          status = encodeOperand(context, rocksdb::Slice(operand.data(), operand.size()), encoded);
+        if (status.ok())
+        {
+          rocksdb::Slice encoded_slice(encoded);
+          status = batch.Merge(cf, SpanSlices(key).parts(), rocksdb::SliceParts(&encoded_slice, 1));
+        }
+      }
+      else if (status.ok())
+        status = batch.Delete(cf, SpanSlices(key).parts());
+    }
+  }
+
+  rocksdb::WriteOptions write_options;
+  write_options.sync = false;
+#ifdef DISABLE_WAL
+  write_options.disableWAL = true;
+#endif
+
+  size_t failed = 0;
+  if (status.ok())
+  {
+    TRACE_SPAN("write", "db");
+    status = context.m_db->writeIf(write_options, conditions, &batch, failed);
+  }
+  invalidateHotKeys(batch);
+  frame.commit();
+  beginReply(context);
+
+  if (status.IsAborted())
+  {
+    uint8_t conflict[5] = { STAT_CONFLICT };
+    putBE32(conflict + 1, static_cast<uint32_t>(failed));
+    context.m_buffered_socket.write_n(conflict, sizeof(conflict));
+  }
+  else if (!status.ok())
+    writeError(context, status);
+  else
+    writeStatus(context, STAT_OK);
+
+  return true;
+}
+
+// Close off the current PUT_MULTI batch in the reply: status, pair count and, for a failure,
+// the error text
+void recordPutBatch(WorkerContext& context, const rocksdb::Status& status)
+{
+  vector<uint8_t>& out = context.m_put_results;
+  size_t at = out.size();
+  out.resize(at + 5);
+  out[at] = status.ok() ? STAT_OK : STAT_ERR;
+  putBE32(out.data() + at + 1, context.m_put_pairs);
+
+  if (!status.ok())
+  {
+    string error = status.ToString();
+    size_t errorLength = MIN(error.size(), size_t(0xFFFF));
+    out.resize(at + 7);
+    putBE16(out.data() + at + 5, static_cast<uint16_t>(errorLength));
+    out.insert(out.end(), error.begin(), error.begin() + errorLength);
+  }
+
+  context.m_put_records++;
+  context.m_put_pairs = 0;
+}
+
+void commitPutBatch(WorkerContext& context)
+{
+  if (context.m_put_pairs == 0)
+    return;
+
+  rocksdb::WriteOptions write_options;
+  write_options.sync = false;
+#ifdef DISABLE_WAL
+  write_options.disableWAL = true;
+#endif
+
+  rocksdb::Status status;
+  {
+    TRACE_SPAN("write", "db");
+    status = context.m_db->write(write_options, context.m_put_batch.get());
+  }
+  invalidateHotKeys(*context.m_put_batch);
+  context.m_put_batch->Clear();
+
+  // A failed batch is recorded at the end of the stream, together with everything skipped after it
+  if (!status.ok())
+    context.m_put_error = status;
+  else
+    recordPutBatch(context, status);
+}
+
+// Stream of KV pairs terminated by a zero key length. Pairs are added to a WriteBatch straight
+// out of the receive buffer, and the batch is committed (atomically, one WAL write) every
+// g_put_batch_bytes, so the stream can be far larger than the receive buffer.
+//
+// The reply lists every batch: a record count, then per batch a status and pair count (plus
+// error length and text on failure). Once a batch fails the rest of the stream is read but not
+// applied, and counts towards the failed record.
+NOINLINE bool doPutMulti(WorkerContext& context, char opcode)
+{
+  if (context.m_pending_op != OP_PUT_MULTI)
+  {
+    // PUT_MULTI_TTL's TTL comes before the stream, and every value gets the same expiry
+    uint32_t ttl = 0;
+    FrameReader header(context.m_buffered_socket, context.m_frame_header);
+    if (opcode == OP_PUT_MULTI_TTL && !header.read_u32(ttl))
+      return false;
+
+    char trailer_bytes[EXPIRY_TRAILER_MAX];
+    rocksdb::Slice trailer;
+    header.commit();
+    context.m_pending_op = OP_PUT_MULTI;
+    context.m_put_batch = std::make_unique<rocksdb::WriteBatch>();
+    context.m_put_pairs = 0;
+    context.m_put_records = 0;
+    context.m_put_results.clear();
+    context.m_put_error = valueTrailer(context, ttl, trailer_bytes, trailer);
+    context.m_put_trailer.assign(trailer.data(), trailer.size());
+  }
+
+  while (true)
+  {
+    uint32_t klen;
+    uint32_t vlen;
+    RingSpan<const uint8_t> key;
+    RingSpan<const uint8_t> value;
+    FrameReader frame(context.m_buffered_socket);
+    if (!frame.read_u32(klen))
+      return false;
+
+    if (klen == 0)
+    {
+      // End of stream. Commit the tail and report.
+      frame.commit();
+      if (context.m_put_error.ok())
+        commitPutBatch(context);
+      if (!context.m_put_error.ok())
+        recordPutBatch(context, context.m_put_error);
+
+      context.m_put_batch.reset();
+      context.m_pending_op = 0;
+      beginReply(context);
+
+      uint8_t header[4];
+      putBE32(header, context.m_put_records);
+
+      struct iovec iov[2];
+      iov[0].iov_base = header;
+      iov[0].iov_len = sizeof(header);
+      iov[1].iov_base = context.m_put_results.data();
+      iov[1].iov_len = context.m_put_results.size();
+      context.m_buffered_socket.write_iov(iov, 2);
+      return true;
+    }
+
+    if (!frame.read_span(klen, key) || !frame.read_u32(vlen) || !frame.read_span(vlen, value))
+      return false;
+
+    if (context.m_put_error.ok())
+    {
+      auto status = context.m_put_batch->Put(StorageEngine::columnFamily(context.m_ns.get()), SpanSlices(key).parts(),
+        SpanSlices(value, context.m_put_trailer).parts());
+      if (!status.ok())
+        context.m_put_error = status;
+    }
+    frame.commit();
+    context.m_put_pairs++;
+
+    if (context.m_put_error.ok() && context.m_put_batch->GetDataSize() >= g_put_batch_bytes)
+      commitPutBatch(context);
+  }
+}
+
+/**
+ * Stream of sorted KV pairs terminated by a zero key length, handed to the engine's bulk loader
+ * (RocksDB writes SST files and ingests them straight into the bottom of the LSM, bypassing the
+ * memtable and WAL; LMDB commits them in one transaction). Nothing is visible until the whole
+ * stream has been loaded. Replies with STAT_OK, or an error if the keys weren't sorted or the
+ * load failed.
+ *
+ * Ingestion runs on the event loop thread, so the loop's other connections wait for it.
+ */
+NOINLINE bool doPutBulk(WorkerContext& context)
+{
+  if (context.m_pending_op != OP_BULK_PUT)
+  {
+    context.m_buffered_socket.consume(context.m_frame_header);
+    context.m_pending_op = OP_BULK_PUT;
+    context.m_bulk = context.m_db->newBulkLoad(context.m_ns, context.m_id);
+  }
+
+  // Values that need a trailer are stitched together with it here
+  bool expires = expiring(context.m_ns.get());
+  string stored;
+  while (true)
+  {
+    uint32_t klen;
+    uint32_t vlen;
+    std::string_view key;
+    std::string_view value;
+    FrameReader frame(context.m_buffered_socket);
+    if (!frame.read_u32(klen))
+      return false;
+
+    if (klen == 0)
+    {
+      frame.commit();
+      auto status = context.m_bulk->finish();
+      context.m_bulk.reset();
+      if (g_hot_cache != nullptr && !context.m_ns)
+        g_hot_cache->clear(); // too many keys to drop one by one
+      context.m_pending_op = 0;
+      beginReply(context);
+
+      if (!status.ok())
+      {
+        writeError(context, status);
+        return true;
+      }
+
+      char response[] = { STAT_OK };
+      context.m_buffered_socket.write_n(response, sizeof(response));
+      return true;
+    }
+
+    if (!frame.read_view(klen, context.m_key, key) || !frame.read_u32(vlen) || !frame.read_view(vlen, context.m_value, value))
+      return false;
+
+    if (expires)
+    {
+      char trailer[EXPIRY_TRAILER_MAX];
+      stored.assign(value.data(), value.size());
+      stored.append(trailer, expiryTrailer(0, trailer));
+      value = stored;
+    }
+
+    context.m_bulk->add(rocksdb::Slice(key.data(), key.size()), rocksdb::Slice(value.data(), value.size()));
+    frame.commit();
+  }
+}
+
+// Collect the run of complete tagged frames with the given opcode, in the current request's
+// namespace, at the head of the receive buffer (up to PIPELINE_BATCH_MAX). Ids land in
+// m_batch_ids; the key (and for PUTs the value) are lent to the callback in place, before the
+// frame is consumed. Returns how many frames were taken.
+template <typename OnFrame>
+size_t collectTagged(WorkerContext& context, char opcode, bool with_value, OnFrame&& on_frame)
+{
+  BufferedSocket& socket = context.m_buffered_socket;
+  const char tagged = opcode | OP_FLAG_TAGGED;
+  const uint32_t ns = context.m_ns ? context.m_ns->id : 0;
+  size_t count = 0;
+
+  context.m_batch_ids.clear();
+  while (count < PIPELINE_BATCH_MAX)
+  {
+    char next;
+    if (!socket.peek(0, &next, 1) || static_cast<char>(next & ~OP_FLAG_NAMESPACE) != tagged)
+      break;
+
+    uint32_t id;
+    uint32_t frame_ns = 0;
+    uint32_t klen;
+    uint32_t vlen;
+    RingSpan<const uint8_t> key;
+    RingSpan<const uint8_t> value = { nullptr, 0, nullptr, 0 };
+    FrameReader frame(socket, 1);
+    if (!frame.read_u32(id) || ((next & OP_FLAG_NAMESPACE) && !frame.read_u32(frame_ns)) || frame_ns != ns ||
+        !frame.read_u32(klen) || !frame.read_span(klen, key))
+      break;
+    if (with_value && (!frame.read_u32(vlen) || !frame.read_span(vlen, value)))
+      break;
+
+    context.m_batch_ids.push_back(id);
+    on_frame(count, key, value);
+    frame.commit();
+    count++;
+  }
+
+  return count;
+}
+
+// Point lookups for m_batch_keys[0..count) done as one MultiGet. The keys are sorted first so
+// RocksDB walks each memtable/SST once; slot i of the result belongs to m_batch_keys[order[i]].
+struct LookupBatch
+{
+  vector<uint32_t> order;
+  vector<uint64_t> tickets; // hot cache tickets of the misses (slots past the hits), to fill it in with
+  vector<rocksdb::PinnableSlice> values;
+  vector<rocksdb::Status> statuses;
+  vector<string> errors;
+};
+
+void sortedMultiGet(WorkerContext& context, size_t count, LookupBatch& batch, bool use_hot_cache = false)
+{
+  batch.order.resize(count);
+  for (size_t i = 0; i < count; i++)
+    batch.order[i] = static_cast<uint32_t>(i);
+  std::sort(batch.order.begin(), batch.order.end(), [&context](uint32_t a, uint32_t b) {
+    return context.m_batch_keys[a] < context.m_batch_keys[b];
+  });
+
+  batch.values = vector<rocksdb::PinnableSlice>(count);
+  batch.statuses.assign(count, rocksdb::Status());
+  batch.errors.clear();
+  batch.errors.reserve(count); // reply iovecs point into these strings, so no reallocation
+
+  // Keys the hot cache has (it holds values as stored, expiry trailer and all) are answered from
+  // it and moved to the front; only the rest, still in key order, go to MultiGet
+  size_t hits = 0;
+  bool cached = use_hot_cache && g_hot_cache != nullptr && !context.m_ns;
+  if (cached)
+  {
+    vector<uint32_t> missed;
+    batch.tickets.clear();
+    for (size_t i = 0; i < count; i++)
+    {
+      uint32_t request = batch.order[i];
+      uint64_t ticket = 0;
+      if (g_hot_cache->lookup(context.m_batch_keys[request], context.m_value, ticket))
+      {
+        batch.values[hits].PinSelf(context.m_value);
+        batch.order[hits++] = request; // only overwrites slots already looked at
+      }
+      else
+      {
+        missed.push_back(request);
+        batch.tickets.push_back(ticket);
+      }
+    }
+
+    std::copy(missed.begin(), missed.end(), batch.order.begin() + hits);
+  }
+
+  size_t misses = count - hits;
+  vector<rocksdb::Slice> keys(misses);
+  for (size_t i = 0; i < misses; i++)
+    keys[i] = context.m_batch_keys[batch.order[hits + i]];
+
+  rocksdb::ReadOptions read_options;
+  read_options.fill_cache = g_fill_cache;
+  read_options.total_order_seek = false;
+#if ROCKSDB_MAJOR >= 7
+  read_options.async_io = true; // overlaps the SST reads when RocksDB was built with coroutine support
+#endif
+
+  if (misses > 0)
+  {
+    TRACE_SPAN("multi_get", "db");
+    context.m_db->multiGet(read_options, context.m_ns.get(), misses, keys.data(), batch.values.data() + hits,
+      batch.statuses.data() + hits);
+  }
+
+  if (cached)
+  {
+    for (size_t i = hits; i < count; i++)
+    {
+      if (batch.statuses[i].ok())
+        g_hot_cache->insert(context.m_batch_keys[batch.order[i]], batch.values[i].ToStringView(), batch.tickets[i - hits]);
+    }
+  }
+
+  if (!expiring(context.m_ns.get()))
+    return;
+
+  uint32_t now = expiryNow();
+  for (size_t i = 0; i < count; i++)
+  {
+    if (batch.statuses[i].ok() && !stripExpiry(batch.values[i], now))
+    {
+      batch.values[i].Reset();
+      batch.statuses[i] = rocksdb::Status::NotFound();
+    }
+  }
+}
+
+// Gather the GET_ONE style reply for result slot i: status, then value length and value (or
+// error length and text). The first `tag` bytes of `header` already hold the request id, if any,
+// and 5 more are free after them.
+void gatherLookup(LookupBatch& batch, size_t i, uint8_t* header, size_t tag, vector<struct iovec>& iov)
+{
+  const rocksdb::Status& status = batch.statuses[i];
+  uint8_t* reply = header + tag;
+  if (status.ok())
+  {
+    reply[0] = STAT_OK;
+    putBE32(reply + 1, static_cast<uint32_t>(batch.values[i].size()));
+    iov.push_back({ header, tag + 5 });
+    iov.push_back({ const_cast<char*>(batch.values[i].data()), batch.values[i].size() });
+  }
+  else if (status.IsNotFound())
+  {
+    reply[0] = STAT_NOT_FOUND;
+    iov.push_back({ header, tag + 1 });
+  }
+  else
+  {
+    batch.errors.push_back(status.ToString());
+    string& error = batch.errors.back();
+    size_t errorLength = MIN(error.size(), size_t(0xFFFF));
+    reply[0] = STAT_ERR;
+    putBE16(reply + 1, static_cast<uint16_t>(errorLength));
+    iov.push_back({ header, tag + 3 });
+    iov.push_back({ error.data(), errorLength });
+  }
+}
+
+// Back-to-back tagged GETs are answered by the hot cache where it can, and the rest by a single
+// MultiGet. The replies go back in that order (cache hits, then the rest in key order) rather than
+// the order they were asked, all of them in one gathered write.
+NOINLINE bool doGetOneBatch(WorkerContext& context)
+{
+  // MultiGet sorts the keys, so they are copied out
+  size_t count = collectTagged(context, OP_GET_ONE, false, [&context](size_t i, const RingSpan<const uint8_t>& key, const RingSpan<const uint8_t>&) {
+    if (context.m_batch_keys.size() == i)
+      context.m_batch_keys.emplace_back();
+
+    string& out = context.m_batch_keys[i];
+    out.assign(reinterpret_cast<const char*>(key.first), key.first_len);
+    out.append(reinterpret_cast<const char*>(key.second), key.second_len);
+  });
+  if (count == 0)
+    return false;
+
+  LookupBatch batch;
+  sortedMultiGet(context, count, batch, true);
+
+  // Request id + status + length per reply
+  constexpr size_t HEADER = 9;
+  vector<uint8_t>& headers = context.m_batch_replies;
+  headers.resize(count * HEADER);
+  vector<struct iovec> iov;
+  iov.reserve(count * 2);
+
+  for (size_t i = 0; i < count; i++)
+  {
+    uint8_t* header = headers.data() + i * HEADER;
+    putBE32(header, context.m_batch_ids[batch.order[i]]);
+    gatherLookup(batch, i, header, 4, iov);
+  }
+
+  context.m_buffered_socket.write_iov(iov.data(), static_cast<int>(iov.size()));
+  return true;
+}
+
+// Count followed by that many length-prefixed keys. Every key gets a GET_ONE style reply, in the
+// order asked, and the whole lot goes out as one gathered write.
+NOINLINE bool doMultiGet(WorkerContext& context)
+{
+  uint32_t count;
+  FrameReader frame(context.m_buffered_socket, context.m_frame_header);
+  if (!frame.read_u32(count))
+    return false;
+
+  if (count > MULTI_GET_MAX_KEYS)
+    throw std::runtime_error("Too many keys in MULTI_GET");
+
+  // A big MULTI_GET arrives over many reads. Walk the lengths (lending the keys, not copying
+  // them) until the whole frame is here, and only then copy the keys out for sorting.
+  FrameReader probe = frame;
+  for (uint32_t i = 0; i < count; i++)
+  {
+    uint32_t klen;
+    RingSpan<const uint8_t> key;
+    if (!probe.read_u32(klen) || !probe.read_span(klen, key))
+      return false;
+  }
+
+  if (context.m_batch_keys.size() < count)
+    context.m_batch_keys.resize(count);
+
+  for (uint32_t i = 0; i < count; i++)
+  {
+    uint32_t klen;
+    frame.read_u32(klen);
+    frame.read_bytes(klen, context.m_batch_keys[i]);
+  }
+  frame.commit();
+
+  LookupBatch batch;
+  sortedMultiGet(context, count, batch);
+
+  // Result slot of each key, in request order
+  vector<uint32_t> slot(count);
+  for (uint32_t i = 0; i < count; i++)
+    slot[batch.order[i]] = i;
+
+  vector<uint8_t>& headers = context.m_batch_replies;
+  headers.resize(4 + size_t(count) * 5);
+  vector<struct iovec> iov;
+  iov.reserve(1 + size_t(count) * 2);
+
+  if (context.m_tagged)
+  {
+    putBE32(headers.data(), context.m_request_id);
+    iov.push_back({ headers.data(), 4 });
+  }
+
+  for (uint32_t i = 0; i < count; i++)
+    gatherLookup(batch, slot[i], headers.data() + 4 + size_t(i) * 5, 0, iov);
+
+  context.m_buffered_socket.write_iov(iov.data(), static_cast<int>(iov.size()));
+  return true;
+}
+
+// Back-to-back tagged PUTs (or MERGEs) are committed as one WriteBatch, so the burst costs one
+// WAL append. Every request in the batch gets the batch's status, so one bad merge operand fails
+// the burst it came in with.
+NOINLINE bool doPutOneBatch(WorkerContext& context, char opcode)
+{
+  rocksdb::WriteBatch batch;
+  rocksdb::ColumnFamilyHandle* column_family = StorageEngine::columnFamily(context.m_ns.get());
+  bool merge = opcode == OP_MERGE;
+  std::unique_ptr<CoalescedWrite> write;
+  if (g_coalescer != nullptr)
+  {
+    write = std::make_unique<CoalescedWrite>();
+    write->ns = context.m_ns;
+    write->merge = merge;
+    write->opcode = opcode;
+  }
+
+  char trailer_bytes[EXPIRY_TRAILER_MAX];
+  rocksdb::Slice trailer;
+  auto status = valueTrailer(context, 0, trailer_bytes, trailer);
+  string operand;
+  size_t count = collectTagged(context, opcode, true, [&](size_t, const RingSpan<const uint8_t>& key, const RingSpan<const uint8_t>& value) {
+    // Once an entry is refused the whole burst fails; the rest is only consumed
+    if (!status.ok())
+      return;
+
+    if (merge)
+    {
+      // Operands are rewritten, so they are copied out
+      context.m_value.assign(reinterpret_cast<const char*>(value.first), value.first_len);
+      context.m_value.append(reinterpret_cast<const char*>(value.second), value.second_len);
+      status = encodeOperand(context, context.m_value, operand);
+      if (!status.ok())
+        return;
+
+      if (write)
+        write->put(key, operand);
+      else
+      {
+        rocksdb::Slice slice(operand);
+        status = batch.Merge(column_family, SpanSlices(key).parts(), rocksdb::SliceParts(&slice, 1));
+      }
+    }
+    else if (write)
+      write->put(key, value, trailer);
+    else
+      status = batch.Put(column_family, SpanSlices(key).parts(), SpanSlices(value, trailer).parts());
+  });
+  if (count == 0)
+    return false;
+
+  if (!status.ok())
+  {
+    writePutBatchReplies(context, status, opcode);
+    return true;
+  }
+
+  if (write)
+  {
+    context.m_commit_batch = true;
+    g_coalescer->submit(context, write.release());
+    return true;
+  }
+
+  rocksdb::WriteOptions write_options;
+  write_options.sync = false;
+#ifdef DISABLE_WAL
+  write_options.disableWAL = true;
+#endif
+
+  {
+    TRACE_SPAN("write", "db");
+    status = context.m_db->write(write_options, &batch);
+  }
+  invalidateHotKeys(batch);
+  writePutBatchReplies(context, status, opcode);
+  return true;
+}
+
+// Tracing: a sampled request that had to wait for the rest of its frame gets a span for the
+// wait, up to the call (starting at `entry`) that found the frame complete
+void traceFrameWait(WorkerContext& context, uint64_t entry, bool progress)
+{
+  if (!progress && context.m_pending_op == 0 && !context.m_awaiting_commit)
+    context.m_trace_waiting = true;
+  else if (context.m_trace_waiting)
+  {
+    Tracer::record("read", "socket", context.m_trace_start, entry);
+    context.m_trace_waiting = false;
+  }
+}
+
+bool dispatchRequest(WorkerContext& context)
+{
+  BufferedSocket& socket = context.m_buffered_socket;
+
+  // Nothing else runs until the last write is acked
+  if (context.m_awaiting_commit)
+    return false;
+
+  // A streaming scan still takes the control frames queued up behind it
+  if (isScanOp(context.m_pending_op))
+  {
+    while (doScanControl(context)) { }
+  }
+
+  // get opcode
+  char opcode = context.m_pending_op;
+  if (opcode == 0)
+  {
+    if (!socket.peek(0, &opcode, 1))
+      return false;
+
+    // Timed from here, even if the rest of the frame is still on its way
+    uint8_t base = static_cast<uint8_t>(opcode & ~(OP_FLAG_TAGGED | OP_FLAG_NAMESPACE));
+    if (g_metrics != nullptr && context.m_timed_op == 0 && base < OP_SLOTS)
+    {
+      context.m_timed_op = base;
+      context.m_timed_start = std::chrono::steady_clock::now();
+    }
+
+    if (context.m_trace_start == 0 && Tracer::sample())
+    {
+      context.m_trace_start = Tracer::now();
+      context.m_trace_op = base;
+      Tracer::setActive(true);
+    }
+
+    context.m_tagged = (opcode & OP_FLAG_TAGGED) != 0;
+    context.m_frame_header = 1;
+    if (context.m_tagged)
+    {
+      uint32_t id;
+      if (!socket.peek(1, &id, sizeof(id)))
+        return false;
+
+      context.m_request_id = fromNet32(id);
+      context.m_frame_header += sizeof(id);
+      opcode &= ~OP_FLAG_TAGGED;
+
+      // This client pipelines, so hold replies until the whole burst has been executed
+      socket.cork();
+    }
+
+    context.m_ns.reset();
+    if (opcode & OP_FLAG_NAMESPACE)
+    {
+      uint32_t id;
+      if (!socket.peek(context.m_frame_header, &id, sizeof(id)))
+        return false;
+
+      context.m_frame_header += sizeof(id);
+      opcode &= ~OP_FLAG_NAMESPACE;
+      if (opcode == OP_SCAN_CREDIT || opcode == OP_SCAN_CANCEL || opcode == OP_SCAN_HINT)
+        throw std::runtime_error("Scan control frames can't be namespaced");
+
+      if (fromNet32(id) != 0)
+      {
+        context.m_ns = context.m_db->findNamespace(fromNet32(id));
+        if (!context.m_ns)
+          throw std::runtime_error("Unknown namespace");
+      }
+    }
+
+    if (context.m_tagged && opcode == OP_GET_ONE)
+      return doGetOneBatch(context);
+    if (context.m_tagged && (opcode == OP_PUT_ONE || opcode == OP_MERGE))
+      return doPutOneBatch(context, opcode);
+  }
+
+  switch (opcode)
+  {
+    case OP_GET_ONE: // GET one
+      return doGetOne(context);
+    case OP_GET_N: // GET n
+    case OP_GET_N_REV:
+      return doGetN(context, opcode);
+    case OP_GET_BETWEEN: // GET between
+    case OP_GET_BETWEEN_REV:
+      return doGetBetween(context, opcode);
+    case OP_GET_PREFIX: // GET keys starting with a prefix
+    case OP_GET_PREFIX_REV:
+      return doGetPrefix(context, opcode);
+    case OP_CURSOR_OPEN:
+      return doCursorOpen(context);
+    case OP_CURSOR_NEXT:
+      return doCursorNext(context);
+    case OP_CURSOR_CLOSE:
+      return doCursorClose(context);
+    case OP_PUT_ONE: // PUT one
+    case OP_PUT_ONE_TTL:
+      return doPutOne(context, opcode);
+    case OP_MERGE:
+      return doMerge(context);
+    case OP_CAS:
+    case OP_WRITE_IF:
+      return doConditionalWrite(context, opcode);
+    case OP_PUT_MULTI: // PUT n
+    case OP_PUT_MULTI_TTL:
+      return doPutMulti(context, opcode);
+    case OP_BULK_PUT: // stream sorted pairs into an SST file and ingest it
+      return doPutBulk(context);
+    case OP_MULTI_GET: // GET a list of keys
+      return doMultiGet(context);
+    case OP_CACHE_STATS:
+      return doCacheStats(context);
+    case OP_TRACE_DUMP:
+      return doTraceDump(context);
+    case OP_CREATE_NAMESPACE:
+      return doCreateNamespace(context);
+    case OP_DROP_NAMESPACE:
+      return doDropNamespace(context);
+    case OP_SCAN_CREDIT:
+    case OP_SCAN_CANCEL:
+    case OP_SCAN_HINT:
+      if (context.m_tagged)
+        throw std::runtime_error("Scan control frames can't be tagged");
+      return doScanControl(context);
+    default:
+      throw std::runtime_error("Unknown opcode"); // Something is awry, drop the connection
+  }
+}
+
+// Runs (or resumes) one request against the buffered input. Returns false when it can't make
+// progress until the socket is readable or writable again.
+bool handleRequest(WorkerContext& context)
+{
+  if (g_metrics == nullptr && !Tracer::enabled())
+    return dispatchRequest(context);
+
+  // A sampled request owns the thread's spans while it runs
+  uint64_t entry = context.m_trace_start != 0 ? Tracer::now() : 0;
+  Tracer::setActive(context.m_trace_start != 0);
+
+  bool progress;
+  try
+  {
+    progress = dispatchRequest(context);
+  }
+  catch (const std::exception&)
+  {
+    Tracer::setActive(false);
+    if (g_metrics != nullptr && context.m_timed_op != 0)
+      g_metrics->local().failures[context.m_timed_op].add(1);
+    throw;
+  }
+
+  Tracer::setActive(false);
+  if (context.m_trace_start != 0)
+    traceFrameWait(context, entry, progress);
+
+  // A coalesced PUT is only done once it is acked
+  if (progress && !context.m_awaiting_commit)
+    recordRequest(context);
+  return progress;
+}
+
+// An event loop runs on its own thread and owns every connection handed to it, so connection count
+// no longer dictates thread count. Connections are keyed by a 64-bit id (carried in the epoll
+// event / io_uring user data) rather than the fd, so a recycled fd can never be mistaken for the
+// connection that used to own it.
+class EventLoop
+{
+protected:
+  StorageEngine* m_db;
+  int m_wakeup;
+  uint64_t m_next_id;
+
+  std::mutex m_incoming_mutex;
+  vector<tuple<UnixSocket, struct sockaddr_un>> m_incoming;
+
+  unordered_map<uint64_t, std::unique_ptr<WorkerContext>> m_connections;
+
+  // Acks from the write coalescer, waiting to be handed to their connections
+  MpscQueue<CoalescedWrite> m_commits;
+
+  std::chrono::steady_clock::time_point m_next_reap;
+
+  // Whether the loop is due for a sweep of its connections' idle cursors (about once a second)
+  bool reapDue(std::chrono::steady_clock::time_point now)
+  {
+    if (now < m_next_reap)
+      return false;
+
+    m_next_reap = now + std::chrono::seconds(1);
+    return true;
+  }
+
+  // Metrics: how many bytes wait in this loop's receive rings, sampled at each sweep
+  void sampleRings()
+  {
+    if (g_metrics == nullptr)
+      return;
+
+    int64_t buffered = 0;
+    for (auto& [id, context] : m_connections)
+      buffered += context->m_buffered_socket.buffered();
+    g_metrics->local().ring_buffered.set(buffered);
+  }
+
+  vector<tuple<UnixSocket, struct sockaddr_un>> takeIncoming()
+  {
+    vector<tuple<UnixSocket, struct sockaddr_un>> incoming;
+    std::lock_guard<std::mutex> lock(m_incoming_mutex);
+    incoming.swap(m_incoming);
+    return incoming;
+  }
+
+public:
+  EventLoop(const EventLoop&) = delete;
+  EventLoop& operator=(const EventLoop&) = delete;
+
+  EventLoop(StorageEngine* db) :
+    m_db(db),
+    m_wakeup(eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC)),
+    m_next_id(1)
+  {
+    if (m_wakeup == -1)
+      throw std::runtime_error("Failed to create event loop wakeup");
+  }
+
+  virtual ~EventLoop()
+  {
+    while (CoalescedWrite* write = m_commits.pop())
+      delete write;
+
+    close(m_wakeup);
+  }
+
+  // Interrupt the loop's wait. Safe from any thread.
+  void wake()
+  {
+    uint64_t one = 1;
+    if (write(m_wakeup, &one, sizeof(one)) < 0)
+      cerr << "Error waking event loop: " << strerror(errno) << endl;
+  }
+
+  // Hand a freshly accepted connection to this loop. Called from the acceptor thread.
+  void adopt(UnixSocket socket, const struct sockaddr_un& addr)
+  {
+    {
+      std::lock_guard<std::mutex> lock(m_incoming_mutex);
+      m_incoming.emplace_back(socket, addr);
+    }
+
+    wake();
+  }
+
+  // Queue an ack from the write coalescer thread; it wakes the loop once per group
+  void postCommit(CoalescedWrite* write)
+  {
+    m_commits.push(write);
+  }
+
+  // Thread body. Returns once g_stop is set.
+  virtual void run() = 0;
+};
+
+// Edge-triggered epoll reactor. Every connection is registered for both directions once; the
+// service loop reads until EAGAIN and flushes until EAGAIN, so the edges always re-arm.
+class EpollLoop : public EventLoop
+{
+private:
+  static constexpr uint64_t WAKEUP_ID = 0;
+  static constexpr int MAX_EVENTS = 256;
+
+  int m_epoll;
+
+  // Connections that ran out of budget with work left; serviced again before sleeping
+  std::deque<uint64_t> m_ready;
+
+  void adoptIncoming()
+  {
+    uint64_t counter;
+    while (read(m_wakeup, &counter, sizeof(counter)) > 0) { }
+
+    for (auto& [socket, addr] : takeIncoming())
+    {
+      uint64_t id = m_next_id++;
+      auto context = std::make_unique<WorkerContext>(id, socket, addr, m_db, true);
+      context->m_loop = this;
+
+      // Anything that arrived before registration is covered: EPOLL_CTL_ADD reports the
+      // current readiness even in edge-triggered mode.
+      struct epoll_event event;
+      event.events = EPOLLIN | EPOLLOUT | EPOLLRDHUP | EPOLLET;
+      event.data.u64 = id;
+      if (epoll_ctl(m_epoll, EPOLL_CTL_ADD, socket, &event) == -1)
+      {
+        cerr << "Error registering connection: " << strerror(errno) << endl;
+        continue; // context closes the socket
+      }
+
+      m_connections.emplace(id, std::move(context));
+    }
+  }
+
+  // Read, execute and reply until the socket runs dry. Returns false if the connection is done.
+  bool service(WorkerContext& context)
+  {
+    BufferedSocket& socket = context.m_buffered_socket;
+
+    for (int round = 0; round < SERVICE_BUDGET; round++)
+    {
+      // Execute everything already buffered, unless the peer is behind on reading replies
+      while (!socket.congested() && handleRequest(context)) { }
+
+      if (socket.congested())
+      {
+        if (!socket.flush())
+          return true; // EPOLLOUT resumes us
+
+        continue; // drained, pick the paused request back up
+      }
+
+      // Replies to the whole batch go out together (a pipelining client's are corked until now)
+      socket.flush();
+
+      // Parked until the write coalescer acks; deliverCommits() picks us back up
+      if (context.m_awaiting_commit)
+        return true;
+
+      // The current request needs more input
+      socket.make_room();
+      switch (socket.fill())
+      {
+        case BufferedSocket::FillResult::Data:
+        case BufferedSocket::FillResult::Full:
+          continue;
+        case BufferedSocket::FillResult::Closed:
+          return false;
+        case BufferedSocket::FillResult::WouldBlock:
+          socket.flush();
+          if (context.m_pending_op == 0)
+            context.trim();
+          return true;
+      }
+    }
+
+    // Out of budget. Let the other connections on this loop have a turn.
+    socket.flush();
+    if (!context.m_scheduled)
+    {
+      context.m_scheduled = true;
+      m_ready.push_back(context.m_id);
+    }
+    return true;
+  }
+
+  void serviceConnection(uint64_t id)
+  {
+    auto it = m_connections.find(id);
+    if (it == m_connections.end())
+      return; // closed earlier in this batch
+
+    bool keep = false;
+    try
+    {
+      keep = service(*it->second);
+    }
+    catch (const std::exception& e)
+    {
+      std::cerr << e.what() << '\n';
+    }
+
+    if (!keep)
+      m_connections.erase(it); // closes the socket, which also drops it from epoll
+  }
+
+  // Reply to coalesced writes, then run whatever their connections sent in the meantime
+  void deliverCommits()
+  {
+    while (CoalescedWrite* write = m_commits.pop())
+    {
+      std::unique_ptr<CoalescedWrite> owned(write);
+      auto it = m_connections.find(write->connection);
+      if (it == m_connections.end())
+        continue; // hung up while the write was in flight
+
+      finishCoalescedWrite(*it->second, *write);
+      serviceConnection(write->connection);
+    }
+  }
+
+public:
+  EpollLoop(StorageEngine* db) :
+    EventLoop(db),
+    m_epoll(epoll_create1(EPOLL_CLOEXEC))
+  {
+    if (m_epoll == -1)
+      throw std::runtime_error("Failed to create event loop");
+
+    struct epoll_event event;
+    event.events = EPOLLIN | EPOLLET;
+    event.data.u64 = WAKEUP_ID;
+    if (epoll_ctl(m_epoll, EPOLL_CTL_ADD, m_wakeup, &event) == -1)
+      throw std::runtime_error("Failed to register event loop wakeup");
+  }
+
+  ~EpollLoop()
+  {
+    m_connections.clear();
+    close(m_epoll);
+  }
+
+  void run() override
+  {
+    struct epoll_event events[MAX_EVENTS];
+
+    while (!g_stop)
+    {
+      int timeout = m_ready.empty() ? 500 : 0; // wake up periodically to notice shutdown
+      int count = epoll_wait(m_epoll, events, MAX_EVENTS, timeout);
+      if (count == -1)
+      {
+        if (errno == EINTR)
+          continue;
+
+        cerr << "Error waiting for events: " << strerror(errno) << endl;
+        return;
+      }
+
+      for (int i = 0; i < count; i++)
+      {
+        uint64_t id = events[i].data.u64;
+        if (id == WAKEUP_ID)
+        {
+          adoptIncoming();
+          deliverCommits();
+        }
+        else
+          serviceConnection(id);
+      }
+
+      // Only the connections that were already waiting get a turn; anything that re-queues
+      // itself waits for the next round, after epoll had a chance to report new I/O.
+      for (size_t n = m_ready.size(); n > 0; n--)
+      {
+        uint64_t id = m_ready.front();
+        m_ready.pop_front();
+
+        auto it = m_connections.find(id);
+        if (it == m_connections.end())
+          continue;
+
+        it->second->m_scheduled = false;
+        serviceConnection(id);
+      }
+
+      auto now = std::chrono::steady_clock::now();
+      if (reapDue(now))
+      {
+        for (auto& [id, context] : m_connections)
+          reapCursors(*context, now);
+        sampleRings();
+      }
+    }
+  }
+};
+
+#ifdef HAVE_SPSC_RING
+
+// Edge-triggered epoll reactor split over two threads (--decouple-io). The I/O thread only pulls
+// bytes off the sockets into each connection's receive ring, which is in SPSC mode; its executor
+// thread parses, executes and sends replies. A slow scan or a big batch then no longer stops the
+// socket from being drained, and the next requests are already buffered when the executor gets
+// to them.
+//
+// The I/O thread owns the epoll set and the connection map; the executor owns everything else in a
+// connection. A full ring hands the ring over to the executor (m_input_blocked), which grows it if
+// it holds an incomplete frame and asks for reading to resume. Closing goes the other way: the
+// executor asks the I/O thread to forget the connection, and deletes it once that is done.
+class DecoupledLoop : public EventLoop
+{
+private:
+  static constexpr uint64_t WAKEUP_ID = 0;
+  static constexpr int MAX_EVENTS = 256;
+
+  int m_epoll;
+
+  // Connections with something for the executor to look at
+  MpscQueue<WorkerContext> m_exec_queue;
+  FutexSignal m_exec_signal;
+  std::atomic<bool> m_exec_stop;
+
+  // Executor -> I/O thread: connections to resume reading, and connections to forget
+  std::mutex m_request_mutex;
+  vector<uint64_t> m_resume_requests;
+  vector<uint64_t> m_retire_requests;
+
+  // Either thread: make sure the executor looks at the connection
+  void post(WorkerContext& context)
+  {
+    if (!context.m_exec_queued.exchange(true, std::memory_order_acq_rel))
+    {
+      m_exec_queue.push(&context);
+      m_exec_signal.notify();
+    }
+  }
+
+  static void destroy(WorkerContext* context)
+  {
+    delete context->m_commit_ack.exchange(nullptr, std::memory_order_acquire);
+    delete context;
+  }
+
+  // ---- I/O thread ----
+
+  void adoptIncoming()
+  {
+    uint64_t counter;
+    while (read(m_wakeup, &counter, sizeof(counter)) > 0) { }
+
+    for (auto& [socket, addr] : takeIncoming())
+    {
+      uint64_t id = m_next_id++;
+      auto context = std::make_unique<WorkerContext>(id, socket, addr, m_db, true);
+      context->m_loop = this;
+
+      struct epoll_event event;
+      event.events = EPOLLIN | EPOLLOUT | EPOLLRDHUP | EPOLLET;
+      event.data.u64 = id;
+      if (epoll_ctl(m_epoll, EPOLL_CTL_ADD, socket, &event) == -1)
+      {
+        cerr << "Error registering connection: " << strerror(errno) << endl;
+        continue; // context closes the socket
+      }
+
+      m_connections.emplace(id, std::move(context));
+    }
+  }
+
+  // Drain the socket into the ring until EAGAIN, hang-up, or the ring is full
+  void readInput(WorkerContext& context)
+  {
+    if (context.m_input_blocked.load(std::memory_order_acquire) ||
+        context.m_input_closed.load(std::memory_order_relaxed))
+      return;
+
+    bool reading = true;
+    while (reading)
+    {
+      BufferedSocket::FillResult result;
+      try
+      {
+        result = context.m_buffered_socket.fill();
+      }
+      catch (const std::exception& e)
+      {
+        std::cerr << e.what() << '\n';
+        result = BufferedSocket::FillResult::Closed;
+      }
+
+      switch (result)
+      {
+        case BufferedSocket::FillResult::Data:
+          post(context); // let the executor start on it while we keep reading
+          continue;
+        case BufferedSocket::FillResult::Full:
+          context.m_input_blocked.store(true, std::memory_order_release);
+          break;
+        case BufferedSocket::FillResult::Closed:
+          context.m_input_closed.store(true, std::memory_order_release);
+          break;
+        case BufferedSocket::FillResult::WouldBlock:
+          break;
+      }
+
+      reading = false;
+    }
+
+    post(context);
+  }
+
+  void handleEvent(uint64_t id, uint32_t events)
+  {
+    auto it = m_connections.find(id);
+    if (it == m_connections.end())
+      return;
+
+    if (events & (EPOLLIN | EPOLLRDHUP | EPOLLHUP | EPOLLERR))
+      readInput(*it->second);
+    else
+      post(*it->second); // EPOLLOUT: the executor has output to flush
+  }
+
+  // Coalesced write acks go to the executor, which owns the reply path
+  void deliverCommits()
+  {
+    while (CoalescedWrite* write = m_commits.pop())
+    {
+      auto it = m_connections.find(write->connection);
+      if (it == m_connections.end())
+      {
+        delete write; // hung up while the write was in flight
+        continue;
+      }
+
+      delete it->second->m_commit_ack.exchange(write, std::memory_order_acq_rel);
+      post(*it->second);
+    }
+  }
+
+  void handleRequests()
+  {
+    vector<uint64_t> resume;
+    vector<uint64_t> retire;
+    {
+      std::lock_guard<std::mutex> lock(m_request_mutex);
+      resume.swap(m_resume_requests);
+      retire.swap(m_retire_requests);
+    }
+
+    for (uint64_t id : resume)
+    {
+      auto it = m_connections.find(id);
+      if (it != m_connections.end())
+        readInput(*it->second);
+    }
+
+    for (uint64_t id : retire)
+    {
+      auto it = m_connections.find(id);
+      if (it == m_connections.end())
+        continue;
+
+      WorkerContext* context = it->second.release();
+      m_connections.erase(it);
+      epoll_ctl(m_epoll, EPOLL_CTL_DEL, context->m_socket, nullptr);
+
+      // Our last touch; the executor deletes it when it next pops it
+      context->m_forgotten.store(true, std::memory_order_release);
+      post(*context);
+    }
+  }
+
+  // ---- executor thread ----
+
+  void requestResume(uint64_t id)
+  {
+    {
+      std::lock_guard<std::mutex> lock(m_request_mutex);
+      m_resume_requests.push_back(id);
+    }
+
+    wake();
+  }
+
+  void requestRetire(WorkerContext& context)
+  {
+    context.m_retiring = true;
+    {
+      std::lock_guard<std::mutex> lock(m_request_mutex);
+      m_retire_requests.push_back(context.m_id);
+    }
+
+    wake();
+  }
+
+  // Execute what the I/O thread buffered and send the replies. Returns false if the connection
+  // is done.
+  bool execute(WorkerContext& context)
+  {
+    BufferedSocket& socket = context.m_buffered_socket;
+
+    if (!context.m_cursors.empty())
+      reapCursors(context, std::chrono::steady_clock::now());
+
+    if (CoalescedWrite* write = context.m_commit_ack.exchange(nullptr, std::memory_order_acquire))
+    {
+      std::unique_ptr<CoalescedWrite> owned(write);
+      finishCoalescedWrite(context, *write);
+    }
+
+    for (int round = 0; round < SERVICE_BUDGET; round++)
+    {
+      // Read before parsing: if the peer is gone, everything it sent is already in the ring
+      bool closed = context.m_input_closed.load(std::memory_order_acquire);
+
+      while (!socket.congested() && handleRequest(context)) { }
+
+      if (socket.congested())
+      {
+        if (!socket.flush())
+          return true; // EPOLLOUT resumes us
+
+        continue;
+      }
+
+      socket.flush();
+
+      if (context.m_awaiting_commit)
+        return true;
+
+      if (closed)
+        return false;
+
+      // The I/O thread stopped at a full ring. It's ours until we hand it back, so grow it if
+      // what's left is one frame too big to fit.
+      if (context.m_input_blocked.load(std::memory_order_acquire))
+      {
+        socket.make_room();
+        context.m_input_blocked.store(false, std::memory_order_release);
+        requestResume(context.m_id);
+        return true;
+      }
+
+      // Waiting for input; the I/O thread posts us when it lands
+      if (context.m_pending_op == 0)
+        context.trim(false);
+      return true;
+    }
+
+    // Out of budget. Let the other connections have a turn.
+    socket.flush();
+    post(context);
+    return true;
+  }
+
+  void runExecutor()
+  {
+    while (!m_exec_stop.load(std::memory_order_relaxed))
+    {
+      uint32_t ticket = m_exec_signal.prepare();
+      WorkerContext* context = m_exec_queue.pop();
+      if (context == nullptr)
+      {
+        m_exec_signal.wait(ticket, 500); // wake up periodically to notice shutdown
+        continue;
+      }
+
+      // An RMW, so it pairs with the post() that saw the flag still set: whatever that thread
+      // published before posting is visible below
+      context->m_exec_queued.exchange(false, std::memory_order_acq_rel);
+      if (context->m_forgotten.load(std::memory_order_acquire))
+      {
+        destroy(context);
+        continue;
+      }
+
+      if (context->m_retiring)
+        continue;
+
+      bool keep = false;
+      try
+      {
+        keep = execute(*context);
+      }
+      catch (const std::exception& e)
+      {
+        std::cerr << e.what() << '\n';
+      }
+
+      if (!keep)
+        requestRetire(*context);
+    }
+  }
+
+public:
+  DecoupledLoop(StorageEngine* db) :
+    EventLoop(db),
+    m_epoll(epoll_create1(EPOLL_CLOEXEC)),
+    m_exec_stop(false)
+  {
+    if (m_epoll == -1)
+      throw std::runtime_error("Failed to create event loop");
+
+    struct epoll_event event;
+    event.events = EPOLLIN | EPOLLET;
+    event.data.u64 = WAKEUP_ID;
+    if (epoll_ctl(m_epoll, EPOLL_CTL_ADD, m_wakeup, &event) == -1)
+      throw std::runtime_error("Failed to register event loop wakeup");
+  }
+
+  ~DecoupledLoop()
+  {
+    // Both threads are gone. Whatever is still queued was either forgotten (ours to delete) or
+    // is still in the map.
+    while (WorkerContext* context = m_exec_queue.pop())
+    {
+      if (context->m_forgotten.load(std::memory_order_acquire))
+        destroy(context);
+    }
+
+    for (auto& [id, context] : m_connections)
+      destroy(context.release());
+
+    m_connections.clear();
+    close(m_epoll);
+  }
+
+  // The I/O thread; the executor lives and dies with it
+  void run() override
+  {
+    std::thread executor(&DecoupledLoop::runExecutor, this);
+    struct epoll_event events[MAX_EVENTS];
+
+    while (!g_stop)
+    {
+      int count = epoll_wait(m_epoll, events, MAX_EVENTS, 500); // wake up periodically to notice shutdown
+      if (count == -1)
+      {
+        if (errno == EINTR)
+          continue;
+
+        cerr << "Error waiting for events: " << strerror(errno) << endl;
+        break;
+      }
+
+      for (int i = 0; i < count; i++)
+      {
+        uint64_t id = events[i].data.u64;
+        if (id == WAKEUP_ID)
+        {
+          adoptIncoming();
+          deliverCommits();
+          handleRequests();
+        }
+        else
+          handleEvent(id, events[i].events);
+      }
+
+      // Cursors belong to the executor; have it look over every connection
+      if (reapDue(std::chrono::steady_clock::now()))
+      {
+        for (auto& [id, context] : m_connections)
+          post(*context);
+        sampleRings();
+      }
+    }
+
+    m_exec_stop.store(true, std::memory_order_relaxed);
+    m_exec_signal.notify();
+    executor.join();
+  }
+};
+
+#endif
+
+#ifdef HAVE_LIBURING
+
+// io_uring reactor. Every connection keeps one multishot recv armed against a ring of provided
+// buffers registered with the kernel, so a request costs no syscall on the read side; replies are
+// gathered into the connection's output queue and go out as one SEND per flush. Completions and
+// new submissions share a single io_uring_enter per loop iteration, which makes a small GET_ONE
+// round trip roughly one kernel transition.
+class UringLoop : public EventLoop
+{
+private:
+  enum : uint64_t
+  {
+    URING_WAKE = 0,
+    URING_RECV = 1,
+    URING_SEND = 2
+  };
+
+  static constexpr unsigned RING_ENTRIES = 4096;
+  static constexpr int BUFFER_GROUP = 0;
+
+  struct io_uring m_ring;
+  struct io_uring_buf_ring* m_buf_ring;
+  std::unique_ptr<uint8_t[]> m_buffers;
+  uint64_t m_wakeup_value;
+
+  static uint64_t tag(uint64_t id, uint64_t kind)
+  {
+    return (id << 2) | kind;
+  }
+
+  struct io_uring_sqe* nextSqe()
+  {
+    struct io_uring_sqe* sqe = io_uring_get_sqe(&m_ring);
+    if (sqe == nullptr)
+    {
+      // Submission queue is full; push what we have to the kernel and retry
+      io_uring_submit(&m_ring);
+      sqe = io_uring_get_sqe(&m_ring);
+      if (sqe == nullptr)
+        throw std::runtime_error("io_uring submission queue exhausted");
+    }
+    return sqe;
+  }
+
+  uint8_t* buffer(uint16_t bid)
+  {
+    return m_buffers.get() + static_cast<size_t>(bid) * URING_BUFFER_SIZE;
+  }
+
+  void recycleBuffer(uint16_t bid)
+  {
+    io_uring_buf_ring_add(m_buf_ring, buffer(bid), URING_BUFFER_SIZE, bid, io_uring_buf_ring_mask(URING_BUFFER_COUNT), 0);
+    io_uring_buf_ring_advance(m_buf_ring, 1);
+  }
+
+  void armWakeup()
+  {
+    struct io_uring_sqe* sqe = nextSqe();
+    io_uring_prep_read(sqe, m_wakeup, &m_wakeup_value, sizeof(m_wakeup_value), 0);
+    io_uring_sqe_set_data64(sqe, tag(0, URING_WAKE));
+  }
+
+  void armRecv(WorkerContext& context)
+  {
+    struct io_uring_sqe* sqe = nextSqe();
+    io_uring_prep_recv_multishot(sqe, context.m_socket, nullptr, 0, 0);
+    sqe->flags |= IOSQE_BUFFER_SELECT;
+    sqe->buf_group = BUFFER_GROUP;
+    io_uring_sqe_set_data64(sqe, tag(context.m_id, URING_RECV));
+    context.m_uring_ops++;
+  }
+
+  // At most one send per connection is in flight, which keeps replies ordered
+  void armSend(WorkerContext& context)
+  {
+    const uint8_t* data;
+    size_t len;
+    if (context.m_uring_sending || !context.m_buffered_socket.prepare_send(data, len))
+      return;
+
+    struct io_uring_sqe* sqe = nextSqe();
+    io_uring_prep_send(sqe, context.m_socket, data, len, MSG_NOSIGNAL);
+    io_uring_sqe_set_data64(sqe, tag(context.m_id, URING_SEND));
+    context.m_uring_sending = true;
+    context.m_uring_ops++;
+  }
+
+  // Run whatever requests are buffered, then queue the replies
+  void execute(WorkerContext& context)
+  {
+    BufferedSocket& socket = context.m_buffered_socket;
+    while (!socket.congested() && handleRequest(context)) { }
+
+    armSend(context);
+    if (context.m_pending_op == 0 && socket.buffered() == 0 && socket.pending_output() == 0)
+      context.trim();
+  }
+
+  // Shut the socket down so outstanding operations complete, and free the connection once the
+  // kernel no longer references its buffers.
+  void retire(WorkerContext& context)
+  {
+    if (!context.m_closing)
+    {
+      context.m_closing = true;
+      shutdown(context.m_socket, SHUT_RDWR);
+    }
+
+    if (context.m_uring_ops == 0)
+      m_connections.erase(context.m_id);
+  }
+
+  void adoptIncoming()
+  {
+    for (auto& [socket, addr] : takeIncoming())
+    {
+      uint64_t id = m_next_id++;
+      auto context = std::make_unique<WorkerContext>(id, socket, addr, m_db, false);
+      context->m_loop = this;
+      armRecv(*context);
+      m_connections.emplace(id, std::move(context));
+    }
+  }
+
+  void deliverCommits()
+  {
+    while (CoalescedWrite* write = m_commits.pop())
+    {
+      std::unique_ptr<CoalescedWrite> owned(write);
+      auto it = m_connections.find(write->connection);
+      if (it == m_connections.end() || it->second->m_closing)
+        continue;
+
+      WorkerContext& context = *it->second;
+      try
+      {
+        finishCoalescedWrite(context, *write);
+        execute(context);
+      }
+      catch (const std::exception& e)
+      {
+        std::cerr << e.what() << '\n';
+        retire(context);
+      }
+    }
+  }
+
+  void complete(struct io_uring_cqe* cqe)
+  {
+    uint64_t data = io_uring_cqe_get_data64(cqe);
+    uint64_t kind = data & 3;
+    uint64_t id = data >> 2;
+
+    if (kind == URING_WAKE)
+    {
+      adoptIncoming();
+      deliverCommits();
+      armWakeup();
+      return;
+    }
+
+    auto it = m_connections.find(id);
+    if (it == m_connections.end())
+      return;
+
+    WorkerContext& context = *it->second;
+    bool more = (cqe->flags & IORING_CQE_F_MORE) != 0;
+    if (!more)
+      context.m_uring_ops--;
+
+    try
+    {
+      if (kind == URING_RECV)
+      {
+        if (cqe->res > 0)
+        {
+          uint16_t bid = cqe->flags >> IORING_CQE_BUFFER_SHIFT;
+          if (!context.m_closing)
+            context.m_buffered_socket.receive(buffer(bid), cqe->res);
+          recycleBuffer(bid);
+        }
+        else if (cqe->res != -ENOBUFS)
+        {
+          // EOF or a hard error
+          retire(context);
+          return;
+        }
+
+        if (context.m_closing)
+        {
+          retire(context);
+          return;
+        }
+
+        execute(context);
+
+        // Multishot ends when the buffer ring runs dry (or the kernel just decides to); re-arm
+        if (!more)
+          armRecv(context);
+      }
+      else
+      {
+        context.m_uring_sending = false;
+        if (cqe->res < 0 || context.m_closing)
+        {
+          retire(context);
+          return;
+        }
+
+        context.m_buffered_socket.complete_send(cqe->res);
+
+        // Room freed up: resume anything paused behind the backlog, then send the next batch
+        execute(context);
+      }
+    }
+    catch (const std::exception& e)
+    {
+      std::cerr << e.what() << '\n';
+      retire(context);
+    }
+  }
+
+public:
+  UringLoop(StorageEngine* db) :
+    EventLoop(db),
+    m_buf_ring(nullptr),
+    m_buffers(new uint8_t[static_cast<size_t>(URING_BUFFER_COUNT) * URING_BUFFER_SIZE]),
+    m_wakeup_value(0)
+  {
+    // The ring is built here on the acceptor thread but only ever driven from run(), so no
+    // IORING_SETUP_SINGLE_ISSUER (that pins submission to the creating thread).
+    struct io_uring_params params;
+    memset(&params, 0, sizeof(params));
+    params.flags = IORING_SETUP_COOP_TASKRUN;
+
+    int ret = io_uring_queue_init_params(RING_ENTRIES, &m_ring, &params);
+    if (ret == -EINVAL)
+    {
+      // Older kernel without task-run hints
+      memset(&params, 0, sizeof(params));
+      ret = io_uring_queue_init_params(RING_ENTRIES, &m_ring, &params);
+    }
+    if (ret < 0)
+      throw std::runtime_error(string("Failed to create io_uring: ") + strerror(-ret));
+
+    m_buf_ring = io_uring_setup_buf_ring(&m_ring, URING_BUFFER_COUNT, BUFFER_GROUP, 0, &ret);
+    if (m_buf_ring == nullptr)
+    {
+      io_uring_queue_exit(&m_ring);
+      throw std::runtime_error(string("Failed to register io_uring buffers: ") + strerror(-ret));
+    }
+
+    for (unsigned i = 0; i < URING_BUFFER_COUNT; i++)
+      io_uring_buf_ring_add(m_buf_ring, buffer(i), URING_BUFFER_SIZE, i, io_uring_buf_ring_mask(URING_BUFFER_COUNT), i);
+    io_uring_buf_ring_advance(m_buf_ring, URING_BUFFER_COUNT);
+
+    armWakeup();
+  }
+
+  ~UringLoop()
+  {
+    // Tear the ring down first so the kernel lets go of the connection buffers
+    io_uring_free_buf_ring(&m_ring, m_buf_ring, URING_BUFFER_COUNT, BUFFER_GROUP);
+    io_uring_queue_exit(&m_ring);
+    m_connections.clear();
+  }
+
+  void run() override
+  {
+    while (!g_stop)
+    {
+      struct __kernel_timespec timeout = { 0, 500 * 1000 * 1000 }; // wake up periodically to notice shutdown
+      struct io_uring_cqe* cqe;
+
+      int ret = io_uring_submit_and_wait_timeout(&m_ring, &cqe, 1, &timeout, nullptr);
+      if (ret < 0 && ret != -ETIME && ret != -EINTR && ret != -EAGAIN && ret != -EBUSY)
+      {
+        cerr << "Error waiting for completions: " << strerror(-ret) << endl;
+        return;
+      }
+
+      unsigned head;
+      unsigned seen = 0;
+      io_uring_for_each_cqe(&m_ring, head, cqe)
+      {
+        complete(cqe);
+        seen++;
+      }
+      io_uring_cq_advance(&m_ring, seen);
+
+      auto now = std::chrono::steady_clock::now();
+      if (reapDue(now))
+      {
+        for (auto& [id, context] : m_connections)
+          reapCursors(*context, now);
+        sampleRings();
+      }
+    }
+  }
+};
+
+#endif
+
+void WriteCoalescer::run()
+{
+  // Acks promise the write is durable; the fsync is shared by the whole group
+  rocksdb::WriteOptions write_options;
+  write_options.sync = true;
+#ifdef DISABLE_WAL
+  write_options.sync = false;
+  write_options.disableWAL = true;
+#endif
+
+  rocksdb::WriteBatch batch;
+  vector<CoalescedWrite*> group;
+  vector<EventLoop*> loops;
+
+  while (true)
+  {
+    // Read the signal before looking at the queue, so a submit in between can't be slept through
+    uint32_t seen = m_signal.load(std::memory_order_acquire);
+    CoalescedWrite* write = m_queue.pop();
+    if (write == nullptr)
+    {
+      if (m_stop.load(std::memory_order_acquire))
+        return;
+
+      m_signal.wait(seen, std::memory_order_acquire);
+      continue;
+    }
+
+    group.push_back(write);
+    size_t bytes = write->ops.size();
+    if (m_max_delay.count() > 0 && bytes < m_max_bytes)
+      std::this_thread::sleep_for(m_max_delay); // give the group a chance to fill up
+
+    while (bytes < m_max_bytes && (write = m_queue.pop()) != nullptr)
+    {
+      group.push_back(write);
+      bytes += write->ops.size();
+    }
+
+    // A member that can't be written (its namespace was dropped, say) fails on its own; the rest
+    // of the group goes ahead without it
+    batch.Clear();
+    size_t members = 0;
+    for (CoalescedWrite* member : group)
+    {
+      if (member->ns && m_db->findNamespace(member->ns->id) != member->ns)
+      {
+        member->status = rocksdb::Status::InvalidArgument("Namespace was dropped");
+        continue;
+      }
+
+      batch.SetSavePoint();
+      member->status = member->addTo(batch);
+      if (member->status.ok())
+      {
+        batch.PopSavePoint();
+        members++;
+      }
+      else
+        batch.RollbackToSavePoint();
+    }
+
+    rocksdb::Status status;
+    if (members > 0)
+      status = m_db->write(write_options, &batch);
+    invalidateHotKeys(batch);
+
+    // The check above can race a drop, and RocksDB rejects a whole batch over one bad op, so
+    // retry the members of a failed group one at a time
+    for (CoalescedWrite* member : group)
+    {
+      if (!member->status.ok())
+        continue;
+
+      if (status.ok() || members == 1)
+      {
+        member->status = status;
+        continue;
+      }
+
+      batch.Clear();
+      member->status = member->addTo(batch);
+      if (member->status.ok())
+        member->status = m_db->write(write_options, &batch);
+      invalidateHotKeys(batch);
+    }
+
+    // Hand every ack back to its connection's loop, waking each loop once
+    loops.clear();
+    for (CoalescedWrite* member : group)
+    {
+      EventLoop* loop = member->loop;
+      loop->postCommit(member);
+      if (std::find(loops.begin(), loops.end(), loop) == loops.end())
+        loops.push_back(loop);
+    }
+
+    for (EventLoop* loop : loops)
+      loop->wake();
+
+    group.clear();
+  }
+}
+
+// Serves the metrics on --admin-socket, in the Prometheus text format: to an HTTP GET of /metrics
+// (curl --unix-socket <path> http://localhost/metrics), or as is to a client that sends nothing
+// and shuts down its end. GET /trace drains the sampled requests (--trace-sample) as Chrome trace
+// JSON, like TRACE_DUMP. One connection at a time on its own thread, so scrapes never hold up
+// the event loops; recording threads are only read from.
+class AdminServer
+{
+private:
+  // Statistics tickers exported as counters
+  struct Ticker
+  {
+    rocksdb::Tickers ticker;
+    const char* name;
+    const char* help;
+  };
+
+  static constexpr Ticker TICKERS[] = {
+    { rocksdb::BLOCK_CACHE_HIT, "scramjet_rocksdb_block_cache_hit_total", "Block cache hits; the hit rate is hits / (hits + misses)" },
+    { rocksdb::BLOCK_CACHE_MISS, "scramjet_rocksdb_block_cache_miss_total", "Block cache misses" },
+    { rocksdb::BLOOM_FILTER_USEFUL, "scramjet_rocksdb_bloom_filter_useful_total", "SST reads a filter ruled out" },
+    { rocksdb::MEMTABLE_HIT, "scramjet_rocksdb_memtable_hit_total", "Point reads answered by a memtable" },
+    { rocksdb::MEMTABLE_MISS, "scramjet_rocksdb_memtable_miss_total", "Point reads that went past the memtables" },
+    { rocksdb::STALL_MICROS, "scramjet_rocksdb_stall_micros_total", "Microseconds writes were stalled for compaction or flush to catch up" },
+    { rocksdb::BYTES_WRITTEN, "scramjet_rocksdb_written_bytes_total", "Bytes written by Put and Write" },
+    { rocksdb::BYTES_READ, "scramjet_rocksdb_read_bytes_total", "Bytes read by point lookups" },
+    { rocksdb::NUMBER_KEYS_WRITTEN, "scramjet_rocksdb_keys_written_total", "Keys written" },
+    { rocksdb::NUMBER_KEYS_READ, "scramjet_rocksdb_keys_read_total", "Keys read by point lookups" },
+    { rocksdb::COMPACT_READ_BYTES, "scramjet_rocksdb_compaction_read_bytes_total", "Bytes read by compactions" },
+    { rocksdb::COMPACT_WRITE_BYTES, "scramjet_rocksdb_compaction_write_bytes_total", "Bytes written by compactions" },
+    { rocksdb::WAL_FILE_SYNCED, "scramjet_rocksdb_wal_synced_total", "WAL syncs" },
+  };
+
+  // Integer DB properties exported as gauges
+  struct Property
   {
-    vbuf_cache = std::make_unique<char[]>(vlen);
-    vbuf_cache_alloc = vlen;
-    vbuf = vbuf_cache.get();
-  }
+    const char* property;
+    const char* name;
+    const char* help;
+  };
 
-  // Read the value
-  timeout = { 5, 0 };
-  if (!context.m_buffered_socket.read_n(vbuf, vlen, timeout))
-    throw std::runtime_error("Failed to read value");
-  
-  // Write the key and value to the DB
-  rocksdb::Slice kslice(kbuf, klen);
-  rocksdb::Slice vslice(vbuf, vlen);
-  auto status = context.m_db->Put(write_options, kslice, vslice);
+  static constexpr Property PROPERTIES[] = {
+    { "rocksdb.estimate-pending-compaction-bytes", "scramjet_rocksdb_pending_compaction_bytes", "Estimated bytes compaction must rewrite to get every level under its target" },
+    { "rocksdb.num-running-compactions", "scramjet_rocksdb_running_compactions", "Compactions running" },
+    { "rocksdb.num-running-flushes", "scramjet_rocksdb_running_flushes", "Memtable flushes running" },
+    { "rocksdb.num-immutable-mem-table", "scramjet_rocksdb_immutable_memtables", "Memtables waiting to be flushed" },
+    { "rocksdb.cur-size-all-mem-tables", "scramjet_rocksdb_memtable_bytes", "Bytes in all memtables" },
+    { "rocksdb.block-cache-usage", "scramjet_rocksdb_block_cache_bytes", "Bytes held by the block cache" },
+    { "rocksdb.estimate-num-keys", "scramjet_rocksdb_estimated_keys", "Estimated number of keys" },
+    { "rocksdb.estimate-live-data-size", "scramjet_rocksdb_live_data_bytes", "Estimated bytes of live data" },
+    { "rocksdb.total-sst-files-size", "scramjet_rocksdb_sst_bytes", "Bytes in SST files" },
+    { "rocksdb.actual-delayed-write-rate", "scramjet_rocksdb_delayed_write_rate", "Write rate limit in bytes per second while writes are delayed, 0 otherwise" },
+    { "rocksdb.is-write-stopped", "scramjet_rocksdb_write_stopped", "1 while writes are stopped" },
+  };
 
-  // TODO: handle errors? For now, we just ignore.
-  if (!status.ok())
-  { }
+  StorageEngine* m_db;
+  std::shared_ptr<rocksdb::Statistics> m_statistics;
+  UnixSocket m_socket;
+  std::thread m_thread;
 
-  return true;
-}
+  string render()
+  {
+    std::array<uint64_t, OP_SLOTS> requests {};
+    std::array<uint64_t, OP_SLOTS> failures {};
+    vector<LatencyHistogram::Totals> latency(OP_SLOTS);
+    uint64_t bytesIn = 0;
+    uint64_t bytesOut = 0;
+    uint64_t opened = 0;
+    uint64_t closed = 0;
+    int64_t ringBytes = 0;
+    int64_t ringBuffered = 0;
+
+    g_metrics->forEach([&](const ThreadMetrics& metrics) {
+      for (size_t op = 0; op < OP_SLOTS; op++)
+      {
+        requests[op] += metrics.requests[op].get();
+        failures[op] += metrics.failures[op].get();
+        metrics.latency[op].addTo(latency[op]);
+      }
 
-void doPutMulti(WorkerContext& context)
-{
-  std::unique_ptr<char[]> kbuf_cache;
-  std::unique_ptr<char[]> vbuf_cache;
+      bytesIn += metrics.bytes_in.get();
+      bytesOut += metrics.bytes_out.get();
+      opened += metrics.connections_opened.get();
+      closed += metrics.connections_closed.get();
+      ringBytes += metrics.ring_bytes.get();
+      ringBuffered += metrics.ring_buffered.get();
+    });
+
+    PrometheusText page;
 
-  size_t kbuf_cache_alloc;
-  size_t vbuf_cache_alloc;
+    page.family("scramjet_requests_total", "counter", "Requests completed, by opcode");
+    for (size_t op = 0; op < OP_SLOTS; op++)
+    {
+      if (const char* name = opName(op))
+        page.sample("scramjet_requests_total", string("op=\"") + name + "\"", requests[op]);
+    }
 
-  while (doPutN_one(context, kbuf_cache, vbuf_cache, kbuf_cache_alloc, vbuf_cache_alloc)) { }
-  // Send 0x00 to indicate end of stream
-  char status = 0x00;
+    page.family("scramjet_request_failures_total", "counter", "Requests that dropped their connection, by opcode");
+    for (size_t op = 0; op < OP_SLOTS; op++)
+    {
+      if (const char* name = opName(op))
+        page.sample("scramjet_request_failures_total", string("op=\"") + name + "\"", failures[op]);
+    }
 
-  struct timeval timeout = { 5, 0 };
-  if (!context.m_buffered_socket.write_n(&status, sizeof(status), timeout))
-    throw std::runtime_error("Failed to write end of stream response");
-}
+    page.family("scramjet_request_duration_seconds", "histogram", "Time from a request's first byte being parsed until its reply is queued, by opcode");
+    for (size_t op = 0; op < OP_SLOTS; op++)
+    {
+      if (const char* name = opName(op))
+        page.histogram("scramjet_request_duration_seconds", string("op=\"") + name + "\"", latency[op]);
+    }
 
-// NOINLINE boundary for alloca calls
-NOINLINE bool doPutN_one(
-  WorkerContext& context,
-  std::unique_ptr<char[]>& kbuf_cache,
-  std::unique_ptr<char[]>& vbuf_cache,
-  size_t& kbuf_cache_alloc,
-  size_t& vbuf_cache_alloc
-)
-{
-  unsigned int klen;
-  unsigned int vlen;
-  char* kbuf;
-  char* vbuf;
+    page.family("scramjet_received_bytes_total", "counter", "Bytes read from client connections");
+    page.sample("scramjet_received_bytes_total", "", bytesIn);
+    page.family("scramjet_sent_bytes_total", "counter", "Bytes written to client connections");
+    page.sample("scramjet_sent_bytes_total", "", bytesOut);
+    page.family("scramjet_connections_opened_total", "counter", "Client connections accepted");
+    page.sample("scramjet_connections_opened_total", "", opened);
+    page.family("scramjet_connections_active", "gauge", "Client connections open");
+    page.sample("scramjet_connections_active", "", int64_t(opened - closed));
+    page.family("scramjet_receive_ring_bytes", "gauge", "Memory held by connection receive rings");
+    page.sample("scramjet_receive_ring_bytes", "", ringBytes);
+    page.family("scramjet_receive_ring_buffered_bytes", "gauge", "Bytes received but not yet parsed, sampled about once a second");
+    page.sample("scramjet_receive_ring_buffered_bytes", "", ringBuffered);
+
+    if (g_hot_cache != nullptr)
+    {
+      HotCache::Stats stats = g_hot_cache->stats();
+      page.family("scramjet_hot_cache_hits_total", "counter", "GET_ONEs answered by the hot value cache");
+      page.sample("scramjet_hot_cache_hits_total", "", stats.hits);
+      page.family("scramjet_hot_cache_misses_total", "counter", "GET_ONEs the hot value cache could not answer");
+      page.sample("scramjet_hot_cache_misses_total", "", stats.misses);
+      page.family("scramjet_hot_cache_entries", "gauge", "Values in the hot value cache");
+      page.sample("scramjet_hot_cache_entries", "", stats.entries);
+      page.family("scramjet_hot_cache_bytes", "gauge", "Bytes charged to the hot value cache");
+      page.sample("scramjet_hot_cache_bytes", "", stats.bytes);
+    }
 
-  struct timeval timeout;
+    if (m_statistics)
+    {
+      for (const Ticker& ticker : TICKERS)
+      {
+        page.family(ticker.name, "counter", ticker.help);
+        page.sample(ticker.name, "", m_statistics->getTickerCount(ticker.ticker));
+      }
+    }
 
-  rocksdb::WriteOptions write_options;
-  write_options.sync = false;
+    for (const Property& property : PROPERTIES)
+    {
+      uint64_t value;
+      if (!m_db->getIntProperty(property.property, &value))
+        continue;
 
-  // Read key
-  timeout = { 5, 0 };
-  if (!context.m_buffered_socket.read_n(reinterpret_cast<char*>(&klen), sizeof(klen), timeout))
-    throw std::runtime_error("Failed to read key length");
+      page.family(property.name, "gauge", property.help);
+      page.sample(property.name, "", value);
+    }
 
-  // Allocate space for the key
-  if (klen == 0)
-  {
-    // No more keys to read
-    return false;
-  }
-  else if (klen < STACK_ALLOC_MAX_SIZE)
-  {
-    kbuf = reinterpret_cast<char*>(alloca(klen));
-  }
-  else if (kbuf_cache != nullptr && kbuf_cache_alloc >= klen)
-  {
-    kbuf = kbuf_cache.get();
+    return page.str();
   }
-  else
+
+  // Answer one client. Anything slower than a second to talk to is dropped.
+  void serve(UnixSocket client)
   {
-    kbuf_cache = std::make_unique<char[]>(klen);
-    kbuf_cache_alloc = klen;
-    kbuf = kbuf_cache.get();
-  }
+    struct timeval timeout = { 1, 0 };
+    setsockopt(client, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+    setsockopt(client, SOL_SOCKET, SO_SNDTIMEO, &timeout, sizeof(timeout));
+
+    // Read up to the end of the request head, or until the client shuts down its end
+    string request;
+    while (request.find("\r\n\r\n") == string::npos && request.size() < 8192)
+    {
+      char chunk[1024];
+      ssize_t n = recv(client, chunk, sizeof(chunk), 0);
+      if (n == 0)
+        break;
+      if (n < 0)
+      {
+        if (errno == EINTR)
+          continue;
+        return;
+      }
+      request.append(chunk, n);
+    }
 
-  // Read the key
-  timeout = { 5, 0 };
-  if (!context.m_buffered_socket.read_n(kbuf, klen, timeout))
-    throw std::runtime_error("Failed to read key");
+    string response;
+    if (request.empty())
+      response = render();
+    else if (request.compare(0, 13, "GET /metrics ") == 0 || request.compare(0, 6, "GET / ") == 0)
+    {
+      string body = render();
+      response = "HTTP/1.0 200 OK\r\nContent-Type: text/plain; version=0.0.4\r\nContent-Length: " + std::to_string(body.size()) +
+                 "\r\nConnection: close\r\n\r\n" + body;
+    }
+    else if (Tracer::COMPILED_IN && request.compare(0, 11, "GET /trace ") == 0)
+    {
+      string body = Tracer::dump();
+      response = "HTTP/1.0 200 OK\r\nContent-Type: application/json\r\nContent-Length: " + std::to_string(body.size()) +
+                 "\r\nConnection: close\r\n\r\n" + body;
+    }
+    else
+      response = "HTTP/1.0 404 Not Found\r\nContent-Length: 0\r\nConnection: close\r\n\r\n";
 
-  // Read the value length
-  timeout = { 5, 0 };
-  if (!context.m_buffered_socket.read_n(reinterpret_cast<char*>(&vlen), sizeof(vlen), timeout))
-    throw std::runtime_error("Failed to read value length");
-  
-  // Allocate space for the value
-  if (vlen < STACK_ALLOC_MAX_SIZE)
-  {
-    vbuf = reinterpret_cast<char*>(alloca(vlen));
-  }
-  else if (vbuf_cache != nullptr && vbuf_cache_alloc >= vlen)
-  {
-    vbuf = vbuf_cache.get();
+    size_t sent = 0;
+    while (sent < response.size())
+    {
+      ssize_t n = send(client, response.data() + sent, response.size() - sent, MSG_NOSIGNAL);
+      if (n < 0)
+      {
+        if (errno == EINTR)
+          continue;
+        return;
+      }
+      sent += n;
+    }
   }
-  else
+
+  void run()
   {
-    vbuf_cache = std::make_unique<char[]>(vlen);
-    vbuf_cache_alloc = vlen;
-    vbuf = vbuf_cache.get();
-  }
+    while (!g_stop)
+    {
+      struct pollfd listener = { m_socket, POLLIN, 0 };
+      if (poll(&listener, 1, 500) <= 0) // wake up periodically to notice shutdown
+        continue;
 
-  // Read the value
-  timeout = { 5, 0 };
-  if (!context.m_buffered_socket.read_n(vbuf, vlen, timeout))
-    throw std::runtime_error("Failed to read value");
-  
-  // Write the key and value to the DB
-  rocksdb::Slice kslice(kbuf, klen);
-  rocksdb::Slice vslice(vbuf, vlen);
-  auto status = context.m_db->Put(write_options, kslice, vslice);
+      UnixSocket client = accept4(m_socket, nullptr, nullptr, SOCK_CLOEXEC);
+      if (client == -1)
+        continue;
 
-  if (!status.ok())
-  {
-    // return an error opcode
-    char error[] = { ERR_ERR, 0x00 }; // error of 0 length
-    if (!context.m_buffered_socket.write_n(error, sizeof(error), timeout))
-      throw std::runtime_error("Failed to write error response");
+      serve(client);
+      close(client);
+    }
   }
 
-  return true;
-}
-
-/**
- * We create a new SST file and write the data to it.
- * Then, we merge that SST file into the main database.
- */
-void doPutBulk(WorkerContext& context)
-{
-  std::unique_ptr<char[]> kbuf_cache;
-  std::unique_ptr<char[]> vbuf_cache;
+public:
+  AdminServer(const AdminServer&) = delete;
+  AdminServer& operator=(const AdminServer&) = delete;
 
-  size_t kbuf_cache_alloc;
-  size_t vbuf_cache_alloc;
+  // Takes over the listening socket; serves until g_stop is set
+  AdminServer(StorageEngine* db, std::shared_ptr<rocksdb::Statistics> statistics, UnixSocket socket) :
+    m_db(db),
+    m_statistics(std::move(statistics)),
+    m_socket(socket),
+    m_thread(&AdminServer::run, this)
+  { }
 
-  fs::path dir = fs::temp_directory_path();
-  auto filename = dir / fs::path("bulk_" + std::to_string(
-    std::chrono::system_clock::now().time_since_epoch().count()
-  ) + ".sst");
+  ~AdminServer()
+  {
+    m_thread.join();
+    close(m_socket);
+  }
+};
 
-  std::string sst_file = dir;
+// Long-only flags: --config, and the StorageConfig settings, which go by their flag's name
+constexpr int OPT_CONFIG = 0x100;
+constexpr int OPT_STORAGE = 0x101;
+constexpr int OPT_STORAGE_ENGINE = 0x102;
+constexpr int OPT_LMDB_MAP_SIZE = 0x103;
+constexpr int OPT_MERGE_OPERATOR = 0x104;
+constexpr int OPT_KEY_TTL = 0x105;
 
-  // Create an SST file
-  rocksdb::SstFileWriter sst_file_writer(rocksdb::EnvOptions(), context.m_db->GetOptions());
-  rocksdb::Status status = sst_file_writer.Open(sst_file);
+enum class IoEngine
+{
+  Epoll,
+  Uring
+};
 
-  if (!status.ok())
-  {
-    // Send error code
-    throw std::runtime_error("Failed to open SST file");
-  }
-}
+enum class StorageBackend
+{
+  RocksDb,
+  Lmdb
+};
 
-// DO NOT INLINE. THIS FUNCTION USES UNSAFE CODE (alloca)
-void handleRequest(WorkerContext& context)
+std::unique_ptr<EventLoop> makeEventLoop([[maybe_unused]] IoEngine engine, StorageEngine* db, [[maybe_unused]] bool decouple)
 {
-  // get opcode
-  char opcode;
-  struct timeval timeout = { 5, 0 };
+#ifdef HAVE_LIBURING
+  if (engine == IoEngine::Uring)
+    return std::make_unique<UringLoop>(db);
+#endif
 
-  if (!context.m_buffered_socket.read_n(&opcode, 1, timeout))
-  {
-    throw std::runtime_error("Failed to read opcode");
-  }
+#ifdef HAVE_SPSC_RING
+  if (decouple)
+    return std::make_unique<DecoupledLoop>(db);
+#endif
 
-  switch (opcode)
-  {
-    case OP_GET_ONE: // GET one
-      doGetOne(context);
-      return;
-    case OP_GET_N: // GET n
-      doGetN(context);
-      return;
-    case OP_GET_BETWEEN: // GET between
-      doGetBetween(context);
-      return;
-    case OP_PUT_ONE: // PUT one
-      doPutOne(context);
-      return;
-    case OP_PUT_MULTI: // PUT n
-      doPutMulti(context);
-      return;
-    case OP_BULK_PUT: // BULK PUT into SST (perhaps make it behave like OP_PUT_N?)
-      doPutBulk(context);
-      return;
-    default:
-      return; // Probably close the connection because something is awry
-  }
+  return std::make_unique<EpollLoop>(db);
 }
 
-// Function to handle incoming connections
-void workerThread(
-  UnixSocket client_socket,
-  struct sockaddr_un client_addr,
-  rocksdb::DB* db
-)
+void onStopSignal(int)
 {
-  try
-  {
-    cout << "Handling client connection..." << endl;
-    WorkerContext context(client_socket, client_addr, db);
-
-    // RERL: Read-Execute-Reply Loop
-    while (true)
-    {
-      handleRequest(context);
-    }
-  }
-  catch(const std::exception& e)
-  {
-    std::cerr << e.what() << '\n';
-    close(client_socket);
-  }
+  g_stop = true;
 }
 
 int main(int argc, char** argv)
 {
-  // Main loop to accept connections
-  std::mutex giveChildTimeToCopyDataMutex;
-
   string dbPath;
   string socketPath;
+  unsigned int ioThreads = std::thread::hardware_concurrency();
+  IoEngine ioEngine = IoEngine::Epoll;
+  bool decoupleIo = false;
+  bool coalesceWrites = false;
+  std::chrono::microseconds coalesceDelay(COALESCE_MAX_DELAY_US);
+  size_t coalesceBytes = COALESCE_MAX_BATCH_BYTES;
+  size_t hotCacheBytes = HOT_CACHE_BYTES;
+  string adminSocketPath;
+  double traceSample = 0;
+  string configPath;
+  StorageBackend backend = StorageBackend::RocksDb;
+  [[maybe_unused]] size_t lmdbMapSize = LMDB_MAP_BYTES; // LMDB builds only
+  string ingestDir;
+  StorageConfig storage;
+  vector<std::pair<string, string>> storageFlags;
   rocksdb::Options options;
   options.create_if_missing = true;
-  options.db_write_buffer_size = 4 << 30; // Default: 4GB
-  options.max_open_files = 500;           // Default: 500
 
   static struct option long_options[] = {
     {"db-path", required_argument, nullptr, 'd'},
     {"socket-path", required_argument, nullptr, 's'},
+    {"storage-engine", required_argument, nullptr, OPT_STORAGE_ENGINE},
+    {"lmdb-map-size", required_argument, nullptr, OPT_LMDB_MAP_SIZE},
+    {"config", required_argument, nullptr, OPT_CONFIG},
     {"write-buffer", required_argument, nullptr, 'w'},
     {"max-files", required_argument, nullptr, 'f'},
+    {"block-cache-bytes", required_argument, nullptr, OPT_STORAGE},
+    {"block-cache-type", required_argument, nullptr, OPT_STORAGE},
+    {"filter-bits-per-key", required_argument, nullptr, OPT_STORAGE},
+    {"filter-type", required_argument, nullptr, OPT_STORAGE},
+    {"block-size", required_argument, nullptr, OPT_STORAGE},
+    {"partition-index-filters", no_argument, nullptr, OPT_STORAGE},
+    {"pin-l0-filter-index", no_argument, nullptr, OPT_STORAGE},
+    {"compression-per-level", required_argument, nullptr, OPT_STORAGE},
+    {"bottommost-compression", required_argument, nullptr, OPT_STORAGE},
+    {"io-threads", required_argument, nullptr, 't'},
+    {"io-engine", required_argument, nullptr, 'e'},
+    {"put-batch-bytes", required_argument, nullptr, 'b'},
+    {"ingest-dir", required_argument, nullptr, 'i'},
+    {"prefix-extractor", required_argument, nullptr, 'p'},
+    {"merge-operator", required_argument, nullptr, OPT_MERGE_OPERATOR},
+    {"key-ttl", no_argument, nullptr, OPT_KEY_TTL},
+    {"cursor-idle-timeout", required_argument, nullptr, 'C'},
+    {"hot-cache-bytes", required_argument, nullptr, 'H'},
+    {"decouple-io", no_argument, nullptr, 'x'},
+    {"coalesce-writes", no_argument, nullptr, 'c'},
+    {"coalesce-delay", required_argument, nullptr, 'D'},
+    {"coalesce-bytes", required_argument, nullptr, 'B'},
+    {"admin-socket", required_argument, nullptr, 'A'},
+    {"trace-sample", required_argument, nullptr, 'T'},
     {"help", no_argument, nullptr, 'h'},
     {nullptr, 0, nullptr, 0}};
 
   int opt;
-  while ((opt = getopt_long(argc, argv, "d:s:w:f:h", long_options, nullptr)) != -1)
+  int optionIndex = 0;
+  while ((opt = getopt_long(argc, argv, "d:s:w:f:t:e:xb:i:p:C:H:cD:B:A:T:h", long_options, &optionIndex)) != -1)
   {
     switch (opt)
     {
@@ -1144,11 +4736,94 @@ int main(int argc, char** argv)
     case 's':
       socketPath = optarg;
       break;
+    case OPT_STORAGE_ENGINE:
+      if (string(optarg) == "rocksdb")
+        backend = StorageBackend::RocksDb;
+      else if (string(optarg) == "lmdb")
+        backend = StorageBackend::Lmdb;
+      else
+      {
+        cerr << "Unknown storage engine: " << optarg << endl;
+        return 1;
+      }
+      break;
+    case OPT_LMDB_MAP_SIZE:
+      lmdbMapSize = std::stoull(optarg);
+      break;
+    case OPT_CONFIG:
+      configPath = optarg;
+      break;
     case 'w':
-      options.db_write_buffer_size = std::stoull(optarg);
+      storageFlags.emplace_back("write-buffer", optarg);
       break;
     case 'f':
-      options.max_open_files = std::stoi(optarg);
+      storageFlags.emplace_back("max-files", optarg);
+      break;
+    case OPT_STORAGE:
+      storageFlags.emplace_back(long_options[optionIndex].name, optarg != nullptr ? optarg : "true");
+      break;
+    case 't':
+      ioThreads = std::stoul(optarg);
+      break;
+    case 'e':
+      if (string(optarg) == "epoll")
+        ioEngine = IoEngine::Epoll;
+      else if (string(optarg) == "io_uring")
+        ioEngine = IoEngine::Uring;
+      else
+      {
+        cerr << "Unknown I/O engine: " << optarg << endl;
+        return 1;
+      }
+      break;
+    case 'x':
+      decoupleIo = true;
+      break;
+    case 'b':
+      g_put_batch_bytes = std::stoull(optarg);
+      break;
+    case 'i':
+      ingestDir = optarg;
+      break;
+    case 'p':
+      g_prefix_extractor = makePrefixExtractor(optarg);
+      if (!g_prefix_extractor)
+      {
+        cerr << "Bad prefix extractor (want fixed:<len> or capped:<len>): " << optarg << endl;
+        return 1;
+      }
+      break;
+    case OPT_MERGE_OPERATOR:
+      g_merge_operator = makeMergeOperator(optarg);
+      if (!g_merge_operator)
+      {
+        cerr << "Bad merge operator (want add, max, min, append or list:<n>): " << optarg << endl;
+        return 1;
+      }
+      break;
+    case OPT_KEY_TTL:
+      g_key_ttl = true;
+      break;
+    case 'C':
+      g_cursor_idle_timeout = std::chrono::seconds(std::stoul(optarg));
+      break;
+    case 'H':
+      hotCacheBytes = std::stoull(optarg);
+      break;
+    case 'c':
+      coalesceWrites = true;
+      break;
+    case 'D':
+      coalesceDelay = std::chrono::microseconds(std::stoull(optarg));
+      break;
+    case 'B':
+      coalesceBytes = std::stoull(optarg);
+      break;
+    case 'A':
+      adminSocketPath = optarg;
+      break;
+    case 'T':
+      traceSample = std::stod(optarg);
       break;
     case 'h':
       print_usage(argv[0]);
@@ -1166,60 +4841,266 @@ int main(int argc, char** argv)
     return 1;
   }
 
+  if (ioThreads == 0)
+    ioThreads = 1;
+
+  // The config file first, then the flags on top
+  if (!configPath.empty() && !storage.load(configPath))
+    return 1;
+
+  for (const auto& [name, value] : storageFlags)
+  {
+    if (!storage.set(name, value))
+    {
+      cerr << "Bad value for --" << name << ": " << value << endl;
+      return 1;
+    }
+  }
+
+  if (!storage.apply(options, g_prefix_extractor != nullptr))
+    return 1;
+
+  g_fill_cache = storage.block_cache_bytes > 0;
+
+  // Prefix scans want prefix blooms: in the SST filters (see StorageConfig::apply), and on the
+  // memtable
+  if (g_prefix_extractor)
+  {
+    options.prefix_extractor = g_prefix_extractor;
+    options.memtable_prefix_bloom_size_ratio = 0.1;
+  }
+
+  options.merge_operator = g_merge_operator;
+  if (g_merge_operator && backend == StorageBackend::Lmdb)
+  {
+    cerr << "Error: LMDB has no merge operators (--merge-operator).\n";
+    return 1;
+  }
+
+  if (g_key_ttl)
+  {
+    if (backend == StorageBackend::Lmdb)
+    {
+      cerr << "Error: LMDB has no compaction to drop expired keys (--key-ttl).\n";
+      return 1;
+    }
+    if (g_merge_operator)
+    {
+      cerr << "Error: --key-ttl and --merge-operator can't be used together; merged values would lose their expiry.\n";
+      return 1;
+    }
+
+    options.compaction_filter = ExpiryCompactionFilter::instance();
+  }
+
+  if (traceSample > 0 && !Tracer::COMPILED_IN)
+  {
+    cerr << "Error: --trace-sample needs a build with ENABLE_TRACING (cmake -DSCRAMJET_WITH_TRACING=ON).\n";
+    return 1;
+  }
+
+  // Tickers only; histograms and timers cost too much on the read path
+  if (!adminSocketPath.empty() && backend == StorageBackend::RocksDb)
+  {
+    options.statistics = rocksdb::CreateDBStatistics();
+    options.statistics->set_stats_level(rocksdb::StatsLevel::kExceptHistogramOrTimers);
+  }
+
+#ifndef HAVE_LMDB
+  if (backend == StorageBackend::Lmdb)
+  {
+    cerr << "Error: this build has no LMDB support (configure with liblmdb installed).\n";
+    return 1;
+  }
+#endif
+
+#ifndef HAVE_LIBURING
+  if (ioEngine == IoEngine::Uring)
+  {
+    cerr << "Error: this build has no io_uring support (configure with liburing installed).\n";
+    return 1;
+  }
+#endif
+
+#ifndef HAVE_SPSC_RING
+  if (decoupleIo)
+  {
+    cerr << "Error: --decouple-io needs the mirrored receive ring (built with DISABLE_MIRRORED_RING).\n";
+    return 1;
+  }
+#endif
+
+  if (decoupleIo && ioEngine == IoEngine::Uring)
+  {
+    cerr << "Error: --decouple-io only works with the epoll engine.\n";
+    return 1;
+  }
+
+  // Stop cleanly on SIGINT/SIGTERM. No SA_RESTART, so the blocking accept() below wakes up.
+  struct sigaction stop_action;
+  memset(&stop_action, 0, sizeof(stop_action));
+  stop_action.sa_handler = onStopSignal;
+  sigaction(SIGINT, &stop_action, nullptr);
+  sigaction(SIGTERM, &stop_action, nullptr);
+  signal(SIGPIPE, SIG_IGN);
+
   // Initialize the database
-  rocksdb::DB* db = nullptr;
-  auto status = rocksdb::DB::Open(options, dbPath, &db);
+  std::unique_ptr<StorageEngine> db;
+  rocksdb::Status status;
+#ifdef HAVE_LMDB
+  if (backend == StorageBackend::Lmdb)
+    status = LmdbEngine::open(dbPath, lmdbMapSize, db);
+  else
+#endif
+    status = RocksDbEngine::open(options, dbPath, ingestDir, [&storage](const string& spec, rocksdb::ColumnFamilyOptions& cf_options) {
+      return configureNamespace(spec, storage, cf_options);
+    }, db);
+
   if (!status.ok())
   {
     cerr << "Error opening database: " << status.ToString() << endl;
     return 1;
   }
 
+  cout << "Opened " << db->name() << " database at " << dbPath << endl;
+
   auto socket = bindAndListen(socketPath);
   if (socket == -1)
   {
     cerr << "Error binding to socket: " << strerror(errno) << endl;
-    goto cleanup_fail;
+
+    return 1;
   }
 
-  while (true)
+  // Metrics are only recorded for an admin socket to serve them on
+  UnixSocket adminSocket = -1;
+  std::unique_ptr<PerThread<ThreadMetrics>> metrics;
+  if (!adminSocketPath.empty())
+  {
+    adminSocket = bindAndListen(adminSocketPath);
+    if (adminSocket == -1)
+    {
+      cerr << "Error binding to admin socket: " << strerror(errno) << endl;
+      close(socket);
+      unlink(socketPath.c_str());
+      return 1;
+    }
+
+    metrics = std::make_unique<PerThread<ThreadMetrics>>();
+    g_metrics = metrics.get();
+  }
+
+  // Fixed pool of event loops; accepted connections are dealt out round-robin
+  vector<std::unique_ptr<EventLoop>> loops;
+  vector<std::thread> threads;
+  try
+  {
+    for (unsigned int i = 0; i < ioThreads; i++)
+      loops.push_back(makeEventLoop(ioEngine, db.get(), decoupleIo));
+  }
+  catch (const std::exception& e)
+  {
+    if (ioEngine != IoEngine::Uring)
+      throw;
+
+    // Kernel without (usable) io_uring; the epoll engine works everywhere
+    cerr << e.what() << ", falling back to epoll" << endl;
+    ioEngine = IoEngine::Epoll;
+    loops.clear();
+    for (unsigned int i = 0; i < ioThreads; i++)
+      loops.push_back(makeEventLoop(ioEngine, db.get(), decoupleIo));
+  }
+
+  std::unique_ptr<HotCache> hotCache;
+  if (hotCacheBytes > 0)
+  {
+    hotCache = std::make_unique<HotCache>(hotCacheBytes);
+    g_hot_cache = hotCache.get();
+    cout << "Caching hot values (" << hotCacheBytes << " bytes)" << endl;
+  }
+
+  std::unique_ptr<WriteCoalescer> coalescer;
+  if (coalesceWrites)
+  {
+    coalescer = std::make_unique<WriteCoalescer>(db.get(), coalesceDelay, coalesceBytes);
+    g_coalescer = coalescer.get();
+    cout << "Coalescing writes (max delay " << coalesceDelay.count() << "us, max batch " << coalesceBytes << " bytes)" << endl;
+  }
+
+  if (traceSample > 0)
+  {
+    Tracer::configure(traceSample);
+    cout << "Tracing " << traceSample * 100 << "% of requests" << endl;
+  }
+
+  std::unique_ptr<AdminServer> admin;
+  if (adminSocket != -1)
+  {
+    admin = std::make_unique<AdminServer>(db.get(), options.statistics, adminSocket);
+    cout << "Serving metrics on " << adminSocketPath << endl;
+  }
+
+  for (auto& loop : loops)
+    threads.emplace_back(&EventLoop::run, loop.get());
+
+  cout << "Serving with " << ioThreads << (ioEngine == IoEngine::Uring ? " io_uring" : " epoll") << " I/O threads"
+       << (decoupleIo ? " (each with an executor thread)" : "") << endl;
+
+  // Main loop to accept connections
+  size_t next_loop = 0;
+  while (!g_stop)
   {
     struct sockaddr_un client_addr;
     socklen_t client_addr_len = sizeof(client_addr);
-    UnixSocket client_socket = accept(socket, reinterpret_cast< sockaddr*>(&client_addr), &client_addr_len);
+    UnixSocket client_socket = accept4(
+      socket,
+      reinterpret_cast<sockaddr*>(&client_addr),
+      &client_addr_len,
+      SOCK_NONBLOCK | SOCK_CLOEXEC
+    );
+
     if (client_socket == -1)
     {
-      cerr << "Error accepting connection: " << strerror(errno) << endl;
+      if (errno != EINTR)
+        cerr << "Error accepting connection: " << strerror(errno) << endl;
       continue; // Continue to accept next connection
     }
 
-    cout << "Accepted connection from client." << endl;
-    // Handle the client connection here
+    loops[next_loop]->adopt(client_socket, client_addr);
+    next_loop = (next_loop + 1) % loops.size();
+  }
 
-    struct sockaddr_un client_addr_copy;
-    memcpy(
-      reinterpret_cast<void*>(&client_addr_copy),
-      reinterpret_cast<void*>(&client_addr),
-      sizeof(client_addr)
-    );
+  cout << "Shutting down..." << endl;
+  close(socket);
+  unlink(socketPath.c_str());
 
-    std::thread worker(workerThread, client_addr_copy, db);
-    worker.detach();
+  for (auto& thread : threads)
+    thread.join();
+
+  if (admin)
+  {
+    admin.reset();
+    unlink(adminSocketPath.c_str());
   }
 
-cleanup:  
-  // De-initialize the database
-  db->Close();
-  delete db;
-  db = nullptr;
+  // Commits what's left; the acks die with the loops
+  g_coalescer = nullptr;
+  coalescer.reset();
+  loops.clear();
 
-  return 0;
+  if (hotCache)
+  {
+    HotCache::Stats stats = hotCache->stats();
+    cout << "Hot value cache: " << stats.hits << " hits, " << stats.misses << " misses" << endl;
+    g_hot_cache = nullptr;
+    hotCache.reset();
+  }
 
-cleanup_fail:
   // De-initialize the database
-  db->Close();
-  delete db;
-  db = nullptr;
+  db.reset();
 
-  return 1;
+  g_metrics = nullptr;
+  metrics.reset();
+
+  return 0;
 }
@@ -0,0 +1,27 @@
+#ifndef _FCSH_TEST_CHECK_H
+#define _FCSH_TEST_CHECK_H
+
+#include <iostream>
+
+// Just enough of a harness for the unit tests: CHECK reports a failed condition and carries on,
+// and a test's main() returns testResult(), which fails the run if any check did
+inline int g_check_failures = 0;
+
+#define CHECK(condition)                                                                         \
+  do                                                                                             \
+  {                                                                                              \
+    if (!(condition))                                                                            \
+    {                                                                                            \
+      std::cerr << __FILE__ << ":" << __LINE__ << ": check failed: " #condition << std::endl;   \
+      g_check_failures++;                                                                        \
+    }                                                                                            \
+  } while (0)
+
+inline int testResult()
+{
+  if (g_check_failures > 0)
+    std::cerr << g_check_failures << " check(s) failed" << std::endl;
+  return g_check_failures == 0 ? 0 : 1;
+}
+
+#endif
@@ -0,0 +1,159 @@
+#include <cstdio>
+#include <cstdlib>
+#include <fstream>
+#include <string>
+
+#include <unistd.h>
+
+#include <config.h>
+
+#include "check.h"
+
+void testSet()
+{
+  StorageConfig config;
+  CHECK(config.set("write-buffer", "1048576") && config.write_buffer == 1048576);
+  CHECK(config.set("max-files", "-1") && config.max_files == -1);
+  CHECK(config.set("block-cache-type", "hyperclock") && config.hyper_clock_cache);
+  CHECK(config.set("filter-type", "ribbon") && config.ribbon_filter);
+  CHECK(config.set("filter-bits-per-key", "9.5") && config.filter_bits_per_key == 9.5);
+  CHECK(config.set("partition-index-filters", "1") && config.partition_index_filters);
+  CHECK(config.set("pin-l0-filter-index", "false") && !config.pin_l0_filter_index);
+  CHECK(config.set("bottommost-compression", "zstd") && config.bottommost_compression == rocksdb::kZSTD);
+
+  CHECK(config.set("compression-per-level", "none,lz4,zstd"));
+  CHECK(config.compression_per_level.size() == 3);
+  CHECK(config.compression_per_level[0] == rocksdb::kNoCompression);
+  CHECK(config.compression_per_level[2] == rocksdb::kZSTD);
+
+  CHECK(!config.set("write-buffer", "lots"));
+  CHECK(!config.set("block-cache-type", "arc"));
+  CHECK(!config.set("filter-type", "cuckoo"));
+  CHECK(!config.set("partition-index-filters", "yes"));
+  CHECK(!config.set("compression-per-level", "none,,zstd"));
+  CHECK(!config.set("compression-per-level", "lz4,"));
+  CHECK(!config.set("bottommost-compression", "lzma"));
+  CHECK(!config.set("no-such-setting", "1"));
+}
+
+void testLoad()
+{
+  char path[] = "/tmp/config_testXXXXXX";
+  int fd = mkstemp(path);
+  CHECK(fd >= 0);
+  close(fd);
+
+  {
+    std::ofstream out(path);
+    out << "# RocksDB tuning\n"
+        << "\n"
+        << "  block-size = 16384   # bigger blocks\n"
+        << "pin-l0-filter-index\n"
+        << "compression-per-level=none,lz4\n";
+  }
+
+  StorageConfig config;
+  CHECK(config.load(path));
+  CHECK(config.block_size == 16384);
+  CHECK(config.pin_l0_filter_index);
+  CHECK(config.compression_per_level.size() == 2);
+
+  {
+    std::ofstream out(path);
+    out << "block-size = 4096\n"
+        << "block-size = big\n";
+  }
+  CHECK(!config.load(path));
+
+  remove(path);
+  CHECK(!config.load(path));
+}
+
+void testApply()
+{
+  StorageConfig config;
+  rocksdb::Options options;
+  CHECK(config.set("max-files", "123"));
+  CHECK(config.apply(options, false));
+  CHECK(options.max_open_files == 123);
+  CHECK(!config.table_options.filter_policy);
+
+  // Prefix scans get prefix blooms even without filters asked for
+  StorageConfig scans;
+  CHECK(scans.apply(options, true));
+  CHECK(scans.table_options.filter_policy != nullptr);
+}
+
+// Prefix scans run in prefix mode only when every key under the prefix shares its bucket
+void testCoversPrefix()
+{
+  CHECK(makePrefixExtractor("fixed:0") == nullptr);
+  CHECK(makePrefixExtractor("fixed:x") == nullptr);
+  CHECK(makePrefixExtractor("rolling:3") == nullptr);
+
+  auto fixed = makePrefixExtractor("fixed:3");
+  CHECK(fixed != nullptr);
+  CHECK(!coversPrefix(*fixed, ""));
+  CHECK(!coversPrefix(*fixed, "ab"));
+  CHECK(coversPrefix(*fixed, "abc"));
+  CHECK(coversPrefix(*fixed, "abcd"));
+
+  // A capped extractor takes in short keys too, but the keys under a short prefix reach past it
+  auto capped = makePrefixExtractor("capped:3");
+  CHECK(capped != nullptr);
+  CHECK(!coversPrefix(*capped, ""));
+  CHECK(!coversPrefix(*capped, "ab"));
+  CHECK(coversPrefix(*capped, "abc"));
+  CHECK(coversPrefix(*capped, "abcd"));
+}
+
+rocksdb::Status configure(const std::string& spec, rocksdb::ColumnFamilyOptions& options)
+{
+  StorageConfig storage;
+  options = rocksdb::ColumnFamilyOptions();
+  return configureNamespace(spec, storage, options);
+}
+
+void testNamespace()
+{
+  rocksdb::ColumnFamilyOptions options;
+  CHECK(configure("", options).ok());
+  CHECK(configure(";;", options).ok());
+
+  CHECK(configure("compaction=universal;compression=lz4;ttl=3600", options).ok());
+  CHECK(options.compaction_style == rocksdb::kCompactionStyleUniversal);
+  CHECK(options.compression == rocksdb::kLZ4Compression);
+  CHECK(options.ttl == 3600);
+
+  CHECK(configure("prefix=fixed:3", options).ok() && options.prefix_extractor != nullptr);
+  CHECK(configure("block-cache-bytes=1048576", options).ok());
+
+  CHECK(configure("merge=add", options).ok() && options.merge_operator != nullptr);
+  CHECK(configure("merge=none", options).ok() && options.merge_operator == nullptr);
+  CHECK(configure("key-ttl=on", options).ok() && options.compaction_filter == ExpiryCompactionFilter::instance());
+  CHECK(configure("key-ttl=off", options).ok() && options.compaction_filter == nullptr);
+
+  CHECK(configure("compaction=tiered", options).IsInvalidArgument());
+  CHECK(configure("compression=lzma", options).IsInvalidArgument());
+  CHECK(configure("ttl=soon", options).IsInvalidArgument());
+  CHECK(configure("prefix=bad", options).IsInvalidArgument());
+  CHECK(configure("block-cache-bytes=0", options).IsInvalidArgument());
+  CHECK(configure("merge=list:0", options).IsInvalidArgument());
+  CHECK(configure("key-ttl=maybe", options).IsInvalidArgument());
+  CHECK(configure("colour=blue", options).IsInvalidArgument());
+
+  // Merged values would lose their trailers, in either order
+  CHECK(configure("merge=add;key-ttl=on", options).IsInvalidArgument());
+  CHECK(configure("key-ttl=on;merge=list:4", options).IsInvalidArgument());
+  CHECK(configure("merge=add;key-ttl=on;merge=none", options).ok());
+}
+
+int main()
+{
+  testSet();
+  testLoad();
+  testApply();
+  testCoversPrefix();
+  testNamespace();
+  return testResult();
+}
@@ -0,0 +1,104 @@
+#include <cstdint>
+#include <string>
+
+#include <expiry.h>
+
+#include "check.h"
+
+// A value as a namespace with key-ttl stores it
+std::string stored(const std::string& value, uint32_t ttl)
+{
+  char trailer[EXPIRY_TRAILER_MAX];
+  return value + std::string(trailer, expiryTrailer(ttl, trailer));
+}
+
+uint32_t expiresAt(const std::string& value)
+{
+  auto at = reinterpret_cast<const uint8_t*>(value.data() + value.size() - EXPIRY_TRAILER_MAX);
+  return (uint32_t(at[0]) << 24) | (uint32_t(at[1]) << 16) | (uint32_t(at[2]) << 8) | at[3];
+}
+
+void testRoundTrip()
+{
+  uint32_t now = expiryNow();
+
+  std::string forever = stored("abc", 0);
+  CHECK(forever.size() == 4);
+  rocksdb::Slice value(forever);
+  CHECK(stripExpiry(value, UINT32_MAX) && value.ToString() == "abc");
+
+  std::string expiring = stored("abc", 100);
+  CHECK(expiring.size() == 3 + EXPIRY_TRAILER_MAX);
+  uint32_t at = expiresAt(expiring);
+  CHECK(at >= now + 100 && at <= expiryNow() + 100);
+
+  value = rocksdb::Slice(expiring);
+  CHECK(stripExpiry(value, at - 1) && value.ToString() == "abc");
+  value = rocksdb::Slice(expiring);
+  CHECK(!stripExpiry(value, at));
+
+  // An empty value that expires is all trailer
+  std::string empty = stored("", 100);
+  value = rocksdb::Slice(empty);
+  CHECK(stripExpiry(value, now) && value.empty());
+}
+
+// A TTL reaching past 2106 expires at the last second a BE32 can say, rather than wrapping into the past
+void testClamp()
+{
+  std::string value = stored("v", UINT32_MAX);
+  CHECK(expiresAt(value) == UINT32_MAX);
+
+  rocksdb::Slice slice(value);
+  CHECK(stripExpiry(slice, expiryNow()) && slice.ToString() == "v");
+}
+
+// Trailers don't identify themselves: a value without one comes back as it is only if it ends in
+// neither marker, which is why a namespace can't switch key TTLs on over existing values
+void testNoTrailer()
+{
+  rocksdb::Slice value("xyz");
+  CHECK(stripExpiry(value, expiryNow()) && value.ToString() == "xyz");
+
+  std::string never("ab\0", 3);
+  value = rocksdb::Slice(never);
+  CHECK(stripExpiry(value, expiryNow()) && value.ToString() == "ab");
+
+  // Ends like an expiry but is too short to hold one
+  std::string short_value("\x07\x01", 2);
+  value = rocksdb::Slice(short_value);
+  CHECK(stripExpiry(value, expiryNow()) && value.size() == 2);
+
+  value = rocksdb::Slice();
+  CHECK(stripExpiry(value, expiryNow()) && value.empty());
+}
+
+void testFilter()
+{
+  const ExpiryCompactionFilter* filter = ExpiryCompactionFilter::instance();
+  CHECK(filter == ExpiryCompactionFilter::instance());
+
+  std::string live = stored("live", 3600);
+  std::string forever = stored("forever", 0);
+  CHECK(!filter->Filter(0, rocksdb::Slice("k"), rocksdb::Slice(live), nullptr, nullptr));
+  CHECK(!filter->Filter(0, rocksdb::Slice("k"), rocksdb::Slice(forever), nullptr, nullptr));
+  CHECK(!filter->Filter(0, rocksdb::Slice("k"), rocksdb::Slice("plain"), nullptr, nullptr));
+
+  // Expired a second ago
+  std::string expired = stored("gone", 3600);
+  uint32_t past = expiryNow() - 1;
+  expired[expired.size() - 5] = static_cast<char>(past >> 24);
+  expired[expired.size() - 4] = static_cast<char>(past >> 16);
+  expired[expired.size() - 3] = static_cast<char>(past >> 8);
+  expired[expired.size() - 2] = static_cast<char>(past);
+  CHECK(filter->Filter(0, rocksdb::Slice("k"), rocksdb::Slice(expired), nullptr, nullptr));
+}
+
+int main()
+{
+  testRoundTrip();
+  testClamp();
+  testNoTrailer();
+  testFilter();
+  return testResult();
+}
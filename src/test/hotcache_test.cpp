@@ -0,0 +1,131 @@
+#include <cstdint>
+#include <cstdio>
+#include <functional>
+#include <string>
+#include <string_view>
+#include <vector>
+
+#include <hotcache.h>
+
+#include "check.h"
+
+// 64 shards of 1KB; an entry of an 8-byte key and a 28-byte value is charged 100 bytes, so a shard
+// holds ten of them
+constexpr size_t CAPACITY = 64 * 1024;
+const std::string VALUE(28, 'v');
+
+// Keys that land in the same shard as each other, so they compete for its space
+std::vector<std::string> keysInOneShard(size_t count)
+{
+  std::vector<std::string> keys;
+  uint64_t shard = 0;
+  for (int i = 0; keys.size() < count; i++)
+  {
+    char key[16];
+    snprintf(key, sizeof(key), "key%05d", i);
+    uint64_t hash = std::hash<std::string_view>()(key);
+    if (keys.empty())
+      shard = hash >> 58;
+    if (hash >> 58 == shard)
+      keys.push_back(key);
+  }
+  return keys;
+}
+
+// Look a key up, and fill it in on a miss the way a reader would
+bool readThrough(HotCache& cache, const std::string& key)
+{
+  std::string value;
+  uint64_t ticket;
+  if (cache.lookup(key, value, ticket))
+    return true;
+
+  cache.insert(key, VALUE, ticket);
+  return false;
+}
+
+bool cached(HotCache& cache, const std::string& key)
+{
+  std::string value;
+  uint64_t ticket;
+  return cache.lookup(key, value, ticket);
+}
+
+void testHitAndMiss()
+{
+  HotCache cache(CAPACITY);
+  std::string value;
+  uint64_t ticket;
+  CHECK(!cache.lookup("a", value, ticket));
+  cache.insert("a", "1", ticket);
+  CHECK(cache.lookup("a", value, ticket) && value == "1");
+
+  HotCache::Stats stats = cache.stats();
+  CHECK(stats.hits == 1 && stats.misses == 1 && stats.entries == 1);
+
+  // Too big for a shard to be worth it
+  CHECK(!cache.lookup("big", value, ticket));
+  cache.insert("big", std::string(CAPACITY / 64, 'x'), ticket);
+  CHECK(!cache.lookup("big", value, ticket));
+}
+
+// A value read before a write landed must not go back in after the write invalidated the key
+void testStaleInsert()
+{
+  HotCache cache(CAPACITY);
+  std::string value;
+  uint64_t ticket;
+  CHECK(!cache.lookup("k", value, ticket));
+  cache.invalidate("k");
+  cache.insert("k", "old", ticket);
+  CHECK(!cache.lookup("k", value, ticket));
+
+  cache.insert("k", "new", ticket);
+  CHECK(cache.lookup("k", value, ticket) && value == "new");
+
+  // clear() bumps every shard's generation too
+  CHECK(!cache.lookup("j", value, ticket));
+  cache.clear();
+  cache.insert("j", "old", ticket);
+  CHECK(!cache.lookup("j", value, ticket));
+  CHECK(cache.stats().entries == 0);
+}
+
+void testClockAndAdmission()
+{
+  HotCache cache(CAPACITY);
+  std::vector<std::string> keys = keysInOneShard(12);
+
+  // Fill the shard
+  for (size_t i = 0; i < 10; i++)
+    readThrough(cache, keys[i]);
+  CHECK(cache.stats().entries == 10);
+
+  // Hit all but the last, which leaves it the only one the clock hand doesn't spare
+  for (size_t i = 0; i < 9; i++)
+    CHECK(cached(cache, keys[i]));
+
+  // A key asked for once is no more popular than anything it would push out: not admitted
+  CHECK(!readThrough(cache, keys[10]));
+  CHECK(!cached(cache, keys[10]));
+  CHECK(cache.stats().entries == 10);
+
+  // Asked for more often than the victim, it gets in, and the unreferenced entry makes way
+  CHECK(!cached(cache, keys[11]));
+  CHECK(!cached(cache, keys[11]));
+  CHECK(!readThrough(cache, keys[11]));
+  CHECK(cached(cache, keys[11]));
+  CHECK(!cached(cache, keys[9]));
+  for (size_t i = 0; i < 9; i++)
+    CHECK(cached(cache, keys[i]));
+  CHECK(cache.stats().entries == 10);
+  CHECK(cache.stats().bytes <= CAPACITY / 64);
+}
+
+int main()
+{
+  testHitAndMiss();
+  testStaleInsert();
+  testClockAndAdmission();
+  return testResult();
+}
@@ -0,0 +1,126 @@
+#include <cstdint>
+#include <memory>
+#include <string>
+#include <vector>
+
+#include <merge.h>
+
+#include "check.h"
+
+std::string int64Value(int64_t value)
+{
+  std::string out(8, '\0');
+  uint64_t bits = static_cast<uint64_t>(value);
+  for (size_t i = 8; i-- > 0; bits >>= 8)
+    out[i] = static_cast<char>(bits & 0xFF);
+  return out;
+}
+
+// Run one merge of an operand (in stored form) into a value, or into nothing
+bool merge(const ValueMergeOperator& op, const std::string* existing, const std::string& operand, std::string& out)
+{
+  rocksdb::Slice base = existing != nullptr ? rocksdb::Slice(*existing) : rocksdb::Slice();
+  return op.Merge(rocksdb::Slice("key"), existing != nullptr ? &base : nullptr, rocksdb::Slice(operand), &out, nullptr);
+}
+
+std::string listOf(const ValueMergeOperator& op, const std::vector<std::string>& items)
+{
+  std::string list;
+  for (const std::string& item : items)
+  {
+    std::string encoded;
+    op.encodeOperand(item, encoded);
+    list += encoded;
+  }
+  return list;
+}
+
+void testInt64()
+{
+  auto add = makeMergeOperator("add");
+  auto max = makeMergeOperator("max");
+  auto min = makeMergeOperator("min");
+  CHECK(add && max && min);
+
+  std::string encoded;
+  CHECK(add->encodeOperand(int64Value(5), encoded) && encoded == int64Value(5));
+  CHECK(!add->encodeOperand("1234567", encoded));
+
+  std::string out;
+  std::string base = int64Value(40);
+  CHECK(merge(*add, &base, int64Value(2), out) && out == int64Value(42));
+  CHECK(merge(*add, nullptr, int64Value(-3), out) && out == int64Value(-3));
+
+  // Adding wraps rather than overflowing
+  base = int64Value(INT64_MAX);
+  CHECK(merge(*add, &base, int64Value(1), out) && out == int64Value(INT64_MIN));
+
+  base = int64Value(-7);
+  CHECK(merge(*max, &base, int64Value(-9), out) && out == int64Value(-7));
+  CHECK(merge(*min, &base, int64Value(-9), out) && out == int64Value(-9));
+
+  // A base that isn't an integer (a PUT_ONE's value, say) counts as no value at all
+  base = "junk";
+  CHECK(merge(*max, &base, int64Value(-9), out) && out == int64Value(-9));
+  CHECK(merge(*min, &base, int64Value(12), out) && out == int64Value(12));
+  CHECK(merge(*add, &base, int64Value(12), out) && out == int64Value(12));
+
+  // A malformed operand fails the merge
+  base = int64Value(1);
+  CHECK(!merge(*add, &base, "bad", out));
+}
+
+void testAppend()
+{
+  auto append = makeMergeOperator("append");
+  CHECK(append != nullptr);
+
+  std::string out;
+  std::string base = "ab";
+  CHECK(merge(*append, &base, "cd", out) && out == "abcd");
+  CHECK(merge(*append, nullptr, "cd", out) && out == "cd");
+}
+
+void testBoundedList()
+{
+  auto list = makeMergeOperator("list:3");
+  CHECK(list != nullptr);
+
+  std::string encoded;
+  CHECK(list->encodeOperand("xyz", encoded) && encoded == std::string("\0\0\0\3xyz", 7));
+
+  // Merging past the limit keeps the newest items
+  std::string out;
+  std::string base = listOf(*list, { "1", "22" });
+  CHECK(merge(*list, &base, listOf(*list, { "333", "4444" }), out));
+  CHECK(out == listOf(*list, { "22", "333", "4444" }));
+
+  // Operands may themselves be folded lists, as in a partial merge
+  CHECK(merge(*list, nullptr, listOf(*list, { "a", "b", "c", "d", "e" }), out));
+  CHECK(out == listOf(*list, { "c", "d", "e" }));
+
+  // A base that isn't a list is dropped; an operand that isn't one fails the merge
+  base = "not a list";
+  CHECK(merge(*list, &base, listOf(*list, { "a" }), out) && out == listOf(*list, { "a" }));
+  CHECK(!merge(*list, nullptr, std::string("\0\0\0\x09" "ab", 6), out));
+}
+
+void testSpecs()
+{
+  CHECK(makeMergeOperator("list:1") != nullptr);
+  CHECK(makeMergeOperator("list:0") == nullptr);
+  CHECK(makeMergeOperator("list:x") == nullptr);
+  CHECK(makeMergeOperator("list:") == nullptr);
+  CHECK(makeMergeOperator("list") == nullptr);
+  CHECK(makeMergeOperator("sum") == nullptr);
+  CHECK(makeMergeOperator("") == nullptr);
+}
+
+int main()
+{
+  testInt64();
+  testAppend();
+  testBoundedList();
+  testSpecs();
+  return testResult();
+}
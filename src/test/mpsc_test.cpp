@@ -0,0 +1,88 @@
+#include <cstdint>
+#include <memory>
+#include <thread>
+#include <vector>
+
+#include <mpsc.h>
+
+#include "check.h"
+
+struct Item : MpscNode
+{
+  uint32_t producer;
+  uint32_t sequence;
+};
+
+void testEmpty()
+{
+  MpscQueue<Item> queue;
+  CHECK(queue.pop() == nullptr);
+
+  Item item;
+  item.producer = 0;
+  item.sequence = 0;
+  queue.push(&item);
+  CHECK(queue.pop() == &item);
+  CHECK(queue.pop() == nullptr);
+}
+
+// Several threads push at once while one pops: every item comes out exactly once, and each
+// producer's items come out in the order it pushed them
+void testProducers()
+{
+  constexpr uint32_t PRODUCERS = 4;
+  constexpr uint32_t ITEMS = 200000;
+
+  MpscQueue<Item> queue;
+  std::vector<std::unique_ptr<Item[]>> items;
+  for (uint32_t p = 0; p < PRODUCERS; p++)
+  {
+    items.emplace_back(new Item[ITEMS]);
+    for (uint32_t i = 0; i < ITEMS; i++)
+    {
+      items[p][i].producer = p;
+      items[p][i].sequence = i;
+    }
+  }
+
+  std::vector<std::thread> producers;
+  for (uint32_t p = 0; p < PRODUCERS; p++)
+  {
+    producers.emplace_back([&queue, &items, p]() {
+      for (uint32_t i = 0; i < ITEMS; i++)
+        queue.push(&items[p][i]);
+    });
+  }
+
+  // pop() can come back empty while a push is halfway done; keep asking
+  std::vector<uint32_t> next(PRODUCERS, 0);
+  bool in_order = true;
+  for (uint64_t popped = 0; popped < uint64_t(PRODUCERS) * ITEMS; )
+  {
+    Item* item = queue.pop();
+    if (item == nullptr)
+    {
+      std::this_thread::yield();
+      continue;
+    }
+
+    if (item->sequence != next[item->producer]++)
+      in_order = false;
+    popped++;
+  }
+
+  for (std::thread& producer : producers)
+    producer.join();
+
+  CHECK(in_order);
+  for (uint32_t p = 0; p < PRODUCERS; p++)
+    CHECK(next[p] == ITEMS);
+  CHECK(queue.pop() == nullptr);
+}
+
+int main()
+{
+  testEmpty();
+  testProducers();
+  return testResult();
+}
@@ -0,0 +1,187 @@
+#include <algorithm>
+#include <cstdint>
+#include <stdexcept>
+#include <thread>
+#include <vector>
+
+#include <rbuf.h>
+
+#include "check.h"
+
+// Fills `count` bytes at the ring's free space with a running sequence, and publishes them
+template <typename Ring>
+void produceSequence(Ring& ring, size_t count, uint8_t& next)
+{
+  RingSpan<uint8_t> free = ring.free_span();
+  for (size_t i = 0; i < count; i++)
+    (i < free.first_len ? free.first[i] : free.second[i - free.first_len]) = next++;
+  ring.produce(count);
+}
+
+// Whether the `count` bytes at the front of the ring (in one piece or two) carry the sequence
+template <typename Ring>
+bool holdsSequence(const Ring& ring, size_t count, uint8_t first)
+{
+  RingSpan<const uint8_t> span = ring.peek_span(0, count);
+  if (span.size() != count)
+    return false;
+
+  for (size_t i = 0; i < count; i++)
+  {
+    uint8_t byte = i < span.first_len ? span.first[i] : span.second[i - span.first_len];
+    if (byte != static_cast<uint8_t>(first + i))
+      return false;
+  }
+  return true;
+}
+
+void testPlainWrap()
+{
+  RingBuffer<uint8_t> ring(16);
+  uint8_t next = 0;
+  produceSequence(ring, 12, next);
+  CHECK(ring.discard(10) == 10);
+
+  // 2 queued at 10..11; the free space runs from 12 to the end and then wraps to the front
+  RingSpan<uint8_t> free = ring.free_span();
+  CHECK(free.first_len == 4 && free.second_len == 10);
+
+  produceSequence(ring, 8, next);
+  RingSpan<const uint8_t> span = ring.peek_span(0, 100);
+  CHECK(span.first_len == 6 && span.second_len == 4);
+  CHECK(holdsSequence(ring, 10, 10));
+}
+
+void testMirroredWrap()
+{
+  MirroredRingBuffer<uint8_t> ring(1);
+  size_t capacity = ring.capacity();
+  CHECK(capacity >= 4096 && (capacity & (capacity - 1)) == 0);
+
+  // Move the start most of the way round, so what follows crosses the end of the allocation
+  uint8_t next = 0;
+  produceSequence(ring, capacity - 100, next);
+  CHECK(ring.discard(capacity - 100) == capacity - 100);
+  CHECK(ring.empty());
+
+  // Free space and queued data each come in one piece however they straddle the end
+  RingSpan<uint8_t> free = ring.free_span();
+  CHECK(free.first_len == capacity && free.second_len == 0);
+
+  uint8_t first = next;
+  produceSequence(ring, 300, next);
+  RingSpan<const uint8_t> span = ring.peek_span(0, 300);
+  CHECK(span.first_len == 300 && span.second_len == 0);
+  CHECK(holdsSequence(ring, 300, first));
+
+  // Peeking past the data is clamped, peeking at an offset skips
+  CHECK(ring.peek_span(250, 1000).first_len == 50);
+  CHECK(ring.peek_span(300, 1).first_len == 0);
+  CHECK(ring.peek_span(10, 1).first[0] == static_cast<uint8_t>(first + 10));
+
+  uint8_t out[50];
+  CHECK(ring.pop_n(50, out) == 50);
+  CHECK(out[0] == first && out[49] == static_cast<uint8_t>(first + 49));
+  CHECK(ring.size() == 250);
+
+  // Discarding more than there is drops what is there
+  CHECK(ring.discard(1000) == 250);
+  CHECK(ring.empty());
+
+  // Producing more than the free space is refused and leaves the ring alone
+  bool threw = false;
+  try
+  {
+    ring.produce(capacity + 1);
+  }
+  catch (const std::out_of_range&)
+  {
+    threw = true;
+  }
+  CHECK(threw && ring.empty());
+}
+
+void testMirroredGrow()
+{
+  MirroredRingBuffer<uint8_t> ring(1);
+  size_t capacity = ring.capacity();
+
+  uint8_t next = 0;
+  produceSequence(ring, capacity - 10, next);
+  ring.discard(capacity - 10);
+
+  // 20 bytes queued across the end; pushing more than fits grows the ring and keeps them in order
+  uint8_t first = next;
+  produceSequence(ring, 20, next);
+  std::vector<uint8_t> more(capacity);
+  for (size_t i = 0; i < more.size(); i++)
+    more[i] = next++;
+  ring.push_n(more.data(), more.size());
+
+  CHECK(ring.capacity() > capacity);
+  CHECK(ring.size() == capacity + 20);
+  CHECK(holdsSequence(ring, capacity + 20, first));
+}
+
+// One thread produces a long sequence in uneven chunks while another polls for it and checks
+// every byte, going round the ring many times
+void testSpsc()
+{
+  MirroredRingBuffer<uint8_t, true> ring(4096);
+  constexpr size_t TOTAL = 2 << 20;
+
+  std::thread producer([&ring]() {
+    uint8_t next = 0;
+    size_t sent = 0;
+    size_t chunk = 1;
+    while (sent < TOTAL)
+    {
+      RingSpan<uint8_t> free = ring.free_span();
+      size_t count = std::min({ free.first_len, chunk, TOTAL - sent });
+      if (count == 0)
+      {
+        std::this_thread::yield();
+        continue;
+      }
+
+      for (size_t i = 0; i < count; i++)
+        free.first[i] = next++;
+      ring.produce(count);
+      sent += count;
+      chunk = chunk % 1500 + 7;
+    }
+  });
+
+  uint8_t expected = 0;
+  size_t received = 0;
+  bool in_order = true;
+  while (received < TOTAL)
+  {
+    RingSpan<const uint8_t> span = ring.peek_span(0, SIZE_MAX);
+    if (span.first_len == 0)
+    {
+      std::this_thread::yield();
+      continue;
+    }
+
+    for (size_t i = 0; i < span.first_len; i++)
+    {
+      if (span.first[i] != expected++)
+        in_order = false;
+    }
+    received += ring.discard(span.first_len);
+  }
+
+  producer.join();
+  CHECK(in_order);
+  CHECK(received == TOTAL && ring.empty());
+}
+
+int main()
+{
+  testPlainWrap();
+  testMirroredWrap();
+  testMirroredGrow();
+  testSpsc();
+  return testResult();
+}
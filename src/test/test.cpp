@@ -1,6 +0,0 @@
-#include <iostream>
-
-int main() {
-  std::cout << "Basic test to satisfy linker." << std::endl;
-  return 0;
-}